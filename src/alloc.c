@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "alloc.h"
+#include "panic.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+THREAD_LOCAL void **scratch;
+THREAD_LOCAL size_t scratch_len, scratch_cap;
+
+//
+// alloc_or_panic - allocates zeroed memory for a pass and records it in the scratch table, panics on failure, what
+// names the work the memory is for
+//
+void *alloc_or_panic(size_t len, size_t size, const char *what) {
+        void *buf = NULL;
+
+        if (scratch_len == scratch_cap) {
+                size_t new_cap = scratch_cap ? scratch_cap * 2 : SCRATCH_INIT_LEN;
+                void **new_scratch;
+
+                if ((new_scratch = realloc(scratch, new_cap * sizeof(void*)))) {
+                        scratch = new_scratch;
+                        scratch_cap = new_cap;
+                }
+        }
+
+        if (scratch_len == scratch_cap || !(buf = calloc(len ? len : 1, size))) {
+                fprintf(stderr, FMT_ERRMSG("failed to allocate memory for %s\n"), what);
+                panic(ERR_MALLOC_FAIL);
+        }
+
+        scratch[scratch_len++] = buf;
+
+        return buf;
+}
+
+//
+// keep_scratch - takes a buffer from alloc_or_panic out of the scratch table so it outlives the pass, for buffers
+// which replace one owned by the assembler context, buffers are mostly let go of newest first so the table is
+// searched from the end
+//
+void keep_scratch(void *buf) {
+        for (size_t i = scratch_len; i-- > 0;) {
+                if (scratch[i] == buf) {
+                        scratch[i] = scratch[--scratch_len];
+                        return;
+                }
+        }
+}
+
+//
+// free_scratch - frees a buffer from alloc_or_panic
+//
+void free_scratch(void *buf) {
+        keep_scratch(buf);
+        free(buf);
+}
+
+//
+// free_all_scratch - frees every buffer from alloc_or_panic which hasn't been freed yet
+//
+void free_all_scratch(void) {
+        while (scratch_len > 0)
+                free(scratch[--scratch_len]);
+}
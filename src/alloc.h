@@ -0,0 +1,20 @@
+#ifndef ALLOC_H_INCLUDED
+        #define ALLOC_H_INCLUDED 1
+
+        #include <stddef.h>
+
+        #include "threadlocal.h"
+
+        // the scratch table starts with room for this many buffers
+        enum {SCRATCH_INIT_LEN = 16};
+
+        // buffers the passes are working with, a panic abandons a pass part way through so c8asm_assemble frees
+        // whichever are left, the table itself belongs to the assembler context
+        extern THREAD_LOCAL void **scratch;
+        extern THREAD_LOCAL size_t scratch_len, scratch_cap;
+
+        extern void *alloc_or_panic(size_t len, size_t size, const char *what);
+        extern void keep_scratch(void *buf);
+        extern void free_scratch(void *buf);
+        extern void free_all_scratch(void);
+#endif
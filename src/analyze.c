@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "lexer.h"
+#include "parser.h"
+#include "analyze.h"
+#include "print_msg.h"
+#include "alloc.h"
+
+THREAD_LOCAL Block *blocks;
+THREAD_LOCAL int blocks_len;
+THREAD_LOCAL int *block_of;
+
+THREAD_LOCAL bool analyze_report;
+THREAD_LOCAL const char *analyze_path_from, *analyze_path_to;
+
+// worst case cost of calling the subroutine starting at each block, COST_UNKNOWN until computed
+static THREAD_LOCAL long *callee_costs;
+
+enum {COST_UNKNOWN = -2, COST_IN_PROGRESS = -1};
+
+// deepest nesting of calls made by the subroutine starting at each block, DEPTH_UNKNOWN until computed
+static THREAD_LOCAL int *callee_depths;
+
+enum {DEPTH_UNKNOWN = -2, DEPTH_RECURSIVE = -1};
+
+// defined in analyze.h
+extern inline uint16_t instr_word(const Instruction *buffer, uint32_t i);
+extern inline bool is_skip(uint16_t word);
+extern inline uint32_t instr_len(uint16_t word);
+
+//
+// addr_to_word - converts an address to an index in the output stream, returns -1 if it isn't the start of an
+// instruction in the program
+//
+static long addr_to_word(uint32_t addr, uint32_t words_len, const bool *is_start) {
+        if (addr < C8_CODE_START_ADDR || (addr & 1))
+                return -1;
+
+        uint32_t i = (addr - C8_CODE_START_ADDR) / sizeof(Instruction);
+        if (i >= words_len || !is_start[i])
+                return -1;
+
+        return i;
+}
+
+//
+// build_cfg - splits the program in the output stream into basic blocks and links them, returns false if the
+// program is empty
+//
+bool build_cfg(void) {
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+
+        free_cfg();
+        if (words_len == 0)
+                return false;
+
+        bool *is_start = alloc_or_panic(words_len + 1, sizeof(bool), "program analysis");
+        bool *is_leader = alloc_or_panic(words_len + 1, sizeof(bool), "program analysis");
+        bool *is_data = alloc_or_panic(words_len + 1, sizeof(bool), "program analysis");
+        block_of = alloc_or_panic(words_len, sizeof(int), "program analysis");
+
+        // the words of a table are stepped over one at a time as they don't hold instructions
+        for (uint32_t i = 0; i < words_len; ++i)
+                is_data[i] = is_table_word(i);
+        for (uint32_t i = 0; i < words_len; i += is_data[i] ? 1 : instr_len(instr_word(outfile_buffer, i)))
+                is_start[i] = !is_data[i];
+
+        // blocks start at the beginning of the program, at labels, at jump and call targets, after any instruction
+        // which changes the flow of control and at either end of a table
+        is_leader[0] = true;
+        for (LabelDef *def = label_defs; def < label_defs_ptr; ++def) {
+                long i = addr_to_word(def->c8_addr, words_len, is_start);
+                if (i >= 0)
+                        is_leader[i] = true;
+        }
+
+        for (uint32_t i = 0; i < words_len; i += is_data[i] ? 1 : instr_len(instr_word(outfile_buffer, i))) {
+                uint16_t word = instr_word(outfile_buffer, i);
+                uint32_t next = i + instr_len(word);
+                long target;
+
+                if (is_data[i]) {
+                        is_leader[i] |= i == 0 || !is_data[i - 1];
+                        is_leader[i + 1] |= !is_data[i + 1];
+                } else if ((word >> 12) == 0x1 || (word >> 12) == 0x2) {
+                        if ((target = addr_to_word(word & 0xFFF, words_len, is_start)) >= 0)
+                                is_leader[target] = true;
+                        is_leader[next] = true;
+                } else if (word == 0x00EE || (word >> 12) == 0xB) {
+                        is_leader[next] = true;
+                } else if (is_skip(word)) {
+                        is_leader[next] = true;
+                        if (next < words_len)
+                                is_leader[next + instr_len(instr_word(outfile_buffer, next))] = true;
+                }
+        }
+
+        blocks = alloc_or_panic(words_len, sizeof(Block), "program analysis");
+        blocks_len = 0;
+        for (uint32_t i = 0; i < words_len; i += is_data[i] ? 1 : instr_len(instr_word(outfile_buffer, i))) {
+                if (is_leader[i])
+                        blocks[blocks_len++] = (Block){.start = i, .call_target = -1, .data = is_data[i]};
+
+                blocks[blocks_len - 1].end = i + (is_data[i] ? 1 : instr_len(instr_word(outfile_buffer, i)));
+                blocks[blocks_len - 1].instrs += !is_data[i];
+        }
+
+        for (int b = 0; b < blocks_len; ++b)
+                for (uint32_t i = blocks[b].start; i < blocks[b].end; ++i)
+                        block_of[i] = b;
+
+        // link blocks through the last instruction of each
+        for (int b = 0; b < blocks_len; ++b) {
+                Block *block = &blocks[b];
+                uint32_t last = block->start;
+                while (last + instr_len(instr_word(outfile_buffer, last)) < block->end)
+                        last += instr_len(instr_word(outfile_buffer, last));
+
+                uint16_t word = instr_word(outfile_buffer, last);
+                long target;
+
+                if (block->data) {
+                        continue;
+                } else if ((word >> 12) == 0x1) {
+                        if ((target = addr_to_word(word & 0xFFF, words_len, is_start)) >= 0)
+                                block->succ[block->succ_len++] = block_of[target];
+                        else
+                                block->indirect = true;
+                } else if ((word >> 12) == 0xB) {
+                        block->indirect = true;
+                } else if (word != 0x00EE && block->end < words_len) {
+                        block->succ[block->succ_len++] = b + 1;
+
+                        if ((word >> 12) == 0x2 && (target = addr_to_word(word & 0xFFF, words_len, is_start)) >= 0)
+                                block->call_target = block_of[target];
+
+                        uint32_t skipped_end = block->end + instr_len(instr_word(outfile_buffer, block->end));
+                        if (is_skip(word) && skipped_end < words_len)
+                                block->succ[block->succ_len++] = block_of[skipped_end];
+                }
+        }
+
+        free_scratch(is_start);
+        free_scratch(is_leader);
+        free_scratch(is_data);
+
+        return true;
+}
+
+//
+// free_cfg - frees the blocks built by build_cfg
+//
+void free_cfg(void) {
+        free_scratch(blocks);
+        free_scratch(block_of);
+        blocks = NULL;
+        block_of = NULL;
+        blocks_len = 0;
+}
+
+//
+// calls_depth - gets the deepest nesting of calls made from a block until the subroutine it is in returns, counting
+// the call into each subroutine, or DEPTH_RECURSIVE if a subroutine can end up calling itself
+//
+static int calls_depth(int from) {
+        bool *seen = alloc_or_panic(blocks_len, sizeof(bool), "program analysis");
+        int *stack = alloc_or_panic(blocks_len, sizeof(int), "program analysis");
+        int stack_len = 0, depth = 0;
+
+        seen[from] = true;
+        stack[stack_len++] = from;
+
+        while (stack_len > 0 && depth != DEPTH_RECURSIVE) {
+                int b = stack[--stack_len], callee = blocks[b].call_target;
+
+                if (callee >= 0) {
+                        // a subroutine still being looked at when it is called again is recursive
+                        if (callee_depths[callee] == DEPTH_UNKNOWN) {
+                                callee_depths[callee] = DEPTH_RECURSIVE;
+                                callee_depths[callee] = calls_depth(callee);
+                        }
+
+                        if (callee_depths[callee] == DEPTH_RECURSIVE)
+                                depth = DEPTH_RECURSIVE;
+                        else if (callee_depths[callee] + 1 > depth)
+                                depth = callee_depths[callee] + 1;
+                }
+
+                for (int s = 0; s < blocks[b].succ_len; ++s) {
+                        if (!seen[blocks[b].succ[s]]) {
+                                seen[blocks[b].succ[s]] = true;
+                                stack[stack_len++] = blocks[b].succ[s];
+                        }
+                }
+        }
+
+        free_scratch(seen);
+        free_scratch(stack);
+
+        return depth;
+}
+
+//
+// call_depth - gets the deepest nesting of calls from the start of the program, which is how many of the 16 levels
+// of the stack it uses, or -1 if a subroutine can end up calling itself
+//
+int call_depth(void) {
+        if (!build_cfg())
+                return 0;
+
+        callee_depths = alloc_or_panic(blocks_len, sizeof(int), "program analysis");
+        for (int b = 0; b < blocks_len; ++b)
+                callee_depths[b] = DEPTH_UNKNOWN;
+
+        int depth = calls_depth(0);
+
+        free_scratch(callee_depths);
+        callee_depths = NULL;
+        free_cfg();
+
+        return depth;
+}
+
+static long worst_path(int from, int to, long *loop_body);
+
+//
+// block_cost - gets the worst case number of instructions executed by a block, including any subroutine it calls
+//
+static long block_cost(int b) {
+        long cost = blocks[b].instrs;
+        int callee = blocks[b].call_target;
+
+        if (callee < 0)
+                return cost;
+
+        // recursive calls are counted once
+        if (callee_costs[callee] == COST_UNKNOWN) {
+                callee_costs[callee] = COST_IN_PROGRESS;
+                callee_costs[callee] = worst_path(callee, -1, NULL);
+        }
+
+        return cost + ((callee_costs[callee] > 0) ? callee_costs[callee] : 0);
+}
+
+//
+// worst_path - finds the most instructions executed going from one block to another without jumping backwards,
+// excluding the instructions of the destination, if to is -1 then the longest path from the block is found instead
+//
+// if loop_body is not NULL it is set to the longest path from the block back to itself through one backward jump,
+// or -1 if no backward jump reaches it
+//
+// every edge other than a backward jump goes to a later block so the blocks are already in topological order
+//
+static long worst_path(int from, int to, long *loop_body) {
+        long *dist = alloc_or_panic(blocks_len, sizeof(long), "program analysis");
+        long worst = -1;
+
+        for (int b = 0; b < blocks_len; ++b)
+                dist[b] = -1;
+        dist[from] = block_cost(from);
+
+        if (loop_body)
+                *loop_body = -1;
+
+        for (int b = from; b < blocks_len; ++b) {
+                if (dist[b] < 0)
+                        continue;
+
+                if (to < 0 && dist[b] > worst)
+                        worst = dist[b];
+
+                for (int s = 0; s < blocks[b].succ_len; ++s) {
+                        int succ = blocks[b].succ[s];
+
+                        if (succ > b) {
+                                long cost = dist[b] + block_cost(succ);
+                                if (cost > dist[succ])
+                                        dist[succ] = cost;
+                        } else if (succ == from && loop_body && dist[b] > *loop_body) {
+                                *loop_body = dist[b];
+                        }
+                }
+        }
+
+        if (to >= 0)
+                worst = (dist[to] >= 0) ? dist[to] - block_cost(to) : -1;
+
+        free_scratch(dist);
+
+        return worst;
+}
+
+//
+// label_block - gets the block starting at a label, or -1 if the label is at the end of the program
+//
+static int label_block(const LabelDef *def) {
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+        uint32_t i = (def->c8_addr - C8_CODE_START_ADDR) / sizeof(Instruction);
+
+        return (i < words_len) ? block_of[i] : -1;
+}
+
+//
+// find_label - finds a label definition by name, label_defs is sorted by resolve_labels
+//
+static LabelDef *find_label(const char *name) {
+        ptrdiff_t lo = 0, hi = label_defs_ptr - label_defs;
+
+        while (lo < hi) {
+                ptrdiff_t mid = lo + (hi - lo) / 2;
+                int diff = strcmp(name, label_defs[mid].label_text);
+
+                if (!diff)
+                        return &label_defs[mid];
+                if (diff < 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+
+        return NULL;
+}
+
+//
+// cmp_label_addrs - orders pointers to label definitions by address
+//
+static int cmp_label_addrs(const void *a, const void *b) {
+        const LabelDef *x = *(LabelDef *const *)a, *y = *(LabelDef *const *)b;
+
+        return (x->c8_addr > y->c8_addr) - (x->c8_addr < y->c8_addr);
+}
+
+//
+// check_budgets - reports budget directives whose label can execute more instructions than allowed, the budget
+// covers one iteration of the loop started by the label or, if it doesn't start a loop, the longest path from it
+//
+static void check_budgets(void) {
+        for (Budget *budget = budgets; budget < budgets_ptr; ++budget) {
+                LabelDef *def;
+                int b;
+
+                if (!(def = find_label(budget->label_text))) {
+                        print_msg(ERROR, budget->pos, "undefined reference to label `%s`", budget->label_text);
+                        ++error_count;
+                        continue;
+                }
+
+                if ((b = label_block(def)) < 0) {
+                        print_msg(ERROR, budget->pos, "label `%s` is not followed by any instructions",
+                                budget->label_text);
+                        ++error_count;
+                        continue;
+                }
+
+                long loop_body, worst = worst_path(b, -1, &loop_body);
+                if (loop_body >= 0)
+                        worst = loop_body;
+
+                if (worst > budget->limit) {
+                        print_msg(ERROR, budget->pos, "%s `%s` executes up to %ld instructions, exceeding its budget of %d",
+                                (loop_body >= 0) ? "one iteration of loop" : "label", budget->label_text, worst,
+                                budget->limit);
+                        ++error_count;
+                }
+        }
+}
+
+//
+// print_report - prints per label instruction counts, worst case paths and loop bodies to stdout
+//
+static void print_report(void) {
+        ptrdiff_t label_defs_len = label_defs_ptr - label_defs;
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+        LabelDef **by_addr = alloc_or_panic(label_defs_len, sizeof(LabelDef*), "program analysis");
+
+        for (ptrdiff_t i = 0; i < label_defs_len; ++i)
+                by_addr[i] = &label_defs[i];
+        qsort(by_addr, label_defs_len, sizeof(LabelDef*), cmp_label_addrs);
+
+        printf("%-32s %-8s %8s %12s %10s\n", "label", "address", "instrs", "worst path", "loop body");
+
+        for (ptrdiff_t i = 0; i < label_defs_len; ++i) {
+                uint32_t start = (by_addr[i]->c8_addr - C8_CODE_START_ADDR) / sizeof(Instruction);
+                uint32_t end = (i + 1 < label_defs_len) ?
+                        (by_addr[i + 1]->c8_addr - C8_CODE_START_ADDR) / sizeof(Instruction) : words_len;
+                int b = label_block(by_addr[i]);
+                long instrs = 0, worst = 0, loop_body = -1;
+
+                for (uint32_t w = start; w < end && w < words_len; w += instr_len(instr_word(outfile_buffer, w)))
+                        instrs += !is_table_word(w);
+
+                if (b >= 0)
+                        worst = worst_path(b, -1, &loop_body);
+
+                printf("%-32s 0x%-6X %8ld %12ld ", by_addr[i]->label_text, (unsigned)by_addr[i]->c8_addr, instrs,
+                        worst);
+                if (loop_body >= 0)
+                        printf("%10ld\n", loop_body);
+                else
+                        printf("%10s\n", "-");
+        }
+
+        free_scratch(by_addr);
+
+        if (!analyze_path_from)
+                return;
+
+        LabelDef *from, *to;
+        if (!(from = find_label(analyze_path_from)) || !(to = find_label(analyze_path_to))) {
+                printf("\nno such label `%s`\n", from ? analyze_path_to : analyze_path_from);
+                return;
+        }
+
+        int from_block = label_block(from), to_block = label_block(to);
+        long worst = (from_block >= 0 && to_block >= 0) ? worst_path(from_block, to_block, NULL) : -1;
+
+        if (worst < 0)
+                printf("\n`%s` can't reach `%s` without jumping backwards\n", analyze_path_from, analyze_path_to);
+        else
+                printf("\nworst case path from `%s` to `%s`: %ld instructions\n", analyze_path_from, analyze_path_to,
+                        worst);
+}
+
+//
+// analyze_program - checks budget directives and prints the analysis report if it was asked for
+//
+void analyze_program(void) {
+        if (budgets_ptr == budgets && !analyze_report)
+                return;
+
+        if (!build_cfg())
+                return;
+
+        callee_costs = alloc_or_panic(blocks_len, sizeof(long), "program analysis");
+        for (int b = 0; b < blocks_len; ++b)
+                callee_costs[b] = COST_UNKNOWN;
+
+        check_budgets();
+        if (analyze_report)
+                print_report();
+
+        free_scratch(callee_costs);
+        callee_costs = NULL;
+        free_cfg();
+}
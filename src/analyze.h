@@ -0,0 +1,68 @@
+#ifndef ANALYZE_H_INCLUDED
+        #define ANALYZE_H_INCLUDED 1
+
+        #include <stdint.h>
+        #include <stdbool.h>
+
+        #include "threadlocal.h"
+        #include "parser.h"
+
+        // a basic block of the assembled program, instructions are counted as executed so `mov I, long` counts once
+        // although it takes two words
+        typedef struct {
+                uint32_t start, end; // range of words in the output stream
+                uint32_t instrs;
+
+                int succ[2];         // successor blocks, a successor at or before this block is a backward jump
+                int succ_len;
+
+                int call_target;     // block called by a call ending this block or -1
+                bool indirect;       // ends in a vjmp so the successor is unknown
+                bool data;           // holds the bytes of a table rather than instructions, so it has no successors
+        } Block;
+
+        extern THREAD_LOCAL Block *blocks;
+        extern THREAD_LOCAL int blocks_len;
+        extern THREAD_LOCAL int *block_of; // maps a word in the output stream to the block holding it
+
+        extern THREAD_LOCAL bool analyze_report;
+        extern THREAD_LOCAL const char *analyze_path_from, *analyze_path_to;
+
+        extern bool build_cfg(void);
+        extern void free_cfg(void);
+        extern int call_depth(void);
+        extern void analyze_program(void);
+
+        //
+        // instr_word - gets the instruction word at an index in the output stream
+        //
+        inline uint16_t instr_word(const Instruction *buffer, uint32_t i) {
+                const uint8_t *bytes = (const uint8_t*)(buffer + i);
+                return (bytes[0] << 8) | bytes[1];
+        }
+
+        //
+        // is_skip - checks whether an instruction conditionally skips the next one
+        //
+        inline bool is_skip(uint16_t word) {
+                switch (word >> 12) {
+                        case 0x3: // FALLTHROUGH
+                        case 0x4:
+                                return true;
+                        case 0x5: // FALLTHROUGH
+                        case 0x9:
+                                return (word & 0xF) == 0;
+                        case 0xE:
+                                return (word & 0xFF) == 0x9E || (word & 0xFF) == 0xA1;
+                }
+
+                return false;
+        }
+
+        //
+        // instr_len - gets the number of words taken by an instruction
+        //
+        inline uint32_t instr_len(uint16_t word) {
+                return (word == 0xF000) ? 2 : 1;
+        }
+#endif
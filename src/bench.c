@@ -0,0 +1,576 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "lexer.h"
+#include "parser.h"
+#include "print_msg.h"
+#include "c8tokens.h"
+#include "parallel.h"
+#include "panic.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+#define USAGE "usage: %s [options] [infile]\n" \
+              "\n" \
+              "times the lexer, parser and label resolution of c8asm separately on a program held in memory, a\n" \
+              "generated program is used when no infile is given\n" \
+              "\n" \
+              "options:\n" \
+              "  --iterations=N                timed runs of each component (default 200)\n" \
+              "  --warmup=N                    untimed runs of each component before timing (default 20)\n" \
+              "  --statements=N                statements in the generated program (default 20000)\n" \
+              "  --threads=N                   parse and resolve labels on up to N threads (default 1)\n" \
+              "  --token-cache[=MB]            time lexing a generated library of MB megabytes (default 10) against\n" \
+              "                                loading its tokens from a cache mapped into memory, with 20\n" \
+              "                                iterations after 2 warmup runs unless given\n"
+
+// labels referenced by the generated program, kept low so every reference fits in 12 bits
+enum {BENCH_REF_LABELS = 64};
+
+// the statements the generated program cycles through, a group of them starts with the definition of label l<group>
+// and refers to one of the first BENCH_REF_LABELS labels
+static const char *bench_stmts[] = {
+        "l%d:\n",
+        "mov v%x, %u\n",
+        "add v%x, 0x%X\n",
+        "se v%x, 0b1010\n",
+        "jmp l%d\n",
+        "mov I, l%d\n",
+        "drw v%x, v1, 0o5\n",
+        "call l%d ; a comment\n",
+        "sub v%x, v2\n",
+        "ret\n"
+};
+
+// samples of a component, each sample is one pass over its input
+typedef struct {
+        const char *name;
+        size_t items; // items handled in one pass
+        uint64_t *ns;
+} Samples;
+
+static int iterations = 200, warmup = 20;
+
+// the defaults of --iterations and --warmup with --token-cache, where each pass is over megabytes of source
+enum {CACHE_ITERATIONS = 20, CACHE_WARMUP = 2};
+
+//
+// now_ns - reads the monotonic clock
+//
+static uint64_t now_ns(void) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+//
+// xmalloc - allocates a buffer for the benchmark or exits
+//
+static void *xmalloc(size_t size) {
+        void *buf;
+
+        if (!(buf = malloc(size ? size : 1))) {
+                fputs(FMT_ERRMSG("failed to allocate buffer for benchmark\n"), stderr);
+                exit(ERR_MALLOC_FAIL);
+        }
+
+        return buf;
+}
+
+//
+// gen_program - generates a program of n statements which assembles without errors
+//
+static char *gen_program(long n, long *len) {
+        size_t cap = n * 32 + 1, used = 0;
+        char *src = xmalloc(cap);
+
+        for (long i = 0; i < n; ++i) {
+                size_t stmts_len = sizeof(bench_stmts) / sizeof(bench_stmts[0]);
+                const char *fmt = bench_stmts[i % stmts_len];
+                long group = i / stmts_len;
+
+                if (fmt[0] == 'l')
+                        used += sprintf(src + used, fmt, (int)group);
+                else if (strstr(fmt, "l%d"))
+                        used += sprintf(src + used, fmt, (int)(group % BENCH_REF_LABELS));
+                else
+                        used += sprintf(src + used, fmt, (unsigned)(i & 0xF), (unsigned)(i & 0xFF));
+        }
+
+        *len = used;
+        return src;
+}
+
+//
+// read_program - reads a source file into a '\0' terminated buffer
+//
+static char *read_program(const char *name, long *len) {
+        FILE *infile;
+
+        if (!(infile = fopen(name, "rb"))) {
+                fprintf(stderr, FMT_ERRMSG("failed to open file `%s`\n"), name);
+                exit(ERR_FOPEN_FAIL);
+        }
+
+        fseek(infile, 0, SEEK_END);
+        *len = ftell(infile);
+        rewind(infile);
+
+        char *src = xmalloc(*len + 1);
+        if (fread(src, 1, *len, infile) != (size_t)*len) {
+                fprintf(stderr, FMT_ERRMSG("failed to read file `%s`\n"), name);
+                exit(ERR_FREAD_FAIL);
+        }
+        src[*len] = '\0';
+
+        fclose(infile);
+        return src;
+}
+
+//
+// split_src - copies the integers or the names of a program into a buffer of their own, separated by spaces, so
+// lex_int and lex_name can be timed without the rest of the lexer
+//
+static char *split_src(const char *src, int ints, long *len) {
+        char *out = xmalloc(strlen(src) + 1), *p = out;
+
+        while (*src) {
+                if (ISDEC(*src) || isalpha(*src) || *src == '_') {
+                        const char *start = src;
+
+                        while (ISLABELCHAR(*src))
+                                ++src;
+
+                        // keep label definitions whole, and `I` lexes as a symbol rather than a name
+                        if (*src == ':')
+                                ++src;
+                        if ((ISDEC(*start) != 0) == ints && !(src - start == 1 && *start == 'I')) {
+                                memcpy(p, start, src - start);
+                                p += src - start;
+                                *p++ = ' ';
+                        }
+                } else if (*src == ';') {
+                        while (*src && *src != '\n')
+                                ++src;
+                } else {
+                        ++src;
+                }
+        }
+
+        *p = '\0';
+        *len = p - out;
+        return out;
+}
+
+//
+// cmp_u64 - orders samples for finding percentiles
+//
+static int cmp_u64(const void *a, const void *b) {
+        uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+        return (x > y) - (x < y);
+}
+
+//
+// report - prints the median and tail of the samples of a component
+//
+static void report(Samples *samples) {
+        qsort(samples->ns, iterations, sizeof(uint64_t), cmp_u64);
+
+        uint64_t median = samples->ns[iterations / 2];
+        uint64_t p90 = samples->ns[(size_t)iterations * 90 / 100];
+        uint64_t p99 = samples->ns[(size_t)iterations * 99 / 100];
+
+        printf("%-16s %9lu %11.1f %11.1f %11.1f %11.1f %9.2f\n", samples->name, (unsigned long)samples->items,
+                samples->ns[0] / 1e3, median / 1e3, p90 / 1e3, p99 / 1e3,
+                samples->items ? (double)median / samples->items : 0.0);
+}
+
+//
+// pass_lex_int - lexes every integer of a buffer of integers, returns how many were lexed
+//
+static size_t pass_lex_int(char *ints, long len) {
+        size_t n = 0;
+
+        lex_set_input(ints, len);
+        next_char();
+        while (current_char != EOF) {
+                if (ISDEC(current_char)) {
+                        lex_int();
+                        ++n;
+                } else {
+                        next_char();
+                }
+        }
+
+        return n;
+}
+
+//
+// pass_lex_name - lexes every name of a buffer of names, returns how many were lexed
+//
+static size_t pass_lex_name(char *names, long len) {
+        size_t n = 0;
+
+        name_pool_len = 0;
+        lex_set_input(names, len);
+        next_char();
+        while (current_char != EOF) {
+                if (isalpha(current_char) || current_char == '_') {
+                        lex_name();
+                        ++n;
+                } else {
+                        next_char();
+                }
+        }
+
+        return n;
+}
+
+//
+// pass_classify - classifies every name of a list of names, returns how many were keywords
+//
+static size_t pass_classify(char **names, size_t names_len) {
+        size_t keywords = 0;
+
+        for (size_t i = 0; i < names_len; ++i)
+                keywords += classify_name(names[i]) != NAME_LBLREF;
+
+        return keywords;
+}
+
+//
+// reset_parser - empties the output and label tables so the token stream can be parsed again
+//
+static void reset_parser(void) {
+        rewind_tkn_stream();
+        outfile_buffer_ptr = outfile_buffer;
+        label_defs_ptr = label_defs;
+        label_refs_ptr = label_refs;
+        budgets_ptr = budgets;
+        sections_ptr = sections;
+        table_positions_ptr = table_positions;
+        vreg_uses_ptr = vreg_uses;
+        stmt_has_vreg = false;
+        msgs_len = msg_text_len = 0;
+        error_count = warning_count = 0;
+}
+
+//
+// map_cache - writes a token cache to a temporary file and maps it, as c8asm --token-cache maps its caches, the
+// file is gone once the benchmark exits
+//
+static const uint8_t *map_cache(const uint8_t *cache, size_t len) {
+        FILE *file;
+        void *map;
+
+        if (!(file = tmpfile()) || fwrite(cache, 1, len, file) != len || fflush(file) ||
+                        (map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(file), 0)) == MAP_FAILED) {
+                fputs(FMT_ERRMSG("failed to map token cache\n"), stderr);
+                exit(ERR_FWRITE_FAIL);
+        }
+
+        return map;
+}
+
+//
+// bench_token_cache - times lexing a library against loading its tokens from a cache, the library is only lexed so
+// it may be far larger than memory, as shared libraries of routines are
+//
+static int bench_token_cache(const char *infile, long mb) {
+        long src_len;
+        char *src;
+
+        if (infile) {
+                src = read_program(infile, &src_len);
+        } else {
+                // size the library from the length of a sample of its statements
+                free(gen_program(1000, &src_len));
+                src = gen_program(mb * 1024 * 1024 / src_len * 1000, &src_len);
+        }
+
+        if (src_len == 0) {
+                fputs(FMT_ERRMSG("empty input\n"), stderr);
+                return ERR_EMPTY_FILE;
+        }
+
+        infile_name = (char*)(infile ? infile : "generated");
+        uint8_t *types = xmalloc(src_len + 1);
+        uint32_t *positions = xmalloc((src_len + 1) * sizeof(uint32_t));
+        uint32_t *payloads = xmalloc((src_len + 1) * sizeof(uint32_t));
+
+        int err;
+        if ((err = setjmp(panic_env))) {
+                flush_msgs(stderr);
+                return err;
+        }
+
+        // lex once to write the cache
+        tkn_types = types;
+        tkn_positions = positions;
+        tkn_payloads = payloads;
+        lex_set_input(src, src_len);
+        rewind_tkn_stream();
+        lex_src();
+        if (error_count > 0) {
+                flush_msgs(stderr);
+                fputs(FMT_ERRMSG("the library must lex without errors to be cached\n"), stderr);
+                return FAILURE;
+        }
+
+        c8asm_tokens tokens = {
+                .types = tkn_types,
+                .positions = tkn_positions,
+                .payloads = tkn_payloads,
+                .names = name_pool,
+                .count = tkn_types_ptr - tkn_types,
+                .payloads_count = tkn_payloads_ptr - tkn_payloads,
+                .names_len = name_pool_len
+        };
+        size_t cache_len = c8asm_tokens_write(NULL, &tokens, src, src_len);
+        uint8_t *cache = xmalloc(cache_len);
+        c8asm_tokens_write(cache, &tokens, src, src_len);
+        const uint8_t *mapped = map_cache(cache, cache_len);
+
+        Samples components[] = {
+                {.name = "lex_src", .items = tokens.count},
+                {.name = "token cache", .items = tokens.count}
+        };
+
+        for (size_t c = 0; c < 2; ++c) {
+                components[c].ns = xmalloc(sizeof(uint64_t) * iterations);
+
+                for (int i = -warmup; i < iterations; ++i) {
+                        uint64_t start;
+                        c8asm_tokens cached;
+
+                        name_pool_len = 0;
+                        if (c == 0) {
+                                tkn_types = types;
+                                tkn_positions = positions;
+                                tkn_payloads = payloads;
+                                start = now_ns();
+                                lex_set_input(src, src_len);
+                                rewind_tkn_stream();
+                                lex_src();
+                        } else {
+                                // the cache is checked against the source as c8asm_assemble does on every load
+                                start = now_ns();
+                                if (!c8asm_tokens_open(&cached, mapped, cache_len, src, src_len)) {
+                                        fputs(FMT_ERRMSG("the token cache doesn't match the library\n"), stderr);
+                                        return FAILURE;
+                                }
+                                lex_cached(&cached);
+                        }
+
+                        uint64_t elapsed = now_ns() - start;
+
+                        if (i >= 0)
+                                components[c].ns[i] = elapsed;
+                }
+        }
+
+        printf("%ld bytes, %lu tokens, %lu byte cache, %d iterations after %d warmup\n\n", src_len,
+                (unsigned long)tokens.count, (unsigned long)cache_len, iterations, warmup);
+        printf("%-16s %9s %11s %11s %11s %11s %9s\n", "component", "items", "min us", "median us", "p90 us",
+                "p99 us", "ns/item");
+
+        for (size_t c = 0; c < 2; ++c)
+                report(&components[c]);
+
+        // report sorts the samples so the medians are in place
+        printf("\nloading the cache is %.1fx faster than lexing\n", (double)components[0].ns[iterations / 2] /
+                components[1].ns[iterations / 2]);
+
+        return SUCCESS;
+}
+
+int main(int argc, char **argv) {
+        const char *infile = NULL;
+        long statements = 20000, cache_mb = 0;
+        bool iterations_set = false, warmup_set = false;
+
+        for (int i = 1; i < argc; ++i) {
+                if (!strncmp(argv[i], "--iterations=", 13)) {
+                        iterations = atoi(argv[i] + 13);
+                        iterations_set = true;
+                } else if (!strncmp(argv[i], "--warmup=", 9)) {
+                        warmup = atoi(argv[i] + 9);
+                        warmup_set = true;
+                } else if (!strncmp(argv[i], "--statements=", 13)) {
+                        statements = atol(argv[i] + 13);
+                } else if (!strncmp(argv[i], "--threads=", 10)) {
+                        if ((parse_threads = atoi(argv[i] + 10)) < 1 || parse_threads > PARALLEL_MAX_THREADS) {
+                                fprintf(stderr, USAGE, argv[0]);
+                                return ERR_INVALID_ARG;
+                        }
+                } else if (!strcmp(argv[i], "--token-cache")) {
+                        cache_mb = 10;
+                } else if (!strncmp(argv[i], "--token-cache=", 14)) {
+                        if ((cache_mb = atol(argv[i] + 14)) < 1) {
+                                fprintf(stderr, USAGE, argv[0]);
+                                return ERR_INVALID_ARG;
+                        }
+                } else if (argv[i][0] == '-' || infile) {
+                        fprintf(stderr, USAGE, argv[0]);
+                        return ERR_INVALID_ARG;
+                } else {
+                        infile = argv[i];
+                }
+        }
+
+        if (cache_mb) {
+                iterations = iterations_set ? iterations : CACHE_ITERATIONS;
+                warmup = warmup_set ? warmup : CACHE_WARMUP;
+        }
+
+        if (iterations < 1 || warmup < 0 || statements < 1) {
+                fprintf(stderr, USAGE, argv[0]);
+                return ERR_INVALID_ARG;
+        }
+
+        if (cache_mb)
+                return bench_token_cache(infile, cache_mb);
+
+        long src_len;
+        char *src = infile ? read_program(infile, &src_len) : gen_program(statements, &src_len);
+
+        if (src_len == 0) {
+                fputs(FMT_ERRMSG("empty input\n"), stderr);
+                return ERR_EMPTY_FILE;
+        }
+
+        // the same buffers c8asm_assemble sizes from the length of the source
+        infile_name = (char*)(infile ? infile : "generated");
+        tkn_types = xmalloc(src_len + 1);
+        tkn_positions = xmalloc((src_len + 1) * sizeof(uint32_t));
+        tkn_payloads = xmalloc((src_len + 1) * sizeof(uint32_t));
+        outfile_buffer = xmalloc(IMAGE_WORDS * sizeof(Instruction));
+        // the default program is larger than CHIP-8 memory so everything is assembled with XO-CHIP's address space
+        target = TARGET_XOCHIP;
+        outfile_buffer_end = outfile_buffer + program_words(TARGET_XOCHIP);
+        instr_positions = xmalloc(IMAGE_WORDS * sizeof(uint32_t));
+        label_defs = xmalloc(LABEL_BUFFER_INIT_LEN * sizeof(LabelDef));
+        label_refs = xmalloc(LABEL_BUFFER_INIT_LEN * sizeof(LabelRef));
+        budgets = xmalloc(LABEL_BUFFER_INIT_LEN * sizeof(Budget));
+        label_defs_cap = label_refs_cap = budgets_cap = LABEL_BUFFER_INIT_LEN;
+
+        int err;
+        if ((err = setjmp(panic_env))) {
+                flush_msgs(stderr);
+                return err;
+        }
+
+        long ints_len, names_len;
+        char *ints = split_src(src, 1, &ints_len), *names = split_src(src, 0, &names_len);
+
+        // names for classify_name, without the colons of label definitions
+        size_t name_list_len = 0;
+        char **name_list = xmalloc(sizeof(char*) * (names_len / 2 + 1));
+        char *names_copy = xmalloc(names_len + 1);
+
+        memcpy(names_copy, names, names_len + 1);
+        for (char *name = strtok(names_copy, ": "); name; name = strtok(NULL, ": "))
+                name_list[name_list_len++] = name;
+
+        // lex the whole program once, this is the token stream parsed by every pass of the parser
+        lex_set_input(src, src_len);
+        rewind_tkn_stream();
+        lex_src();
+        size_t tkns_len = tkn_types_ptr - tkn_types;
+
+        reset_parser();
+        parse_tkn_stream();
+        if (error_count > 0) {
+                flush_msgs(stderr);
+                fputs(FMT_ERRMSG("the program must assemble without errors to be benchmarked\n"), stderr);
+                return FAILURE;
+        }
+
+        // label resolution sorts the definitions in place so each pass starts from a copy in source order
+        size_t stmts_len = outfile_buffer_ptr - outfile_buffer;
+        ptrdiff_t defs_len = label_defs_ptr - label_defs;
+        LabelDef *defs = xmalloc(sizeof(LabelDef) * defs_len);
+        memcpy(defs, label_defs, sizeof(LabelDef) * defs_len);
+
+        Samples components[] = {
+                {.name = "lex_int"},
+                {.name = "lex_name"},
+                {.name = "classify_name", .items = name_list_len},
+                {.name = "lex_src", .items = tkns_len},
+                {.name = "parse_tkn_stream", .items = stmts_len},
+                {.name = "resolve_labels", .items = label_refs_ptr - label_refs}
+        };
+        size_t components_len = sizeof(components) / sizeof(components[0]);
+
+        for (size_t c = 0; c < components_len; ++c) {
+                components[c].ns = xmalloc(sizeof(uint64_t) * iterations);
+
+                for (int i = -warmup; i < iterations; ++i) {
+                        uint64_t start = 0;
+                        volatile size_t items = 0;
+
+                        switch (c) {
+                                case 0:
+                                        start = now_ns();
+                                        items = pass_lex_int(ints, ints_len);
+                                        break;
+                                case 1:
+                                        start = now_ns();
+                                        items = pass_lex_name(names, names_len);
+                                        break;
+                                case 2:
+                                        start = now_ns();
+                                        items = pass_classify(name_list, name_list_len);
+                                        break;
+                                case 3:
+                                        name_pool_len = 0;
+                                        start = now_ns();
+                                        lex_set_input(src, src_len);
+                                        rewind_tkn_stream();
+                                        lex_src();
+                                        break;
+                                case 4:
+                                        reset_parser();
+                                        start = now_ns();
+                                        parse_tkn_stream();
+                                        break;
+                                case 5:
+                                        memcpy(label_defs, defs, sizeof(LabelDef) * defs_len);
+                                        start = now_ns();
+                                        resolve_labels();
+                                        break;
+                        }
+
+                        uint64_t elapsed = now_ns() - start;
+
+                        if (c < 2)
+                                components[c].items = items;
+                        if (i >= 0)
+                                components[c].ns[i] = elapsed;
+                }
+        }
+
+        printf("%ld bytes, %lu tokens, %lu words, %ld label definitions, %d iterations after %d warmup\n\n",
+                src_len, (unsigned long)tkns_len, (unsigned long)stmts_len, (long)defs_len, iterations, warmup);
+        printf("%-16s %9s %11s %11s %11s %11s %9s\n", "component", "items", "min us", "median us", "p90 us",
+                "p99 us", "ns/item");
+
+        for (size_t c = 0; c < components_len; ++c)
+                report(&components[c]);
+
+        return SUCCESS;
+}
@@ -0,0 +1,970 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "c8asm.h"
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "lexer.h"
+#include "parser.h"
+#include "print_msg.h"
+#include "expr.h"
+#include "analyze.h"
+#include "fold.h"
+#include "loads.h"
+#include "inliner.h"
+#include "regalloc.h"
+#include "sections.h"
+#include "instrument.h"
+#include "sandbox.h"
+#include "trace.h"
+#include "c8map.h"
+#include "c8tokens.h"
+#include "endian.h"
+#include "alloc.h"
+#include "parallel.h"
+#include "panic.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+THREAD_LOCAL long infile_len;
+THREAD_LOCAL char *infile_name, *infile_buffer, *infile_buffer_ptr;
+THREAD_LOCAL int current_char;
+
+THREAD_LOCAL Token current_tkn;
+THREAD_LOCAL uint8_t *tkn_types, *tkn_types_ptr;
+THREAD_LOCAL uint32_t *tkn_positions, *tkn_positions_ptr;
+THREAD_LOCAL uint32_t *tkn_payloads, *tkn_payloads_ptr;
+
+THREAD_LOCAL char *name_pool;
+THREAD_LOCAL size_t name_pool_len, name_pool_cap;
+
+THREAD_LOCAL Instruction *outfile_buffer, *outfile_buffer_ptr, *outfile_buffer_end;
+THREAD_LOCAL uint32_t *instr_positions;
+
+THREAD_LOCAL LabelRef *label_refs, *label_refs_ptr;
+THREAD_LOCAL LabelDef *label_defs, *label_defs_ptr;
+THREAD_LOCAL ptrdiff_t label_defs_cap, label_refs_cap;
+
+THREAD_LOCAL Budget *budgets, *budgets_ptr;
+THREAD_LOCAL ptrdiff_t budgets_cap;
+
+THREAD_LOCAL Section *sections, *sections_ptr;
+THREAD_LOCAL ptrdiff_t sections_cap;
+
+THREAD_LOCAL uint32_t *table_positions, *table_positions_ptr;
+THREAD_LOCAL ptrdiff_t table_positions_cap;
+THREAD_LOCAL Expr table_expr;
+
+THREAD_LOCAL VregUse *vreg_uses, *vreg_uses_ptr;
+THREAD_LOCAL ptrdiff_t vreg_uses_cap;
+
+THREAD_LOCAL int error_count, warning_count;
+
+THREAD_LOCAL Target target;
+
+THREAD_LOCAL Msg *msgs;
+THREAD_LOCAL size_t msgs_len, msgs_cap;
+THREAD_LOCAL char *msg_text;
+THREAD_LOCAL size_t msg_text_len, msg_text_cap;
+
+THREAD_LOCAL DiagFormat diag_format;
+THREAD_LOCAL int diag_max_errors;
+
+THREAD_LOCAL jmp_buf panic_env;
+
+// defined in panic.h
+extern inline void panic(ExitCode err);
+
+struct c8asm_ctx {
+        const char *src_name;
+
+        char *src;
+        size_t src_cap;
+
+        uint8_t *tkn_types;
+        uint32_t *tkn_positions, *tkn_payloads;
+        size_t tkn_types_cap, tkn_positions_cap, tkn_payloads_cap;
+
+        char *name_pool;
+        size_t name_pool_cap;
+
+        // a token cache given for the next assembly, and the stream of the last source lexed without errors, kept for
+        // building a cache of it, tkns_len is 0 if there is none
+        const uint8_t *token_cache;
+        size_t token_cache_len;
+        bool token_cache_used;
+        uint32_t tkns_len, tkn_payloads_len, names_len;
+        size_t lexed_len;
+
+        uint8_t *tokens_out;
+        size_t tokens_out_cap;
+
+        // programs can't outgrow memory so the image is sized for the largest target
+        Instruction outfile_buffer[IMAGE_WORDS];
+        uint32_t instr_positions[IMAGE_WORDS];
+
+        // the result of the last successful assembly, kept for building its map
+        bool assembled;
+        size_t src_len, outfile_len;
+        ptrdiff_t label_defs_len;
+
+        uint8_t *map;
+        size_t map_cap;
+
+        LabelDef *label_defs;
+        LabelRef *label_refs;
+        ptrdiff_t label_defs_cap, label_refs_cap;
+
+        Budget *budgets;
+        ptrdiff_t budgets_cap;
+
+        Section *sections;
+        ptrdiff_t sections_cap;
+
+        uint32_t *table_positions;
+        ptrdiff_t table_positions_cap;
+        Expr table_expr;
+
+        Counter *counters;
+        ptrdiff_t counters_cap, counters_len;
+
+        VregUse *vreg_uses;
+        ptrdiff_t vreg_uses_cap;
+
+        Msg *msgs;
+        size_t msgs_cap;
+        char *msg_text;
+        size_t msg_text_cap;
+
+        void **scratch;
+        size_t scratch_cap;
+
+        DiagFormat diag_format;
+        int diag_max_errors;
+
+        Target target;
+
+        bool analyze_report;
+        const char *analyze_path_from, *analyze_path_to;
+
+        bool fold_code;
+        bool eliminate_loads;
+        bool inline_leaves;
+        uint32_t inline_budget;
+        int counter_bytes;
+        int threads;
+
+        c8asm_limits limits;
+
+        TraceRing trace;
+
+        int error_count, warning_count;
+        uint32_t folded_subroutines, folded_bytes;
+        uint32_t loads_removed;
+        uint32_t inlined_calls, inlined_subroutines;
+        int stack_depth_before, stack_depth_after;
+        uint32_t instrumented_labels, counters_addr;
+};
+
+//
+// reserve - grows a buffer to hold at least len elements of size elem_size, returns 0 on failure
+//
+static int reserve(void **buf, size_t *cap, size_t len, size_t elem_size) {
+        if (len <= *cap)
+                return 1;
+
+        void *new_buf;
+        if (!(new_buf = realloc(*buf, len * elem_size)))
+                return 0;
+
+        *buf = new_buf;
+        *cap = len;
+
+        return 1;
+}
+
+//
+// load_ctx - makes the buffers of a context the current assembler state
+//
+static void load_ctx(c8asm_ctx *ctx, size_t len) {
+        infile_name = (char*)ctx->src_name;
+        lex_set_input(ctx->src, len);
+
+        tkn_types_ptr = tkn_types = ctx->tkn_types;
+        tkn_positions_ptr = tkn_positions = ctx->tkn_positions;
+        tkn_payloads_ptr = tkn_payloads = ctx->tkn_payloads;
+
+        name_pool = ctx->name_pool;
+        name_pool_len = 0;
+        name_pool_cap = ctx->name_pool_cap;
+
+        outfile_buffer_ptr = outfile_buffer = ctx->outfile_buffer;
+        outfile_buffer_end = outfile_buffer + program_words(ctx->target);
+        instr_positions = ctx->instr_positions;
+
+        label_defs_ptr = label_defs = ctx->label_defs;
+        label_refs_ptr = label_refs = ctx->label_refs;
+        label_defs_cap = ctx->label_defs_cap;
+        label_refs_cap = ctx->label_refs_cap;
+
+        budgets_ptr = budgets = ctx->budgets;
+        budgets_cap = ctx->budgets_cap;
+
+        sections_ptr = sections = ctx->sections;
+        sections_cap = ctx->sections_cap;
+
+        table_positions_ptr = table_positions = ctx->table_positions;
+        table_positions_cap = ctx->table_positions_cap;
+        table_expr = ctx->table_expr;
+
+        counters_ptr = counters = ctx->counters;
+        counters_cap = ctx->counters_cap;
+
+        vreg_uses_ptr = vreg_uses = ctx->vreg_uses;
+        vreg_uses_cap = ctx->vreg_uses_cap;
+        vregs_allocated = vreg_moves_removed = 0;
+        stmt_has_vreg = false;
+
+        msgs = ctx->msgs;
+        msgs_len = 0;
+        msgs_cap = ctx->msgs_cap;
+        msg_text = ctx->msg_text;
+        msg_text_len = 0;
+        msg_text_cap = ctx->msg_text_cap;
+
+        scratch = ctx->scratch;
+        scratch_len = 0;
+        scratch_cap = ctx->scratch_cap;
+
+        diag_format = ctx->diag_format;
+        diag_max_errors = ctx->diag_max_errors;
+
+        target = ctx->target;
+
+        analyze_report = ctx->analyze_report;
+        analyze_path_from = ctx->analyze_path_from;
+        analyze_path_to = ctx->analyze_path_to;
+
+        fold_code = ctx->fold_code;
+        folded_subroutines = folded_bytes = 0;
+        eliminate_loads = ctx->eliminate_loads;
+        loads_removed = 0;
+        inline_leaves = ctx->inline_leaves;
+        inline_budget = ctx->inline_budget;
+        inlined_calls = inlined_subroutines = 0;
+        stack_depth_before = stack_depth_after = 0;
+        counter_bytes = ctx->counter_bytes;
+        instrumented_labels = counters_addr = 0;
+        parse_threads = ctx->threads;
+
+        trace_ring = ctx->trace.cap ? &ctx->trace : NULL;
+
+        limit_tokens = ctx->limits.tokens;
+        limit_labels = ctx->limits.labels;
+        limit_errors = ctx->limits.errors;
+        start_deadline(ctx->limits.time_ms);
+
+        error_count = warning_count = 0;
+}
+
+//
+// store_ctx - hands buffers which may have been reallocated during assembly back to a context
+//
+static void store_ctx(c8asm_ctx *ctx) {
+        ctx->name_pool = name_pool;
+        ctx->name_pool_cap = name_pool_cap;
+
+        ctx->label_defs = label_defs;
+        ctx->label_refs = label_refs;
+        ctx->label_defs_cap = label_defs_cap;
+        ctx->label_refs_cap = label_refs_cap;
+
+        ctx->budgets = budgets;
+        ctx->budgets_cap = budgets_cap;
+
+        ctx->sections = sections;
+        ctx->sections_cap = sections_cap;
+
+        ctx->table_positions = table_positions;
+        ctx->table_positions_cap = table_positions_cap;
+        ctx->table_expr = table_expr;
+
+        ctx->counters = counters;
+        ctx->counters_cap = counters_cap;
+        ctx->counters_len = counters_ptr - counters;
+
+        ctx->vreg_uses = vreg_uses;
+        ctx->vreg_uses_cap = vreg_uses_cap;
+
+        ctx->outfile_len = outfile_buffer_ptr - outfile_buffer;
+        ctx->label_defs_len = label_defs_ptr - label_defs;
+
+        ctx->msgs = msgs;
+        ctx->msgs_cap = msgs_cap;
+        ctx->msg_text = msg_text;
+        ctx->msg_text_cap = msg_text_cap;
+
+        ctx->scratch = scratch;
+        ctx->scratch_cap = scratch_cap;
+
+        ctx->error_count = error_count;
+        ctx->warning_count = warning_count;
+        ctx->folded_subroutines = folded_subroutines;
+        ctx->folded_bytes = folded_bytes;
+        ctx->loads_removed = loads_removed;
+        ctx->inlined_calls = inlined_calls;
+        ctx->inlined_subroutines = inlined_subroutines;
+        ctx->stack_depth_before = stack_depth_before;
+        ctx->stack_depth_after = stack_depth_after;
+        ctx->instrumented_labels = instrumented_labels;
+        ctx->counters_addr = counters_addr;
+
+        trace_ring = NULL;
+
+        limit_tokens = limit_labels = limit_errors = 0;
+        limit_deadline = 0;
+        parse_threads = 0;
+}
+
+//
+// c8asm_ctx_new - creates an assembler context, returns NULL on failure
+//
+c8asm_ctx *c8asm_ctx_new(void) {
+        c8asm_ctx *ctx;
+
+        if (!(ctx = calloc(1, sizeof(c8asm_ctx))))
+                return NULL;
+
+        if (!((ctx->label_defs = malloc(sizeof(LabelDef) * LABEL_BUFFER_INIT_LEN)) &&
+                        (ctx->label_refs = malloc(sizeof(LabelRef) * LABEL_BUFFER_INIT_LEN)))) {
+                c8asm_ctx_free(ctx);
+                return NULL;
+        }
+        ctx->label_defs_cap = ctx->label_refs_cap = LABEL_BUFFER_INIT_LEN;
+
+        ctx->src_name = "<input>";
+
+        return ctx;
+}
+
+//
+// c8asm_ctx_free - frees an assembler context and all of its buffers
+//
+void c8asm_ctx_free(c8asm_ctx *ctx) {
+        if (!ctx)
+                return;
+
+        free(ctx->src);
+        free(ctx->tkn_types);
+        free(ctx->tkn_positions);
+        free(ctx->tkn_payloads);
+        free(ctx->name_pool);
+        free(ctx->map);
+        free(ctx->tokens_out);
+        free(ctx->label_defs);
+        free(ctx->label_refs);
+        free(ctx->budgets);
+        free(ctx->sections);
+        free(ctx->table_positions);
+        free_expr(&ctx->table_expr);
+        free(ctx->counters);
+        free(ctx->vreg_uses);
+        free(ctx->msgs);
+        free(ctx->msg_text);
+        free(ctx->scratch);
+        free(ctx->trace.events);
+        free(ctx);
+}
+
+//
+// c8asm_set_src_name - sets the name used for the source in diagnostics, the string is not copied
+//
+void c8asm_set_src_name(c8asm_ctx *ctx, const char *name) {
+        ctx->src_name = name;
+}
+
+//
+// c8asm_set_diagnostics - sets the format diagnostics are written to stderr in and the number of errors shown, a
+// max_errors of 0 shows every error
+//
+void c8asm_set_diagnostics(c8asm_ctx *ctx, int format, int max_errors) {
+        ctx->diag_format = format;
+        ctx->diag_max_errors = max_errors;
+}
+
+//
+// c8asm_set_target - sets the machine programs are assembled for
+//
+void c8asm_set_target(c8asm_ctx *ctx, int target) {
+        ctx->target = target;
+}
+
+//
+// c8asm_capacity - gets the number of bytes of memory programs can take on the context's target
+//
+size_t c8asm_capacity(const c8asm_ctx *ctx) {
+        return program_words(ctx->target) * C8_INSTR_SIZE;
+}
+
+//
+// c8asm_set_analysis - enables the analysis report, which is printed to stdout after assembly, and optionally asks
+// for the worst case path between two labels, budget directives are checked whether or not the report is enabled
+//
+void c8asm_set_analysis(c8asm_ctx *ctx, int report, const char *path_from, const char *path_to) {
+        ctx->analyze_report = report;
+        ctx->analyze_path_from = path_from;
+        ctx->analyze_path_to = path_to;
+}
+
+//
+// c8asm_set_fold - enables folding subroutines which are identical to an earlier one into it, see fold.c
+//
+void c8asm_set_fold(c8asm_ctx *ctx, int fold) {
+        ctx->fold_code = fold;
+}
+
+//
+// c8asm_set_eliminate_loads - enables taking out loads of a register with the value it already holds, see loads.c
+//
+void c8asm_set_eliminate_loads(c8asm_ctx *ctx, int eliminate) {
+        ctx->eliminate_loads = eliminate;
+}
+
+//
+// c8asm_set_inline - enables inlining leaf subroutines at their calls while the program stays within budget bytes,
+// a budget of 0 allows all of memory, see inliner.c
+//
+void c8asm_set_inline(c8asm_ctx *ctx, int enable, size_t budget) {
+        ctx->inline_leaves = enable;
+        ctx->inline_budget = (budget > UINT32_MAX) ? UINT32_MAX : budget;
+}
+
+//
+// c8asm_set_instrument - enables instrumenting programs with a counter of bits 8 or 16 bits wide for each label, which
+// goes up each time the label is reached, a bits of 0 disables it, see instrument.c
+//
+void c8asm_set_instrument(c8asm_ctx *ctx, int bits) {
+        ctx->counter_bytes = bits / 8;
+}
+
+//
+// c8asm_set_threads - sets the number of threads parsing and label resolution may use, 1 (the default) does all of
+// the work on the calling thread, see parallel.c
+//
+void c8asm_set_threads(c8asm_ctx *ctx, int threads) {
+        ctx->threads = (threads < 1) ? 1 : (threads > PARALLEL_MAX_THREADS) ? PARALLEL_MAX_THREADS : threads;
+}
+
+//
+// c8asm_set_token_cache - gives a token cache (see c8tokens.h) to the next call to c8asm_assemble, which skips lexing
+// if the cache holds the tokens of its source, the cache must stay valid until that call returns
+//
+void c8asm_set_token_cache(c8asm_ctx *ctx, const void *cache, size_t len) {
+        ctx->token_cache = cache;
+        ctx->token_cache_len = len;
+}
+
+//
+// c8asm_set_limits - sets the limits on the work done assembling one source, NULL removes every limit
+//
+void c8asm_set_limits(c8asm_ctx *ctx, const c8asm_limits *limits) {
+        ctx->limits = limits ? *limits : (c8asm_limits){0};
+}
+
+//
+// c8asm_set_trace - enables tracing with a ring of at least max_events events, the oldest are overwritten once it is
+// full, a max_events of 0 disables tracing, returns 0 on failure
+//
+int c8asm_set_trace(c8asm_ctx *ctx, size_t max_events) {
+        size_t cap = 1;
+
+        free(ctx->trace.events);
+        ctx->trace = (TraceRing){0};
+
+        if (max_events == 0)
+                return 1;
+
+        while (cap < max_events)
+                cap *= 2;
+
+        if (!(ctx->trace.events = malloc(cap * sizeof(TraceEvent))))
+                return 0;
+        ctx->trace.cap = cap;
+
+        return 1;
+}
+
+//
+// c8asm_trace_begin - begins a span on the context's track, for work done by the caller such as loading the source,
+// name must outlive the context
+//
+void c8asm_trace_begin(c8asm_ctx *ctx, const char *name) {
+        if (ctx->trace.cap)
+                trace_push(&ctx->trace, 'B', name, 0);
+}
+
+//
+// c8asm_trace_end - ends the innermost span on the context's track
+//
+void c8asm_trace_end(c8asm_ctx *ctx, const char *name) {
+        if (ctx->trace.cap)
+                trace_push(&ctx->trace, 'E', name, 0);
+}
+
+//
+// c8asm_write_trace - writes the events traced by each context to stream in the Chrome trace event format with a
+// track per context, contexts without tracing enabled are skipped, returns 0 on failure
+//
+int c8asm_write_trace(c8asm_ctx *const *ctxs, size_t ctxs_len, FILE *stream) {
+        const TraceRing **rings;
+        size_t rings_len = 0;
+
+        if (!(rings = malloc((ctxs_len ? ctxs_len : 1) * sizeof(TraceRing*))))
+                return 0;
+
+        for (size_t i = 0; i < ctxs_len; ++i)
+                if (ctxs[i]->trace.cap)
+                        rings[rings_len++] = &ctxs[i]->trace;
+
+        int ok = trace_write(rings, rings_len, stream);
+        free(rings);
+
+        return ok;
+}
+
+//
+// c8asm_error_count - gets the number of errors generated by the last call to c8asm_assemble
+//
+int c8asm_error_count(const c8asm_ctx *ctx) {
+        return ctx->error_count;
+}
+
+//
+// c8asm_warning_count - gets the number of warnings generated by the last call to c8asm_assemble
+//
+int c8asm_warning_count(const c8asm_ctx *ctx) {
+        return ctx->warning_count;
+}
+
+//
+// c8asm_folded_subroutines - gets the number of subroutines folded by the last call to c8asm_assemble
+//
+int c8asm_folded_subroutines(const c8asm_ctx *ctx) {
+        return ctx->folded_subroutines;
+}
+
+//
+// c8asm_folded_bytes - gets the number of bytes taken out of the program by folding in the last call to
+// c8asm_assemble
+//
+size_t c8asm_folded_bytes(const c8asm_ctx *ctx) {
+        return ctx->folded_bytes;
+}
+
+//
+// c8asm_loads_removed - gets the number of redundant loads taken out by the last call to c8asm_assemble
+//
+int c8asm_loads_removed(const c8asm_ctx *ctx) {
+        return ctx->loads_removed;
+}
+
+//
+// c8asm_inlined_calls - gets the number of calls replaced with the subroutine they call by the last call to
+// c8asm_assemble
+//
+int c8asm_inlined_calls(const c8asm_ctx *ctx) {
+        return ctx->inlined_calls;
+}
+
+//
+// c8asm_inlined_subroutines - gets the number of subroutines taken out by the last call to c8asm_assemble as every
+// call to them was inlined
+//
+int c8asm_inlined_subroutines(const c8asm_ctx *ctx) {
+        return ctx->inlined_subroutines;
+}
+
+//
+// c8asm_stack_depth - gets the deepest nesting of calls in the program before and after inlining in the last call to
+// c8asm_assemble, -1 if the program is recursive
+//
+void c8asm_stack_depth(const c8asm_ctx *ctx, int *before, int *after) {
+        *before = ctx->stack_depth_before;
+        *after = ctx->stack_depth_after;
+}
+
+//
+// c8asm_instrumented_labels - gets the number of labels given a counter by the last call to c8asm_assemble
+//
+int c8asm_instrumented_labels(const c8asm_ctx *ctx) {
+        return ctx->instrumented_labels;
+}
+
+//
+// c8asm_counters_addr - gets the address of the first counter put in by the last call to c8asm_assemble, counters
+// follow each other in the order of the labels they count
+//
+uint32_t c8asm_counters_addr(const c8asm_ctx *ctx) {
+        return ctx->counters_addr;
+}
+
+//
+// c8asm_token_cache_used - checks whether the last call to c8asm_assemble took its tokens from a cache
+//
+int c8asm_token_cache_used(const c8asm_ctx *ctx) {
+        return ctx->token_cache_used;
+}
+
+//
+// c8asm_assemble - assembles len bytes of source, see c8asm.h
+//
+int c8asm_assemble(c8asm_ctx *ctx, const char *src, size_t len, const uint8_t **out, size_t *outlen) {
+        int err;
+
+        ctx->error_count = ctx->warning_count = 0;
+        ctx->folded_subroutines = ctx->folded_bytes = 0;
+        ctx->loads_removed = 0;
+        ctx->inlined_calls = ctx->inlined_subroutines = 0;
+        ctx->stack_depth_before = ctx->stack_depth_after = 0;
+        ctx->instrumented_labels = ctx->counters_addr = 0;
+        ctx->counters_len = 0;
+        ctx->assembled = false;
+
+        // a cache is only given for a single call
+        c8asm_tokens cache;
+        bool use_cache = ctx->token_cache && c8asm_tokens_open(&cache, ctx->token_cache, ctx->token_cache_len, src,
+                len);
+        ctx->token_cache = NULL;
+        ctx->token_cache_used = use_cache;
+        ctx->tkns_len = 0;
+
+        if (len == 0)
+                return ERR_EMPTY_FILE;
+
+        // token positions are stored as 32 bit offsets into the source
+        if (len >= UINT32_MAX)
+                return ERR_FILE_TOO_LARGE;
+
+        if (ctx->limits.src_len && len > ctx->limits.src_len)
+                return ERR_LIMIT_SRC_LEN;
+
+        // every token is at least one character long so the source length bounds the size of the token stream, and
+        // every instruction takes at least one token, tokens from a cache are used where they lie
+        if (!(reserve((void**)&ctx->src, &ctx->src_cap, len + 1, 1) && (use_cache ||
+                        (reserve((void**)&ctx->tkn_types, &ctx->tkn_types_cap, len + 1, sizeof(uint8_t)) &&
+                        reserve((void**)&ctx->tkn_positions, &ctx->tkn_positions_cap, len + 1, sizeof(uint32_t)) &&
+                        reserve((void**)&ctx->tkn_payloads, &ctx->tkn_payloads_cap, len + 1, sizeof(uint32_t)))))) {
+                fputs(FMT_ERRMSG("failed to allocate buffers for assembly\n"), stderr);
+                return ERR_MALLOC_FAIL;
+        }
+
+        // the lexer may look one character past the end of the source
+        memcpy(ctx->src, src, len);
+        ctx->src[len] = '\0';
+
+        load_ctx(ctx, len);
+
+        // messages collected before a failure are still reported unless flushing them is what failed
+        volatile bool flushed = false;
+
+        if ((err = setjmp(panic_env))) {
+                if (!flushed) {
+                        flushed = true;
+                        flush_msgs(stderr);
+                }
+                // the pass which panicked may have been part way through building blocks or using scratch buffers
+                free_cfg();
+                free_all_scratch();
+                store_ctx(ctx);
+                return err;
+        }
+
+        trace_begin("assemble");
+
+        if (use_cache) {
+                trace_begin("load token cache");
+                lex_cached(&cache);
+                trace_end("load token cache");
+        } else {
+                trace_begin("lex");
+                lex_src();
+                trace_end("lex");
+
+                // the lexer only reports errors, a stream with errors isn't cached as they wouldn't be reported again
+                if (error_count == 0) {
+                        ctx->tkns_len = tkn_types_ptr - tkn_types;
+                        ctx->tkn_payloads_len = tkn_payloads_ptr - tkn_payloads;
+                        ctx->names_len = name_pool_len;
+                        ctx->lexed_len = len;
+                }
+        }
+        trace_counter("tokens", tkn_types_ptr - tkn_types);
+
+        rewind_tkn_stream();
+        trace_begin("parse");
+        parse_tkn_stream();
+        trace_end("parse");
+        trace_counter("label definitions", label_defs_ptr - label_defs);
+        trace_counter("label references", label_refs_ptr - label_refs);
+
+        if (sections_ptr > sections) {
+                trace_begin("place sections");
+                place_sections();
+                trace_end("place sections");
+        }
+
+        resolve_labels();
+
+        // the passes after parsing only poll the deadline between them, their work is bounded by the size of memory
+        poll_deadline();
+
+        if (error_count == 0 && vreg_uses_ptr > vreg_uses) {
+                trace_begin("allocate registers");
+                allocate_registers();
+                trace_end("allocate registers");
+                trace_counter("virtual registers", vregs_allocated);
+        }
+
+        poll_deadline();
+
+        // inlining goes first as it puts the loads of the caller and the subroutine next to each other, and loads are
+        // removed before folding as that can make more subroutines identical
+        if (error_count == 0 && inline_leaves) {
+                trace_begin("inline");
+                inline_subroutines();
+                trace_end("inline");
+                trace_counter("inlined calls", inlined_calls);
+        }
+
+        poll_deadline();
+        if (error_count == 0 && eliminate_loads) {
+                trace_begin("eliminate loads");
+                eliminate_redundant_loads();
+                trace_end("eliminate loads");
+                trace_counter("loads removed", loads_removed);
+        }
+
+        poll_deadline();
+        if (error_count == 0 && fold_code) {
+                trace_begin("fold");
+                fold_program();
+                trace_end("fold");
+                trace_counter("folded bytes", folded_bytes);
+        }
+
+        poll_deadline();
+        if (error_count == 0) {
+                trace_begin("analyze");
+                analyze_program();
+                trace_end("analyze");
+        }
+
+        // counting code is put in last so it is left out of the analysis and no pass moves it
+        poll_deadline();
+        if (error_count == 0 && counter_bytes) {
+                trace_begin("instrument");
+                instrument_program();
+                trace_end("instrument");
+                trace_counter("instrumented labels", instrumented_labels);
+        }
+
+        flushed = true;
+        trace_begin("flush diagnostics");
+        flush_msgs(stderr);
+        trace_end("flush diagnostics");
+
+        trace_end("assemble");
+        store_ctx(ctx);
+
+        if (error_count > 0)
+                return FAILURE;
+
+        *out = (const uint8_t*)outfile_buffer;
+        *outlen = (outfile_buffer_ptr - outfile_buffer) * sizeof(Instruction);
+
+        ctx->assembled = true;
+        ctx->src_len = len;
+
+        return SUCCESS;
+}
+
+// appended to the name of a label to name its counter in the map
+#define COUNTER_SUFFIX "@count"
+
+// walks the source once to find the lines and columns of increasing offsets
+typedef struct {
+        const char *src;
+        uint32_t pos, line, line_start;
+} LineCursor;
+
+//
+// advance_cursor - moves a cursor to an offset, a cursor moved back starts over from the top of the source which only
+// happens when sections are placed out of source order
+//
+static void advance_cursor(LineCursor *cursor, uint32_t pos) {
+        if (pos < cursor->pos)
+                *cursor = (LineCursor){.src = cursor->src, .line = 1};
+
+        while (cursor->pos < pos)
+                if (cursor->src[cursor->pos++] == '\n') {
+                        ++cursor->line;
+                        cursor->line_start = cursor->pos;
+                }
+}
+
+//
+// put_location - stores the line and column of an offset as u32 line, u16 column, u16 file
+//
+static void put_location(uint8_t *p, LineCursor *cursor, uint32_t pos) {
+        advance_cursor(cursor, pos);
+
+        uint32_t col = pos - cursor->line_start + 1;
+
+        put_u32(p, cursor->line);
+        put_u16(p + 4, (col > UINT16_MAX) ? UINT16_MAX : col);
+        put_u16(p + 6, 0);
+}
+
+//
+// cmp_label_def_addrs - orders label definitions by address, then by position in the source
+//
+static int cmp_label_def_addrs(const void *a, const void *b) {
+        const LabelDef *x = a, *y = b;
+
+        if (x->c8_addr != y->c8_addr)
+                return (x->c8_addr > y->c8_addr) - (x->c8_addr < y->c8_addr);
+
+        return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+//
+// c8asm_build_map - builds a debug map of the last program assembled, see c8asm.h and c8map.h
+//
+// unless sections are placed out of source order, instructions and labels are emitted in source order so their
+// addresses and source offsets rise together and a single pass over the source gives the location of each, words
+// left between sections are not in the map
+//
+int c8asm_build_map(c8asm_ctx *ctx, const uint8_t **out, size_t *outlen) {
+        if (!ctx->assembled)
+                return FAILURE;
+
+        // resolve_labels leaves the definitions sorted by name
+        qsort(ctx->label_defs, ctx->label_defs_len, sizeof(LabelDef), cmp_label_def_addrs);
+
+        size_t lines_len = 0;
+        for (size_t i = 0; i < ctx->outfile_len; ++i)
+                lines_len += ctx->instr_positions[i] != POS_NONE;
+
+        size_t strings_len = strlen(ctx->src_name) + 1;
+        for (ptrdiff_t i = 0; i < ctx->label_defs_len; ++i)
+                strings_len += strlen(ctx->label_defs[i].label_text) + 1;
+        for (ptrdiff_t i = 0; i < ctx->counters_len; ++i)
+                strings_len += strlen(ctx->counters[i].label_text) + sizeof(COUNTER_SUFFIX);
+
+        // counters come after the program so their symbols follow those of the labels in address order
+        size_t symbols_len = ctx->label_defs_len + ctx->counters_len;
+
+        size_t lines_start = C8ASM_MAP_HEADER_SIZE;
+        size_t symbols_start = lines_start + lines_len * C8ASM_MAP_LINE_SIZE;
+        size_t files_start = symbols_start + symbols_len * C8ASM_MAP_SYMBOL_SIZE;
+        size_t strings_start = files_start + 4;
+        size_t len = strings_start + strings_len;
+
+        if (len > UINT32_MAX)
+                return ERR_FILE_TOO_LARGE;
+
+        if (!reserve((void**)&ctx->map, &ctx->map_cap, len, 1))
+                return ERR_MALLOC_FAIL;
+
+        uint8_t *map = ctx->map;
+        memcpy(map, "C8ASMMAP", 8);
+        put_u32(map + 8, C8ASM_MAP_VERSION);
+        put_u32(map + 12, lines_len);
+        put_u32(map + 16, symbols_len);
+        put_u32(map + 20, 1);
+        put_u32(map + 24, strings_start);
+        put_u32(map + 28, strings_len);
+
+        LineCursor cursor = {.src = ctx->src, .line = 1};
+        uint8_t *entry = map + lines_start;
+        for (size_t i = 0; i < ctx->outfile_len; ++i) {
+                if (ctx->instr_positions[i] == POS_NONE)
+                        continue;
+
+                put_u32(entry, C8_CODE_START_ADDR + i * C8_INSTR_SIZE);
+                put_location(entry + 4, &cursor, ctx->instr_positions[i]);
+                entry += C8ASM_MAP_LINE_SIZE;
+        }
+
+        size_t string_offset = 0;
+        put_u32(map + files_start, string_offset);
+        memcpy(map + strings_start, ctx->src_name, strlen(ctx->src_name) + 1);
+        string_offset += strlen(ctx->src_name) + 1;
+
+        cursor = (LineCursor){.src = ctx->src, .line = 1};
+        for (ptrdiff_t i = 0; i < ctx->label_defs_len; ++i) {
+                const LabelDef *def = &ctx->label_defs[i];
+                uint8_t *symbol = map + symbols_start + i * C8ASM_MAP_SYMBOL_SIZE;
+                size_t name_len = strlen(def->label_text) + 1;
+
+                put_u32(symbol, def->c8_addr);
+                put_location(symbol + 4, &cursor, def->pos);
+                put_u32(symbol + 12, string_offset);
+
+                memcpy(map + strings_start + string_offset, def->label_text, name_len);
+                string_offset += name_len;
+        }
+
+        // a counter is named after the label it counts, at the location of the label
+        cursor = (LineCursor){.src = ctx->src, .line = 1};
+        for (ptrdiff_t i = 0; i < ctx->counters_len; ++i) {
+                const Counter *counter = &ctx->counters[i];
+                uint8_t *symbol = map + symbols_start + (ctx->label_defs_len + i) * C8ASM_MAP_SYMBOL_SIZE;
+                size_t name_len = strlen(counter->label_text);
+
+                put_u32(symbol, counter->addr);
+                put_location(symbol + 4, &cursor, counter->pos);
+                put_u32(symbol + 12, string_offset);
+
+                memcpy(map + strings_start + string_offset, counter->label_text, name_len);
+                memcpy(map + strings_start + string_offset + name_len, COUNTER_SUFFIX, sizeof(COUNTER_SUFFIX));
+                string_offset += name_len + sizeof(COUNTER_SUFFIX);
+        }
+
+        *out = map;
+        *outlen = len;
+
+        return SUCCESS;
+}
+
+//
+// c8asm_build_token_cache - builds a token cache of the last source lexed, see c8asm.h and c8tokens.h
+//
+int c8asm_build_token_cache(c8asm_ctx *ctx, const uint8_t **out, size_t *outlen) {
+        if (!ctx->tkns_len)
+                return FAILURE;
+
+        c8asm_tokens tokens = {
+                .types = ctx->tkn_types,
+                .positions = ctx->tkn_positions,
+                .payloads = ctx->tkn_payloads,
+                .names = ctx->name_pool,
+                .count = ctx->tkns_len,
+                .payloads_count = ctx->tkn_payloads_len,
+                .names_len = ctx->names_len
+        };
+
+        size_t len = c8asm_tokens_write(NULL, &tokens, ctx->src, ctx->lexed_len);
+        if (!reserve((void**)&ctx->tokens_out, &ctx->tokens_out_cap, len, 1))
+                return ERR_MALLOC_FAIL;
+
+        *out = ctx->tokens_out;
+        *outlen = c8asm_tokens_write(ctx->tokens_out, &tokens, ctx->src, ctx->lexed_len);
+
+        return SUCCESS;
+}
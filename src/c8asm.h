@@ -0,0 +1,86 @@
+#ifndef C8ASM_H_INCLUDED
+        #define C8ASM_H_INCLUDED 1
+
+        #include <stdio.h>
+        #include <stddef.h>
+        #include <stdint.h>
+
+        //
+        // libc8asm - assembles c8asm source held in memory
+        //
+        // a c8asm_ctx owns every buffer used during assembly and keeps them between calls so repeated assembly
+        // doesn't reallocate, distinct contexts may be used concurrently from distinct threads but a single
+        // context must not be used by two threads at once
+        //
+        // c8asm_assemble returns an ExitCode (see exitcodes.h), SUCCESS (0) on success, on success *out points to
+        // the assembled image which stays valid until the next call with the same context or until it is freed
+        //
+        typedef struct c8asm_ctx c8asm_ctx;
+
+        // formats for diagnostics, which are collected during assembly and written to stderr in a single write
+        enum {
+                C8ASM_DIAG_TEXT,
+                C8ASM_DIAG_JSON
+        };
+
+        // machines which programs can be assembled for, XO-CHIP adds a 64 KiB address space and extra instructions
+        enum {
+                C8ASM_TARGET_CHIP8,
+                C8ASM_TARGET_XOCHIP
+        };
+
+        // the most threads c8asm_set_threads lets parsing and label resolution use, more are taken as this many
+        enum {C8ASM_MAX_THREADS = 64};
+
+        // limits on the work done assembling one source, for running untrusted input, a field of 0 is no limit, once
+        // one is exceeded c8asm_assemble stops and returns the matching ERR_LIMIT_* ExitCode
+        typedef struct {
+                size_t src_len;   // bytes of source
+                uint32_t tokens;
+                uint32_t labels;  // label definitions
+                uint32_t errors;
+                uint32_t time_ms; // wall time spent in c8asm_assemble
+        } c8asm_limits;
+
+        extern c8asm_ctx *c8asm_ctx_new(void);
+        extern void c8asm_ctx_free(c8asm_ctx *ctx);
+
+        extern void c8asm_set_src_name(c8asm_ctx *ctx, const char *name);
+        extern void c8asm_set_diagnostics(c8asm_ctx *ctx, int format, int max_errors);
+        extern void c8asm_set_target(c8asm_ctx *ctx, int target);
+        extern size_t c8asm_capacity(const c8asm_ctx *ctx);
+        extern void c8asm_set_analysis(c8asm_ctx *ctx, int report, const char *path_from, const char *path_to);
+        extern void c8asm_set_fold(c8asm_ctx *ctx, int fold);
+        extern void c8asm_set_eliminate_loads(c8asm_ctx *ctx, int eliminate);
+        extern void c8asm_set_inline(c8asm_ctx *ctx, int enable, size_t budget);
+        extern void c8asm_set_instrument(c8asm_ctx *ctx, int bits);
+        extern void c8asm_set_threads(c8asm_ctx *ctx, int threads);
+        extern void c8asm_set_token_cache(c8asm_ctx *ctx, const void *cache, size_t len);
+        extern void c8asm_set_limits(c8asm_ctx *ctx, const c8asm_limits *limits);
+        extern int c8asm_set_trace(c8asm_ctx *ctx, size_t max_events);
+        extern void c8asm_trace_begin(c8asm_ctx *ctx, const char *name);
+        extern void c8asm_trace_end(c8asm_ctx *ctx, const char *name);
+        extern int c8asm_write_trace(c8asm_ctx *const *ctxs, size_t ctxs_len, FILE *stream);
+        extern int c8asm_error_count(const c8asm_ctx *ctx);
+        extern int c8asm_warning_count(const c8asm_ctx *ctx);
+        extern int c8asm_folded_subroutines(const c8asm_ctx *ctx);
+        extern size_t c8asm_folded_bytes(const c8asm_ctx *ctx);
+        extern int c8asm_loads_removed(const c8asm_ctx *ctx);
+        extern int c8asm_inlined_calls(const c8asm_ctx *ctx);
+        extern int c8asm_inlined_subroutines(const c8asm_ctx *ctx);
+        extern void c8asm_stack_depth(const c8asm_ctx *ctx, int *before, int *after);
+        extern int c8asm_instrumented_labels(const c8asm_ctx *ctx);
+        extern uint32_t c8asm_counters_addr(const c8asm_ctx *ctx);
+        extern int c8asm_token_cache_used(const c8asm_ctx *ctx);
+
+        extern int c8asm_assemble(c8asm_ctx *ctx, const char *src, size_t len, const uint8_t **out, size_t *outlen);
+
+        // builds a debug map (see c8map.h) of the program assembled by the last successful call to c8asm_assemble,
+        // *out points into the context like the output of c8asm_assemble
+        extern int c8asm_build_map(c8asm_ctx *ctx, const uint8_t **out, size_t *outlen);
+
+        // builds a token cache (see c8tokens.h) of the source lexed by the last call to c8asm_assemble, which can be
+        // given to c8asm_set_token_cache to skip lexing it again, *out points into the context like the output of
+        // c8asm_assemble, fails if lexing reported errors or the tokens came from a cache
+        extern int c8asm_build_token_cache(c8asm_ctx *ctx, const uint8_t **out, size_t *outlen);
+#endif
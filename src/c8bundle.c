@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "c8bundle.h"
+#include "exitcodes.h"
+#include "endian.h"
+
+typedef struct {
+        char *name;
+        uint32_t name_len;
+        uint64_t hash;
+
+        uint8_t *rom;
+        uint32_t rom_len;
+} BundleEntry;
+
+struct c8asm_bundle_writer {
+        BundleEntry *entries;
+        size_t entries_len, entries_cap;
+
+        // the finished bundle
+        uint8_t *image;
+};
+
+//
+// hash_name - 64 bit FNV-1a hash of a name
+//
+static uint64_t hash_name(const char *name, size_t len) {
+        uint64_t hash = 14695981039346656037u;
+
+        for (size_t i = 0; i < len; ++i)
+                hash = (hash ^ (uint8_t)name[i]) * 1099511628211u;
+
+        return hash;
+}
+
+//
+// page_align - rounds an offset up to a page boundary
+//
+static size_t page_align(size_t offset) {
+        return (offset + C8ASM_BUNDLE_PAGE_SIZE - 1) / C8ASM_BUNDLE_PAGE_SIZE * C8ASM_BUNDLE_PAGE_SIZE;
+}
+
+//
+// cmp_entries - orders entries by name hash, then by name
+//
+static int cmp_entries(const void *a, const void *b) {
+        const BundleEntry *x = a, *y = b;
+
+        if (x->hash != y->hash)
+                return (x->hash > y->hash) - (x->hash < y->hash);
+
+        return strcmp(x->name, y->name);
+}
+
+//
+// c8asm_bundle_writer_new - creates an empty bundle, returns NULL on failure
+//
+c8asm_bundle_writer *c8asm_bundle_writer_new(void) {
+        return calloc(1, sizeof(c8asm_bundle_writer));
+}
+
+//
+// c8asm_bundle_writer_free - frees a bundle along with its ROMs and image
+//
+void c8asm_bundle_writer_free(c8asm_bundle_writer *writer) {
+        if (!writer)
+                return;
+
+        for (size_t i = 0; i < writer->entries_len; ++i) {
+                free(writer->entries[i].name);
+                free(writer->entries[i].rom);
+        }
+
+        free(writer->entries);
+        free(writer->image);
+        free(writer);
+}
+
+//
+// c8asm_bundle_add - adds a copy of a ROM to a bundle under name
+//
+int c8asm_bundle_add(c8asm_bundle_writer *writer, const char *name, const uint8_t *rom, size_t len) {
+        size_t name_len = strlen(name);
+
+        if (name_len >= UINT32_MAX || len >= UINT32_MAX)
+                return ERR_FILE_TOO_LARGE;
+
+        if (writer->entries_len >= writer->entries_cap) {
+                size_t new_cap = writer->entries_cap ? writer->entries_cap * 2 : 64;
+                BundleEntry *new_entries;
+
+                if (!(new_entries = realloc(writer->entries, new_cap * sizeof(BundleEntry))))
+                        return ERR_MALLOC_FAIL;
+
+                writer->entries = new_entries;
+                writer->entries_cap = new_cap;
+        }
+
+        BundleEntry entry = {
+                .name = malloc(name_len + 1),
+                .name_len = name_len,
+                .hash = hash_name(name, name_len),
+                .rom = malloc(len ? len : 1),
+                .rom_len = len
+        };
+
+        if (!(entry.name && entry.rom)) {
+                free(entry.name);
+                free(entry.rom);
+                return ERR_MALLOC_FAIL;
+        }
+
+        memcpy(entry.name, name, name_len + 1);
+        memcpy(entry.rom, rom, len);
+        writer->entries[writer->entries_len++] = entry;
+
+        return SUCCESS;
+}
+
+//
+// c8asm_bundle_finish - lays out a bundle, *out points to the image until the writer is freed, returns
+// ERR_INVALID_ARG if two ROMs share a name
+//
+int c8asm_bundle_finish(c8asm_bundle_writer *writer, const uint8_t **out, size_t *outlen) {
+        size_t count = writer->entries_len;
+
+        qsort(writer->entries, count, sizeof(BundleEntry), cmp_entries);
+
+        for (size_t i = 1; i < count; ++i)
+                if (!cmp_entries(&writer->entries[i - 1], &writer->entries[i]))
+                        return ERR_INVALID_ARG;
+
+        size_t names_start = C8ASM_BUNDLE_HEADER_SIZE + count * C8ASM_BUNDLE_ENTRY_SIZE;
+        size_t names_end = names_start;
+
+        for (size_t i = 0; i < count; ++i)
+                names_end += writer->entries[i].name_len + 1;
+
+        // name offsets are 32 bits
+        if (names_end > UINT32_MAX || count > UINT32_MAX)
+                return ERR_FILE_TOO_LARGE;
+
+        size_t len = names_end;
+        for (size_t i = 0; i < count; ++i)
+                len = page_align(len) + writer->entries[i].rom_len;
+
+        free(writer->image);
+        if (!(writer->image = calloc(len ? len : 1, 1)))
+                return ERR_MALLOC_FAIL;
+
+        uint8_t *image = writer->image;
+        memcpy(image, "C8BUNDLE", 8);
+        put_u32(image + 8, C8ASM_BUNDLE_VERSION);
+        put_u32(image + 12, count);
+        put_u32(image + 16, C8ASM_BUNDLE_PAGE_SIZE);
+
+        size_t name_offset = names_start, rom_offset = names_end;
+
+        for (size_t i = 0; i < count; ++i) {
+                const BundleEntry *entry = &writer->entries[i];
+                uint8_t *index_entry = image + C8ASM_BUNDLE_HEADER_SIZE + i * C8ASM_BUNDLE_ENTRY_SIZE;
+
+                rom_offset = page_align(rom_offset);
+
+                put_u64(index_entry, entry->hash);
+                put_u64(index_entry + 8, rom_offset);
+                put_u32(index_entry + 16, entry->rom_len);
+                put_u32(index_entry + 20, name_offset);
+                put_u32(index_entry + 24, entry->name_len);
+
+                memcpy(image + name_offset, entry->name, entry->name_len + 1);
+                memcpy(image + rom_offset, entry->rom, entry->rom_len);
+
+                name_offset += entry->name_len + 1;
+                rom_offset += entry->rom_len;
+        }
+
+        *out = image;
+        *outlen = len;
+
+        return SUCCESS;
+}
+
+//
+// c8asm_bundle_open - checks that len bytes of data hold a bundle and fills in a view of it, every offset is checked
+// here so lookups don't need to
+//
+int c8asm_bundle_open(c8asm_bundle *bundle, const void *data, size_t len) {
+        const uint8_t *bytes = data;
+
+        if (len < C8ASM_BUNDLE_HEADER_SIZE || memcmp(bytes, "C8BUNDLE", 8) ||
+                        get_u32(bytes + 8) != C8ASM_BUNDLE_VERSION)
+                return 0;
+
+        uint32_t count = get_u32(bytes + 12);
+        if ((len - C8ASM_BUNDLE_HEADER_SIZE) / C8ASM_BUNDLE_ENTRY_SIZE < count)
+                return 0;
+
+        for (uint32_t i = 0; i < count; ++i) {
+                const uint8_t *entry = bytes + C8ASM_BUNDLE_HEADER_SIZE + i * (size_t)C8ASM_BUNDLE_ENTRY_SIZE;
+                uint64_t rom_offset = get_u64(entry + 8);
+                uint32_t rom_len = get_u32(entry + 16);
+                uint32_t name_offset = get_u32(entry + 20), name_len = get_u32(entry + 24);
+
+                if (rom_offset > len || rom_len > len - rom_offset)
+                        return 0;
+
+                if (name_offset >= len || name_len >= len - name_offset || bytes[name_offset + name_len] != '\0')
+                        return 0;
+
+                if (i > 0 && get_u64(entry - C8ASM_BUNDLE_ENTRY_SIZE) > get_u64(entry))
+                        return 0;
+        }
+
+        *bundle = (c8asm_bundle){
+                .data = bytes,
+                .len = len,
+                .count = count
+        };
+
+        return 1;
+}
+
+//
+// c8asm_bundle_entry - gets the name and ROM of the i-th entry of the index
+//
+int c8asm_bundle_entry(const c8asm_bundle *bundle, uint32_t i, const char **name, const uint8_t **rom, size_t *len) {
+        if (i >= bundle->count)
+                return 0;
+
+        const uint8_t *entry = bundle->data + C8ASM_BUNDLE_HEADER_SIZE + i * (size_t)C8ASM_BUNDLE_ENTRY_SIZE;
+
+        if (name)
+                *name = (const char*)bundle->data + get_u32(entry + 20);
+        if (rom)
+                *rom = bundle->data + get_u64(entry + 8);
+        if (len)
+                *len = get_u32(entry + 16);
+
+        return 1;
+}
+
+//
+// c8asm_bundle_find - finds a ROM by name with a binary search of the index
+//
+int c8asm_bundle_find(const c8asm_bundle *bundle, const char *name, const uint8_t **rom, size_t *len) {
+        uint64_t hash = hash_name(name, strlen(name));
+        uint32_t lo = 0, hi = bundle->count;
+
+        // find the first entry with the hash
+        while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+
+                if (get_u64(bundle->data + C8ASM_BUNDLE_HEADER_SIZE + mid * (size_t)C8ASM_BUNDLE_ENTRY_SIZE) < hash)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        // names only need comparing when hashes collide
+        for (; lo < bundle->count; ++lo) {
+                const uint8_t *entry = bundle->data + C8ASM_BUNDLE_HEADER_SIZE + lo * (size_t)C8ASM_BUNDLE_ENTRY_SIZE;
+
+                if (get_u64(entry) != hash)
+                        break;
+
+                if (!strcmp((const char*)bundle->data + get_u32(entry + 20), name))
+                        return c8asm_bundle_entry(bundle, lo, NULL, rom, len);
+        }
+
+        return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef C8BUNDLE_H_INCLUDED
+        #define C8BUNDLE_H_INCLUDED 1
+
+        #include <stddef.h>
+        #include <stdint.h>
+
+        //
+        // ROM bundles - many assembled programs in a single file which can be mapped into memory and searched in place
+        //
+        // all integers are little endian, a bundle is laid out as
+        //
+        //     header   magic "C8BUNDLE", u32 version, u32 count, u32 page size, u32 reserved, u64 reserved
+        //     index    count entries sorted by name hash then name, each u64 name hash (64 bit FNV-1a),
+        //              u64 ROM offset, u32 ROM length, u32 name offset, u32 name length, u32 reserved
+        //     names    the names, each followed by a '\0'
+        //     ROMs     each starting on a page boundary
+        //
+        // functions returning int return an ExitCode (see exitcodes.h) unless noted otherwise
+        //
+        enum {
+                C8ASM_BUNDLE_VERSION = 1,
+                C8ASM_BUNDLE_PAGE_SIZE = 4096,
+                C8ASM_BUNDLE_HEADER_SIZE = 32,
+                C8ASM_BUNDLE_ENTRY_SIZE = 32
+        };
+
+        typedef struct c8asm_bundle_writer c8asm_bundle_writer;
+
+        // a view of a bundle in memory, filled in by c8asm_bundle_open
+        typedef struct {
+                const uint8_t *data;
+                size_t len;
+                uint32_t count;
+        } c8asm_bundle;
+
+        extern c8asm_bundle_writer *c8asm_bundle_writer_new(void);
+        extern void c8asm_bundle_writer_free(c8asm_bundle_writer *writer);
+        extern int c8asm_bundle_add(c8asm_bundle_writer *writer, const char *name, const uint8_t *rom, size_t len);
+        extern int c8asm_bundle_finish(c8asm_bundle_writer *writer, const uint8_t **out, size_t *outlen);
+
+        // these return 1 on success and 0 if the bundle is malformed or the ROM isn't found
+        extern int c8asm_bundle_open(c8asm_bundle *bundle, const void *data, size_t len);
+        extern int c8asm_bundle_find(const c8asm_bundle *bundle, const char *name, const uint8_t **rom, size_t *len);
+        extern int c8asm_bundle_entry(const c8asm_bundle *bundle, uint32_t i, const char **name, const uint8_t **rom,
+                size_t *len);
+#endif
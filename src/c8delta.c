@@ -0,0 +1,577 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "c8delta.h"
+#include "c8tokens.h"
+#include "exitcodes.h"
+#include "parser.h"
+#include "endian.h"
+
+// matches of fewer words away from where the last segment ended aren't worth a segment of their own, and at most
+// MAX_CHAIN earlier positions with the same hash are tried for each
+enum {MIN_MATCH = 4, MAX_CHAIN = 256, HASH_BITS = 15};
+
+// ROMs are loaded at C8_CODE_START_ADDR and can't be larger than XO-CHIP memory
+enum {ROM_MAX_LEN = XOCHIP_MEM_END - C8_CODE_START_ADDR};
+
+// masked words compare equal to any word of the same instruction whatever its address, see find_keys
+enum {KEY_ADDR = 0x10000, KEY_LONG_ADDR = 0x20000};
+
+// words new_start to new_start + len of the new ROM copied from old_start of the old ROM
+typedef struct {
+        uint32_t new_start, old_start, len;
+} Segment;
+
+// a delta being built, failed is set once growing it fails
+typedef struct {
+        uint8_t *buf;
+        size_t len, cap;
+        bool failed;
+} Buffer;
+
+//
+// push_bytes - appends bytes to a buffer, growing it if needed
+//
+static void push_bytes(Buffer *buffer, const void *bytes, size_t len) {
+        if (buffer->failed)
+                return;
+
+        if (buffer->len + len > buffer->cap) {
+                size_t new_cap = buffer->cap ? buffer->cap : 256;
+                uint8_t *new_buf;
+
+                while (new_cap < buffer->len + len)
+                        new_cap *= 2;
+
+                if (!(new_buf = realloc(buffer->buf, new_cap))) {
+                        buffer->failed = true;
+                        return;
+                }
+                buffer->buf = new_buf;
+                buffer->cap = new_cap;
+        }
+
+        memcpy(buffer->buf + buffer->len, bytes, len);
+        buffer->len += len;
+}
+
+//
+// push_varint - appends an unsigned LEB128 varint to a buffer
+//
+static void push_varint(Buffer *buffer, uint64_t n) {
+        uint8_t bytes[10];
+        size_t len = 0;
+
+        do {
+                bytes[len++] = (n & 0x7F) | ((n > 0x7F) ? 0x80 : 0);
+                n >>= 7;
+        } while (n);
+
+        push_bytes(buffer, bytes, len);
+}
+
+//
+// read_varint - reads an unsigned LEB128 varint and moves *p past it, returns false if it runs past end
+//
+static bool read_varint(const uint8_t **p, const uint8_t *end, uint64_t *n) {
+        *n = 0;
+
+        for (int shift = 0; shift < 64; shift += 7) {
+                if (*p >= end)
+                        return false;
+
+                uint8_t byte = *(*p)++;
+                *n |= (uint64_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80))
+                        return true;
+        }
+
+        return false;
+}
+
+//
+// zigzag - maps signed numbers to unsigned ones so numbers near 0 either side stay short as varints
+//
+static uint64_t zigzag(int64_t n) {
+        return (n < 0) ? ~((uint64_t)n << 1) : (uint64_t)n << 1;
+}
+
+//
+// unzigzag - undoes zigzag
+//
+static int64_t unzigzag(uint64_t n) {
+        return (n & 1) ? -(int64_t)(n >> 1) - 1 : (int64_t)(n >> 1);
+}
+
+//
+// get_word - reads the big endian word i of a ROM
+//
+static uint16_t get_word(const uint8_t *rom, uint32_t i) {
+        return rom[i * 2] << 8 | rom[i * 2 + 1];
+}
+
+//
+// put_word - writes the big endian word i of a ROM
+//
+static void put_word(uint8_t *rom, uint32_t i, uint16_t word) {
+        rom[i * 2] = word >> 8;
+        rom[i * 2 + 1] = word;
+}
+
+//
+// has_addr - checks whether an instruction holds an address in its low 12 bits, these are jmp, call, `mov I` and vjmp
+//
+static bool has_addr(uint16_t word) {
+        uint16_t op = word >> 12;
+
+        return op == 0x1 || op == 0x2 || op == 0xA || op == 0xB;
+}
+
+//
+// move_addr - finds where the word at an address of the old ROM was copied to in the new one, the end of the old ROM
+// moves to the end of the new one, returns -1 if the word wasn't copied
+//
+static int64_t move_addr(uint32_t addr, const int32_t *old_to_new, uint32_t old_words) {
+        uint32_t word = (addr - C8_CODE_START_ADDR) / C8_INSTR_SIZE;
+
+        if (addr < C8_CODE_START_ADDR || addr % C8_INSTR_SIZE || word > old_words)
+                return -1;
+
+        int32_t i = old_to_new[word];
+
+        return (i < 0) ? -1 : C8_CODE_START_ADDR + (int64_t)i * C8_INSTR_SIZE;
+}
+
+//
+// build_base - starts the new ROM from the segments of the old one, with the addresses copied moved to where the
+// words they point at went, this is all of the new ROM which the delta doesn't hold as runs
+//
+// old_to_new has room for old_words + 1 entries, a word copied more than once is taken to be where it was first
+// copied to
+//
+static void build_base(const uint8_t *old, uint32_t old_words, uint8_t *rom, size_t len, const Segment *segments,
+                size_t segments_len, int32_t *old_to_new) {
+        memset(rom, 0, len);
+
+        for (uint32_t i = 0; i < old_words; ++i)
+                old_to_new[i] = -1;
+        old_to_new[old_words] = len / C8_INSTR_SIZE;
+
+        for (size_t s = 0; s < segments_len; ++s) {
+                const Segment *seg = &segments[s];
+
+                for (uint32_t i = 0; i < seg->len; ++i)
+                        if (old_to_new[seg->old_start + i] < 0)
+                                old_to_new[seg->old_start + i] = seg->new_start + i;
+
+                memcpy(rom + seg->new_start * C8_INSTR_SIZE, old + seg->old_start * C8_INSTR_SIZE,
+                        seg->len * C8_INSTR_SIZE);
+        }
+
+        for (size_t s = 0; s < segments_len; ++s) {
+                const Segment *seg = &segments[s];
+
+                for (uint32_t i = 0; i < seg->len; ++i) {
+                        uint16_t word = get_word(old, seg->old_start + i);
+                        int64_t addr;
+
+                        if (has_addr(word)) {
+                                addr = move_addr(word & 0xFFF, old_to_new, old_words);
+                                if (addr >= 0 && addr <= 0xFFF)
+                                        put_word(rom, seg->new_start + i, (word & 0xF000) | addr);
+                        } else if (word == 0xF000 && i + 1 < seg->len) {
+                                // the address of a long `mov I` is the whole of the next word
+                                ++i;
+                                addr = move_addr(get_word(old, seg->old_start + i), old_to_new, old_words);
+                                if (addr >= 0 && addr <= 0xFFFF)
+                                        put_word(rom, seg->new_start + i, addr);
+                        }
+                }
+        }
+}
+
+//
+// find_keys - masks the addresses out of the words of a ROM, so code which only differs in where its references
+// point is matched up
+//
+static uint32_t *find_keys(const uint8_t *rom, uint32_t words) {
+        uint32_t *keys;
+
+        if (!(keys = malloc((words ? words : 1) * sizeof(uint32_t))))
+                return NULL;
+
+        for (uint32_t i = 0; i < words; ++i) {
+                uint16_t word = get_word(rom, i);
+
+                if (i > 0 && keys[i - 1] == 0xF000)
+                        keys[i] = KEY_LONG_ADDR;
+                else
+                        keys[i] = has_addr(word) ? KEY_ADDR | (word & 0xF000) : word;
+        }
+
+        return keys;
+}
+
+//
+// hash_keys - hashes the MIN_MATCH keys starting at one
+//
+static uint32_t hash_keys(const uint32_t *keys) {
+        uint32_t hash = 0;
+
+        for (int i = 0; i < MIN_MATCH; ++i)
+                hash = (hash ^ keys[i]) * 0x9E3779B1u;
+
+        return hash >> (32 - HASH_BITS);
+}
+
+//
+// match_len - counts the keys which match from a word of each ROM
+//
+static uint32_t match_len(const uint32_t *new_keys, uint32_t new_words, uint32_t i, const uint32_t *old_keys,
+                uint32_t old_words, uint32_t j) {
+        uint32_t len = 0;
+
+        while (i + len < new_words && j + len < old_words && new_keys[i + len] == old_keys[j + len])
+                ++len;
+
+        return len;
+}
+
+//
+// find_segments - matches up the words of the new ROM with the old one, keeping on from where the last match ended
+// as long as the words match, which follows code shifted by an edit, and otherwise looking for the longest match
+// anywhere in the old ROM, returns the number of segments or -1 on failure
+//
+static ptrdiff_t find_segments(const uint8_t *old, uint32_t old_words, const uint8_t *rom, uint32_t words,
+                Segment **segments) {
+        uint32_t *old_keys = find_keys(old, old_words), *new_keys = find_keys(rom, words);
+        int32_t *heads = malloc(sizeof(int32_t) << HASH_BITS), *chain = malloc((old_words + 1) * sizeof(int32_t));
+        ptrdiff_t segments_len = 0, segments_cap = 64;
+
+        *segments = malloc(segments_cap * sizeof(Segment));
+
+        if (!(old_keys && new_keys && heads && chain && *segments)) {
+                segments_len = -1;
+                goto done;
+        }
+
+        // later positions are tried first
+        for (uint32_t h = 0; h < 1u << HASH_BITS; ++h)
+                heads[h] = -1;
+        for (uint32_t j = 0; j + MIN_MATCH <= old_words; ++j) {
+                uint32_t h = hash_keys(old_keys + j);
+
+                chain[j] = heads[h];
+                heads[h] = j;
+        }
+
+        uint32_t i = 0, j = 0;
+        while (i < words) {
+                uint32_t len = match_len(new_keys, words, i, old_keys, old_words, j);
+
+                if (len < 2 && i + MIN_MATCH <= words) {
+                        uint32_t best_len = 0, best_j = 0, tries = 0;
+
+                        // the nearest of the longest matches keeps the next segment close
+                        for (int32_t k = heads[hash_keys(new_keys + i)]; k >= 0 && tries < MAX_CHAIN; k = chain[k],
+                                        ++tries) {
+                                uint32_t k_len = match_len(new_keys, words, i, old_keys, old_words, k);
+
+                                if (k_len > best_len || (k_len == best_len &&
+                                                labs((long)k - (long)j) < labs((long)best_j - (long)j))) {
+                                        best_len = k_len;
+                                        best_j = k;
+                                }
+                        }
+
+                        if (best_len >= MIN_MATCH) {
+                                len = best_len;
+                                j = best_j;
+                        }
+                }
+
+                // a changed word is sent as it is and the next is expected to follow on from the old one
+                if (len < 2) {
+                        ++i;
+                        ++j;
+                        continue;
+                }
+
+                Segment *last = segments_len ? &(*segments)[segments_len - 1] : NULL;
+                if (last && last->new_start + last->len == i && last->old_start + last->len == j) {
+                        last->len += len;
+                } else {
+                        if (segments_len >= segments_cap) {
+                                Segment *new_segments;
+
+                                if (!(new_segments = realloc(*segments, segments_cap * 2 * sizeof(Segment)))) {
+                                        segments_len = -1;
+                                        goto done;
+                                }
+                                *segments = new_segments;
+                                segments_cap *= 2;
+                        }
+
+                        (*segments)[segments_len++] = (Segment){.new_start = i, .old_start = j, .len = len};
+                }
+
+                i += len;
+                j += len;
+        }
+
+done:
+        free(old_keys);
+        free(new_keys);
+        free(heads);
+        free(chain);
+
+        return segments_len;
+}
+
+//
+// push_run - appends a run of changed bytes to a delta, *end is where the last run ended
+//
+static void push_run(Buffer *delta, size_t *end, const uint8_t *rom, size_t start, size_t len, bool fill) {
+        push_varint(delta, start - *end);
+        push_varint(delta, (uint64_t)len << 1 | fill);
+        push_bytes(delta, rom + start, fill ? 1 : len);
+
+        *end = start + len;
+}
+
+//
+// push_runs - appends the bytes of the new ROM which differ from the base as runs, returns the number of runs
+//
+static uint32_t push_runs(Buffer *delta, const uint8_t *base, const uint8_t *rom, size_t len) {
+        uint32_t runs = 0;
+        size_t end = 0, i = 0;
+
+        while (i < len) {
+                if (base[i] == rom[i]) {
+                        ++i;
+                        continue;
+                }
+
+                // gaps of up to 3 unchanged bytes cost no more to send than starting another run
+                size_t last = i;
+                for (size_t j = i + 1; j < len && j - last <= 3; ++j)
+                        if (base[j] != rom[j])
+                                last = j;
+
+                // repeats of at least 4 bytes are sent as fills, the rest as they are
+                size_t start = i;
+                while (start < last + 1) {
+                        size_t repeat = start;
+                        while (repeat < last + 1 && rom[repeat] == rom[start])
+                                ++repeat;
+
+                        if (repeat - start >= 4) {
+                                push_run(delta, &end, rom, start, repeat - start, true);
+                                start = repeat;
+                        } else {
+                                size_t stop = repeat;
+                                while (stop < last + 1) {
+                                        size_t next = stop;
+                                        while (next < last + 1 && rom[next] == rom[stop])
+                                                ++next;
+                                        if (next - stop >= 4)
+                                                break;
+                                        stop = next;
+                                }
+
+                                push_run(delta, &end, rom, start, stop - start, false);
+                                start = stop;
+                        }
+                        ++runs;
+                }
+
+                i = last + 1;
+        }
+
+        return runs;
+}
+
+//
+// c8asm_delta_build - builds a delta from the old ROM to the new one, see c8delta.h
+//
+int c8asm_delta_build(const uint8_t *old, size_t old_len, const uint8_t *rom, size_t len, uint8_t **out,
+                size_t *outlen) {
+        if (old_len > ROM_MAX_LEN || len > ROM_MAX_LEN)
+                return ERR_FILE_TOO_LARGE;
+
+        uint32_t old_words = old_len / C8_INSTR_SIZE, words = len / C8_INSTR_SIZE;
+        Segment *segments;
+        ptrdiff_t segments_len = find_segments(old, old_words, rom, words, &segments);
+        uint8_t *base = malloc(len ? len : 1);
+        int32_t *old_to_new = malloc((old_words + 1) * sizeof(int32_t));
+        Buffer delta = {0};
+
+        if (segments_len < 0 || !base || !old_to_new) {
+                free(segments);
+                free(base);
+                free(old_to_new);
+                return ERR_MALLOC_FAIL;
+        }
+
+        uint8_t header[C8ASM_DELTA_HEADER_SIZE] = {0};
+        push_bytes(&delta, header, sizeof(header));
+
+        uint32_t new_end = 0, old_end = 0;
+        for (ptrdiff_t s = 0; s < segments_len; ++s) {
+                push_varint(&delta, segments[s].new_start - new_end);
+                push_varint(&delta, zigzag((int64_t)segments[s].old_start - old_end));
+                push_varint(&delta, segments[s].len);
+
+                new_end = segments[s].new_start + segments[s].len;
+                old_end = segments[s].old_start + segments[s].len;
+        }
+
+        // the runs are whatever the segments, with their addresses moved, don't already get right
+        build_base(old, old_words, base, len, segments, segments_len, old_to_new);
+        uint32_t runs = push_runs(&delta, base, rom, len);
+
+        free(segments);
+        free(base);
+        free(old_to_new);
+
+        if (delta.failed) {
+                free(delta.buf);
+                return ERR_MALLOC_FAIL;
+        }
+
+        memcpy(delta.buf, "C8ASMDLT", 8);
+        put_u32(delta.buf + 8, C8ASM_DELTA_VERSION);
+        put_u32(delta.buf + 12, old_len);
+        put_u32(delta.buf + 16, len);
+        put_u32(delta.buf + 20, segments_len);
+        put_u32(delta.buf + 24, runs);
+        put_u32(delta.buf + 28, 0);
+        put_u64(delta.buf + 32, c8asm_src_hash((const char*)old, old_len));
+        put_u64(delta.buf + 40, c8asm_src_hash((const char*)rom, len));
+
+        *out = delta.buf;
+        *outlen = delta.len;
+
+        return SUCCESS;
+}
+
+//
+// read_segments - reads and checks the segments of a delta, returns false if they are malformed
+//
+static bool read_segments(const uint8_t **p, const uint8_t *end, Segment *segments, uint32_t segments_len,
+                uint32_t old_words, uint32_t words) {
+        uint64_t new_end = 0;
+        int64_t old_end = 0;
+
+        for (uint32_t s = 0; s < segments_len; ++s) {
+                uint64_t skip, old_skip, len;
+
+                if (!(read_varint(p, end, &skip) && read_varint(p, end, &old_skip) && read_varint(p, end, &len)))
+                        return false;
+
+                // every number is bounded by the size of memory before it is added to anything
+                int64_t old_start = old_end + unzigzag(old_skip);
+                if (skip > words || len > words || new_end + skip + len > words || old_start < 0 ||
+                                old_start > old_words || len > (uint64_t)(old_words - old_start))
+                        return false;
+
+                segments[s] = (Segment){.new_start = new_end + skip, .old_start = old_start, .len = len};
+                new_end += skip + len;
+                old_end = old_start + len;
+        }
+
+        return true;
+}
+
+//
+// read_runs - reads the runs of a delta and writes them over the new ROM, returns false if they are malformed
+//
+static bool read_runs(const uint8_t **p, const uint8_t *end, uint32_t runs, uint8_t *rom, size_t len) {
+        uint64_t run_end = 0;
+
+        for (uint32_t r = 0; r < runs; ++r) {
+                uint64_t skip, header;
+
+                if (!(read_varint(p, end, &skip) && read_varint(p, end, &header)))
+                        return false;
+
+                uint64_t run_len = header >> 1;
+                bool fill = header & 1;
+                if (skip > len || run_len > len || run_end + skip + run_len > len ||
+                                (size_t)(end - *p) < (fill ? 1 : run_len))
+                        return false;
+
+                run_end += skip;
+                if (fill) {
+                        memset(rom + run_end, *(*p)++, run_len);
+                } else {
+                        memcpy(rom + run_end, *p, run_len);
+                        *p += run_len;
+                }
+                run_end += run_len;
+        }
+
+        return true;
+}
+
+//
+// c8asm_delta_apply - applies a delta to the ROM it was built from, see c8delta.h
+//
+int c8asm_delta_apply(const uint8_t *old, size_t old_len, const uint8_t *delta, size_t delta_len, uint8_t **out,
+                size_t *outlen) {
+        if (delta_len < C8ASM_DELTA_HEADER_SIZE || memcmp(delta, "C8ASMDLT", 8) ||
+                        get_u32(delta + 8) != C8ASM_DELTA_VERSION)
+                return ERR_INVALID_ARG;
+
+        if (get_u32(delta + 12) != old_len || get_u64(delta + 32) != c8asm_src_hash((const char*)old, old_len))
+                return FAILURE;
+
+        size_t len = get_u32(delta + 16);
+        uint32_t segments_len = get_u32(delta + 20), runs = get_u32(delta + 24);
+
+        // every segment takes at least 3 bytes and every run at least 3
+        if (len > ROM_MAX_LEN || segments_len > delta_len / 3 || runs > delta_len / 3)
+                return ERR_INVALID_ARG;
+
+        uint32_t old_words = old_len / C8_INSTR_SIZE, words = len / C8_INSTR_SIZE;
+        Segment *segments = malloc((segments_len ? segments_len : 1) * sizeof(Segment));
+        int32_t *old_to_new = malloc((old_words + 1) * sizeof(int32_t));
+        uint8_t *rom = malloc(len ? len : 1);
+
+        if (!(segments && old_to_new && rom)) {
+                free(segments);
+                free(old_to_new);
+                free(rom);
+                return ERR_MALLOC_FAIL;
+        }
+
+        const uint8_t *p = delta + C8ASM_DELTA_HEADER_SIZE, *end = delta + delta_len;
+        int err = SUCCESS;
+
+        if (!read_segments(&p, end, segments, segments_len, old_words, words)) {
+                err = ERR_INVALID_ARG;
+        } else {
+                build_base(old, old_words, rom, len, segments, segments_len, old_to_new);
+
+                // the hash of the result catches a delta damaged on the way
+                if (!read_runs(&p, end, runs, rom, len) || p != end ||
+                                get_u64(delta + 40) != c8asm_src_hash((const char*)rom, len))
+                        err = ERR_INVALID_ARG;
+        }
+
+        free(segments);
+        free(old_to_new);
+
+        if (err != SUCCESS) {
+                free(rom);
+                return err;
+        }
+
+        *out = rom;
+        *outlen = len;
+
+        return SUCCESS;
+}
@@ -0,0 +1,39 @@
+#ifndef C8DELTA_H_INCLUDED
+        #define C8DELTA_H_INCLUDED 1
+
+        #include <stddef.h>
+        #include <stdint.h>
+
+        //
+        // ROM deltas - the changes between two builds of a program, small enough to send to a device over a slow link
+        // in place of the whole program, made by c8asm_delta_build and applied to the old ROM by c8asm_delta_apply
+        //
+        // the header is little endian, the body is made of unsigned LEB128 varints, signed ones zigzag encoded, a
+        // delta is laid out as
+        //
+        //     header    magic "C8ASMDLT", u32 version, u32 old length, u32 new length, u32 segment count,
+        //               u32 run count, u32 reserved, u64 old hash, u64 new hash (c8asm_src_hash of each ROM)
+        //     segments  runs of words copied from the old ROM in order of their new position, each the words skipped
+        //               since the last segment, the signed distance of its old start from the end of the last
+        //               segment in the old ROM and its length in words
+        //     runs      changed bytes in order, each the bytes skipped since the last run, its length << 1 with the
+        //               low bit set for a fill, then a single byte repeated for a fill or the bytes of the run
+        //
+        // the new ROM starts out as zeros, then each segment is copied in, and the address of every jmp, call, vjmp,
+        // `mov I` and long `mov I` copied which pointed into a segment is moved along with it, so code shifted by an
+        // edit doesn't need its references sent again, and the runs are written over the result
+        //
+        // functions return an ExitCode (see exitcodes.h), *out is allocated with malloc and freed by the caller
+        //
+        enum {
+                C8ASM_DELTA_VERSION = 1,
+                C8ASM_DELTA_HEADER_SIZE = 48
+        };
+
+        extern int c8asm_delta_build(const uint8_t *old, size_t old_len, const uint8_t *rom, size_t len,
+                uint8_t **out, size_t *outlen);
+
+        // returns FAILURE if the delta was made from another ROM than old and ERR_INVALID_ARG if it is malformed
+        extern int c8asm_delta_apply(const uint8_t *old, size_t old_len, const uint8_t *delta, size_t delta_len,
+                uint8_t **out, size_t *outlen);
+#endif
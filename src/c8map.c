@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "c8map.h"
+#include "endian.h"
+
+//
+// string_ok - checks that an offset into the strings of a map starts a terminated string
+//
+static int string_ok(const c8asm_map *map, uint32_t offset, uint32_t strings_len) {
+        return offset < strings_len && memchr(map->strings + offset, '\0', strings_len - offset);
+}
+
+//
+// c8asm_map_open - checks that len bytes of data hold a map and fills in a view of it, every offset is checked here
+// so lookups don't need to
+//
+int c8asm_map_open(c8asm_map *map, const void *data, size_t len) {
+        const uint8_t *bytes = data;
+
+        if (len < C8ASM_MAP_HEADER_SIZE || memcmp(bytes, "C8ASMMAP", 8) || get_u32(bytes + 8) != C8ASM_MAP_VERSION)
+                return 0;
+
+        uint64_t lines_count = get_u32(bytes + 12), symbols_count = get_u32(bytes + 16);
+        uint64_t files_count = get_u32(bytes + 20);
+        uint64_t strings_offset = get_u32(bytes + 24), strings_len = get_u32(bytes + 28);
+
+        uint64_t tables_len = lines_count * C8ASM_MAP_LINE_SIZE + symbols_count * C8ASM_MAP_SYMBOL_SIZE +
+                files_count * 4;
+        if (C8ASM_MAP_HEADER_SIZE + tables_len > strings_offset || strings_offset + strings_len > len)
+                return 0;
+
+        *map = (c8asm_map){
+                .data = bytes,
+                .len = len,
+                .lines_count = lines_count,
+                .symbols_count = symbols_count,
+                .files_count = files_count,
+                .lines = bytes + C8ASM_MAP_HEADER_SIZE,
+                .symbols = bytes + C8ASM_MAP_HEADER_SIZE + lines_count * C8ASM_MAP_LINE_SIZE,
+                .files = bytes + C8ASM_MAP_HEADER_SIZE + lines_count * C8ASM_MAP_LINE_SIZE +
+                        symbols_count * C8ASM_MAP_SYMBOL_SIZE,
+                .strings = (const char*)bytes + strings_offset
+        };
+
+        for (uint32_t i = 0; i < map->files_count; ++i)
+                if (!string_ok(map, get_u32(map->files + i * 4), strings_len))
+                        return 0;
+
+        for (uint32_t i = 0; i < map->lines_count; ++i)
+                if (get_u16(map->lines + i * C8ASM_MAP_LINE_SIZE + 10) >= map->files_count)
+                        return 0;
+
+        for (uint32_t i = 0; i < map->symbols_count; ++i) {
+                const uint8_t *symbol = map->symbols + i * C8ASM_MAP_SYMBOL_SIZE;
+
+                if (get_u16(symbol + 10) >= map->files_count || !string_ok(map, get_u32(symbol + 12), strings_len))
+                        return 0;
+        }
+
+        return 1;
+}
+
+//
+// last_at_or_before - binary searches a table sorted by a leading u32 address for the last entry at or before addr,
+// returns count if there is none
+//
+static uint32_t last_at_or_before(const uint8_t *table, uint32_t count, size_t entry_size, uint32_t addr) {
+        uint32_t lo = 0, hi = count;
+
+        while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+
+                if (get_u32(table + mid * entry_size) <= addr)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo ? lo - 1 : count;
+}
+
+//
+// c8asm_map_lookup - finds the source location of the instruction at an address
+//
+int c8asm_map_lookup(const c8asm_map *map, uint32_t addr, const char **file, uint32_t *line, uint32_t *col) {
+        uint32_t i = last_at_or_before(map->lines, map->lines_count, C8ASM_MAP_LINE_SIZE, addr);
+
+        if (i == map->lines_count)
+                return 0;
+
+        const uint8_t *entry = map->lines + i * C8ASM_MAP_LINE_SIZE;
+
+        // only the word itself or the second byte of it match
+        if (addr - get_u32(entry) > 1)
+                return 0;
+
+        if (file)
+                *file = map->strings + get_u32(map->files + get_u16(entry + 10) * 4);
+        if (line)
+                *line = get_u32(entry + 4);
+        if (col)
+                *col = get_u16(entry + 8);
+
+        return 1;
+}
+
+//
+// c8asm_map_symbol - finds the closest label defined at or before an address
+//
+int c8asm_map_symbol(const c8asm_map *map, uint32_t addr, const char **name, uint32_t *label_addr) {
+        uint32_t i = last_at_or_before(map->symbols, map->symbols_count, C8ASM_MAP_SYMBOL_SIZE, addr);
+
+        if (i == map->symbols_count)
+                return 0;
+
+        const uint8_t *symbol = map->symbols + i * C8ASM_MAP_SYMBOL_SIZE;
+
+        if (name)
+                *name = map->strings + get_u32(symbol + 12);
+        if (label_addr)
+                *label_addr = get_u32(symbol);
+
+        return 1;
+}
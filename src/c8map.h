@@ -0,0 +1,45 @@
+#ifndef C8MAP_H_INCLUDED
+        #define C8MAP_H_INCLUDED 1
+
+        #include <stddef.h>
+        #include <stdint.h>
+
+        //
+        // debug maps - the source location of every instruction of an assembled program and its labels, written by
+        // c8asm_build_map (see c8asm.h) and made to be mapped into memory and searched in place
+        //
+        // all integers are little endian, a map is laid out as
+        //
+        //     header   magic "C8ASMMAP", u32 version, u32 line count, u32 symbol count, u32 file count,
+        //              u32 strings offset, u32 strings length
+        //     lines    an entry for every word of the program sorted by address, each u32 address, u32 line,
+        //              u16 column, u16 file
+        //     symbols  label definitions sorted by address, each u32 address, u32 line, u16 column, u16 file,
+        //              u32 name offset, followed by the counters of an instrumented program named `label@count`
+        //     files    u32 name offset for each source file
+        //     strings  names, each followed by a '\0', offsets are relative to the start of the strings
+        //
+        // lines and columns start at 1, columns past 65535 are stored as 65535
+        //
+        enum {
+                C8ASM_MAP_VERSION = 1,
+                C8ASM_MAP_HEADER_SIZE = 32,
+                C8ASM_MAP_LINE_SIZE = 12,
+                C8ASM_MAP_SYMBOL_SIZE = 16
+        };
+
+        // a view of a map in memory, filled in by c8asm_map_open
+        typedef struct {
+                const uint8_t *data;
+                size_t len;
+                uint32_t lines_count, symbols_count, files_count;
+                const uint8_t *lines, *symbols, *files;
+                const char *strings;
+        } c8asm_map;
+
+        // these return 1 on success and 0 if the map is malformed or nothing is found at the address
+        extern int c8asm_map_open(c8asm_map *map, const void *data, size_t len);
+        extern int c8asm_map_lookup(const c8asm_map *map, uint32_t addr, const char **file, uint32_t *line,
+                uint32_t *col);
+        extern int c8asm_map_symbol(const c8asm_map *map, uint32_t addr, const char **name, uint32_t *label_addr);
+#endif
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "c8delta.h"
+#include "mapfile.h"
+#include "output.h"
+#include "exitcodes.h"
+#include "ansicodes.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+#define USAGE "usage: %s <old ROM> <delta> <new ROM>\n" \
+              "\n" \
+              "applies a delta written by c8asm --delta to the ROM it was made from and writes the new ROM, the new\n" \
+              "ROM may replace the old one\n"
+
+int main(int argc, char **argv) {
+        if (argc != 4) {
+                fprintf(stderr, USAGE, argv[0]);
+                return (argc < 4) ? ERR_TOO_FEW_ARGS : ERR_INVALID_ARG;
+        }
+
+        const uint8_t *old, *delta;
+        size_t old_len, delta_len;
+        int err;
+
+        if ((err = map_file(argv[1], &old, &old_len)) != SUCCESS)
+                return err;
+
+        if ((err = map_file(argv[2], &delta, &delta_len)) != SUCCESS) {
+                unmap_file(old, old_len);
+                return err;
+        }
+
+        uint8_t *rom = NULL;
+        size_t rom_len;
+
+        if ((err = c8asm_delta_apply(old, old_len, delta, delta_len, &rom, &rom_len)) == FAILURE)
+                fprintf(stderr, FMT_ERRMSG("`%s` was made from another ROM than `%s`\n"), argv[2], argv[1]);
+        else if (err == ERR_INVALID_ARG)
+                fprintf(stderr, FMT_ERRMSG("`%s` is not a valid ROM delta\n"), argv[2]);
+        else if (err == ERR_MALLOC_FAIL)
+                fputs(FMT_ERRMSG("failed to allocate memory for the new ROM\n"), stderr);
+
+        unmap_file(old, old_len);
+        unmap_file(delta, delta_len);
+
+        // the old ROM is unmapped first as the new one may be written over it
+        if (err == SUCCESS)
+                err = write_output(argv[3], rom, rom_len, false);
+
+        free(rom);
+
+        return err;
+}
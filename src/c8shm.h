@@ -0,0 +1,80 @@
+#ifndef C8SHM_H_INCLUDED
+        #define C8SHM_H_INCLUDED 1
+
+        #include <stddef.h>
+        #include <stdint.h>
+        #include <string.h>
+
+        //
+        // shared memory output - `c8asm --shm=NAME` publishes each program it assembles to the POSIX shared memory
+        // object NAME so a process which has it mapped picks up a new ROM without going through the filesystem, this
+        // header is all a reader needs and builds with gcc or clang
+        //
+        // the region is only shared between processes on one machine so integers are in host byte order, it is laid
+        // out as
+        //
+        //     header   magic "C8ASMSHM", u32 version, u32 capacity, u32 sequence, u32 length
+        //     image    capacity bytes, the first length of which hold the program
+        //
+        // the sequence is odd while the assembler is writing an image and goes up by two with each image published,
+        // it is 0 until the first one is, so a reader copies the image and keeps the copy only if the sequence was
+        // even and didn't change over the copy
+        //
+        enum {
+                C8ASM_SHM_VERSION = 1,
+                C8ASM_SHM_HEADER_SIZE = 24,
+                C8ASM_SHM_CAPACITY = 0x10000 - 0x200 // the largest program for any target
+        };
+
+        //
+        // c8asm_shm_check - checks that len bytes of a mapped region hold a shared memory image header, returns 1 if
+        // they do and 0 if not
+        //
+        static inline int c8asm_shm_check(const void *region, size_t len) {
+                const uint32_t *fields = (const uint32_t*)((const uint8_t*)region + 8);
+
+                return len >= C8ASM_SHM_HEADER_SIZE && !memcmp(region, "C8ASMSHM", 8) &&
+                        fields[0] == C8ASM_SHM_VERSION && fields[1] <= len - C8ASM_SHM_HEADER_SIZE;
+        }
+
+        //
+        // c8asm_shm_seq - gets the sequence of a checked region, a reader can poll this and only copy the image when
+        // it changes
+        //
+        static inline uint32_t c8asm_shm_seq(const void *region) {
+                return __atomic_load_n((const uint32_t*)((const uint8_t*)region + 16), __ATOMIC_ACQUIRE);
+        }
+
+        //
+        // c8asm_shm_read - copies the image in a checked region to out, which has room for cap bytes, and sets *len
+        // to its length and *seq to the sequence it was published with
+        //
+        // returns 1 on success, 0 if nothing has been published yet or an image was being written during the copy so
+        // the caller should try again, and -1 if the image doesn't fit in out
+        //
+        static inline int c8asm_shm_read(const void *region, uint8_t *out, size_t cap, size_t *len, uint32_t *seq) {
+                const uint32_t *fields = (const uint32_t*)((const uint8_t*)region + 8);
+                uint32_t before = __atomic_load_n(&fields[2], __ATOMIC_ACQUIRE);
+
+                if (before == 0 || before & 1)
+                        return 0;
+
+                // the length and image are only trusted once the sequence is seen unchanged after reading them
+                uint32_t image_len = __atomic_load_n(&fields[3], __ATOMIC_RELAXED);
+                if (image_len > fields[1])
+                        return 0;
+                if (image_len > cap)
+                        return -1;
+
+                memcpy(out, (const uint8_t*)region + C8ASM_SHM_HEADER_SIZE, image_len);
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&fields[2], __ATOMIC_RELAXED) != before)
+                        return 0;
+
+                *len = image_len;
+                *seq = before;
+
+                return 1;
+        }
+#endif
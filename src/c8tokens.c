@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "c8tokens.h"
+#include "lexer.h"
+#include "endian.h"
+
+//
+// c8asm_src_hash - hashes a source 8 bytes at a time, this runs on every lookup of a cache so it has to be much
+// cheaper than lexing, it only needs to tell sources apart rather than resist collisions made on purpose
+//
+uint64_t c8asm_src_hash(const char *src, size_t len) {
+        const uint8_t *bytes = (const uint8_t*)src;
+        uint64_t hash = 0x9E3779B97F4A7C15u ^ len;
+        size_t i = 0;
+
+        for (; i + 8 <= len; i += 8) {
+                hash = (hash ^ get_u64(bytes + i)) * 0xFF51AFD7ED558CCDu;
+                hash ^= hash >> 32;
+        }
+
+        uint64_t tail = 0;
+        for (int shift = 0; i < len; ++i, shift += 8)
+                tail |= (uint64_t)bytes[i] << shift;
+
+        // mix the last bits into every bit of the hash
+        hash = (hash ^ tail) * 0xFF51AFD7ED558CCDu;
+        hash ^= hash >> 33;
+        hash *= 0xC4CEB9FE1A85EC53u;
+        hash ^= hash >> 33;
+
+        return hash;
+}
+
+//
+// is_little_endian - checks the byte order of the host, the arrays of a cache are only usable in place on little
+// endian hosts
+//
+static bool is_little_endian(void) {
+        const uint16_t probe = 1;
+
+        return *(const uint8_t*)&probe == 1;
+}
+
+//
+// type_ok - checks that a byte is a type the lexer produces, other than the end of the stream
+//
+static bool type_ok(uint8_t type) {
+        return type <= NAME_LBLDEF || type == NAME_I || type == SYM_COMMA || type == SYM_COLON ||
+                type == CONST_INT || type == SYM_OP;
+}
+
+//
+// c8asm_tokens_open - checks that len bytes of data hold a cache of the tokens of src and fills in a view of it,
+// every token is checked here so the parser can trust the stream as it does one just lexed
+//
+int c8asm_tokens_open(c8asm_tokens *tokens, const void *data, size_t len, const char *src, size_t src_len) {
+        const uint8_t *bytes = data;
+
+        // the positions and payloads are read as u32 arrays where they lie
+        if (!is_little_endian() || (uintptr_t)bytes % sizeof(uint32_t) || len < C8ASM_TOKENS_HEADER_SIZE ||
+                        memcmp(bytes, "C8ASMTKN", 8) || get_u32(bytes + 8) != C8ASM_TOKENS_VERSION ||
+                        get_u64(bytes + 16) != lexer_fingerprint() || get_u32(bytes + 32) != src_len)
+                return 0;
+
+        uint64_t count = get_u32(bytes + 12), payloads_count = get_u32(bytes + 36), names_len = get_u32(bytes + 40);
+        if (count == 0 || payloads_count > count ||
+                        C8ASM_TOKENS_HEADER_SIZE + count * 5 + payloads_count * 4 + names_len != len)
+                return 0;
+
+        *tokens = (c8asm_tokens){
+                .positions = (const uint32_t*)(bytes + C8ASM_TOKENS_HEADER_SIZE),
+                .payloads = (const uint32_t*)(bytes + C8ASM_TOKENS_HEADER_SIZE + count * 4),
+                .types = bytes + C8ASM_TOKENS_HEADER_SIZE + (count + payloads_count) * 4,
+                .names = (const char*)bytes + C8ASM_TOKENS_HEADER_SIZE + count * 5 + payloads_count * 4,
+                .count = count,
+                .payloads_count = payloads_count,
+                .names_len = names_len
+        };
+
+        if (tokens->types[count - 1] != STREAM_END || (names_len && tokens->names[names_len - 1] != '\0'))
+                return 0;
+
+        // names are read up to their '\0' so any offset inside the names is safe
+        uint32_t payload_i = 0;
+        for (uint32_t i = 0; i < count - 1; ++i) {
+                uint8_t type = tokens->types[i];
+
+                if (!type_ok(type) || tokens->positions[i] > src_len)
+                        return 0;
+                if (!TKN_HAS_PAYLOAD(type))
+                        continue;
+                if (payload_i == payloads_count)
+                        return 0;
+
+                uint32_t payload = tokens->payloads[payload_i++];
+                if (((type == NAME_LBLREF || type == NAME_LBLDEF) && payload >= names_len) ||
+                                (type == NAME_REG && payload >= VREG_BASE && payload - VREG_BASE >= names_len))
+                        return 0;
+        }
+
+        if (payload_i != payloads_count || tokens->positions[count - 1] > src_len)
+                return 0;
+
+        // checked last as it reads the whole source
+        return get_u64(bytes + 24) == c8asm_src_hash(src, src_len);
+}
+
+//
+// c8asm_tokens_write - writes a cache of the tokens of src, see c8tokens.h
+//
+size_t c8asm_tokens_write(uint8_t *out, const c8asm_tokens *tokens, const char *src, size_t src_len) {
+        size_t len = C8ASM_TOKENS_HEADER_SIZE + (size_t)tokens->count * 5 + (size_t)tokens->payloads_count * 4 +
+                tokens->names_len;
+
+        if (!out)
+                return len;
+
+        memcpy(out, "C8ASMTKN", 8);
+        put_u32(out + 8, C8ASM_TOKENS_VERSION);
+        put_u32(out + 12, tokens->count);
+        put_u64(out + 16, lexer_fingerprint());
+        put_u64(out + 24, c8asm_src_hash(src, src_len));
+        put_u32(out + 32, src_len);
+        put_u32(out + 36, tokens->payloads_count);
+        put_u32(out + 40, tokens->names_len);
+        put_u32(out + 44, 0);
+
+        uint8_t *p = out + C8ASM_TOKENS_HEADER_SIZE;
+        for (uint32_t i = 0; i < tokens->count; ++i, p += 4)
+                put_u32(p, tokens->positions[i]);
+        for (uint32_t i = 0; i < tokens->payloads_count; ++i, p += 4)
+                put_u32(p, tokens->payloads[i]);
+
+        memcpy(p, tokens->types, tokens->count);
+        memcpy(p + tokens->count, tokens->names, tokens->names_len);
+
+        return len;
+}
@@ -0,0 +1,46 @@
+#ifndef C8TOKENS_H_INCLUDED
+        #define C8TOKENS_H_INCLUDED 1
+
+        #include <stddef.h>
+        #include <stdint.h>
+
+        //
+        // token caches - the token stream of a source, written by c8asm_build_token_cache (see c8asm.h) so a source
+        // assembled again can skip lexing, made to be mapped into memory and used in place
+        //
+        // all integers are little endian, a cache is laid out as
+        //
+        //     header     magic "C8ASMTKN", u32 version, u32 token count, u64 lexer fingerprint, u64 source hash,
+        //                u32 source length, u32 payload count, u32 names length, u32 reserved
+        //     positions  u32 source offset of each token
+        //     payloads   u32 payload of each token which carries one, in token order
+        //     types      u8 type of each token, the last ends the stream
+        //     names      the names of labels and virtual registers, each followed by a '\0'
+        //
+        // a cache is keyed by the hash of its source (c8asm_src_hash) and by a fingerprint of the lexer which wrote
+        // it, so it is never used for another source or by an assembler which would lex the source differently, the
+        // tokens are used in place so a cache is only used on little endian hosts
+        //
+        enum {
+                C8ASM_TOKENS_VERSION = 1,
+                C8ASM_TOKENS_HEADER_SIZE = 48
+        };
+
+        // a token stream, filled in by c8asm_tokens_open or given to c8asm_tokens_write, the types are the TokenType
+        // values of the lexer
+        typedef struct {
+                const uint8_t *types;
+                const uint32_t *positions, *payloads;
+                const char *names;
+                uint32_t count, payloads_count, names_len;
+        } c8asm_tokens;
+
+        extern uint64_t c8asm_src_hash(const char *src, size_t len);
+
+        // returns 1 if len bytes of data hold a cache of the tokens of src and 0 otherwise
+        extern int c8asm_tokens_open(c8asm_tokens *tokens, const void *data, size_t len, const char *src,
+                size_t src_len);
+
+        // writes a cache of the tokens of src to out unless it is NULL, returns the size of the cache
+        extern size_t c8asm_tokens_write(uint8_t *out, const c8asm_tokens *tokens, const char *src, size_t src_len);
+#endif
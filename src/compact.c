@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "parser.h"
+#include "analyze.h"
+#include "compact.h"
+#include "alloc.h"
+
+// defined in compact.h
+extern inline uint32_t word_addr(uint32_t i);
+extern inline uint32_t ref_target(const LabelRef *ref, uint16_t word);
+extern inline void patch_ref(const LabelRef *ref, uint32_t target);
+
+//
+// find_literal_addr - finds an instruction holding an address in the program which didn't come from a label, such
+// an address can't be moved when the program is compacted, returns -1 if there is none
+//
+long find_literal_addr(void) {
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+        bool *has_ref = alloc_or_panic(words_len + 1, sizeof(bool), "compacting the program");
+        long found = -1;
+
+        for (LabelRef *ref = label_refs; ref < label_refs_ptr; ++ref)
+                has_ref[ref->output_pos - outfile_buffer] = true;
+
+        uint32_t len;
+        for (uint32_t i = 0; i < words_len && found < 0; i += len) {
+                uint16_t word = instr_word(outfile_buffer, i);
+
+                // the bytes of a table aren't addresses even when they look like an instruction holding one
+                len = is_table_word(i) ? 1 : instr_len(word);
+                if (is_table_word(i))
+                        continue;
+
+                switch (word >> 12) {
+                        case 0x1: // FALLTHROUGH
+                        case 0x2:
+                        case 0xA:
+                        case 0xB:
+                                if (!has_ref[i] && (word & 0xFFF) >= C8_CODE_START_ADDR)
+                                        found = i;
+                                break;
+                        case 0xF:
+                                if (word == 0xF000 && i + 1 < words_len && !has_ref[i + 1] &&
+                                                instr_word(outfile_buffer, i + 1) >= C8_CODE_START_ADDR)
+                                        found = i;
+                                break;
+                }
+        }
+
+        free_scratch(has_ref);
+
+        return found;
+}
+
+//
+// find_section_directive - finds the first org or section directive of the program, a program placed in sections can't
+// be compacted as that would move sections fixed at their addresses and the ones packed around them, returns the
+// offset of the directive in the source or -1 if there is none
+//
+long find_section_directive(void) {
+        // the first section is the `code` section opened before the first directive
+        return (sections_ptr - sections > 1) ? (long)sections[1].pos : -1;
+}
+
+//
+// compact_program - takes the dead words out of the program, moving the words after them down, and patches every
+// label and label reference with the new addresses
+//
+// a label on a dead word moves to the next word left, unless redirect maps its word to another one, redirect may be
+// NULL, dead and redirect cover one word past the end of the program for labels there
+//
+void compact_program(const bool *dead, const long *redirect) {
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+        uint32_t *new_index = alloc_or_panic(words_len + 1, sizeof(uint32_t), "compacting the program");
+
+        uint32_t removed = 0;
+        for (uint32_t i = 0; i <= words_len; ++i) {
+                new_index[i] = i - removed;
+                removed += dead[i];
+        }
+
+        #define MOVE_WORD(i) new_index[redirect ? redirect[i] : (long)(i)]
+        #define MOVE_ADDR(addr) word_addr(MOVE_WORD(((addr) - C8_CODE_START_ADDR) / C8_INSTR_SIZE))
+
+        for (LabelDef *def = label_defs; def < label_defs_ptr; ++def)
+                def->c8_addr = MOVE_ADDR(def->c8_addr);
+
+        // references are patched in place and move with the words holding them, labels are always in the program or
+        // one word past its end
+        LabelRef *kept = label_refs;
+        for (LabelRef *ref = label_refs; ref < label_refs_ptr; ++ref) {
+                uint32_t i = ref->output_pos - outfile_buffer;
+
+                if (dead[i])
+                        continue;
+
+                patch_ref(ref, MOVE_ADDR(ref_target(ref, instr_word(outfile_buffer, i))));
+
+                *kept = *ref;
+                kept++->output_pos = outfile_buffer + new_index[i];
+        }
+        label_refs_ptr = kept;
+
+        #undef MOVE_ADDR
+        #undef MOVE_WORD
+
+        for (uint32_t i = 0; i < words_len; ++i) {
+                if (dead[i])
+                        continue;
+
+                outfile_buffer[new_index[i]] = outfile_buffer[i];
+                instr_positions[new_index[i]] = instr_positions[i];
+        }
+        outfile_buffer_ptr -= removed;
+
+        free_scratch(new_index);
+}
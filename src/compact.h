@@ -0,0 +1,39 @@
+#ifndef COMPACT_H_INCLUDED
+        #define COMPACT_H_INCLUDED 1
+
+        #include <stdint.h>
+        #include <stdbool.h>
+
+        #include "parser.h"
+
+        extern long find_literal_addr(void);
+        extern long find_section_directive(void);
+        extern void compact_program(const bool *dead, const long *redirect);
+
+        //
+        // word_addr - gets the address of a word in the output stream
+        //
+        inline uint32_t word_addr(uint32_t i) {
+                return C8_CODE_START_ADDR + i * C8_INSTR_SIZE;
+        }
+
+        //
+        // ref_target - gets the address patched into a word by a label reference
+        //
+        inline uint32_t ref_target(const LabelRef *ref, uint16_t word) {
+                return (ref->kind == REF_ADDR16) ? word : (word & 0xFFF);
+        }
+
+        //
+        // patch_ref - patches an address into the word a label reference points at
+        //
+        inline void patch_ref(const LabelRef *ref, uint32_t target) {
+                uint8_t *instr_ptr = (uint8_t*)ref->output_pos;
+
+                if (ref->kind == REF_ADDR16)
+                        instr_ptr[0] = target >> 8;
+                else
+                        instr_ptr[0] = (instr_ptr[0] & 0xF0) | ((target & 0xF00) >> 8);
+                instr_ptr[1] = target & 0x0FF;
+        }
+#endif
@@ -0,0 +1,34 @@
+#ifndef ENDIAN_H_INCLUDED
+        #define ENDIAN_H_INCLUDED 1
+
+        #include <stdint.h>
+
+        // little endian integers in the bundle and map file formats, these work on any host byte order
+
+        static inline void put_u16(uint8_t *p, uint16_t n) {
+                p[0] = n;
+                p[1] = n >> 8;
+        }
+
+        static inline void put_u32(uint8_t *p, uint32_t n) {
+                for (int i = 0; i < 4; ++i)
+                        p[i] = n >> (i * 8);
+        }
+
+        static inline void put_u64(uint8_t *p, uint64_t n) {
+                for (int i = 0; i < 8; ++i)
+                        p[i] = n >> (i * 8);
+        }
+
+        static inline uint16_t get_u16(const uint8_t *p) {
+                return p[0] | (p[1] << 8);
+        }
+
+        static inline uint32_t get_u32(const uint8_t *p) {
+                return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+
+        static inline uint64_t get_u64(const uint8_t *p) {
+                return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+        }
+#endif
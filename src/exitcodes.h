@@ -11,5 +11,15 @@
                 ERR_FREAD_FAIL,
                 ERR_INT_TOO_LARGE,
                 ERR_MALLOC_FAIL,
+                ERR_INVALID_ARG,
+                ERR_FILE_TOO_LARGE,
+                ERR_FWRITE_FAIL,
+
+                // a limit set with c8asm_set_limits or --sandbox was exceeded
+                ERR_LIMIT_SRC_LEN,
+                ERR_LIMIT_TOKENS,
+                ERR_LIMIT_LABELS,
+                ERR_LIMIT_ERRORS,
+                ERR_LIMIT_TIME,
         } ExitCode;
 #endif
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "lexer.h"
+#include "parser.h"
+#include "expr.h"
+#include "print_msg.h"
+#include "alloc.h"
+#include "panic.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+// parentheses and unary operators nested deeper than this are an error, which bounds the recursion of the parser
+enum {EXPR_MAX_DEPTH = 64};
+
+// binary operators from the loosest binding to the tightest, as in C
+static const char *const binary_levels[] = {"|", "^", "&", "<>", "+-", "*/%"};
+
+enum {BINARY_LEVELS = sizeof(binary_levels) / sizeof(binary_levels[0])};
+
+static int parse_binary(Expr *expr, int level, int depth);
+
+//
+// push_node - pushes a node to an expression, grows the buffer if needed, returns its index
+//
+static int push_node(Expr *expr, ExprNode node) {
+        if (expr->len >= expr->cap) {
+                ExprNode *new_nodes;
+                int new_cap = expr->cap ? expr->cap * 2 : LABEL_BUFFER_INIT_LEN;
+                if (!(new_nodes = realloc(expr->nodes, new_cap * sizeof(ExprNode)))) {
+                        fputs(FMT_ERRMSG("failed to resize buffer for expression\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+                expr->nodes = new_nodes;
+                expr->cap = new_cap;
+        }
+
+        expr->nodes[expr->len] = node;
+
+        return expr->len++;
+}
+
+//
+// is_name - checks whether the current token is a label reference with the given name
+//
+static bool is_name(const char *name) {
+        return current_tkn.type == NAME_LBLREF && !strcmp(name_pool + current_tkn.value.name, name);
+}
+
+//
+// parse_operand - parses a constant, the index, a unary operator and its operand or an expression in parentheses,
+// returns the node or -1 on error
+//
+static int parse_operand(Expr *expr, int depth) {
+        if (depth > EXPR_MAX_DEPTH) {
+                print_msg(ERROR, current_tkn.pos, "expression is nested too deeply (>%d)", EXPR_MAX_DEPTH);
+                ++error_count;
+                return -1;
+        }
+
+        // a token which can't start an operand is left for the next statement
+        if (*tkn_types_ptr != CONST_INT && *tkn_types_ptr != NAME_LBLREF && *tkn_types_ptr != SYM_OP) {
+                print_msg(ERROR, tkn_positions_ptr[0], "expected an integer constant, `i` or `(`");
+                ++error_count;
+                return -1;
+        }
+
+        next_tkn();
+
+        if (current_tkn.type == CONST_INT)
+                return push_node(expr, (ExprNode){.kind = EXPR_CONST, .value = current_tkn.value.num,
+                        .pos = current_tkn.pos});
+
+        if (is_name("i"))
+                return push_node(expr, (ExprNode){.kind = EXPR_INDEX, .pos = current_tkn.pos});
+
+        if (current_tkn.type == NAME_LBLREF) {
+                print_msg(ERROR, current_tkn.pos, "`%s` can't be used in an expression, only `i`",
+                        name_pool + current_tkn.value.name);
+                ++error_count;
+                return -1;
+        }
+
+        if (current_tkn.type == SYM_OP && strchr("-~+", current_tkn.value.num)) {
+                Token op = current_tkn;
+                int operand = parse_operand(expr, depth + 1);
+
+                if (operand < 0)
+                        return -1;
+
+                return push_node(expr, (ExprNode){.kind = EXPR_UNARY, .op = op.value.num, .lhs = operand,
+                        .pos = op.pos});
+        }
+
+        if (current_tkn.type == SYM_OP && current_tkn.value.num == '(') {
+                int inner = parse_binary(expr, 0, depth + 1);
+
+                if (inner < 0)
+                        return -1;
+
+                if (*tkn_types_ptr != SYM_OP || *tkn_payloads_ptr != ')') {
+                        print_msg(ERROR, tkn_positions_ptr[0], "expected `)`");
+                        ++error_count;
+                        return -1;
+                }
+                next_tkn();
+
+                return inner;
+        }
+
+        print_msg(ERROR, current_tkn.pos, "expected an integer constant, `i` or `(`");
+        ++error_count;
+
+        return -1;
+}
+
+//
+// parse_binary - parses the operators of a level and the tighter binding levels under them, left to right, returns
+// the node or -1 on error
+//
+static int parse_binary(Expr *expr, int level, int depth) {
+        if (level == BINARY_LEVELS)
+                return parse_operand(expr, depth);
+
+        int lhs = parse_binary(expr, level + 1, depth);
+
+        // the payload of the next token is only read once it is known to be an operator
+        while (lhs >= 0 && *tkn_types_ptr == SYM_OP && *tkn_payloads_ptr != '(' && *tkn_payloads_ptr != ')' &&
+                        strchr(binary_levels[level], *tkn_payloads_ptr)) {
+                Token op = next_tkn();
+                int rhs = parse_binary(expr, level + 1, depth);
+
+                if (rhs < 0)
+                        return -1;
+
+                lhs = push_node(expr, (ExprNode){.kind = EXPR_BINARY, .op = op.value.num, .lhs = lhs, .rhs = rhs,
+                        .pos = op.pos});
+        }
+
+        return lhs;
+}
+
+//
+// parse_expr - parses an expression from the token stream into expr, the expression ends at the first token which
+// can't continue it, returns false on error
+//
+bool parse_expr(Expr *expr) {
+        expr->len = 0;
+
+        return parse_binary(expr, 0, 0) >= 0;
+}
+
+//
+// apply - applies an operator to one or two values, arithmetic wraps around rather than overflowing, returns an
+// error message or NULL on success
+//
+static const char *apply(ExprKind kind, char op, int64_t a, int64_t b, int64_t *out) {
+        if (kind == EXPR_UNARY) {
+                *out = (op == '-') ? (int64_t)(0 - (uint64_t)a) : (op == '~') ? ~a : a;
+                return NULL;
+        }
+
+        switch (op) {
+                case '+': *out = (int64_t)((uint64_t)a + (uint64_t)b); break;
+                case '-': *out = (int64_t)((uint64_t)a - (uint64_t)b); break;
+                case '*': *out = (int64_t)((uint64_t)a * (uint64_t)b); break;
+                case '&': *out = a & b;                                break;
+                case '|': *out = a | b;                                break;
+                case '^': *out = a ^ b;                                break;
+                case '/': // FALLTHROUGH
+                case '%':
+                        if (b == 0)
+                                return "division by zero";
+
+                        // INT64_MIN / -1 overflows, its quotient wraps around to itself and the remainder is 0
+                        if (b == -1)
+                                *out = (op == '/') ? (int64_t)(0 - (uint64_t)a) : 0;
+                        else
+                                *out = (op == '/') ? a / b : a % b;
+                        break;
+                case '<': // FALLTHROUGH
+                case '>':
+                        if (b < 0 || b > 63)
+                                return "shift count is out of range (0-63)";
+
+                        // >> is arithmetic, so a negative value stays negative
+                        if (op == '<')
+                                *out = (int64_t)((uint64_t)a << b);
+                        else
+                                *out = (a < 0) ? ~(~a >> b) : a >> b;
+                        break;
+        }
+
+        return NULL;
+}
+
+//
+// fold_expr - replaces every operator whose operands don't depend on the index with its value and drops the nodes
+// left unused, so evaluating the expression for each index only does the work which depends on it, returns false
+// if an operator can't be applied to its constant operands
+//
+bool fold_expr(Expr *expr) {
+        bool ok = true;
+        int64_t *new_values;
+
+        if (!(new_values = realloc(expr->values, expr->len * sizeof(int64_t)))) {
+                fputs(FMT_ERRMSG("failed to allocate memory for expression\n"), stderr);
+                panic(ERR_MALLOC_FAIL);
+        }
+        expr->values = new_values;
+
+        int *moved_to = alloc_or_panic(expr->len, sizeof(int), "expression");
+
+        // folding in order sees the operands of a node before the node, and the nodes which stay are moved down
+        int len = 0;
+        for (int n = 0; n < expr->len; ++n) {
+                ExprNode node = expr->nodes[n];
+
+                if (node.kind == EXPR_UNARY || node.kind == EXPR_BINARY) {
+                        ExprNode *lhs = &expr->nodes[moved_to[node.lhs]];
+                        ExprNode *rhs = (node.kind == EXPR_BINARY) ? &expr->nodes[moved_to[node.rhs]] : lhs;
+
+                        if (lhs->kind == EXPR_CONST && rhs->kind == EXPR_CONST) {
+                                int64_t value;
+                                const char *err = apply(node.kind, node.op, lhs->value, rhs->value, &value);
+
+                                if (err) {
+                                        print_msg(ERROR, node.pos, (char*)err);
+                                        ++error_count;
+                                        ok = false;
+                                        value = 0;
+                                }
+
+                                // the constant operands were the last nodes kept, so the value takes their place
+                                len -= (node.kind == EXPR_BINARY) ? 2 : 1;
+                                node = (ExprNode){.kind = EXPR_CONST, .value = value, .pos = node.pos};
+                        } else {
+                                node.lhs = moved_to[node.lhs];
+                                node.rhs = (node.kind == EXPR_BINARY) ? moved_to[node.rhs] : 0;
+                        }
+                }
+
+                moved_to[n] = len;
+                expr->nodes[len++] = node;
+        }
+        expr->len = len;
+
+        free_scratch(moved_to);
+
+        return ok;
+}
+
+//
+// eval_expr - evaluates a folded expression for an index, returns an error message and sets *pos to the operator
+// which failed, or returns NULL on success
+//
+const char *eval_expr(const Expr *expr, int64_t index, int64_t *value, uint32_t *pos) {
+        int64_t *values = expr->values;
+
+        for (int n = 0; n < expr->len; ++n) {
+                const ExprNode *node = &expr->nodes[n];
+                const char *err;
+
+                switch (node->kind) {
+                        case EXPR_CONST:
+                                values[n] = node->value;
+                                break;
+                        case EXPR_INDEX:
+                                values[n] = index;
+                                break;
+                        case EXPR_UNARY: // FALLTHROUGH
+                        case EXPR_BINARY:
+                                if ((err = apply(node->kind, node->op, values[node->lhs], values[node->rhs],
+                                                &values[n]))) {
+                                        *pos = node->pos;
+                                        return err;
+                                }
+                }
+        }
+
+        *value = values[expr->len - 1];
+
+        return NULL;
+}
+
+//
+// free_expr - frees the buffers of an expression
+//
+void free_expr(Expr *expr) {
+        free(expr->nodes);
+        free(expr->values);
+        *expr = (Expr){0};
+}
@@ -0,0 +1,43 @@
+#ifndef EXPR_H_INCLUDED
+        #define EXPR_H_INCLUDED 1
+
+        #include <stdint.h>
+        #include <stdbool.h>
+
+        #include "threadlocal.h"
+
+        // an expression used to generate a table, operands are 64 bit signed integers and the index of the entry
+        // being generated, named `i`
+        typedef enum {
+                EXPR_CONST,
+                EXPR_INDEX,
+                EXPR_UNARY,  // op is '-', '~' or '+'
+                EXPR_BINARY  // op is one of + - * / % & | ^ and `<` or `>` for `<<` and `>>`
+        } ExprKind;
+
+        typedef struct {
+                ExprKind kind;
+                char op;
+                int lhs, rhs;  // operand nodes, rhs is unused by a unary operator
+                int64_t value; // of a constant
+
+                uint32_t pos;
+        } ExprNode;
+
+        // a tree of nodes in a single buffer, children come before their parents so the root is the last node and the
+        // nodes can be evaluated in order, values holds the value of each node while evaluating
+        typedef struct {
+                ExprNode *nodes;
+                int64_t *values;
+                int len, cap;
+        } Expr;
+
+        // the expression of the table being parsed, reused by every table so its buffers belong to the assembler
+        // context and outlive a panic
+        extern THREAD_LOCAL Expr table_expr;
+
+        extern bool parse_expr(Expr *expr);
+        extern bool fold_expr(Expr *expr);
+        extern const char *eval_expr(const Expr *expr, int64_t index, int64_t *value, uint32_t *pos);
+        extern void free_expr(Expr *expr);
+#endif
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "lexer.h"
+#include "parser.h"
+#include "analyze.h"
+#include "fold.h"
+#include "compact.h"
+#include "print_msg.h"
+#include "alloc.h"
+
+THREAD_LOCAL bool fold_code;
+THREAD_LOCAL uint32_t folded_subroutines, folded_bytes;
+
+// a run of words from a label to the next label which ends in `ret`
+typedef struct {
+        uint32_t start, end; // range of words in the output stream
+        uint64_t hash;
+        bool removable;      // nothing falls through into the body so it can be taken out of the program
+        long into;           // body this one is folded into or -1
+} Body;
+
+// label reference patching each word of the output stream or -1
+static THREAD_LOCAL long *ref_at;
+
+//
+// norm_word - gets a word of a body for comparison, a label reference inside the body is compared by its offset
+// from the start of the body so copies which loop back to their own start still match
+//
+static uint64_t norm_word(const Body *body, uint32_t i) {
+        uint16_t word = instr_word(outfile_buffer, i);
+
+        if (ref_at[i] < 0)
+                return word;
+
+        const LabelRef *ref = &label_refs[ref_at[i]];
+        uint32_t target = ref_target(ref, word), opcode = (ref->kind == REF_ADDR16) ? 0 : (word & 0xF000);
+
+        if (target >= word_addr(body->start) && target < word_addr(body->end))
+                return (uint64_t)2 << 32 | (uint64_t)opcode << 16 | (target - word_addr(body->start));
+
+        return (uint64_t)1 << 32 | (uint64_t)opcode << 16 | target;
+}
+
+//
+// bodies_equal - checks whether two bodies do the same thing
+//
+static bool bodies_equal(const Body *a, const Body *b) {
+        if (a->end - a->start != b->end - b->start)
+                return false;
+
+        for (uint32_t i = 0; i < a->end - a->start; ++i)
+                if (norm_word(a, a->start + i) != norm_word(b, b->start + i))
+                        return false;
+
+        return true;
+}
+
+//
+// cmp_u32 - orders label addresses
+//
+static int cmp_u32(const void *a, const void *b) {
+        uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+        return (x > y) - (x < y);
+}
+
+//
+// cmp_bodies - orders bodies by hash and length so candidates for folding end up adjacent, then by address
+//
+static int cmp_bodies(const void *a, const void *b) {
+        const Body *x = a, *y = b;
+
+        if (x->hash != y->hash)
+                return (x->hash > y->hash) - (x->hash < y->hash);
+        if (x->end - x->start != y->end - y->start)
+                return (x->end - x->start > y->end - y->start) - (x->end - x->start < y->end - y->start);
+
+        return (x->start > y->start) - (x->start < y->start);
+}
+
+//
+// collect_bodies - finds every label delimited body ending in `ret`, returns how many were found
+//
+static long collect_bodies(Body *bodies, uint32_t words_len, const bool *is_start) {
+        ptrdiff_t label_defs_len = label_defs_ptr - label_defs;
+        uint32_t *addrs = alloc_or_panic(label_defs_len, sizeof(uint32_t), "code folding");
+        long addrs_len = 0, bodies_len = 0;
+
+        for (ptrdiff_t i = 0; i < label_defs_len; ++i)
+                addrs[i] = label_defs[i].c8_addr;
+        qsort(addrs, label_defs_len, sizeof(uint32_t), cmp_u32);
+
+        for (ptrdiff_t i = 0; i < label_defs_len; ++i)
+                if (addrs_len == 0 || addrs[addrs_len - 1] != addrs[i])
+                        addrs[addrs_len++] = addrs[i];
+
+        for (long i = 0; i < addrs_len; ++i) {
+                uint32_t start = (addrs[i] - C8_CODE_START_ADDR) / C8_INSTR_SIZE;
+                uint32_t end = (i + 1 < addrs_len) ? (addrs[i + 1] - C8_CODE_START_ADDR) / C8_INSTR_SIZE : words_len;
+
+                if (start >= words_len || end <= start || !is_start[start] || !is_start[end - 1] ||
+                                instr_word(outfile_buffer, end - 1) != 0x00EE)
+                        continue;
+
+                // a body can only be taken out if the instruction before it never falls through into it
+                bool removable = false;
+                if (start > 0) {
+                        uint32_t prev = start - 1;
+                        while (!is_start[prev])
+                                --prev;
+
+                        uint16_t word = instr_word(outfile_buffer, prev);
+                        removable = word == 0x00EE || (word >> 12) == 0x1 || (word >> 12) == 0xB;
+
+                        if (removable && prev > 0) {
+                                uint32_t before = prev - 1;
+                                while (!is_start[before])
+                                        --before;
+
+                                removable = !is_skip(instr_word(outfile_buffer, before));
+                        }
+                }
+
+                Body body = {.start = start, .end = end, .removable = removable, .into = -1};
+
+                body.hash = 14695981039346656037u;
+                for (uint32_t j = start; j < end; ++j)
+                        body.hash = (body.hash ^ norm_word(&body, j)) * 1099511628211u;
+
+                bodies[bodies_len++] = body;
+        }
+
+        free_scratch(addrs);
+
+        return bodies_len;
+}
+
+//
+// compact - takes folded bodies out of the program and redirects their labels to the bodies they were folded into
+//
+static void compact(const Body *bodies, long bodies_len, uint32_t words_len) {
+        bool *dead = alloc_or_panic(words_len + 1, sizeof(bool), "code folding");
+        long *redirect = alloc_or_panic(words_len + 1, sizeof(long), "code folding");
+
+        for (uint32_t i = 0; i <= words_len; ++i)
+                redirect[i] = i;
+
+        for (long i = 0; i < bodies_len; ++i) {
+                if (bodies[i].into < 0)
+                        continue;
+
+                memset(dead + bodies[i].start, 1, bodies[i].end - bodies[i].start);
+                redirect[bodies[i].start] = bodies[bodies[i].into].start;
+
+                ++folded_subroutines;
+                folded_bytes += (bodies[i].end - bodies[i].start) * C8_INSTR_SIZE;
+        }
+
+        compact_program(dead, redirect);
+
+        free_scratch(dead);
+        free_scratch(redirect);
+}
+
+//
+// index_refs - finds the label reference patching each word of the output stream
+//
+static void index_refs(uint32_t words_len) {
+        for (uint32_t i = 0; i <= words_len; ++i)
+                ref_at[i] = -1;
+        for (LabelRef *ref = label_refs; ref < label_refs_ptr; ++ref)
+                ref_at[ref->output_pos - outfile_buffer] = ref - label_refs;
+}
+
+//
+// fold_pass - folds each removable body into an identical one earlier in the program, returns the number folded
+//
+static long fold_pass(void) {
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+        bool *is_start = alloc_or_panic(words_len + 1, sizeof(bool), "code folding");
+        Body *bodies = alloc_or_panic(label_defs_ptr - label_defs, sizeof(Body), "code folding");
+        long folded = 0;
+
+        for (uint32_t i = 0; i < words_len; i += instr_len(instr_word(outfile_buffer, i)))
+                is_start[i] = true;
+
+        long bodies_len = collect_bodies(bodies, words_len, is_start);
+        qsort(bodies, bodies_len, sizeof(Body), cmp_bodies);
+
+        // hashes only narrow down the candidates, a body is compared in full with the kept bodies before it which
+        // have the same hash and length
+        long run = 0;
+        for (long i = 0; i < bodies_len; ++i) {
+                if (bodies[i].hash != bodies[run].hash ||
+                                bodies[i].end - bodies[i].start != bodies[run].end - bodies[run].start)
+                        run = i;
+
+                if (!bodies[i].removable)
+                        continue;
+
+                for (long j = run; j < i; ++j) {
+                        if (bodies[j].into < 0 && bodies_equal(&bodies[j], &bodies[i])) {
+                                bodies[i].into = j;
+                                ++folded;
+                                break;
+                        }
+                }
+        }
+
+        if (folded > 0)
+                compact(bodies, bodies_len, words_len);
+
+        free_scratch(is_start);
+        free_scratch(bodies);
+
+        return folded;
+}
+
+//
+// fold_program - replaces subroutines which are identical to an earlier one with that one and compacts the program,
+// this runs after labels are resolved so references are redirected through the label tables
+//
+void fold_program(void) {
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+
+        ref_at = alloc_or_panic(words_len + 1, sizeof(long), "code folding");
+        index_refs(words_len);
+
+        long literal = find_literal_addr();
+        if (literal >= 0) {
+                print_msg(WARNING, instr_positions[literal], "subroutines were not folded as this address into the "
+                        "program doesn't come from a label and can't be moved");
+                ++warning_count;
+                free_scratch(ref_at);
+                ref_at = NULL;
+                return;
+        }
+
+        long directive = find_section_directive();
+        if (directive >= 0) {
+                print_msg(WARNING, directive, "subroutines were not folded as the program is placed in sections and "
+                        "can't be moved");
+                ++warning_count;
+                free_scratch(ref_at);
+                ref_at = NULL;
+                return;
+        }
+
+        // folding a body can make the bodies calling it identical, so fold until nothing changes
+        while (fold_pass() > 0)
+                index_refs(outfile_buffer_ptr - outfile_buffer);
+
+        free_scratch(ref_at);
+        ref_at = NULL;
+}
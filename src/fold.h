@@ -0,0 +1,13 @@
+#ifndef FOLD_H_INCLUDED
+        #define FOLD_H_INCLUDED 1
+
+        #include <stdint.h>
+        #include <stdbool.h>
+
+        #include "threadlocal.h"
+
+        extern THREAD_LOCAL bool fold_code;
+        extern THREAD_LOCAL uint32_t folded_subroutines, folded_bytes;
+
+        extern void fold_program(void);
+#endif
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "parser.h"
+#include "analyze.h"
+#include "inliner.h"
+#include "compact.h"
+#include "print_msg.h"
+#include "alloc.h"
+
+THREAD_LOCAL bool inline_leaves;
+THREAD_LOCAL uint32_t inline_budget;
+THREAD_LOCAL uint32_t inlined_calls, inlined_subroutines;
+THREAD_LOCAL int stack_depth_before, stack_depth_after;
+
+// a subroutine from a label to the next label which ends in its only `ret` and makes no calls or jumps
+typedef struct {
+        uint32_t start, end; // range of words in the output stream, including the `ret`
+        uint32_t refs;       // label references to any word of the subroutine
+        uint32_t sites;      // calls to it which can be inlined
+        bool removable;      // nothing falls through into the subroutine so it can be taken out of the program
+} Leaf;
+
+//
+// leaf_len - gets the number of words a leaf takes in place of a call to it
+//
+static uint32_t leaf_len(const Leaf *leaf) {
+        return leaf->end - 1 - leaf->start;
+}
+
+//
+// prev_instr - gets the instruction before a word, which must not be the first
+//
+static uint32_t prev_instr(uint32_t i, const bool *is_start) {
+        do
+                --i;
+        while (!is_start[i]);
+
+        return i;
+}
+
+//
+// is_leaf_body - checks whether the words of a subroutine before its `ret` can be copied over a call to it, so none
+// of them leave the subroutine or refer to where they are and the last can't skip the instruction after the call
+//
+static bool is_leaf_body(uint32_t start, uint32_t end) {
+        uint32_t last = end;
+
+        for (uint32_t i = start; i < end; i += instr_len(instr_word(outfile_buffer, i))) {
+                uint16_t word = instr_word(outfile_buffer, i);
+
+                if ((word >> 12) == 0x1 || (word >> 12) == 0x2 || (word >> 12) == 0xB ||
+                                ((word >> 12) == 0x0 && word != 0x00E0))
+                        return false;
+
+                last = i;
+        }
+
+        return last == end || !is_skip(instr_word(outfile_buffer, last));
+}
+
+//
+// cmp_leaf_len - orders leaves so the shortest are inlined first, then by address
+//
+static int cmp_leaf_len(const void *a, const void *b) {
+        const Leaf *x = a, *y = b;
+
+        if (leaf_len(x) != leaf_len(y))
+                return (leaf_len(x) > leaf_len(y)) - (leaf_len(x) < leaf_len(y));
+
+        return (x->start > y->start) - (x->start < y->start);
+}
+
+//
+// cmp_u32 - orders label addresses
+//
+static int cmp_u32(const void *a, const void *b) {
+        uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+        return (x > y) - (x < y);
+}
+
+//
+// collect_leaves - finds every leaf subroutine, returns how many were found
+//
+static long collect_leaves(Leaf *leaves, uint32_t words_len, const bool *is_start) {
+        ptrdiff_t label_defs_len = label_defs_ptr - label_defs;
+        uint32_t *addrs = alloc_or_panic(label_defs_len, sizeof(uint32_t), "inlining");
+        long addrs_len = 0, leaves_len = 0;
+
+        for (ptrdiff_t i = 0; i < label_defs_len; ++i)
+                addrs[i] = label_defs[i].c8_addr;
+        qsort(addrs, label_defs_len, sizeof(uint32_t), cmp_u32);
+
+        for (ptrdiff_t i = 0; i < label_defs_len; ++i)
+                if (addrs_len == 0 || addrs[addrs_len - 1] != addrs[i])
+                        addrs[addrs_len++] = addrs[i];
+
+        for (long i = 0; i < addrs_len; ++i) {
+                uint32_t start = (addrs[i] - C8_CODE_START_ADDR) / C8_INSTR_SIZE;
+                uint32_t end = (i + 1 < addrs_len) ? (addrs[i + 1] - C8_CODE_START_ADDR) / C8_INSTR_SIZE : words_len;
+
+                if (start >= words_len || end <= start || !is_start[start] || !is_start[end - 1] ||
+                                instr_word(outfile_buffer, end - 1) != 0x00EE ||
+                                !is_leaf_body(start, end - 1))
+                        continue;
+
+                // a leaf can only be taken out if the instruction before it never falls through into it
+                bool removable = false;
+                if (start > 0) {
+                        uint32_t prev = prev_instr(start, is_start);
+                        uint16_t word = instr_word(outfile_buffer, prev);
+
+                        removable = word == 0x00EE || (word >> 12) == 0x1 || (word >> 12) == 0xB;
+                        if (removable && prev > 0)
+                                removable = !is_skip(instr_word(outfile_buffer, prev_instr(prev, is_start)));
+                }
+
+                leaves[leaves_len++] = (Leaf){.start = start, .end = end, .removable = removable};
+        }
+
+        free_scratch(addrs);
+
+        return leaves_len;
+}
+
+//
+// rebuild - copies the leaf called at each inlined site over the call, takes out removed leaves and patches every
+// label and label reference with the new addresses
+//
+// site_leaf maps each word to the leaf it calls if the call is inlined or -1, and dead marks words taken out, both
+// cover one word past the end of the program for labels there
+//
+static void rebuild(const Leaf *leaves, const long *site_leaf, const bool *dead, const long *ref_at,
+                uint32_t words_len) {
+        uint32_t *new_index = alloc_or_panic(words_len + 1, sizeof(uint32_t), "inlining");
+        ptrdiff_t refs_len = 0;
+
+        uint32_t len = 0;
+        for (uint32_t i = 0; i <= words_len; ++i) {
+                new_index[i] = len;
+
+                if (site_leaf[i] >= 0) {
+                        const Leaf *leaf = &leaves[site_leaf[i]];
+
+                        len += leaf_len(leaf);
+                        for (uint32_t j = leaf->start; j < leaf->end - 1; ++j)
+                                refs_len += ref_at[j] >= 0;
+                } else if (i < words_len && !dead[i]) {
+                        ++len;
+                        refs_len += ref_at[i] >= 0;
+                }
+        }
+
+        Instruction *image = alloc_or_panic(len, sizeof(Instruction), "inlining");
+        uint32_t *positions = alloc_or_panic(len, sizeof(uint32_t), "inlining");
+        LabelRef *refs = alloc_or_panic(refs_len + LABEL_BUFFER_INIT_LEN, sizeof(LabelRef), "inlining");
+        LabelRef *refs_ptr = refs;
+
+        // references still hold the old addresses, they are patched once the new image is in place
+        for (uint32_t i = 0; i < words_len; ++i) {
+                if (site_leaf[i] >= 0) {
+                        const Leaf *leaf = &leaves[site_leaf[i]];
+
+                        for (uint32_t j = leaf->start; j < leaf->end - 1; ++j) {
+                                uint32_t to = new_index[i] + (j - leaf->start);
+
+                                image[to] = outfile_buffer[j];
+                                positions[to] = instr_positions[j];
+                                if (ref_at[j] >= 0) {
+                                        *refs_ptr = label_refs[ref_at[j]];
+                                        refs_ptr++->output_pos = outfile_buffer + to;
+                                }
+                        }
+                } else if (!dead[i]) {
+                        image[new_index[i]] = outfile_buffer[i];
+                        positions[new_index[i]] = instr_positions[i];
+                        if (ref_at[i] >= 0) {
+                                *refs_ptr = label_refs[ref_at[i]];
+                                refs_ptr++->output_pos = outfile_buffer + new_index[i];
+                        }
+                }
+        }
+
+        memcpy(outfile_buffer, image, len * sizeof(Instruction));
+        memcpy(instr_positions, positions, len * sizeof(uint32_t));
+        outfile_buffer_ptr = outfile_buffer + len;
+
+        #define MOVE_ADDR(addr) word_addr(new_index[((addr) - C8_CODE_START_ADDR) / C8_INSTR_SIZE])
+
+        for (LabelDef *def = label_defs; def < label_defs_ptr; ++def)
+                def->c8_addr = MOVE_ADDR(def->c8_addr);
+
+        for (LabelRef *ref = refs; ref < refs_ptr; ++ref)
+                patch_ref(ref, MOVE_ADDR(ref_target(ref, instr_word(outfile_buffer, ref->output_pos - outfile_buffer))));
+
+        #undef MOVE_ADDR
+
+        // the references now belong to the context in place of the old ones
+        keep_scratch(refs);
+        free(label_refs);
+        label_refs = refs;
+        label_refs_ptr = refs_ptr;
+        label_refs_cap = refs_len + LABEL_BUFFER_INIT_LEN;
+
+        free_scratch(new_index);
+        free_scratch(image);
+        free_scratch(positions);
+}
+
+//
+// inline_subroutines - copies small leaf subroutines over the calls to them while the program stays within the
+// inline budget, shortest first, and takes out each one which is no longer called, this runs after labels are
+// resolved so references are patched through the label tables
+//
+// a call straight after a skip is only inlined if the leaf takes a single word in its place
+//
+void inline_subroutines(void) {
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+
+        long literal = find_literal_addr();
+        if (literal >= 0) {
+                print_msg(WARNING, instr_positions[literal], "subroutines were not inlined as this address into the "
+                        "program doesn't come from a label and can't be moved");
+                ++warning_count;
+                return;
+        }
+
+        long directive = find_section_directive();
+        if (directive >= 0) {
+                print_msg(WARNING, directive, "subroutines were not inlined as the program is placed in sections and "
+                        "can't be moved");
+                ++warning_count;
+                return;
+        }
+
+        stack_depth_before = stack_depth_after = call_depth();
+
+        bool *is_start = alloc_or_panic(words_len + 1, sizeof(bool), "inlining");
+        long *ref_at = alloc_or_panic(words_len + 1, sizeof(long), "inlining");
+        long *leaf_at = alloc_or_panic(words_len + 1, sizeof(long), "inlining");
+        long *site_leaf = alloc_or_panic(words_len + 1, sizeof(long), "inlining");
+        bool *dead = alloc_or_panic(words_len + 1, sizeof(bool), "inlining");
+        Leaf *leaves = alloc_or_panic(label_defs_ptr - label_defs, sizeof(Leaf), "inlining");
+
+        for (uint32_t i = 0; i < words_len; i += instr_len(instr_word(outfile_buffer, i)))
+                is_start[i] = true;
+        for (uint32_t i = 0; i <= words_len; ++i)
+                ref_at[i] = leaf_at[i] = site_leaf[i] = -1;
+        for (LabelRef *ref = label_refs; ref < label_refs_ptr; ++ref)
+                ref_at[ref->output_pos - outfile_buffer] = ref - label_refs;
+
+        long leaves_len = collect_leaves(leaves, words_len, is_start);
+        qsort(leaves, leaves_len, sizeof(Leaf), cmp_leaf_len);
+
+        for (long l = 0; l < leaves_len; ++l)
+                for (uint32_t i = leaves[l].start; i < leaves[l].end; ++i)
+                        leaf_at[i] = l;
+
+        // every reference into a leaf keeps it in the program unless it is a call which gets inlined
+        for (uint32_t i = 0; i < words_len; ++i) {
+                if (ref_at[i] < 0)
+                        continue;
+
+                uint16_t word = instr_word(outfile_buffer, i);
+                uint32_t addr = ref_target(&label_refs[ref_at[i]], word);
+                if (addr < C8_CODE_START_ADDR || (addr - C8_CODE_START_ADDR) / C8_INSTR_SIZE >= words_len)
+                        continue;
+
+                long l = leaf_at[(addr - C8_CODE_START_ADDR) / C8_INSTR_SIZE];
+                if (l < 0)
+                        continue;
+
+                ++leaves[l].refs;
+                if ((word >> 12) == 0x2 && addr == word_addr(leaves[l].start) && (i == 0 ||
+                                !is_skip(instr_word(outfile_buffer, prev_instr(i, is_start))) ||
+                                (leaf_len(&leaves[l]) == 1 && instr_word(outfile_buffer, leaves[l].start) != 0xF000))) {
+                        site_leaf[i] = l;
+                        ++leaves[l].sites;
+                }
+        }
+
+        // inlining which doesn't grow the program is always done, otherwise sites which would take the program past
+        // the budget are turned back into plain calls
+        uint32_t budget = program_words(target), len = words_len;
+        if (inline_budget > 0 && inline_budget / C8_INSTR_SIZE < budget)
+                budget = inline_budget / C8_INSTR_SIZE;
+
+        for (long l = 0; l < leaves_len; ++l) {
+                Leaf *leaf = &leaves[l];
+                if (leaf->sites == 0)
+                        continue;
+
+                bool remove = leaf->removable && leaf->refs == leaf->sites;
+                long growth = (long)leaf->sites * ((long)leaf_len(leaf) - 1) -
+                        (remove ? (long)(leaf->end - leaf->start) : 0);
+
+                if (growth <= 0 || (long)len + growth <= (long)budget) {
+                        len += growth;
+                        inlined_calls += leaf->sites;
+                        if (remove) {
+                                memset(dead + leaf->start, 1, leaf->end - leaf->start);
+                                ++inlined_subroutines;
+                        }
+                        continue;
+                }
+
+                for (uint32_t i = 0; i < words_len; ++i) {
+                        if (site_leaf[i] != l)
+                                continue;
+
+                        if (leaf_len(leaf) <= 1 || len + leaf_len(leaf) - 1 <= budget) {
+                                len += leaf_len(leaf) - 1;
+                                ++inlined_calls;
+                        } else {
+                                site_leaf[i] = -1;
+                        }
+                }
+        }
+
+        if (inlined_calls > 0) {
+                rebuild(leaves, site_leaf, dead, ref_at, words_len);
+                stack_depth_after = call_depth();
+        }
+
+        free_scratch(is_start);
+        free_scratch(ref_at);
+        free_scratch(leaf_at);
+        free_scratch(site_leaf);
+        free_scratch(dead);
+        free_scratch(leaves);
+}
@@ -0,0 +1,15 @@
+#ifndef INLINER_H_INCLUDED
+        #define INLINER_H_INCLUDED 1
+
+        #include <stdint.h>
+        #include <stdbool.h>
+
+        #include "threadlocal.h"
+
+        extern THREAD_LOCAL bool inline_leaves;
+        extern THREAD_LOCAL uint32_t inline_budget; // largest program in bytes inlining may leave, 0 for all of memory
+        extern THREAD_LOCAL uint32_t inlined_calls, inlined_subroutines;
+        extern THREAD_LOCAL int stack_depth_before, stack_depth_after;
+
+        extern void inline_subroutines(void);
+#endif
@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "parser.h"
+#include "analyze.h"
+#include "instrument.h"
+#include "compact.h"
+#include "print_msg.h"
+#include "alloc.h"
+#include "panic.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+// what is known about I at the start of a block, any other value is the address it holds
+enum {I_UNREACHED = UINT32_MAX, I_UNKNOWN = UINT32_MAX - 1};
+
+// words of the code counting entry to a label, not including the load restoring I
+enum {STUB_WORDS_8 = 9, STUB_WORDS_16 = 11};
+
+THREAD_LOCAL int counter_bytes;
+THREAD_LOCAL uint32_t instrumented_labels, counters_addr;
+
+THREAD_LOCAL Counter *counters, *counters_ptr;
+THREAD_LOCAL ptrdiff_t counters_cap;
+
+//
+// push_counter - pushes a Counter to the counter table, grows table if needed
+//
+static void push_counter(const LabelDef *def, uint32_t addr) {
+        ptrdiff_t counters_pushed = counters_ptr - counters;
+
+        if (counters_pushed >= counters_cap) {
+                Counter *new_counters;
+                ptrdiff_t new_cap = counters_cap ? counters_cap * 2 : LABEL_BUFFER_INIT_LEN;
+                if (!(new_counters = realloc(counters, new_cap * sizeof(Counter)))) {
+                        fputs(FMT_ERRMSG("failed to resize buffer for counter table\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+                counters = new_counters;
+                counters_cap = new_cap;
+                counters_ptr = counters + counters_pushed;
+        }
+
+        *counters_ptr++ = (Counter){
+                .label_text = def->label_text,
+                .addr = addr,
+                .pos = def->pos
+        };
+}
+
+//
+// i_after - gets what is known about I after the instruction at a word, given what was known before it, `lod` and
+// `str` count as changing I as they advance it on some interpreters, and a machine code call as changing it as
+// anything might, calls are followed by find_i_values
+//
+static uint32_t i_after(uint32_t i, uint32_t value) {
+        uint16_t word = instr_word(outfile_buffer, i);
+
+        switch (word >> 12) {
+                case 0x0:
+                        return (word & 0xF00) ? I_UNKNOWN : value;
+                case 0xA:
+                        return word & 0xFFF;
+                case 0xF:
+                        if (word == 0xF000)
+                                return instr_word(outfile_buffer, i + 1);
+                        if ((word & 0xFF) == 0x1E || (word & 0xFF) == 0x29 || (word & 0xFF) == 0x55 ||
+                                        (word & 0xFF) == 0x65)
+                                return I_UNKNOWN;
+        }
+
+        return value;
+}
+
+//
+// i_use - checks whether the instruction at a word reads I (1), sets it without reading it (0) or neither (-1), a
+// machine code call counts as reading it, calls and `ret` are followed by find_i_live
+//
+static int i_use(uint32_t i) {
+        uint16_t word = instr_word(outfile_buffer, i);
+
+        switch (word >> 12) {
+                case 0x0:
+                        return (word & 0xF00) ? 1 : -1;
+                case 0xD:
+                        return 1;
+                case 0x5:
+                        return ((word & 0xF) == 0x2 || (word & 0xF) == 0x3) ? 1 : -1;
+                case 0xA:
+                        return 0;
+                case 0xF:
+                        switch (word & 0xFF) {
+                                case 0x00:
+                                        return (word == 0xF000) ? 0 : -1;
+                                case 0x29:
+                                        return 0;
+                                case 0x02: // FALLTHROUGH
+                                case 0x1E:
+                                case 0x33:
+                                case 0x55:
+                                case 0x65:
+                                        return 1;
+                        }
+        }
+
+        return -1;
+}
+
+//
+// last_word - gets the last instruction word of a block
+//
+static uint16_t last_word(const Block *block) {
+        uint32_t last = block->start;
+
+        while (last + instr_len(instr_word(outfile_buffer, last)) < block->end)
+                last += instr_len(instr_word(outfile_buffer, last));
+
+        return instr_word(outfile_buffer, last);
+}
+
+//
+// find_i_changes - finds the blocks from which I may be changed before reaching a `ret`, for a called block that is
+// whether the subroutine changes I, a call to an address which isn't code may change it
+//
+static void find_i_changes(bool *changes) {
+        bool changed = true;
+
+        while (changed) {
+                changed = false;
+
+                for (int b = blocks_len - 1; b >= 0; --b) {
+                        const Block *block = &blocks[b];
+                        bool block_changes = false;
+
+                        if (changes[b])
+                                continue;
+
+                        for (uint32_t i = block->start; i < block->end; i += instr_len(instr_word(outfile_buffer, i)))
+                                block_changes |= i_after(i, I_UNREACHED) != I_UNREACHED;
+
+                        if ((last_word(block) >> 12) == 0x2)
+                                block_changes |= (block->call_target < 0) || changes[block->call_target];
+
+                        for (int s = 0; s < block->succ_len; ++s)
+                                block_changes |= changes[block->succ[s]];
+
+                        if (block_changes) {
+                                changes[b] = true;
+                                changed = true;
+                        }
+                }
+        }
+}
+
+//
+// merge_i - merges what is known about I on a path into the start of a block, returns true if that changed
+//
+static bool merge_i(uint32_t *entry, uint32_t value) {
+        uint32_t merged = (*entry == I_UNREACHED || *entry == value) ? value : I_UNKNOWN;
+
+        if (*entry == merged)
+                return false;
+
+        *entry = merged;
+
+        return true;
+}
+
+//
+// find_i_values - finds what is known about I at the start of every block by iterating to a fixed point, a called
+// block gets the values of its callers and I is the same after a call as before it unless the subroutine changes it
+//
+static void find_i_values(uint32_t *entries, const bool *changes) {
+        for (int b = 0; b < blocks_len; ++b)
+                entries[b] = I_UNREACHED;
+        entries[0] = I_UNKNOWN;
+
+        bool changed = true;
+        while (changed) {
+                changed = false;
+
+                for (int b = 0; b < blocks_len; ++b) {
+                        const Block *block = &blocks[b];
+                        uint32_t value = entries[b];
+
+                        if (value == I_UNREACHED)
+                                continue;
+
+                        for (uint32_t i = block->start; i < block->end; i += instr_len(instr_word(outfile_buffer, i)))
+                                value = i_after(i, value);
+
+                        // the successor of a call is where the subroutine returns to
+                        if ((last_word(block) >> 12) == 0x2) {
+                                if (block->call_target >= 0)
+                                        changed |= merge_i(&entries[block->call_target], value);
+                                if (block->call_target < 0 || changes[block->call_target])
+                                        value = I_UNKNOWN;
+                        }
+
+                        for (int s = 0; s < block->succ_len; ++s)
+                                changed |= merge_i(&entries[block->succ[s]], value);
+                }
+        }
+}
+
+//
+// find_i_live - finds the blocks where I may be read before it is set, by iterating to a fixed point backwards, I is
+// live at a `ret` if it is live where any call returns to
+//
+static void find_i_live(bool *live) {
+        bool changed = true;
+
+        while (changed) {
+                bool ret_live = false;
+                changed = false;
+
+                for (int b = 0; b < blocks_len; ++b)
+                        if ((last_word(&blocks[b]) >> 12) == 0x2 && blocks[b].succ_len > 0)
+                                ret_live |= live[b + 1];
+
+                for (int b = blocks_len - 1; b >= 0; --b) {
+                        const Block *block = &blocks[b];
+                        uint16_t last = last_word(block);
+                        bool block_live = false;
+                        int use = -1;
+
+                        for (uint32_t i = block->start; i < block->end && use < 0;
+                                        i += instr_len(instr_word(outfile_buffer, i)))
+                                use = i_use(i);
+
+                        if (use >= 0)
+                                block_live = use;
+                        else if ((last >> 12) == 0x2)
+                                block_live = (block->call_target < 0) || live[block->call_target];
+                        else if (last == 0x00EE)
+                                block_live = ret_live;
+                        else
+                                for (int s = 0; s < block->succ_len; ++s)
+                                        block_live |= live[block->succ[s]];
+
+                        if (block_live && !live[b]) {
+                                live[b] = true;
+                                changed = true;
+                        }
+                }
+        }
+}
+
+//
+// collect_sites - picks the labels to count, one for each address of code, and sets the words of the code counting
+// entry to each in stub_len, a label is left out if it is loaded into I as data, if it follows a skip or if I is
+// read after it without its value being known so it can't be restored, returns the number picked
+//
+static long collect_sites(const LabelDef **site_def, uint32_t *restore, uint32_t *stub_len, uint32_t words_len) {
+        bool *is_start = alloc_or_panic(words_len + 1, sizeof(bool), "instrumenting the program");
+        bool *is_data = alloc_or_panic(words_len + 1, sizeof(bool), "instrumenting the program");
+        bool *after_skip = alloc_or_panic(words_len + 1, sizeof(bool), "instrumenting the program");
+        bool *i_changes = alloc_or_panic(blocks_len, sizeof(bool), "instrumenting the program");
+        uint32_t *i_values = alloc_or_panic(blocks_len, sizeof(uint32_t), "instrumenting the program");
+        bool *i_live = alloc_or_panic(blocks_len, sizeof(bool), "instrumenting the program");
+        long sites = 0;
+
+        for (int b = 0; b < blocks_len; ++b) {
+                if (blocks[b].data)
+                        continue;
+
+                for (uint32_t i = blocks[b].start; i < blocks[b].end; i += instr_len(instr_word(outfile_buffer, i))) {
+                        is_start[i] = true;
+                        uint16_t word = instr_word(outfile_buffer, i);
+                        after_skip[i + instr_len(word)] = is_skip(word);
+                }
+        }
+
+        for (LabelRef *ref = label_refs; ref < label_refs_ptr; ++ref) {
+                uint16_t word = instr_word(outfile_buffer, ref->output_pos - outfile_buffer);
+
+                if (ref->kind == REF_ADDR16 || (word >> 12) == 0xA)
+                        is_data[(ref_target(ref, word) - C8_CODE_START_ADDR) / C8_INSTR_SIZE] = true;
+        }
+
+        find_i_changes(i_changes);
+        find_i_values(i_values, i_changes);
+        find_i_live(i_live);
+
+        // the label first in the source names a counter shared by every label at its address
+        for (LabelDef *def = label_defs; def < label_defs_ptr; ++def) {
+                uint32_t i = (def->c8_addr - C8_CODE_START_ADDR) / C8_INSTR_SIZE;
+
+                if (i < words_len && is_start[i] && !is_data[i] && (!site_def[i] || def->pos < site_def[i]->pos))
+                        site_def[i] = def;
+        }
+
+        for (uint32_t i = 0; i < words_len; ++i) {
+                if (!site_def[i])
+                        continue;
+
+                int b = block_of[i];
+                uint32_t value = (i_values[b] == I_UNREACHED) ? I_UNKNOWN : i_values[b];
+
+                if (after_skip[i]) {
+                        print_msg(WARNING, site_def[i]->pos, "label `%s` is not counted as it follows a skip",
+                                site_def[i]->label_text);
+                        ++warning_count;
+                        site_def[i] = NULL;
+                        continue;
+                }
+
+                if (i_live[b] && value == I_UNKNOWN) {
+                        print_msg(WARNING, site_def[i]->pos, "label `%s` is not counted as I is read after it and "
+                                "its value there isn't known", site_def[i]->label_text);
+                        ++warning_count;
+                        site_def[i] = NULL;
+                        continue;
+                }
+
+                restore[i] = i_live[b] ? value : I_UNKNOWN;
+                stub_len[i] = ((counter_bytes == 2) ? STUB_WORDS_16 : STUB_WORDS_8) + (restore[i] != I_UNKNOWN);
+                ++sites;
+        }
+
+        free_scratch(is_start);
+        free_scratch(is_data);
+        free_scratch(after_skip);
+        free_scratch(i_changes);
+        free_scratch(i_values);
+        free_scratch(i_live);
+
+        return sites;
+}
+
+//
+// move_addr - gets where an address ends up once the counting code is put in, a label moves to the counting code in
+// front of it so a jump to it is counted too, and an address past the end of the program moves past the counters so
+// memory a program uses after its end isn't shared with them
+//
+static uint32_t move_addr(uint32_t addr, const uint32_t *shift, uint32_t words_len, uint32_t region_words) {
+        if (addr < C8_CODE_START_ADDR)
+                return addr;
+
+        uint32_t i = (addr - C8_CODE_START_ADDR) / C8_INSTR_SIZE;
+        uint32_t moved = (i < words_len) ? shift[i] : shift[words_len] + region_words;
+
+        return addr + moved * C8_INSTR_SIZE;
+}
+
+//
+// site_def_pos - gets the position of the last label picked to be counted, which diagnostics about the counters
+// point at
+//
+static uint32_t site_def_pos(const LabelDef *const *site_def, uint32_t words_len) {
+        for (uint32_t i = words_len; i-- > 0; )
+                if (site_def[i])
+                        return site_def[i]->pos;
+
+        return 0;
+}
+
+//
+// write_stub - writes the code counting entry to a label, it keeps every register by saving the ones it uses in
+// scratch memory and leaves I as it found it if restore holds its value, returns the number of words written
+//
+static uint32_t write_stub(Instruction *out, uint32_t counter, uint32_t scratch, uint32_t restore) {
+        uint8_t *bytes = (uint8_t*)out;
+        uint32_t len = 0;
+
+        #define EMIT(word) (bytes[len * 2] = (word) >> 8, bytes[len * 2 + 1] = (word) & 0xFF, ++len)
+
+        // a 16 bit counter is big endian, the high byte is carried into when the low byte wraps to 0, I is set again
+        // before each store as `lod` and `str` advance it on some interpreters
+        int last = counter_bytes - 1;
+        EMIT(0xA000 | scratch);
+        EMIT(0xF055 | last << 8);
+        EMIT(0xA000 | counter);
+        EMIT(0xF065 | last << 8);
+        EMIT(0x7001 | last << 8);
+        if (counter_bytes == 2) {
+                EMIT(0x4100);
+                EMIT(0x7001);
+        }
+        EMIT(0xA000 | counter);
+        EMIT(0xF055 | last << 8);
+        EMIT(0xA000 | scratch);
+        EMIT(0xF065 | last << 8);
+        if (restore != I_UNKNOWN)
+                EMIT(0xA000 | restore);
+
+        #undef EMIT
+
+        return len;
+}
+
+//
+// instrument_program - puts code counting every entry to a label in front of it, each counter is counter_bytes wide
+// and they are kept after the program, which is then followed by the counters, this runs last so the counting code is
+// left out of analysis
+//
+// every register is kept and I is restored after counting, a label whose code reads I is only counted if the value of
+// I there is known, the counters must fit below 0x1000 as they are loaded with `mov I, addr`
+//
+void instrument_program(void) {
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+
+        long literal = find_literal_addr();
+        if (literal >= 0) {
+                print_msg(WARNING, instr_positions[literal], "the program was not instrumented as this address into "
+                        "the program doesn't come from a label and can't be moved");
+                ++warning_count;
+                return;
+        }
+
+        long directive = find_section_directive();
+        if (directive >= 0) {
+                print_msg(WARNING, directive, "the program was not instrumented as it is placed in sections and can't "
+                        "be moved");
+                ++warning_count;
+                return;
+        }
+
+        if (!build_cfg())
+                return;
+
+        for (int b = 0; b < blocks_len; ++b) {
+                if (blocks[b].indirect) {
+                        uint32_t last = blocks[b].end - 1;
+                        while (last > blocks[b].start && instr_positions[last] == instr_positions[last - 1])
+                                --last;
+
+                        print_msg(WARNING, instr_positions[last], "the program was not instrumented as where this "
+                                "jumps to isn't known");
+                        ++warning_count;
+                        free_cfg();
+                        return;
+                }
+        }
+
+        const LabelDef **site_def = alloc_or_panic(words_len + 1, sizeof(LabelDef*), "instrumenting the program");
+        uint32_t *restore = alloc_or_panic(words_len + 1, sizeof(uint32_t), "instrumenting the program");
+        uint32_t *stub_len = alloc_or_panic(words_len + 1, sizeof(uint32_t), "instrumenting the program");
+        uint32_t *shift = alloc_or_panic(words_len + 1, sizeof(uint32_t), "instrumenting the program");
+
+        long sites = collect_sites(site_def, restore, stub_len, words_len);
+
+        // words of counting code in front of each word
+        for (uint32_t i = 0; i < words_len; ++i)
+                shift[i + 1] = shift[i] + stub_len[i];
+
+        uint32_t new_len = words_len + shift[words_len];
+        uint32_t scratch = word_addr(new_len);
+        uint32_t region_words = (counter_bytes + sites * counter_bytes + C8_INSTR_SIZE - 1) / C8_INSTR_SIZE;
+        uint32_t limit = word_addr(program_words(target));
+
+        if (limit > C8_MEM_END)
+                limit = C8_MEM_END;
+
+        if (word_addr(new_len + region_words) > limit) {
+                print_msg(ERROR, site_def_pos(site_def, words_len), "the instrumented program and its counters run "
+                        "%lu bytes past 0x%X", (unsigned long)(word_addr(new_len + region_words) - limit),
+                        (unsigned)limit);
+                ++error_count;
+                goto done;
+        }
+
+        Instruction *words = alloc_or_panic(words_len, sizeof(Instruction), "instrumenting the program");
+        uint32_t *positions = alloc_or_panic(words_len, sizeof(uint32_t), "instrumenting the program");
+        memcpy(words, outfile_buffer, words_len * sizeof(Instruction));
+        memcpy(positions, instr_positions, words_len * sizeof(uint32_t));
+
+        for (LabelRef *ref = label_refs; ref < label_refs_ptr; ++ref) {
+                uint32_t i = ref->output_pos - outfile_buffer;
+                uint32_t addr = move_addr(ref_target(ref, instr_word(outfile_buffer, i)), shift, words_len,
+                        region_words);
+
+                ref->output_pos = outfile_buffer + i + shift[i] + stub_len[i];
+                patch_ref(&(LabelRef){.output_pos = words + i, .kind = ref->kind}, addr);
+        }
+
+        uint32_t counter = scratch + counter_bytes;
+        for (uint32_t i = 0; i < words_len; ++i) {
+                uint32_t at = i + shift[i];
+
+                if (site_def[i]) {
+                        write_stub(outfile_buffer + at, counter, scratch, (restore[i] == I_UNKNOWN) ? I_UNKNOWN :
+                                move_addr(restore[i], shift, words_len, region_words));
+                        for (uint32_t j = 0; j < stub_len[i]; ++j)
+                                instr_positions[at + j] = site_def[i]->pos;
+
+                        push_counter(site_def[i], counter);
+                        counter += counter_bytes;
+                }
+
+                outfile_buffer[at + stub_len[i]] = words[i];
+                instr_positions[at + stub_len[i]] = positions[i];
+        }
+
+        for (LabelDef *def = label_defs; def < label_defs_ptr; ++def)
+                def->c8_addr = move_addr(def->c8_addr, shift, words_len, region_words);
+
+        // the scratch bytes and counters start out as 0
+        for (uint32_t i = new_len; i < new_len + region_words; ++i) {
+                outfile_buffer[i] = 0;
+                instr_positions[i] = POS_NONE;
+        }
+        outfile_buffer_ptr = outfile_buffer + new_len + region_words;
+
+        instrumented_labels = sites;
+        counters_addr = scratch + counter_bytes;
+
+        free_scratch(words);
+        free_scratch(positions);
+
+done:
+        free_scratch(site_def);
+        free_scratch(restore);
+        free_scratch(stub_len);
+        free_scratch(shift);
+        free_cfg();
+}
@@ -0,0 +1,24 @@
+#ifndef INSTRUMENT_H_INCLUDED
+        #define INSTRUMENT_H_INCLUDED 1
+
+        #include <stdint.h>
+        #include <stddef.h>
+
+        #include "threadlocal.h"
+
+        // a counter of entries to a label put in by instrument_program
+        typedef struct {
+                const char *label_text;
+                uint32_t addr;
+
+                uint32_t pos; // of the label it counts
+        } Counter;
+
+        extern THREAD_LOCAL int counter_bytes; // width of each counter, 0 when instrumenting is off
+        extern THREAD_LOCAL uint32_t instrumented_labels, counters_addr;
+
+        extern THREAD_LOCAL Counter *counters, *counters_ptr;
+        extern THREAD_LOCAL ptrdiff_t counters_cap;
+
+        extern void instrument_program(void);
+#endif
@@ -3,13 +3,16 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "exitcodes.h"
 #include "ansicodes.h"
 #include "lexer.h"
+#include "parser.h"
 #include "print_msg.h"
+#include "sandbox.h"
 #include "panic.h"
 
 static const char *keywords[] = {
@@ -38,35 +41,86 @@ static const char *keywords[] = {
         "bcd",
         "lod",
         "str",
+        "plane",
+        "audio",
+        "pitch",
+        "save",
+        "load",
+        "budget",
+        "org",
+        "section",
+        "table",
         "stimer",
-        "dtimer"
+        "dtimer",
+        "long"
 };
 
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+// defined in lexer.h
+extern inline uint32_t src_pos(void);
+extern inline void rewind_tkn_stream(void);
+extern inline void push_tkn(Token tkn);
+
+//
+// lex_set_input - points the character stream at len bytes of source, src[len] must be readable as the lexer may
+// look one character past the end
 //
-// next_char - sets current_char to and returns the next char from the character stream, sets line_count and col_count
+void lex_set_input(char *src, long len) {
+        infile_buffer_ptr = infile_buffer = src;
+        infile_len = len;
+        current_char = 0;
+}
+
+//
+// next_char - sets current_char to and returns the next char from the character stream
 //
 int next_char(void) {
         if (infile_buffer_ptr - infile_buffer >= infile_len)
                 return (current_char = EOF);
 
-        current_char = *infile_buffer_ptr++;
+        return (current_char = *infile_buffer_ptr++);
+}
 
-        if (current_char == '\n') {
-                ++line_count;
-                col_count = 0;
-        } else
-                ++col_count;
+//
+// reserve_name - makes room for a name of up to len characters and a terminator in the name pool
+//
+static void reserve_name(size_t len) {
+        if (name_pool_len + len + 1 <= name_pool_cap)
+                return;
+
+        size_t new_cap = name_pool_cap ? name_pool_cap : 256;
+        while (new_cap < name_pool_len + len + 1)
+                new_cap *= 2;
+
+        char *new_pool;
+        if (!(new_pool = realloc(name_pool, new_cap))) {
+                fputs(FMT_ERRMSG("failed to allocate buffer for names\n"), stderr);
+                panic(ERR_MALLOC_FAIL);
+        }
 
-        return current_char;
+        name_pool = new_pool;
+        name_pool_cap = new_cap;
 }
 
 //
-// lex_name - lexes a name (NAME_*) and returns it as a token
+// classify_name - finds the TokenType of a keyword, any other name is taken to be a label reference
+//
+TokenType classify_name(const char *name) {
+        int i;
+
+        for (i = 0; i < NAME_REG && strcmp(name, keywords[i]); ++i)
+                ;
+
+        return (i == NAME_REG) ? NAME_LBLREF : i;
+}
+
+//
+// lex_name - lexes a name (NAME_*) and returns it as a token, names are stored in the name pool
 //
 Token lex_name(void) {
         int i;
-        int lexeme_startline = line_count;
-        int lexeme_startcol = col_count;
+        uint32_t lexeme_start = src_pos();
 
         // lex NAME_REG
         if ((current_char == 'V' || current_char == 'v') && isxdigit(infile_buffer_ptr[0])) {
@@ -83,191 +137,367 @@ Token lex_name(void) {
                 next_char();
                 return (Token){
                         .type = NAME_REG,
-                        .line = lexeme_startline,
-                        .col  = lexeme_startcol,
+                        .pos  = lexeme_start,
                         .value.num = reg
                 };
         }
 
         // assume name is a label definition
-        char *name;
-        if (!(name = calloc(32, 1)))
-                goto alloc_fail;
+        reserve_name(32);
+        char *name = name_pool + name_pool_len;
 
         for (i = 0; i < 32 && ISLABELCHAR(current_char); ++i) {
                 name[i] = current_char;
                 next_char();
         }
+        name[i] = '\0';
 
         if (i == 32 && (isalnum(current_char) || current_char == '_')) {
-                print_msg(ERROR, lexeme_startline, lexeme_startcol, "label name is too long (>32 characters)");
+                print_msg(ERROR, lexeme_start, "label name is too long (>32 characters)");
                 ++error_count;
         }
 
-        if (!(name = realloc(name, i + 1)))
-                goto alloc_fail;
-        name[i] = '\0';
-
         if (current_char == SYM_COLON) {
                 next_char();
+                name_pool_len += i + 1;
                 return (Token){
                         .type = NAME_LBLDEF,
-                        .line = lexeme_startline,
-                        .col  = lexeme_startcol,
-                        .value.text = name
+                        .pos  = lexeme_start,
+                        .value.name = name - name_pool
                 };
         }
 
-        // no colon so not a label definition, search for name in keywords list
-        for (i = 0; i < NAME_REG && strcmp(name, keywords[i]); ++i)
-                ;
+        // no colon so not a label definition, keywords are not kept in the name pool
+        TokenType type = classify_name(name);
+
+        if (type == NAME_LBLREF)
+                name_pool_len += i + 1;
+
+        return (Token){
+                .type = type,
+                .pos  = lexeme_start,
+                .value.name = name - name_pool
+        };
+}
+
+//
+// lex_vreg - lexes a virtual register (`%name`) and returns it as a NAME_REG token, names are stored in the name pool
+//
+Token lex_vreg(void) {
+        int i;
+        uint32_t lexeme_start = src_pos();
 
-        // if i == NAME_REG then name was not found in keywords list, assume it's label reference
-        if (i == NAME_REG)
-                i = NAME_LBLREF;
-        else {
-                free(name);
-                name = NULL;
+        next_char();
+
+        reserve_name(32);
+        char *name = name_pool + name_pool_len;
+
+        for (i = 0; i < 32 && ISLABELCHAR(current_char); ++i) {
+                name[i] = current_char;
+                next_char();
+        }
+        name[i] = '\0';
+
+        if (i == 0) {
+                print_msg(ERROR, lexeme_start, "expected a virtual register name after `%%`");
+                ++error_count;
+        } else if (i == 32 && ISLABELCHAR(current_char)) {
+                print_msg(ERROR, lexeme_start, "virtual register name is too long (>32 characters)");
+                ++error_count;
+        }
+
+        name_pool_len += i + 1;
+
+        return (Token){
+                .type = NAME_REG,
+                .pos  = lexeme_start,
+                .value.num = VREG_BASE + (name - name_pool)
+        };
+}
+
+//
+// lex_op - lexes an operator or parenthesis (SYM_OP) and returns it as a token, `<<` and `>>` are held as `<` and `>`
+//
+Token lex_op(void) {
+        uint32_t lexeme_start = src_pos();
+        int op = current_char;
+
+        next_char();
+        if (op == '<' || op == '>') {
+                if (current_char == op) {
+                        next_char();
+                } else {
+                        print_msg(ERROR, lexeme_start, "expected `%c%c`", op, op);
+                        ++error_count;
+                }
         }
 
         return (Token){
-                .type = i,
-                .line = lexeme_startline,
-                .col  = lexeme_startcol,
-                .value.text = name
+                .type = SYM_OP,
+                .pos  = lexeme_start,
+                .value.num = op
         };
+}
+
+//
+// swar_digits - converts 8 ASCII digits of a base up to 16 to their value at once, the first digit is in the lowest
+// byte of chars and is the most significant
+//
+// each step combines neighbouring lanes, digit pairs into 16 bit lanes, then pairs of those into 32 bit lanes and so
+// on, no lane can carry into the next as 8 hex digits are at most 2^32 - 1
+//
+static uint64_t swar_digits(uint64_t chars, uint64_t base) {
+        // '0'-'9' have their value in the low nibble, letters have bit 6 set and their value - 9 in the low nibble
+        uint64_t v = (chars & 0x0F0F0F0F0F0F0F0Fu) + 9 * ((chars >> 6) & 0x0101010101010101u);
+
+        v = (v & 0x00FF00FF00FF00FFu) * base + ((v >> 8) & 0x00FF00FF00FF00FFu);
+        v = (v & 0x0000FFFF0000FFFFu) * (base * base) + ((v >> 16) & 0x0000FFFF0000FFFFu);
+        v = (v & 0x00000000FFFFFFFFu) * (base * base * base * base) + (v >> 32);
+
+        return v;
+}
+
+//
+// pow_u64 - raises a base to a small power
+//
+static uint64_t pow_u64(uint64_t base, int exp) {
+        uint64_t n = 1;
+
+        while (exp-- > 0)
+                n *= base;
 
-alloc_fail:
-        print_msg(ERROR, lexeme_startline, lexeme_startcol, "failed to allocate buffer for name");
-        ++error_count;
+        return n;
 }
 
 //
 // lex_int - lexes an integer constant and returns it as a token
 //
+// the whole run of letters, digits and underscores making up the constant is consumed whether or not it is valid so
+// lexing always moves on, and a malformed constant gets a single error
+//
 Token lex_int(void) {
-        int integer_value = 0;
-        int decimal_value = current_char - '0';
-        int lexeme_startline = line_count;
-        int lexeme_startcol = col_count;
-
-        if (current_char == '0' && isalpha(next_char())) {
-                // parse 0x 0b 0o
-                switch (current_char) {
-                        case 'X':        // FALLTHROUGH
+        uint32_t lexeme_start = src_pos();
+        const char *digits = infile_buffer_ptr - 1;
+        const char *src_end = infile_buffer + infile_len;
+        const char *errmsg = "invalid digits in decimal integer constant";
+        int base = 10;
+        bool valid = true;
+
+        if (digits[0] == '0' && digits + 1 < src_end && isalpha(digits[1])) {
+                switch (digits[1]) {
+                        case 'X': // FALLTHROUGH
                         case 'x':
-                                next_char();
-                                if (!isxdigit(current_char)) {
-                                        print_msg(ERROR, lexeme_startline, lexeme_startcol, 
-                                                "invalid digits supplied to 0x integer constant");
-                                        ++error_count;
-                                }
-
-                                while (!(isspace(current_char) || current_char == EOF)) {
-                                        if (isxdigit(current_char)) {
-                                                integer_value <<= 4;
-                                                if (ISUPPER(current_char))
-                                                        integer_value += (current_char - 55);
-                                                else if (ISLOWER(current_char))
-                                                        integer_value += (current_char - 87);
-                                                else
-                                                        integer_value += (current_char - '0');
-
-                                                next_char();
-                                        } else {
-                                                print_msg(ERROR, lexeme_startline, lexeme_startcol, 
-                                                        "invalid digits supplied to 0x integer constant");
-                                                ++error_count;
-                                        }
-                                }
-
-                                if (integer_value > 4095)
-                                        goto int_too_large;
-
+                                base = 16;
+                                errmsg = "invalid digits supplied to 0x integer constant";
                                 break;
-                        case 'B':        // FALLTHROUGH
+                        case 'B': // FALLTHROUGH
                         case 'b':
-                                next_char();
-                                if (!ISBIN(current_char)) {
-                                        print_msg(ERROR, lexeme_startline, lexeme_startcol, 
-                                                "invalid digits supplied to 0b integer constant");
-                                        ++error_count;
-                                }
-
-                                while (!(isspace(current_char) || current_char == EOF)) {
-                                        if (ISBIN(current_char)) {
-                                                integer_value <<= 1;
-                                                integer_value += (current_char - '0');
-                                                next_char();
-                                        } else {
-                                                print_msg(ERROR, lexeme_startline, lexeme_startcol, 
-                                                        "invalid digits supplied to 0b integer constant");
-                                                ++error_count;
-                                        }
-                                }
-
-                                if (integer_value > 4095)
-                                        goto int_too_large;
-
+                                base = 2;
+                                errmsg = "invalid digits supplied to 0b integer constant";
                                 break;
-                        case 'O':        // FALLTHROUGH
+                        case 'O': // FALLTHROUGH
                         case 'o':
-                                next_char();
-                                if (!ISOCT(current_char)) {
-                                        print_msg(ERROR, lexeme_startline, lexeme_startcol, 
-                                                "invalid digits supplied to 0o integer constant");
-                                        ++error_count;
-                                }
-
-                                while (!(isspace(current_char) || current_char == EOF)) {
-                                        if (ISOCT(current_char)) {
-                                                integer_value <<= 3;
-                                                integer_value += (current_char - '0');
-                                                next_char();
-                                        } else {
-                                                print_msg(ERROR, lexeme_startline, lexeme_startcol, 
-                                                        "invalid digits supplied to 0o integer constant");
-                                                ++error_count;
-                                        }
-                                }
-
-                                if (integer_value > 4095)
-                                        goto int_too_large;
-
+                                base = 8;
+                                errmsg = "invalid digits supplied to 0o integer constant";
                                 break;
-
                         default:
-                                print_msg(ERROR, lexeme_startline, lexeme_startcol, 
-                                        "expecting 0x, 0b or 0o prefixed integer constant");
-                                ++error_count;
+                                errmsg = "expecting 0x, 0b or 0o prefixed integer constant";
+                                valid = false;
                 }
-        } else {
-                // parse decimal
-                integer_value = decimal_value;
-                next_char();
-                while (!(isspace(current_char) || current_char == ';' || current_char == EOF))
-                        if (ISDEC(current_char)) {
-                                integer_value *= 10;
-                                integer_value += (current_char - '0');
-                                next_char();
-                        } else {
-                                print_msg(ERROR, lexeme_startline, lexeme_startcol,
-                                        "invalid digits in decimal integer constant");
-                                ++error_count;
-                        }
 
-                if (integer_value > 4095)
-                        goto int_too_large;
+                digits += 2;
+        }
+
+        // scan the digit run once, checking each digit against the base and shifting it into a chunk of 8 which
+        // starts out as all '0's so a short chunk is padded with leading zeros
+        const uint64_t zeros = 0x3030303030303030u;
+        uint64_t chunk = zeros, value = 0;
+        unsigned dec_digits = (base < 10) ? base : 10;
+        int chunk_len = 0;
+        const char *end = digits;
+
+        for (; end < src_end && ISLABELCHAR(*end); ++end) {
+                unsigned c = *end;
+
+                if (!(c - '0' < dec_digits || (base == 16 && (c | 0x20) - 'a' < 6)))
+                        valid = false;
+
+                chunk = (chunk >> 8) | ((uint64_t)c << 56);
+                if (++chunk_len == 8) {
+                        if (value <= 0xFFFF)
+                                value = value * pow_u64(base, 8) + swar_digits(chunk, base);
+                        chunk = zeros;
+                        chunk_len = 0;
+                }
+        }
+
+        infile_buffer_ptr = (char*)end;
+        next_char();
+
+        if (!valid || end == digits) {
+                print_msg(ERROR, lexeme_start, (char*)errmsg);
+                ++error_count;
+
+                return (Token){.type = CONST_INT, .pos = lexeme_start};
+        }
+
+        if (chunk_len > 0 && value <= 0xFFFF)
+                value = (value ? value * pow_u64(base, chunk_len) : 0) + swar_digits(chunk, base);
+
+        if (value > 0xFFFF) {
+                print_msg(ERROR, lexeme_start, "integer constant is too large (>65535)");
+                ++error_count;
+                value = 0;
         }
 
         return (Token){
                 .type = CONST_INT,
-                .line = lexeme_startline,
-                .col  = lexeme_startcol,
-                .value.num = integer_value
+                .pos  = lexeme_start,
+                .value.num = value
         };
+}
+
+//
+// lexer_fingerprint - hashes the keywords, the values of the token types and which keywords are only keywords at the
+// start of a line, anything which changes how a source is lexed changes these, so a token cache is only used by a
+// lexer which would write the same tokens
+//
+uint64_t lexer_fingerprint(void) {
+        uint64_t hash = 14695981039346656037u;
+        const uint8_t values[] = {C8ASM_TOKENS_VERSION, NAME_REG, NAME_I, SYM_COMMA, CONST_INT, SYM_OP, STREAM_END,
+                VREG_BASE, LINE_KEYWORDS_FIRST, LINE_KEYWORDS_LAST};
+
+        for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i)
+                for (const char *c = keywords[i]; ; ++c) {
+                        hash = (hash ^ (uint8_t)*c) * 1099511628211u;
+                        if (!*c)
+                                break;
+                }
 
-int_too_large:
-        print_msg(ERROR, lexeme_startline, lexeme_startcol, "integer constant is too large (>4095)");
-        ++error_count;
+        for (size_t i = 0; i < sizeof(values); ++i)
+                hash = (hash ^ values[i]) * 1099511628211u;
+
+        return hash;
+}
+
+//
+// lex_cached - points the token stream at the tokens of a cache instead of lexing the source, the parser only reads
+// the stream so it is used where it lies, the names are copied as labels point into the name pool after assembly
+//
+void lex_cached(const c8asm_tokens *cache) {
+        if (limit_tokens && cache->count - 1 > limit_tokens)
+                panic(ERR_LIMIT_TOKENS);
+
+        tkn_types = (uint8_t*)cache->types;
+        tkn_positions = (uint32_t*)cache->positions;
+        tkn_payloads = (uint32_t*)cache->payloads;
+
+        tkn_types_ptr = tkn_types + cache->count;
+        tkn_positions_ptr = tkn_positions + cache->count;
+        tkn_payloads_ptr = tkn_payloads + cache->payloads_count;
+
+        reserve_name(cache->names_len);
+        memcpy(name_pool, cache->names, cache->names_len);
+        name_pool_len = cache->names_len;
+}
+
+//
+// operand_follows - checks whether an operand follows current_char on the same line
+//
+static bool operand_follows(void) {
+        const char *p = infile_buffer_ptr - 1, *src_end = infile_buffer + infile_len;
+
+        if (current_char == EOF)
+                return false;
+
+        while (p < src_end && (*p == ' ' || *p == '\t'))
+                ++p;
+
+        return p < src_end && ISLABELCHAR(*p);
+}
+
+//
+// keyword_in_place - checks whether a keyword lexed at the start of a line or not is a keyword where it is, see
+// LINE_KEYWORDS_FIRST in lexer.h
+//
+static bool keyword_in_place(uint8_t type, bool line_start) {
+        if (type >= LINE_KEYWORDS_FIRST && type <= LINE_KEYWORDS_LAST)
+                return line_start;
+
+        if (type == NAME_LONG)
+                return tkn_types_ptr - tkn_types >= 2 && tkn_types_ptr[-2] == NAME_I &&
+                        tkn_types_ptr[-1] == SYM_COMMA && operand_follows();
+
+        return true;
+}
+
+//
+// after_operand - checks whether the last token lexed ends an operand of a table expression, after which `%` is the
+// modulo operator
+//
+static bool after_operand(void) {
+        if (tkn_types_ptr == tkn_types)
+                return false;
+
+        return tkn_types_ptr[-1] == CONST_INT || tkn_types_ptr[-1] == NAME_LBLREF ||
+                (tkn_types_ptr[-1] == SYM_OP && tkn_payloads_ptr[-1] == ')');
+}
+
+//
+// lex_src - lexes the source buffer and writes the tokens to the token stream
+//
+void lex_src(void) {
+        // whether no token but label definitions has been lexed on the current line
+        bool line_start = true;
+
+        next_char();
+        while (current_char != EOF) {
+                check_deadline();
+                if (limit_tokens && tkn_types_ptr - tkn_types > limit_tokens)
+                        panic(ERR_LIMIT_TOKENS);
+
+                const uint8_t *tkns_before = tkn_types_ptr;
+
+                if (ISDEC(current_char)) {
+                        push_tkn(lex_int());
+                } else if (current_char == SYM_COMMA || current_char == NAME_I) {
+                        push_tkn((Token){
+                                .type = current_char,
+                                .pos = src_pos()
+                        });
+                        next_char();
+                } else if (isalpha(current_char) || current_char == '_') {
+                        Token tkn = lex_name();
+
+                        // lex_name leaves the name of a keyword in the name pool without keeping it
+                        if (tkn.type < NAME_REG && !keyword_in_place(tkn.type, line_start)) {
+                                tkn.type = NAME_LBLREF;
+                                name_pool_len += strlen(name_pool + tkn.value.name) + 1;
+                        }
+
+                        // the name after a table directive defines the label of the table
+                        if (tkn.type == NAME_LBLREF && tkn_types_ptr > tkn_types && tkn_types_ptr[-1] == DIR_TABLE)
+                                tkn.type = NAME_LBLDEF;
+                        push_tkn(tkn);
+                } else if (current_char == '%' && ISLABELCHAR(*infile_buffer_ptr) && !ISDEC(*infile_buffer_ptr) &&
+                                !(!line_start && after_operand())) {
+                        // a virtual register is named like a label, anything else after `%` makes it an operator, as
+                        // does an operand before it
+                        push_tkn(lex_vreg());
+                } else if (current_char && strchr("()+-*/%&|^~<>", current_char)) {
+                        push_tkn(lex_op());
+                } else if (current_char == ';') {
+                        while (!(current_char == '\n' || current_char == EOF))
+                                next_char();
+                } else {
+                        if (current_char == '\n')
+                                line_start = true;
+                        next_char();
+                }
+
+                if (tkn_types_ptr > tkns_before && tkn_types_ptr[-1] != NAME_LBLDEF)
+                        line_start = false;
+        }
+        // the end of the stream is placed at the end of the source, where a statement cut short is reported
+        push_tkn((Token){.type = STREAM_END, .pos = infile_len});
 }
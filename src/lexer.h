@@ -5,6 +5,9 @@
         #include <stdint.h>
         #include <string.h>
 
+        #include "threadlocal.h"
+        #include "c8tokens.h"
+
         #define ISBIN(c)       ((c) == '0' || (c) == '1')
         #define ISOCT(c)       ((unsigned)(c) - '0' <= 7)
         #define ISDEC(c)       ((unsigned)(c) - '0' <= 9)
@@ -41,8 +44,22 @@
                 INSTR_LOD,
                 INSTR_STR,
 
+                // XO-CHIP only
+                INSTR_PLANE,
+                INSTR_AUDIO,
+                INSTR_PITCH,
+                INSTR_SAVE,
+                INSTR_LOAD,
+
+                // directives, these produce no instructions
+                DIR_BUDGET,
+                DIR_ORG,
+                DIR_SECTION,
+                DIR_TABLE,
+
                 NAME_ST,
                 NAME_DT,
+                NAME_LONG,
                 NAME_REG,
                 NAME_LBLREF,
                 NAME_LBLDEF,
@@ -52,26 +69,82 @@
                 SYM_COLON = ':',
 
                 CONST_INT,
+                SYM_OP, // an operator or parenthesis of a table expression, the payload holds its character
 
                 STREAM_END
         } TokenType;
 
+        // keywords from LINE_KEYWORDS_FIRST to LINE_KEYWORDS_LAST are only keywords at the start of a line, after any
+        // label definitions, anywhere else they are label names so sources which used them as labels before they were
+        // keywords still assemble, `long` is only a keyword between `mov I,` and its operand
+        enum {LINE_KEYWORDS_FIRST = INSTR_PLANE, LINE_KEYWORDS_LAST = DIR_TABLE};
+
+        // NAME_REG payloads from VREG_BASE up are virtual registers, holding VREG_BASE plus the offset of their name in
+        // the name pool
+        enum {VREG_BASE = 16};
+
+        // tokens which carry a value in the payload array of the token stream
+        #define TKN_HAS_PAYLOAD(type) ((type) == NAME_REG || (type) == CONST_INT || \
+                                       (type) == NAME_LBLREF || (type) == NAME_LBLDEF || (type) == SYM_OP)
+
+        // a single token, this is only used as a view into the token stream which is stored as parallel arrays
         typedef struct {
                 TokenType type;
-                uint16_t line, col;
+                uint32_t pos; // offset of the token's first character in the source
 
                 union {
                         int num;
-                        char *text;
+                        uint32_t name; // offset of the name in the name pool
                 } value;
         } Token;
 
-        extern long infile_len;
-        extern char *infile_name, *infile_buffer, *infile_buffer_ptr;
-        extern int current_char;
-        extern uint16_t col_count, line_count;
+        extern THREAD_LOCAL long infile_len;
+        extern THREAD_LOCAL char *infile_name, *infile_buffer, *infile_buffer_ptr;
+        extern THREAD_LOCAL int current_char;
 
+        extern THREAD_LOCAL uint8_t *tkn_types, *tkn_types_ptr;
+        extern THREAD_LOCAL uint32_t *tkn_positions, *tkn_positions_ptr;
+        extern THREAD_LOCAL uint32_t *tkn_payloads, *tkn_payloads_ptr;
+
+        extern THREAD_LOCAL char *name_pool;
+        extern THREAD_LOCAL size_t name_pool_len, name_pool_cap;
+
+        extern void lex_set_input(char *src, long len);
         extern int next_char(void);
+        extern TokenType classify_name(const char *name);
         extern Token lex_name(void);
         extern Token lex_int(void);
+        extern Token lex_vreg(void);
+        extern Token lex_op(void);
+        extern void lex_src(void);
+        extern uint64_t lexer_fingerprint(void);
+        extern void lex_cached(const c8asm_tokens *cache);
+
+        //
+        // src_pos - get the offset of current_char in the source
+        //
+        inline uint32_t src_pos(void) {
+                return infile_buffer_ptr - infile_buffer - 1;
+        }
+
+        //
+        // rewind_tkn_stream - moves the token stream back to its first token, for reading what was lexed or writing
+        // over it
+        //
+        inline void rewind_tkn_stream(void) {
+                tkn_types_ptr = tkn_types;
+                tkn_positions_ptr = tkn_positions;
+                tkn_payloads_ptr = tkn_payloads;
+        }
+
+        //
+        // push_tkn - append a token to the token stream
+        //
+        inline void push_tkn(Token tkn) {
+                *tkn_types_ptr++ = tkn.type;
+                *tkn_positions_ptr++ = tkn.pos;
+
+                if (TKN_HAS_PAYLOAD(tkn.type))
+                        *tkn_payloads_ptr++ = tkn.value.num;
+        }
 #endif
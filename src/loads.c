@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "parser.h"
+#include "analyze.h"
+#include "loads.h"
+#include "compact.h"
+#include "print_msg.h"
+#include "alloc.h"
+
+// registers are tracked by value number, a number below 256 is that constant and any other names an unknown value
+// by the instruction or block entry which produced it, two registers with the same number hold the same value
+enum {REGS = 16, VALUE_UNKNOWN = 256, VALUE_UNREACHED = UINT32_MAX};
+
+THREAD_LOCAL bool eliminate_loads;
+THREAD_LOCAL uint32_t loads_removed;
+
+//
+// made_at - gets the value number of an unknown value written to a register by the instruction at a word
+//
+static uint32_t made_at(uint32_t i, int reg) {
+        return VALUE_UNKNOWN + i * REGS + reg;
+}
+
+//
+// merged_at - gets the value number of an unknown value held by a register on entry to a block, numbered past every
+// word so it can't collide with made_at
+//
+static uint32_t merged_at(uint32_t words_len, int b, int reg) {
+        return VALUE_UNKNOWN + (words_len + b) * REGS + reg;
+}
+
+//
+// clobber - gives registers first to last unknown values made by the instruction at a word
+//
+static void clobber(uint32_t *regs, uint32_t i, int first, int last) {
+        for (int r = first; r <= last; ++r)
+                regs[r] = made_at(i, r);
+}
+
+//
+// transfer - applies the instruction at a word to the register values, anything which isn't understood or
+// leaves the program (a call, `wkp`, `rnd`, `lod`) writes unknown values
+//
+static void transfer(uint32_t *regs, uint32_t i) {
+        uint16_t word = instr_word(outfile_buffer, i);
+        int x = (word >> 8) & 0xF, y = (word >> 4) & 0xF;
+        uint8_t nn = word & 0xFF;
+
+        switch (word >> 12) {
+                case 0x0:
+                        if (word != 0x00E0 && word != 0x00EE)
+                                clobber(regs, i, 0, REGS - 1);
+                        break;
+                case 0x2:
+                        clobber(regs, i, 0, REGS - 1);
+                        break;
+                case 0x5:
+                        if ((word & 0xF) == 0x3)
+                                clobber(regs, i, (x < y) ? x : y, (x < y) ? y : x);
+                        break;
+                case 0x6:
+                        regs[x] = nn;
+                        break;
+                case 0x7:
+                        regs[x] = (regs[x] < VALUE_UNKNOWN) ? (uint8_t)(regs[x] + nn) : made_at(i, x);
+                        break;
+                case 0x8:
+                        switch (word & 0xF) {
+                                case 0x0:
+                                        regs[x] = regs[y];
+                                        break;
+                                case 0x1: // FALLTHROUGH
+                                case 0x2:
+                                case 0x3:
+                                case 0x4:
+                                case 0x5:
+                                case 0x6:
+                                case 0x7:
+                                case 0xE:
+                                        // interpreters disagree on what the logical instructions do to VF, and
+                                        // whether shifts read vy, so the results aren't folded
+                                        clobber(regs, i, x, x);
+                                        clobber(regs, i, 0xF, 0xF);
+                                        break;
+                                default:
+                                        clobber(regs, i, 0, REGS - 1);
+                        }
+                        break;
+                case 0xC:
+                        clobber(regs, i, x, x);
+                        break;
+                case 0xD:
+                        clobber(regs, i, 0xF, 0xF);
+                        break;
+                case 0xF:
+                        switch (nn) {
+                                case 0x07: // FALLTHROUGH
+                                case 0x0A:
+                                        clobber(regs, i, x, x);
+                                        break;
+                                case 0x1E:
+                                        // some interpreters flag overflow of I in VF
+                                        clobber(regs, i, 0xF, 0xF);
+                                        break;
+                                case 0x65:
+                                        clobber(regs, i, 0, x);
+                                        break;
+                                case 0x00: // FALLTHROUGH
+                                case 0x01:
+                                case 0x02:
+                                case 0x15:
+                                case 0x18:
+                                case 0x29:
+                                case 0x33:
+                                case 0x3A:
+                                case 0x55:
+                                        break;
+                                default:
+                                        clobber(regs, i, 0, REGS - 1);
+                        }
+                        break;
+        }
+}
+
+//
+// is_redundant - checks whether the instruction at a word loads a register with the value it already holds
+//
+static bool is_redundant(const uint32_t *regs, uint32_t i) {
+        uint16_t word = instr_word(outfile_buffer, i);
+        int x = (word >> 8) & 0xF, y = (word >> 4) & 0xF;
+
+        if ((word >> 12) == 0x6)
+                return regs[x] == (word & 0xFFu);
+        if ((word & 0xF00F) == 0x8000)
+                return regs[x] == regs[y];
+
+        return false;
+}
+
+//
+// find_entries - finds the register values on entry to every block by iterating to a fixed point, the start of the
+// program and every called block are entered with unknown values, blocks which are never reached are left unreached
+//
+// an entry only ever goes from unreached to the value reaching it and from there to a value merged at the entry, so
+// this ends after at most two changes to each register of each block
+//
+static void find_entries(uint32_t *entries, uint32_t words_len) {
+        bool *is_entry = alloc_or_panic(blocks_len, sizeof(bool), "load elimination");
+        uint32_t *regs = alloc_or_panic(REGS, sizeof(uint32_t), "load elimination");
+
+        for (int b = 0; b < blocks_len; ++b) {
+                if (blocks[b].call_target >= 0)
+                        is_entry[blocks[b].call_target] = true;
+                for (int r = 0; r < REGS; ++r)
+                        entries[b * REGS + r] = VALUE_UNREACHED;
+        }
+        is_entry[0] = true;
+
+        for (int b = 0; b < blocks_len; ++b)
+                if (is_entry[b])
+                        for (int r = 0; r < REGS; ++r)
+                                entries[b * REGS + r] = merged_at(words_len, b, r);
+
+        bool changed = true;
+        while (changed) {
+                changed = false;
+
+                for (int b = 0; b < blocks_len; ++b) {
+                        if (entries[b * REGS] == VALUE_UNREACHED)
+                                continue;
+
+                        memcpy(regs, &entries[b * REGS], REGS * sizeof(uint32_t));
+                        for (uint32_t i = blocks[b].start; i < blocks[b].end; i += instr_len(instr_word(outfile_buffer, i)))
+                                transfer(regs, i);
+
+                        // a successor which is reached for the first time takes these values, after that a register
+                        // which reaches it with different values holds a value merged at its entry
+                        for (int s = 0; s < blocks[b].succ_len; ++s) {
+                                int succ = blocks[b].succ[s];
+                                if (is_entry[succ])
+                                        continue;
+
+                                for (int r = 0; r < REGS; ++r) {
+                                        uint32_t *entry = &entries[succ * REGS + r];
+                                        uint32_t merged = (*entry == VALUE_UNREACHED || *entry == regs[r]) ? regs[r] :
+                                                merged_at(words_len, succ, r);
+
+                                        if (*entry != merged) {
+                                                *entry = merged;
+                                                changed = true;
+                                        }
+                                }
+                        }
+                }
+        }
+
+        free_scratch(is_entry);
+        free_scratch(regs);
+}
+
+//
+// eliminate_redundant_loads - takes out `mov vx, const` and `mov vx, vy` instructions which load a register with the
+// value it already holds and compacts the program, this runs after labels are resolved so references are patched
+// through the label tables
+//
+// an instruction which can be skipped is kept, as is every instruction if the program uses `vjmp` since the blocks it
+// can jump to are unknown
+//
+void eliminate_redundant_loads(void) {
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+
+        long literal = find_literal_addr();
+        if (literal >= 0) {
+                print_msg(WARNING, instr_positions[literal], "redundant loads were not removed as this address into "
+                        "the program doesn't come from a label and can't be moved");
+                ++warning_count;
+                return;
+        }
+
+        long directive = find_section_directive();
+        if (directive >= 0) {
+                print_msg(WARNING, directive, "redundant loads were not removed as the program is placed in sections "
+                        "and can't be moved");
+                ++warning_count;
+                return;
+        }
+
+        if (!build_cfg())
+                return;
+
+        for (int b = 0; b < blocks_len; ++b) {
+                if (blocks[b].indirect) {
+                        free_cfg();
+                        return;
+                }
+        }
+
+        uint32_t *entries = alloc_or_panic((size_t)blocks_len * REGS, sizeof(uint32_t), "load elimination");
+        uint32_t *regs = alloc_or_panic(REGS, sizeof(uint32_t), "load elimination");
+        bool *dead = alloc_or_panic(words_len + 1, sizeof(bool), "load elimination");
+
+        find_entries(entries, words_len);
+
+        bool after_skip = false;
+        for (int b = 0; b < blocks_len; ++b) {
+                bool reached = entries[b * REGS] != VALUE_UNREACHED && !blocks[b].data;
+
+                memcpy(regs, &entries[b * REGS], REGS * sizeof(uint32_t));
+                for (uint32_t i = blocks[b].start; i < blocks[b].end; i += instr_len(instr_word(outfile_buffer, i))) {
+                        uint16_t word = instr_word(outfile_buffer, i);
+
+                        if (reached && !after_skip && is_redundant(regs, i)) {
+                                dead[i] = true;
+                                ++loads_removed;
+                        }
+
+                        if (reached)
+                                transfer(regs, i);
+                        after_skip = is_skip(word);
+                }
+        }
+
+        if (loads_removed > 0)
+                compact_program(dead, NULL);
+
+        free_scratch(entries);
+        free_scratch(regs);
+        free_scratch(dead);
+        free_cfg();
+}
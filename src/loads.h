@@ -0,0 +1,13 @@
+#ifndef LOADS_H_INCLUDED
+        #define LOADS_H_INCLUDED 1
+
+        #include <stdint.h>
+        #include <stdbool.h>
+
+        #include "threadlocal.h"
+
+        extern THREAD_LOCAL bool eliminate_loads;
+        extern THREAD_LOCAL uint32_t loads_removed;
+
+        extern void eliminate_redundant_loads(void);
+#endif
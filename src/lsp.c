@@ -0,0 +1,1113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "lsp.h"
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "lexer.h"
+#include "parser.h"
+#include "analyze.h"
+#include "regalloc.h"
+#include "sections.h"
+#include "print_msg.h"
+#include "panic.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+// a token of a single line, label tokens carry the index of their symbol in place of a name pool offset
+typedef struct {
+        uint8_t type;
+        uint32_t col;
+        uint32_t payload;
+} LineTkn;
+
+// a diagnostic reported while lexing a line
+typedef struct {
+        MsgType type;
+        uint32_t col;
+        char *text;
+} LineMsg;
+
+typedef struct {
+        char *text; // not newline terminated, always followed by a '\0'
+        uint32_t len;
+        uint32_t no;
+
+        LineTkn *tkns;
+        uint32_t tkns_len;
+
+        LineMsg *msgs;
+        uint32_t msgs_len;
+} Line;
+
+// a definition of or reference to a label
+typedef struct {
+        Line *line;
+        uint32_t col;
+        bool is_def;
+} Occurrence;
+
+typedef struct {
+        size_t name; // offset into the document's name arena
+        uint32_t len;
+
+        Occurrence *occs;
+        size_t occs_len, occs_cap;
+} Symbol;
+
+typedef struct Doc {
+        char *uri;
+        long version;
+
+        Line **lines;
+        size_t lines_len, lines_cap;
+
+        // symbols are never removed, a name which is no longer used just has no occurrences
+        char *names;
+        size_t names_len, names_cap;
+        Symbol *syms;
+        size_t syms_len, syms_cap;
+        uint32_t *sym_table; // open addressing table of symbol indexes plus one, 0 marks a free slot
+        size_t sym_table_cap;
+
+        struct Doc *next;
+} Doc;
+
+static Doc *docs;
+
+// scratch buffers for lexing lines and for the token stream of a whole document
+static size_t tkn_types_cap, tkn_positions_cap, tkn_payloads_cap;
+static Instruction image[IMAGE_WORDS];
+static uint32_t image_positions[IMAGE_WORDS];
+static uint32_t *line_starts;
+static size_t line_starts_cap;
+
+// output built for a single message
+static char *out_buf;
+static size_t out_len, out_cap;
+
+static char *in_buf;
+static size_t in_cap;
+
+//
+// grow - grows an array to hold at least len elements of size elem_size, panics on failure
+//
+static void grow(void *buf, size_t *cap, size_t len, size_t elem_size) {
+        if (len <= *cap)
+                return;
+
+        size_t new_cap = *cap ? *cap : 16;
+        while (new_cap < len)
+                new_cap *= 2;
+
+        void *new_buf;
+        if (!(new_buf = realloc(*(void**)buf, new_cap * elem_size))) {
+                fputs(FMT_ERRMSG("failed to allocate memory for language server\n"), stderr);
+                panic(ERR_MALLOC_FAIL);
+        }
+
+        *(void**)buf = new_buf;
+        *cap = new_cap;
+}
+
+//
+// reserve_tkns - makes room for len tokens in the token stream
+//
+static void reserve_tkns(size_t len) {
+        grow(&tkn_types, &tkn_types_cap, len, sizeof(uint8_t));
+        grow(&tkn_positions, &tkn_positions_cap, len, sizeof(uint32_t));
+        grow(&tkn_payloads, &tkn_payloads_cap, len, sizeof(uint32_t));
+}
+
+//
+// skip_ws - skips JSON whitespace
+//
+static const char *skip_ws(const char *p) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+                ++p;
+
+        return p;
+}
+
+//
+// skip_value - skips a JSON value without decoding it
+//
+static const char *skip_value(const char *p) {
+        p = skip_ws(p);
+
+        if (*p == '"') {
+                for (++p; *p && *p != '"'; ++p)
+                        if (*p == '\\' && p[1])
+                                ++p;
+
+                return *p ? p + 1 : p;
+        }
+
+        if (*p == '{' || *p == '[') {
+                int depth = 0;
+
+                while (*p) {
+                        if (*p == '"') {
+                                p = skip_value(p);
+                                continue;
+                        }
+
+                        if (*p == '{' || *p == '[')
+                                ++depth;
+                        else if ((*p == '}' || *p == ']') && --depth == 0)
+                                return p + 1;
+
+                        ++p;
+                }
+
+                return p;
+        }
+
+        while (*p && !strchr(",}] \t\r\n", *p))
+                ++p;
+
+        return p;
+}
+
+//
+// json_get - finds the value of a member of a JSON object, returns NULL if obj is NULL or not an object or if the
+// member doesn't exist
+//
+static const char *json_get(const char *obj, const char *key) {
+        if (!obj || *(obj = skip_ws(obj)) != '{')
+                return NULL;
+
+        size_t key_len = strlen(key);
+        const char *p = skip_ws(obj + 1);
+
+        while (*p == '"') {
+                const char *name = p + 1;
+                p = skip_value(p);
+
+                bool match = (size_t)(p - 1 - name) == key_len && !strncmp(name, key, key_len);
+
+                if (*(p = skip_ws(p)) != ':')
+                        return NULL;
+
+                p = skip_ws(p + 1);
+                if (match)
+                        return p;
+
+                if (*(p = skip_ws(skip_value(p))) != ',')
+                        return NULL;
+
+                p = skip_ws(p + 1);
+        }
+
+        return NULL;
+}
+
+//
+// json_first - finds the first element of a JSON array, returns NULL if there is none
+//
+static const char *json_first(const char *arr) {
+        if (!arr || *(arr = skip_ws(arr)) != '[')
+                return NULL;
+
+        arr = skip_ws(arr + 1);
+
+        return (*arr && *arr != ']') ? arr : NULL;
+}
+
+//
+// json_next - finds the element after elem in a JSON array, returns NULL if there is none
+//
+static const char *json_next(const char *elem) {
+        const char *p = skip_ws(skip_value(elem));
+
+        return (*p == ',') ? skip_ws(p + 1) : NULL;
+}
+
+//
+// json_long - reads a JSON number, returns def if value is NULL or not a number
+//
+static long json_long(const char *value, long def) {
+        char *end;
+
+        if (!value)
+                return def;
+
+        long n = strtol(value, &end, 10);
+
+        return (end == value) ? def : n;
+}
+
+//
+// json_bool - reads a JSON boolean, returns false if value is NULL or not true
+//
+static bool json_bool(const char *value) {
+        return value && !strncmp(value, "true", 4);
+}
+
+//
+// json_is - checks whether a JSON value is the string str
+//
+static bool json_is(const char *value, const char *str) {
+        size_t len = strlen(str);
+
+        return value && value[0] == '"' && !strncmp(value + 1, str, len) && value[len + 1] == '"';
+}
+
+//
+// hex_digit - gets the value of a hex digit or -1
+//
+static int hex_digit(int c) {
+        if (ISDEC(c))
+                return c - '0';
+        if (ISUPPER(c) && c <= 'F')
+                return c - 55;
+        if (ISLOWER(c) && c <= 'f')
+                return c - 87;
+
+        return -1;
+}
+
+//
+// read_u_escape - reads the four hex digits of a \u escape, returns -1 if they're malformed
+//
+static long read_u_escape(const char *p) {
+        long code = 0;
+
+        for (int i = 0; i < 4; ++i) {
+                int digit = hex_digit(p[i]);
+                if (digit < 0)
+                        return -1;
+                code = (code << 4) | digit;
+        }
+
+        return code;
+}
+
+//
+// json_str - decodes a JSON string into a newly allocated buffer, returns NULL if value is NULL or not a string
+//
+static char *json_str(const char *value, size_t *len) {
+        if (!value || *value != '"')
+                return NULL;
+
+        // decoding never makes a string longer
+        char *str = NULL;
+        size_t cap = 0;
+        grow(&str, &cap, skip_value(value) - value, 1);
+
+        char *out = str;
+        for (const char *p = value + 1; *p && *p != '"'; ++p) {
+                if (*p != '\\') {
+                        *out++ = *p;
+                        continue;
+                }
+
+                switch (*++p) {
+                        case 'b': *out++ = '\b'; break;
+                        case 'f': *out++ = '\f'; break;
+                        case 'n': *out++ = '\n'; break;
+                        case 'r': *out++ = '\r'; break;
+                        case 't': *out++ = '\t'; break;
+                        case 'u': {
+                                long code = read_u_escape(p + 1);
+                                if (code < 0)
+                                        break;
+                                p += 4;
+
+                                // combine a surrogate pair
+                                if (code >= 0xD800 && code <= 0xDBFF && p[1] == '\\' && p[2] == 'u') {
+                                        long low = read_u_escape(p + 3);
+                                        if (low >= 0xDC00 && low <= 0xDFFF) {
+                                                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                                                p += 6;
+                                        }
+                                }
+
+                                if (code < 0x80) {
+                                        *out++ = code;
+                                } else if (code < 0x800) {
+                                        *out++ = 0xC0 | (code >> 6);
+                                        *out++ = 0x80 | (code & 0x3F);
+                                } else if (code < 0x10000) {
+                                        *out++ = 0xE0 | (code >> 12);
+                                        *out++ = 0x80 | ((code >> 6) & 0x3F);
+                                        *out++ = 0x80 | (code & 0x3F);
+                                } else {
+                                        *out++ = 0xF0 | (code >> 18);
+                                        *out++ = 0x80 | ((code >> 12) & 0x3F);
+                                        *out++ = 0x80 | ((code >> 6) & 0x3F);
+                                        *out++ = 0x80 | (code & 0x3F);
+                                }
+
+                                break;
+                        }
+                        case '\0':
+                                --p;
+                                break;
+                        default:
+                                *out++ = *p;
+                }
+        }
+        *out = '\0';
+
+        if (len)
+                *len = out - str;
+
+        return str;
+}
+
+//
+// out_fmt - appends formatted text to the output buffer
+//
+static void out_fmt(const char *fmt, ...) {
+        va_list arglist;
+
+        va_start(arglist, fmt);
+        int len = vsnprintf(NULL, 0, fmt, arglist);
+        va_end(arglist);
+
+        grow(&out_buf, &out_cap, out_len + len + 1, 1);
+
+        va_start(arglist, fmt);
+        vsnprintf(out_buf + out_len, len + 1, fmt, arglist);
+        va_end(arglist);
+
+        out_len += len;
+}
+
+//
+// out_str - appends a string to the output buffer as a JSON string literal
+//
+static void out_str(const char *str) {
+        out_fmt("\"");
+        for (; *str; ++str) {
+                if (*str == '"' || *str == '\\')
+                        out_fmt("\\%c", *str);
+                else if ((unsigned char)*str < 0x20)
+                        out_fmt("\\u%04x", *str);
+                else
+                        out_fmt("%c", *str);
+        }
+        out_fmt("\"");
+}
+
+//
+// send_msg - writes the output buffer to stdout as a single message
+//
+static void send_msg(void) {
+        fprintf(stdout, "Content-Length: %lu\r\n\r\n", (unsigned long)out_len);
+        fwrite(out_buf, 1, out_len, stdout);
+        fflush(stdout);
+
+        out_len = 0;
+}
+
+//
+// begin_response - starts a response to the request with the given id, the caller appends the result and ends the
+// message with a closing brace
+//
+static void begin_response(const char *id) {
+        if (!id)
+                id = "null";
+
+        out_fmt("{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"result\":", (int)(skip_value(id) - id), id);
+}
+
+//
+// read_msg - reads the body of the next message from stdin, returns NULL at the end of input
+//
+static char *read_msg(void) {
+        char header[256];
+        long content_len = -1;
+
+        while (fgets(header, sizeof(header), stdin)) {
+                if (!strcmp(header, "\r\n") || !strcmp(header, "\n")) {
+                        if (content_len < 0)
+                                continue;
+
+                        grow(&in_buf, &in_cap, content_len + 1, 1);
+                        if (fread(in_buf, 1, content_len, stdin) != (size_t)content_len)
+                                return NULL;
+                        in_buf[content_len] = '\0';
+
+                        return in_buf;
+                }
+
+                if (!strncmp(header, "Content-Length:", 15))
+                        content_len = strtol(header + 15, NULL, 10);
+        }
+
+        return NULL;
+}
+
+//
+// hash_name - FNV-1a hash of a name
+//
+static uint32_t hash_name(const char *name) {
+        uint32_t hash = 2166136261u;
+
+        while (*name)
+                hash = (hash ^ (uint8_t)*name++) * 16777619u;
+
+        return hash;
+}
+
+//
+// intern - finds the symbol for a name, adding one if the name hasn't been seen before
+//
+static uint32_t intern(Doc *doc, const char *name) {
+        // keep the table at most half full
+        if ((doc->syms_len + 1) * 2 > doc->sym_table_cap) {
+                size_t new_cap = doc->sym_table_cap ? doc->sym_table_cap * 2 : 256;
+                uint32_t *table;
+
+                if (!(table = calloc(new_cap, sizeof(uint32_t)))) {
+                        fputs(FMT_ERRMSG("failed to allocate memory for language server\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+
+                for (size_t i = 0; i < doc->syms_len; ++i) {
+                        size_t slot = hash_name(doc->names + doc->syms[i].name) & (new_cap - 1);
+                        while (table[slot])
+                                slot = (slot + 1) & (new_cap - 1);
+                        table[slot] = i + 1;
+                }
+
+                free(doc->sym_table);
+                doc->sym_table = table;
+                doc->sym_table_cap = new_cap;
+        }
+
+        size_t slot = hash_name(name) & (doc->sym_table_cap - 1);
+        for (; doc->sym_table[slot]; slot = (slot + 1) & (doc->sym_table_cap - 1))
+                if (!strcmp(doc->names + doc->syms[doc->sym_table[slot] - 1].name, name))
+                        return doc->sym_table[slot] - 1;
+
+        size_t len = strlen(name);
+        grow(&doc->names, &doc->names_cap, doc->names_len + len + 1, 1);
+        memcpy(doc->names + doc->names_len, name, len + 1);
+
+        grow(&doc->syms, &doc->syms_cap, doc->syms_len + 1, sizeof(Symbol));
+        doc->syms[doc->syms_len] = (Symbol){
+                .name = doc->names_len,
+                .len = len
+        };
+        doc->names_len += len + 1;
+
+        doc->sym_table[slot] = doc->syms_len + 1;
+
+        return doc->syms_len++;
+}
+
+//
+// is_label_tkn - checks whether a token is a label definition or reference
+//
+static bool is_label_tkn(uint8_t type) {
+        return type == NAME_LBLDEF || type == NAME_LBLREF;
+}
+
+//
+// unindex_line - removes the label occurrences on a line from the index
+//
+static void unindex_line(Doc *doc, Line *line) {
+        for (uint32_t i = 0; i < line->tkns_len; ++i) {
+                if (!is_label_tkn(line->tkns[i].type))
+                        continue;
+
+                Symbol *sym = &doc->syms[line->tkns[i].payload];
+                for (size_t j = 0; j < sym->occs_len; ++j)
+                        if (sym->occs[j].line == line && sym->occs[j].col == line->tkns[i].col) {
+                                sym->occs[j] = sym->occs[--sym->occs_len];
+                                break;
+                        }
+        }
+}
+
+//
+// lex_line - lexes a line into its own tokens and diagnostics and adds its labels to the index
+//
+static void lex_line(Doc *doc, Line *line) {
+        // at most one token per character plus the end of the stream
+        reserve_tkns(line->len + 1);
+
+        lex_set_input(line->text, line->len);
+        rewind_tkn_stream();
+        name_pool_len = 0;
+        msgs_len = msg_text_len = 0;
+
+        lex_src();
+
+        uint32_t tkns_len = tkn_types_ptr - tkn_types - 1;
+        if (!(line->tkns = malloc(sizeof(LineTkn) * (tkns_len ? tkns_len : 1)))) {
+                fputs(FMT_ERRMSG("failed to allocate memory for language server\n"), stderr);
+                panic(ERR_MALLOC_FAIL);
+        }
+        line->tkns_len = tkns_len;
+
+        uint32_t *payload = tkn_payloads;
+        for (uint32_t i = 0; i < tkns_len; ++i) {
+                LineTkn *tkn = &line->tkns[i];
+
+                tkn->type = tkn_types[i];
+                tkn->col = tkn_positions[i];
+                tkn->payload = TKN_HAS_PAYLOAD(tkn->type) ? *payload++ : 0;
+
+                // virtual registers keep their name in the arena too but aren't indexed as labels
+                if (tkn->type == NAME_REG && tkn->payload >= VREG_BASE)
+                        tkn->payload = VREG_BASE + intern(doc, name_pool + (tkn->payload - VREG_BASE));
+
+                if (!is_label_tkn(tkn->type))
+                        continue;
+
+                tkn->payload = intern(doc, name_pool + tkn->payload);
+
+                Symbol *sym = &doc->syms[tkn->payload];
+                grow(&sym->occs, &sym->occs_cap, sym->occs_len + 1, sizeof(Occurrence));
+                sym->occs[sym->occs_len++] = (Occurrence){
+                        .line = line,
+                        .col = tkn->col,
+                        .is_def = tkn->type == NAME_LBLDEF
+                };
+        }
+
+        line->msgs = NULL;
+        line->msgs_len = msgs_len;
+        if (msgs_len > 0) {
+                if (!(line->msgs = malloc(sizeof(LineMsg) * msgs_len + msg_text_len))) {
+                        fputs(FMT_ERRMSG("failed to allocate memory for language server\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+
+                // the message text is kept in the same allocation, after the messages
+                char *text = (char*)(line->msgs + msgs_len);
+                memcpy(text, msg_text, msg_text_len);
+
+                for (size_t i = 0; i < msgs_len; ++i)
+                        line->msgs[i] = (LineMsg){
+                                .type = msgs[i].type,
+                                .col = msgs[i].pos,
+                                .text = text + msgs[i].text
+                        };
+        }
+        msgs_len = msg_text_len = 0;
+}
+
+//
+// free_line - removes a line from the index and frees it
+//
+static void free_line(Doc *doc, Line *line) {
+        unindex_line(doc, line);
+
+        free(line->text);
+        free(line->tkns);
+        free(line->msgs);
+        free(line);
+}
+
+//
+// new_line - creates and lexes a line from len characters of text
+//
+static Line *new_line(Doc *doc, const char *text, size_t len) {
+        Line *line;
+
+        if (!((line = calloc(1, sizeof(Line))) && (line->text = malloc(len + 1)))) {
+                fputs(FMT_ERRMSG("failed to allocate memory for language server\n"), stderr);
+                panic(ERR_MALLOC_FAIL);
+        }
+
+        memcpy(line->text, text, len);
+        line->text[len] = '\0';
+        line->len = len;
+
+        lex_line(doc, line);
+
+        return line;
+}
+
+//
+// replace_lines - replaces lines [first, last) with the lines of prefix, text and suffix joined together, only the new
+// lines are lexed
+//
+static void replace_lines(Doc *doc, size_t first, size_t last, const char *prefix, size_t prefix_len, const char *text,
+                size_t text_len, const char *suffix, size_t suffix_len) {
+        // the prefix and suffix belong to lines which are about to be freed
+        char *joined = NULL;
+        size_t joined_cap = 0, joined_len = prefix_len + text_len + suffix_len;
+        grow(&joined, &joined_cap, joined_len + 1, 1);
+
+        memcpy(joined, prefix, prefix_len);
+        memcpy(joined + prefix_len, text, text_len);
+        memcpy(joined + prefix_len + text_len, suffix, suffix_len);
+
+        for (size_t i = first; i < last; ++i)
+                free_line(doc, doc->lines[i]);
+
+        size_t new_len = 1;
+        for (size_t i = 0; i < joined_len; ++i)
+                new_len += joined[i] == '\n';
+
+        grow(&doc->lines, &doc->lines_cap, doc->lines_len - (last - first) + new_len, sizeof(Line*));
+        memmove(doc->lines + first + new_len, doc->lines + last, (doc->lines_len - last) * sizeof(Line*));
+        doc->lines_len = doc->lines_len - (last - first) + new_len;
+
+        const char *line_start = joined, *joined_end = joined + joined_len;
+        for (size_t i = first; i < first + new_len; ++i) {
+                const char *line_end = memchr(line_start, '\n', joined_end - line_start);
+                if (!line_end)
+                        line_end = joined_end;
+
+                doc->lines[i] = new_line(doc, line_start, line_end - line_start);
+                line_start = line_end + 1;
+        }
+
+        free(joined);
+
+        for (size_t i = first; i < doc->lines_len; ++i)
+                doc->lines[i]->no = i;
+}
+
+//
+// apply_change - applies an entry of the contentChanges of a didChange notification to a document
+//
+static void apply_change(Doc *doc, const char *change) {
+        size_t text_len;
+        char *text;
+
+        if (!(text = json_str(json_get(change, "text"), &text_len)))
+                return;
+
+        const char *range = json_get(change, "range");
+        if (!range || doc->lines_len == 0) {
+                replace_lines(doc, 0, doc->lines_len, "", 0, text, text_len, "", 0);
+                free(text);
+                return;
+        }
+
+        const char *start = json_get(range, "start"), *end = json_get(range, "end");
+        size_t start_line = json_long(json_get(start, "line"), 0), start_char = json_long(json_get(start, "character"), 0);
+        size_t end_line = json_long(json_get(end, "line"), 0), end_char = json_long(json_get(end, "character"), 0);
+
+        // positions past the end of a line or of the document are clamped to it
+        if (start_line >= doc->lines_len) {
+                start_line = doc->lines_len - 1;
+                start_char = SIZE_MAX;
+        }
+        if (end_line >= doc->lines_len) {
+                end_line = doc->lines_len - 1;
+                end_char = SIZE_MAX;
+        }
+        if (end_line < start_line) {
+                end_line = start_line;
+                end_char = start_char;
+        }
+
+        Line *first = doc->lines[start_line], *last = doc->lines[end_line];
+        if (start_char > first->len)
+                start_char = first->len;
+        if (end_char > last->len)
+                end_char = last->len;
+        if (first == last && end_char < start_char)
+                end_char = start_char;
+
+        replace_lines(doc, start_line, end_line + 1, first->text, start_char, text, text_len, last->text + end_char,
+                last->len - end_char);
+        free(text);
+}
+
+//
+// find_doc - finds an open document by uri
+//
+static Doc *find_doc(const char *uri) {
+        for (Doc *doc = docs; doc; doc = doc->next)
+                if (!strcmp(doc->uri, uri))
+                        return doc;
+
+        return NULL;
+}
+
+//
+// close_doc - frees an open document
+//
+static void close_doc(Doc *doc) {
+        Doc **link = &docs;
+        while (*link != doc)
+                link = &(*link)->next;
+        *link = doc->next;
+
+        for (size_t i = 0; i < doc->lines_len; ++i)
+                free_line(doc, doc->lines[i]);
+        for (size_t i = 0; i < doc->syms_len; ++i)
+                free(doc->syms[i].occs);
+
+        free(doc->lines);
+        free(doc->names);
+        free(doc->syms);
+        free(doc->sym_table);
+        free(doc->uri);
+        free(doc);
+}
+
+//
+// pos_to_line - finds the line holding an offset in the token stream built by check_doc
+//
+static size_t pos_to_line(Doc *doc, uint32_t pos) {
+        size_t lo = 0, hi = doc->lines_len;
+
+        while (hi - lo > 1) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (line_starts[mid] <= pos)
+                        lo = mid;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+//
+// out_range - appends the range of the word at a column of a line
+//
+static void out_range(const Line *line, uint32_t col) {
+        uint32_t end = col;
+
+        while (end < line->len && ISLABELCHAR(line->text[end]))
+                ++end;
+        if (end == col && col < line->len)
+                ++end;
+
+        out_fmt("{\"start\":{\"line\":%lu,\"character\":%lu},\"end\":{\"line\":%lu,\"character\":%lu}}",
+                (unsigned long)line->no, (unsigned long)col, (unsigned long)line->no, (unsigned long)end);
+}
+
+//
+// out_diagnostic - appends a diagnostic
+//
+static void out_diagnostic(const Line *line, uint32_t col, MsgType type, const char *text, bool first) {
+        out_fmt("%s{\"range\":", first ? "" : ",");
+        out_range(line, col);
+        out_fmt(",\"severity\":%d,\"source\":\"c8asm\",\"message\":", (type == ERROR) ? 1 : 2);
+        out_str(text);
+        out_fmt("}");
+}
+
+//
+// check_doc - parses the cached tokens of a document, resolves its labels and publishes the diagnostics found along
+// with those from lexing each line
+//
+// the token stream is rebuilt from the lines with positions as offsets into the whole document, which is all the
+// parser needs, so nothing is relexed
+//
+static void check_doc(Doc *doc) {
+        size_t tkns_len = 0;
+        int lex_errors = 0;
+
+        grow(&line_starts, &line_starts_cap, doc->lines_len, sizeof(uint32_t));
+        for (size_t i = 0, pos = 0; i < doc->lines_len; ++i) {
+                line_starts[i] = pos;
+                pos += doc->lines[i]->len + 1;
+                tkns_len += doc->lines[i]->tkns_len;
+
+                for (uint32_t j = 0; j < doc->lines[i]->msgs_len; ++j)
+                        lex_errors += doc->lines[i]->msgs[j].type == ERROR;
+        }
+
+        reserve_tkns(tkns_len + 1);
+
+        rewind_tkn_stream();
+        for (size_t i = 0; i < doc->lines_len; ++i) {
+                const Line *line = doc->lines[i];
+
+                for (uint32_t j = 0; j < line->tkns_len; ++j) {
+                        const LineTkn *tkn = &line->tkns[j];
+
+                        *tkn_types_ptr++ = tkn->type;
+                        *tkn_positions_ptr++ = line_starts[i] + tkn->col;
+
+                        if (is_label_tkn(tkn->type))
+                                *tkn_payloads_ptr++ = doc->syms[tkn->payload].name;
+                        else if (tkn->type == NAME_REG && tkn->payload >= VREG_BASE)
+                                *tkn_payloads_ptr++ = VREG_BASE + doc->syms[tkn->payload - VREG_BASE].name;
+                        else if (TKN_HAS_PAYLOAD(tkn->type))
+                                *tkn_payloads_ptr++ = tkn->payload;
+                }
+        }
+
+        uint32_t end_pos = doc->lines_len ? line_starts[doc->lines_len - 1] + doc->lines[doc->lines_len - 1]->len : 0;
+        *tkn_types_ptr++ = STREAM_END;
+        *tkn_positions_ptr++ = end_pos;
+
+        // names in the token stream are offsets into the document's name arena rather than the lexer's pool
+        char *lexer_pool = name_pool;
+        name_pool = doc->names;
+
+        rewind_tkn_stream();
+        outfile_buffer_ptr = outfile_buffer;
+        label_defs_ptr = label_defs;
+        label_refs_ptr = label_refs;
+        budgets_ptr = budgets;
+        sections_ptr = sections;
+        table_positions_ptr = table_positions;
+        vreg_uses_ptr = vreg_uses;
+        stmt_has_vreg = false;
+        msgs_len = msg_text_len = 0;
+        error_count = lex_errors;
+        warning_count = 0;
+
+        parse_tkn_stream();
+        place_sections();
+        resolve_labels();
+
+        if (error_count == 0)
+                allocate_registers();
+
+        if (error_count == 0)
+                analyze_program();
+
+        name_pool = lexer_pool;
+
+        out_fmt("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":");
+        out_str(doc->uri);
+        out_fmt(",\"version\":%ld,\"diagnostics\":[", doc->version);
+
+        bool first = true;
+        for (size_t i = 0; i < doc->lines_len; ++i)
+                for (uint32_t j = 0; j < doc->lines[i]->msgs_len; ++j) {
+                        const LineMsg *msg = &doc->lines[i]->msgs[j];
+                        out_diagnostic(doc->lines[i], msg->col, msg->type, msg->text, first);
+                        first = false;
+                }
+
+        for (size_t i = 0; i < msgs_len; ++i) {
+                size_t line = pos_to_line(doc, msgs[i].pos);
+                out_diagnostic(doc->lines[line], msgs[i].pos - line_starts[line], msgs[i].type,
+                        msg_text + msgs[i].text, first);
+                first = false;
+        }
+        msgs_len = msg_text_len = 0;
+
+        out_fmt("]}}");
+        send_msg();
+}
+
+//
+// find_symbol - finds the symbol of the label token at a position in a document, returns NULL if there is no label
+// there
+//
+static Symbol *find_symbol(Doc *doc, const char *params) {
+        const char *pos = json_get(params, "position");
+        long line_no = json_long(json_get(pos, "line"), -1), col = json_long(json_get(pos, "character"), -1);
+
+        if (line_no < 0 || (size_t)line_no >= doc->lines_len || col < 0)
+                return NULL;
+
+        const Line *line = doc->lines[line_no];
+        for (uint32_t i = 0; i < line->tkns_len; ++i) {
+                const LineTkn *tkn = &line->tkns[i];
+
+                if (is_label_tkn(tkn->type) && tkn->col <= (unsigned long)col &&
+                                (unsigned long)col <= tkn->col + doc->syms[tkn->payload].len)
+                        return &doc->syms[tkn->payload];
+        }
+
+        return NULL;
+}
+
+//
+// cmp_occurrences - orders occurrences by position in the document
+//
+static int cmp_occurrences(const void *a, const void *b) {
+        const Occurrence *x = a, *y = b;
+
+        if (x->line->no != y->line->no)
+                return (x->line->no > y->line->no) - (x->line->no < y->line->no);
+
+        return (x->col > y->col) - (x->col < y->col);
+}
+
+//
+// answer_locations - responds to a definition or references request with the occurrences of the label at the
+// requested position, only definitions are included if refs is false
+//
+static void answer_locations(const char *id, const char *params, bool defs, bool refs) {
+        char *uri = json_str(json_get(json_get(params, "textDocument"), "uri"), NULL);
+        Doc *doc = uri ? find_doc(uri) : NULL;
+        Symbol *sym = doc ? find_symbol(doc, params) : NULL;
+
+        begin_response(id);
+
+        if (!sym) {
+                out_fmt("null}");
+                send_msg();
+                free(uri);
+                return;
+        }
+
+        qsort(sym->occs, sym->occs_len, sizeof(Occurrence), cmp_occurrences);
+
+        out_fmt("[");
+        bool first = true;
+        for (size_t i = 0; i < sym->occs_len; ++i) {
+                if (!(sym->occs[i].is_def ? defs : refs))
+                        continue;
+
+                out_fmt("%s{\"uri\":", first ? "" : ",");
+                out_str(doc->uri);
+                out_fmt(",\"range\":{\"start\":{\"line\":%lu,\"character\":%lu},\"end\":{\"line\":%lu,\"character\":%lu}}}",
+                        (unsigned long)sym->occs[i].line->no, (unsigned long)sym->occs[i].col,
+                        (unsigned long)sym->occs[i].line->no, (unsigned long)(sym->occs[i].col + sym->len));
+                first = false;
+        }
+        out_fmt("]}");
+
+        send_msg();
+        free(uri);
+}
+
+//
+// did_open - handles a textDocument/didOpen notification
+//
+static void did_open(const char *params) {
+        const char *item = json_get(params, "textDocument");
+        char *uri, *text;
+        size_t text_len;
+
+        if (!(uri = json_str(json_get(item, "uri"), NULL)))
+                return;
+
+        if (!(text = json_str(json_get(item, "text"), &text_len))) {
+                free(uri);
+                return;
+        }
+
+        Doc *doc;
+        if ((doc = find_doc(uri))) {
+                free(uri);
+        } else {
+                if (!(doc = calloc(1, sizeof(Doc)))) {
+                        fputs(FMT_ERRMSG("failed to allocate memory for language server\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+                doc->uri = uri;
+                doc->next = docs;
+                docs = doc;
+        }
+
+        doc->version = json_long(json_get(item, "version"), 0);
+        replace_lines(doc, 0, doc->lines_len, "", 0, text, text_len, "", 0);
+        free(text);
+
+        check_doc(doc);
+}
+
+//
+// did_change - handles a textDocument/didChange notification
+//
+static void did_change(const char *params) {
+        const char *item = json_get(params, "textDocument");
+        char *uri;
+        Doc *doc;
+
+        if (!(uri = json_str(json_get(item, "uri"), NULL)))
+                return;
+
+        doc = find_doc(uri);
+        free(uri);
+        if (!doc)
+                return;
+
+        doc->version = json_long(json_get(item, "version"), doc->version);
+
+        for (const char *change = json_first(json_get(params, "contentChanges")); change; change = json_next(change))
+                apply_change(doc, change);
+
+        check_doc(doc);
+}
+
+//
+// did_close - handles a textDocument/didClose notification, the document's diagnostics are cleared
+//
+static void did_close(const char *params) {
+        char *uri;
+        Doc *doc;
+
+        if (!(uri = json_str(json_get(json_get(params, "textDocument"), "uri"), NULL)))
+                return;
+
+        if ((doc = find_doc(uri)))
+                close_doc(doc);
+
+        out_fmt("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":");
+        out_str(uri);
+        out_fmt(",\"diagnostics\":[]}}");
+        send_msg();
+
+        free(uri);
+}
+
+//
+// run_lsp - serves the language server protocol over stdin and stdout, see lsp.h
+//
+int run_lsp(int lsp_target) {
+        int err;
+        bool shutdown = false;
+        char *body;
+
+        if ((err = setjmp(panic_env)))
+                return err;
+
+        target = lsp_target;
+        outfile_buffer = image;
+        outfile_buffer_end = image + program_words(target);
+        instr_positions = image_positions;
+
+        if (!((label_defs = malloc(sizeof(LabelDef) * LABEL_BUFFER_INIT_LEN)) &&
+                        (label_refs = malloc(sizeof(LabelRef) * LABEL_BUFFER_INIT_LEN)))) {
+                fputs(FMT_ERRMSG("failed to allocate memory for language server\n"), stderr);
+                return ERR_MALLOC_FAIL;
+        }
+        label_defs_cap = label_refs_cap = LABEL_BUFFER_INIT_LEN;
+
+        while ((body = read_msg())) {
+                const char *method = json_get(body, "method");
+                const char *id = json_get(body, "id");
+                const char *params = json_get(body, "params");
+
+                if (json_is(method, "initialize")) {
+                        begin_response(id);
+                        out_fmt("{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+                                "\"definitionProvider\":true,\"referencesProvider\":true},"
+                                "\"serverInfo\":{\"name\":\"c8asm\"}}}");
+                        send_msg();
+                } else if (json_is(method, "shutdown")) {
+                        shutdown = true;
+                        begin_response(id);
+                        out_fmt("null}");
+                        send_msg();
+                } else if (json_is(method, "exit")) {
+                        return shutdown ? SUCCESS : FAILURE;
+                } else if (json_is(method, "textDocument/didOpen")) {
+                        did_open(params);
+                } else if (json_is(method, "textDocument/didChange")) {
+                        did_change(params);
+                } else if (json_is(method, "textDocument/didClose")) {
+                        did_close(params);
+                } else if (json_is(method, "textDocument/definition")) {
+                        answer_locations(id, params, true, false);
+                } else if (json_is(method, "textDocument/references")) {
+                        bool decl = json_bool(json_get(json_get(params, "context"), "includeDeclaration"));
+                        answer_locations(id, params, decl, true);
+                } else if (method && id) {
+                        out_fmt("{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"error\":{\"code\":-32601,\"message\":\"method not found\"}}",
+                                (int)(skip_value(id) - id), id);
+                        send_msg();
+                }
+        }
+
+        return SUCCESS;
+}
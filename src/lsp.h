@@ -0,0 +1,7 @@
+#ifndef LSP_H_INCLUDED
+        #define LSP_H_INCLUDED 1
+
+        // serves the language server protocol over stdin and stdout until the client sends exit, target is one of the
+        // C8ASM_TARGET_* constants
+        extern int run_lsp(int target);
+#endif
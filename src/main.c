@@ -3,187 +3,659 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
-#include <ctype.h>
-
+#include <limits.h>
+#include <unistd.h>
+
+#include "c8asm.h"
+#include "output.h"
+#include "lsp.h"
+#include "mapfile.h"
+#include "c8bundle.h"
+#include "c8tokens.h"
+#include "c8delta.h"
+#include "shmout.h"
 #include "exitcodes.h"
 #include "ansicodes.h"
-#include "lexer.h"
-#include "parser.h"
-#include "print_msg.h"
-#include "panic.h"
 
 #define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+#define FMT_WARNMSG(msg) (BOLD(MAGENTA("warning")) ": " msg)
+
+// size of the ring of trace events, the oldest events are dropped from larger traces
+enum {TRACE_MAX_EVENTS = 1 << 18};
+
+// limits of --sandbox, each can be changed with --sandbox=NAME=N,...
+static const c8asm_limits SANDBOX_LIMITS = {
+        .src_len = 256 * 1024,
+        .tokens = 128 * 1024,
+        .labels = 4096,
+        .errors = 100,
+        .time_ms = 1000
+};
+
+#define USAGE "usage: %s [options] <chip8 asm source file> <output file name>\n" \
+              "       %s [options] --bundle=FILE <chip8 asm source file>...\n" \
+              "options:\n" \
+              "  --if-changed                  leave the output file untouched if it already holds the program\n" \
+              "  --max-errors=N                show at most N errors\n" \
+              "  --diagnostics-format=FORMAT   write diagnostics as `text` (default) or `json`\n" \
+              "  --target=TARGET               assemble for `chip8` (default) or `xochip`\n" \
+              "  --analyze                     print instruction counts, worst case paths and loop sizes per label\n" \
+              "  --path=FROM:TO                with --analyze, print the worst case path between two labels\n" \
+              "  --fold                        fold subroutines identical to an earlier one into it\n" \
+              "  --eliminate-loads             remove loads of a register with the value it already holds\n" \
+              "  -O                            inline small leaf subroutines at their calls\n" \
+              "  --inline-budget=N             with -O, keep the program within N bytes\n" \
+              "  --instrument[=16]             count entries to each label in 8 (default) or 16 bit counters\n" \
+              "  --threads=N                   parse and resolve labels on up to N threads (default 1)\n" \
+              "  --size                        print the size of the program and the memory left for the target\n" \
+              "  --lsp                         run as a language server over stdin and stdout\n" \
+              "  --trace=FILE                  write a Chrome trace of the assembler's internals to FILE\n" \
+              "  --map                         write a debug map of the program next to the output file\n" \
+              "  --delta=FILE                  write the changes from the ROM in FILE next to the output file\n" \
+              "  --sandbox[=LIMITS]            limit the source size, tokens, labels, errors and time taken\n" \
+              "  --shm=NAME                    publish the program to the shared memory object NAME\n" \
+              "  --token-cache=DIR             keep the tokens of each source in DIR to skip lexing it again\n" \
+              "  --bundle=FILE                 assemble every source given into a single ROM bundle\n" \
+              "  --bundle-list=FILE            list the ROMs in a bundle\n"
+
+//
+// write_trace - writes the events traced by a context to the file at name
+//
+static int write_trace(c8asm_ctx *ctx, const char *name) {
+        FILE *trace_file;
+
+        if (!(trace_file = fopen(name, "w"))) {
+                fprintf(stderr, FMT_ERRMSG("failed to open file `%s`\n"), name);
+                return ERR_FOPEN_FAIL;
+        }
 
-FILE *infile, *outfile;
+        int ok = c8asm_write_trace(&ctx, 1, trace_file);
+        if (fclose(trace_file) || !ok) {
+                fprintf(stderr, FMT_ERRMSG("failed to write trace to `%s`\n"), name);
+                return ERR_FWRITE_FAIL;
+        }
 
-long infile_len;
-char *outfile_name, *infile_name, *infile_buffer, *infile_buffer_ptr;
-int current_char;
-uint16_t col_count, line_count = 1;
+        return SUCCESS;
+}
 
-Token current_tkn;
-Token *tkn_stream, *tkn_stream_ptr;
+//
+// parse_limits - parses the comma separated NAME=N changes to the sandbox limits given with --sandbox=, returns 0 if
+// they are malformed
+//
+static int parse_limits(char *arg, c8asm_limits *limits) {
+        for (char *item = strtok(arg, ","); item; item = strtok(NULL, ",")) {
+                char *value = strchr(item, '='), *end;
+
+                if (!value)
+                        return 0;
+                *value++ = '\0';
+
+                long n = strtol(value, &end, 10);
+                if (end == value || *end || n < 0 || n > INT_MAX)
+                        return 0;
+
+                if (!strcmp(item, "src"))
+                        limits->src_len = n;
+                else if (!strcmp(item, "tokens"))
+                        limits->tokens = n;
+                else if (!strcmp(item, "labels"))
+                        limits->labels = n;
+                else if (!strcmp(item, "errors"))
+                        limits->errors = n;
+                else if (!strcmp(item, "time"))
+                        limits->time_ms = n;
+                else
+                        return 0;
+        }
 
-Instruction *outfile_buffer, *outfile_buffer_ptr;
+        return 1;
+}
 
-LabelRef *label_refs, *label_refs_ptr;
-LabelDef *label_defs, *label_defs_ptr;
+//
+// read_src - reads a source file into a newly allocated buffer, a file longer than max_len bytes is refused before
+// it is read unless max_len is 0
+//
+static int read_src(const char *name, size_t max_len, char **buffer, long *len) {
+        FILE *infile;
 
-ptrdiff_t label_defs_len, label_refs_len;
+        if (!(infile = fopen(name, "rb"))) {
+                fprintf(stderr, FMT_ERRMSG("failed to open file `%s`\n"), name);
+                return ERR_FOPEN_FAIL;
+        }
 
-int error_count, warning_count;
+        fseek(infile, 0, SEEK_END);
+        *len = ftell(infile);
+        rewind(infile);
 
-// defined in panic.h
-extern inline void panic(ExitCode err);
+        if (*len == 0) {
+                fprintf(stderr, FMT_ERRMSG("input file `%s` is empty\n"), name);
+                fclose(infile);
+                return ERR_EMPTY_FILE;
+        }
 
-int main(int argc, char **argv) {
-        if (argc < 2) {
-                fprintf(stderr, FMT_ERRMSG("too few arguments\nusage: %s <chip8 asm source file> <output file name>\n"),
-                        argv[0]);
-                return ERR_TOO_FEW_ARGS;
+        if (max_len && (unsigned long)*len > max_len) {
+                fprintf(stderr, FMT_ERRMSG("input file `%s` is larger than the limit of %lu bytes\n"), name,
+                        (unsigned long)max_len);
+                fclose(infile);
+                return ERR_LIMIT_SRC_LEN;
         }
 
-        infile_name = argv[1];
+        if (!(*buffer = malloc(*len))) {
+                fprintf(stderr, FMT_ERRMSG("failed to allocate memory for source file `%s`\n"), name);
+                fclose(infile);
+                return ERR_MALLOC_FAIL;
+        }
 
-        if (!(infile = fopen(argv[1], "rb"))) {
-                fprintf(stderr, FMT_ERRMSG("failed to open file `%s`\n"), infile_name);
-                return ERR_FOPEN_FAIL;
+        if (!fread(*buffer, 1, *len, infile)) {
+                fprintf(stderr, FMT_ERRMSG("failed to load source file `%s`\n"), name);
+                free(*buffer);
+                fclose(infile);
+                return ERR_FREAD_FAIL;
         }
+        fclose(infile);
 
-        fseek(infile, 0, SEEK_END);
-        infile_len = ftell(infile);
-        rewind(infile);
+        return SUCCESS;
+}
+
+//
+// load_src - reads a source file as read_src does under a trace span, which is ended whether or not it is read
+//
+static int load_src(c8asm_ctx *ctx, const char *name, size_t max_len, char **buffer, long *len) {
+        c8asm_trace_begin(ctx, "load file");
+        int err = read_src(name, max_len, buffer, len);
+        c8asm_trace_end(ctx, "load file");
 
-        if (infile_len == 0) {
-                fprintf(stderr, FMT_ERRMSG("input file `%s` is empty\n"), infile_name);
-                panic(ERR_EMPTY_FILE);
+        return err;
+}
+
+//
+// token_cache_name - builds the name of the token cache of a source in dir, caches are named after the hash of their
+// source so every copy of a library shares one, returns NULL on failure
+//
+static char *token_cache_name(const char *dir, const char *src, size_t len) {
+        char *name;
+        size_t dir_len = strlen(dir);
+
+        if (!(name = malloc(dir_len + sizeof("/0123456789abcdef.c8t"))))
+                return NULL;
+
+        sprintf(name, "%s/%016llx.c8t", dir, (unsigned long long)c8asm_src_hash(src, len));
+
+        return name;
+}
+
+//
+// assemble_cached - assembles a source with the tokens of its cache in cache_dir, a missing or stale cache is
+// replaced once the source is lexed, returns the result of assembly whether or not the cache could be written
+//
+static int assemble_cached(c8asm_ctx *ctx, const char *cache_dir, const char *src, size_t len, const uint8_t **rom,
+                size_t *rom_len) {
+        const uint8_t *cache, *tokens;
+        size_t cache_len, tokens_len;
+        char *cache_name;
+        int err;
+
+        if (!(cache_name = token_cache_name(cache_dir, src, len))) {
+                fputs(FMT_ERRMSG("failed to allocate memory for token cache name\n"), stderr);
+                return ERR_MALLOC_FAIL;
         }
 
-        if (!(infile_buffer_ptr = infile_buffer = malloc(infile_len))) {
-                fprintf(stderr, FMT_ERRMSG("failed to allocate memory for source file `%s`\n"), infile_name);
-                panic(ERR_MALLOC_FAIL);
+        c8asm_trace_begin(ctx, "map token cache");
+        err = map_file_if_exists(cache_name, &cache, &cache_len);
+        c8asm_trace_end(ctx, "map token cache");
+
+        if (err != SUCCESS) {
+                free(cache_name);
+                return err;
         }
 
-        if (!fread(infile_buffer, 1, infile_len, infile)) {
-                fprintf(stderr, FMT_ERRMSG("failed to load source file `%s`\n"), infile_name);
-                panic(ERR_FREAD_FAIL);
+        c8asm_set_token_cache(ctx, cache, cache_len);
+        err = c8asm_assemble(ctx, src, len, rom, rom_len);
+        unmap_file(cache, cache_len);
+
+        // the cache only saves lexing the source next time, so a failure to write it leaves the result as it is
+        if (!c8asm_token_cache_used(ctx) && c8asm_build_token_cache(ctx, &tokens, &tokens_len) == SUCCESS) {
+                c8asm_trace_begin(ctx, "write token cache");
+                if (write_output_quietly(cache_name, tokens, tokens_len) != SUCCESS)
+                        fprintf(stderr, FMT_WARNMSG("failed to write token cache `%s`, the source will be lexed "
+                                "again next time\n"), cache_name);
+                c8asm_trace_end(ctx, "write token cache");
         }
-        fclose(infile);
-        infile = NULL;
-
-        if (!(tkn_stream_ptr = tkn_stream = malloc(sizeof(Token) * infile_len))) {
-                fputs(FMT_ERRMSG("failed to allocate buffer for token stream\n"), stderr);
-                panic(ERR_MALLOC_FAIL);
-        }
-        
-        // start lexing
-        next_char();
-        while (current_char != EOF) {
-                if (ISDEC(current_char)) {
-                        *tkn_stream_ptr++ = lex_int();
-                } else if (current_char == SYM_COMMA || current_char == NAME_I) {
-                        *tkn_stream_ptr++ = (Token){
-                                .line = line_count,
-                                .col = col_count,
-                                .type = current_char
-                        };
-                        next_char();
-                } else if (isalpha(current_char) || current_char == '_') {
-                        *tkn_stream_ptr++ = lex_name();
-                } else if (current_char == ';') {
-                        while (!(current_char == '\n' || current_char == EOF))
-                                next_char();
-                } else {
-                        next_char();
+
+        free(cache_name);
+
+        return err;
+}
+
+//
+// assemble_file - loads and assembles a source file and reports the number of diagnostics generated and, if size is
+// set, how much of memory the program takes, *rom is owned by the context
+//
+static int assemble_file(c8asm_ctx *ctx, const char *name, int diag_format, bool size, const c8asm_limits *limits,
+                const char *cache_dir, const uint8_t **rom, size_t *rom_len) {
+        char *infile_buffer;
+        long infile_len;
+        int err;
+
+        if ((err = load_src(ctx, name, limits ? limits->src_len : 0, &infile_buffer, &infile_len)) != SUCCESS)
+                return err;
+
+        c8asm_set_src_name(ctx, name);
+        if (cache_dir)
+                err = assemble_cached(ctx, cache_dir, infile_buffer, infile_len, rom, rom_len);
+        else
+                err = c8asm_assemble(ctx, infile_buffer, infile_len, rom, rom_len);
+
+        free(infile_buffer);
+
+        if (err == ERR_FILE_TOO_LARGE)
+                fprintf(stderr, FMT_ERRMSG("input file `%s` is too large\n"), name);
+        else if (err == ERR_LIMIT_TOKENS)
+                fprintf(stderr, FMT_ERRMSG("`%s` has more than the limit of %lu tokens\n"), name,
+                        (unsigned long)limits->tokens);
+        else if (err == ERR_LIMIT_LABELS)
+                fprintf(stderr, FMT_ERRMSG("`%s` defines more than the limit of %lu labels\n"), name,
+                        (unsigned long)limits->labels);
+        else if (err == ERR_LIMIT_ERRORS)
+                fprintf(stderr, FMT_ERRMSG("assembly of `%s` stopped at the limit of %lu errors\n"), name,
+                        (unsigned long)limits->errors);
+        else if (err == ERR_LIMIT_TIME)
+                fprintf(stderr, FMT_ERRMSG("assembly of `%s` took longer than the limit of %lu ms\n"), name,
+                        (unsigned long)limits->time_ms);
+
+        // the json format carries its own counts
+        if (diag_format == C8ASM_DIAG_TEXT) {
+                if (c8asm_warning_count(ctx) > 0)
+                        fprintf(stderr, "%d warning(s) generated\n", c8asm_warning_count(ctx));
+                if (c8asm_error_count(ctx) > 0)
+                        fprintf(stderr, "%d error(s) generated\n", c8asm_error_count(ctx));
+                if (c8asm_folded_subroutines(ctx) > 0)
+                        fprintf(stderr, "%d subroutine(s) folded, %lu byte(s) reclaimed\n",
+                                c8asm_folded_subroutines(ctx), (unsigned long)c8asm_folded_bytes(ctx));
+                if (c8asm_loads_removed(ctx) > 0)
+                        fprintf(stderr, "%d redundant load(s) removed\n", c8asm_loads_removed(ctx));
+                if (c8asm_inlined_calls(ctx) > 0) {
+                        int depth_before, depth_after;
+                        c8asm_stack_depth(ctx, &depth_before, &depth_after);
+
+                        // every inlined call saves executing the call and the ret
+                        fprintf(stderr, "%d call(s) inlined, %d instruction(s) of call overhead saved, %d subroutine(s) "
+                                "removed", c8asm_inlined_calls(ctx), c8asm_inlined_calls(ctx) * 2,
+                                c8asm_inlined_subroutines(ctx));
+                        if (depth_before >= 0 && depth_after >= 0)
+                                fprintf(stderr, ", stack depth %d -> %d", depth_before, depth_after);
+                        fputc('\n', stderr);
                 }
+                if (c8asm_instrumented_labels(ctx) > 0)
+                        fprintf(stderr, "%d label(s) instrumented, counters start at 0x%X\n",
+                                c8asm_instrumented_labels(ctx), (unsigned)c8asm_counters_addr(ctx));
         }
-        (tkn_stream_ptr++)->type = STREAM_END; // finish lexing
 
-        ptrdiff_t tkns_generated = tkn_stream_ptr - tkn_stream;
-        if (!(tkn_stream = realloc(tkn_stream, sizeof(Token) * tkns_generated))) {
-                fputs(FMT_ERRMSG("failed to resize the token stream\n"), stderr);
-                panic(ERR_MALLOC_FAIL);
+        if (size && err == SUCCESS) {
+                size_t capacity = c8asm_capacity(ctx);
+
+                printf("%s: %lu of %lu bytes used, %lu bytes free (%lu%% used)\n", name, (unsigned long)*rom_len,
+                        (unsigned long)capacity, (unsigned long)(capacity - *rom_len),
+                        (unsigned long)(*rom_len * 100 / capacity));
         }
-        tkn_stream_ptr = tkn_stream + tkns_generated;
 
-        if (!(outfile_buffer_ptr = outfile_buffer = malloc(tkns_generated * sizeof(Instruction)))) {
-                fputs(FMT_ERRMSG("failed to allocate buffer for output\n"), stderr);
-                panic(ERR_MALLOC_FAIL);
+        return err;
+}
+
+//
+// write_bundle - assembles each source and writes the programs to a bundle, nothing is written if any source fails
+//
+static int write_bundle(c8asm_ctx *ctx, char **srcs, int srcs_len, const char *name, int diag_format, bool size,
+                const c8asm_limits *limits, const char *cache_dir, bool if_changed) {
+        c8asm_bundle_writer *writer;
+        int err = SUCCESS;
+
+        if (!(writer = c8asm_bundle_writer_new())) {
+                fputs(FMT_ERRMSG("failed to allocate bundle\n"), stderr);
+                return ERR_MALLOC_FAIL;
         }
 
-        if (!((label_defs_ptr = label_defs = malloc(sizeof(LabelDef) * LABEL_BUFFER_INIT_LEN)) &&
-                        (label_refs_ptr = label_refs = malloc(sizeof(LabelRef) * LABEL_BUFFER_INIT_LEN)))) {
-                fputs(FMT_ERRMSG("failed to allocate buffer for label table(s)\n"), stderr);
-                panic(ERR_MALLOC_FAIL);
+        // every source is assembled so all of their diagnostics are reported
+        for (int i = 0; i < srcs_len; ++i) {
+                const uint8_t *rom;
+                size_t rom_len;
+                int src_err = assemble_file(ctx, srcs[i], diag_format, size, limits, cache_dir, &rom, &rom_len);
+                if (src_err == SUCCESS && (src_err = c8asm_bundle_add(writer, srcs[i], rom, rom_len)) != SUCCESS)
+                        fprintf(stderr, FMT_ERRMSG("failed to add `%s` to bundle\n"), srcs[i]);
+
+                if (err == SUCCESS)
+                        err = src_err;
         }
 
-        // start parsing
-        tkn_stream_ptr = tkn_stream;
-        parse_tkn_stream(); // finish parsing
+        const uint8_t *bundle;
+        size_t bundle_len;
 
-        // check that label definitions are unique
-        label_defs_len = label_defs_ptr - label_defs;
-        for (int i = 0; i < label_defs_len; ++i)
-                for (int j = i + 1; j < label_defs_len; ++j)
-                        if (!strcmp(label_defs[i].label_text, label_defs[j].label_text)) {
-                                print_msg(ERROR, label_defs[j].line, label_defs[j].col,
-                                        "multiple definition of label `%s`", label_defs[j].label_text);
-                                ++error_count;
-                        }
+        if (err == SUCCESS && (err = c8asm_bundle_finish(writer, &bundle, &bundle_len)) != SUCCESS)
+                fprintf(stderr, (err == ERR_INVALID_ARG) ? FMT_ERRMSG("a source was given more than once\n") :
+                        FMT_ERRMSG("failed to lay out bundle\n"));
 
-        // resolve label references
-        uint8_t *instr_ptr;
-        bool found_ref;
+        if (err == SUCCESS) {
+                c8asm_trace_begin(ctx, "write output");
+                err = write_output(name, bundle, bundle_len, if_changed);
+                c8asm_trace_end(ctx, "write output");
+        }
 
-        label_refs_len = label_refs_ptr - label_refs;
-        for (int i = 0; i < label_refs_len; ++i) {
-                found_ref = false;
-                for (int j = 0; j < label_defs_len; ++j)
-                        if (!strcmp(label_refs[i].label_text, label_defs[j].label_text)) {
-                                found_ref = true;
+        c8asm_bundle_writer_free(writer);
 
-                                instr_ptr = (uint8_t*)label_refs[i].output_pos;
+        return err;
+}
 
-                                instr_ptr[0] |= ((label_defs[j].c8_addr & 0xF00) >> 8);
-                                instr_ptr[1] = label_defs[j].c8_addr & 0x0FF;
-                        }
+//
+// sibling_name - names a file next to the output file by replacing the extension of the output file, if it has one,
+// returns NULL on failure
+//
+static char *sibling_name(const char *outfile_name, const char *new_ext) {
+        const char *base = strrchr(outfile_name, '/') ? strrchr(outfile_name, '/') + 1 : outfile_name;
+        const char *ext = strrchr(base, '.');
+        size_t stem_len = (ext && ext != base) ? (size_t)(ext - outfile_name) : strlen(outfile_name);
+
+        char *name;
+        if (!(name = malloc(stem_len + strlen(new_ext) + 1)))
+                return NULL;
+        memcpy(name, outfile_name, stem_len);
+        strcpy(name + stem_len, new_ext);
+
+        return name;
+}
 
-                if (!found_ref) {
-                        print_msg(ERROR, label_refs[i].line, label_refs[i].col, "undefined reference to label `%s`",
-                                label_refs[i].label_text);
-                        ++error_count;
-                }
+//
+// write_map - writes the debug map of the program last assembled next to the output file, out.ch8 gets out.map
+//
+static int write_map(c8asm_ctx *ctx, const char *outfile_name, bool if_changed) {
+        const uint8_t *map;
+        size_t map_len;
+        int err;
+
+        if ((err = c8asm_build_map(ctx, &map, &map_len)) != SUCCESS) {
+                fputs(FMT_ERRMSG("failed to build debug map\n"), stderr);
+                return err;
         }
 
-        if (warning_count > 0)
-                fprintf(stderr, "%d warning(s) generated\n", warning_count);
-        if (error_count > 0) {
-                fprintf(stderr, "%d error(s) generated\n", error_count);
-                panic(FAILURE);
+        char *map_name;
+        if (!(map_name = sibling_name(outfile_name, ".map"))) {
+                fputs(FMT_ERRMSG("failed to build debug map\n"), stderr);
+                return ERR_MALLOC_FAIL;
         }
 
-        outfile_name = (argc > 2) ? argv[2] : "out.ch8";
-        if (!(outfile = fopen(outfile_name, "wb"))) {
-                fprintf(stderr, FMT_ERRMSG("failed to open output file `%s` for writing\n"), outfile_name);
-                panic(ERR_FOPEN_FAIL);
+        err = write_output(map_name, map, map_len, if_changed);
+        free(map_name);
+
+        return err;
+}
+
+//
+// write_delta - writes the changes from the ROM in old_name to the program next to the output file, out.ch8 gets
+// out.delta, this runs before the output is written so the old ROM may be the output file
+//
+static int write_delta(const char *old_name, const char *outfile_name, const uint8_t *rom, size_t rom_len,
+                int diag_format, bool if_changed) {
+        const uint8_t *old;
+        size_t old_len;
+        uint8_t *delta;
+        size_t delta_len;
+        int err;
+
+        if ((err = map_file(old_name, &old, &old_len)) != SUCCESS)
+                return err;
+
+        err = c8asm_delta_build(old, old_len, rom, rom_len, &delta, &delta_len);
+        unmap_file(old, old_len);
+
+        if (err != SUCCESS) {
+                fprintf(stderr, (err == ERR_FILE_TOO_LARGE) ? FMT_ERRMSG("`%s` is too large to be a ROM\n") :
+                        FMT_ERRMSG("failed to build delta from `%s`\n"), old_name);
+                return err;
         }
 
-        // write the assembled chip8 code to disk
-        fwrite(outfile_buffer, sizeof(Instruction), outfile_buffer_ptr - outfile_buffer, outfile);
+        char *delta_name;
+        if (!(delta_name = sibling_name(outfile_name, ".delta"))) {
+                fprintf(stderr, FMT_ERRMSG("failed to build delta from `%s`\n"), old_name);
+                free(delta);
+                return ERR_MALLOC_FAIL;
+        }
 
-        // cleanup and exit
-        for (int i = 0; i < label_defs_len; ++i)
-                free(label_defs[i].label_text);
+        if ((err = write_output(delta_name, delta, delta_len, if_changed)) == SUCCESS &&
+                        diag_format == C8ASM_DIAG_TEXT)
+                fprintf(stderr, "delta from `%s` is %lu byte(s) for a %lu byte program\n", old_name,
+                        (unsigned long)delta_len, (unsigned long)rom_len);
 
-        for (int i = 0; i < label_refs_len; ++i)
-                free(label_refs[i].label_text);
+        free(delta_name);
+        free(delta);
 
-        free(tkn_stream);
-        free(outfile_buffer);
-        free(label_defs);
-        free(label_refs);
+        return err;
+}
+
+//
+// list_bundle - prints the ROMs held in a bundle in index order
+//
+static int list_bundle(const char *name) {
+        const uint8_t *data;
+        size_t len;
+        c8asm_bundle bundle;
+        int err;
+
+        if ((err = map_file(name, &data, &len)) != SUCCESS)
+                return err;
+
+        if (!c8asm_bundle_open(&bundle, data, len)) {
+                fprintf(stderr, FMT_ERRMSG("`%s` is not a valid ROM bundle\n"), name);
+                unmap_file(data, len);
+                return ERR_INVALID_ARG;
+        }
+
+        printf("%lu ROM(s)\n", (unsigned long)bundle.count);
+        for (uint32_t i = 0; i < bundle.count; ++i) {
+                const char *rom_name;
+                const uint8_t *rom;
+                size_t rom_len;
+
+                c8asm_bundle_entry(&bundle, i, &rom_name, &rom, &rom_len);
+                printf("%8lu  0x%08lx  %s\n", (unsigned long)rom_len, (unsigned long)(rom - bundle.data), rom_name);
+        }
 
-        fclose(outfile);
+        unmap_file(data, len);
 
         return SUCCESS;
 }
+
+int main(int argc, char **argv) {
+        char *srcs[argc];
+        int srcs_len = 0;
+        bool if_changed = false;
+        int diag_format = C8ASM_DIAG_TEXT, max_errors = 0;
+        int target = C8ASM_TARGET_CHIP8;
+        bool analyze = false, lsp = false, map = false, fold = false, size = false, eliminate_loads = false;
+        bool inline_leaves = false;
+        long inline_budget = 0;
+        int counter_bits = 0;
+        long threads = 1;
+        char *path_from = NULL, *path_to = NULL;
+        char *trace_name = NULL, *bundle_name = NULL, *shm_name = NULL, *cache_dir = NULL, *delta_name = NULL;
+        c8asm_limits sandbox_limits = SANDBOX_LIMITS;
+        const c8asm_limits *limits = NULL;
+
+        for (int i = 1; i < argc; ++i) {
+                if (!strcmp(argv[i], "--if-changed")) {
+                        if_changed = true;
+                } else if (!strncmp(argv[i], "--max-errors=", 13)) {
+                        char *end;
+                        long n = strtol(argv[i] + 13, &end, 10);
+                        if (end == argv[i] + 13 || *end || n < 0 || n > INT_MAX) {
+                                fprintf(stderr, FMT_ERRMSG("invalid value for `--max-errors`\n"));
+                                return ERR_INVALID_ARG;
+                        }
+                        max_errors = n;
+                } else if (!strcmp(argv[i], "--diagnostics-format=text")) {
+                        diag_format = C8ASM_DIAG_TEXT;
+                } else if (!strcmp(argv[i], "--diagnostics-format=json")) {
+                        diag_format = C8ASM_DIAG_JSON;
+                } else if (!strcmp(argv[i], "--target=chip8")) {
+                        target = C8ASM_TARGET_CHIP8;
+                } else if (!strcmp(argv[i], "--target=xochip")) {
+                        target = C8ASM_TARGET_XOCHIP;
+                } else if (!strcmp(argv[i], "--analyze")) {
+                        analyze = true;
+                } else if (!strcmp(argv[i], "--fold")) {
+                        fold = true;
+                } else if (!strcmp(argv[i], "--eliminate-loads")) {
+                        eliminate_loads = true;
+                } else if (!strcmp(argv[i], "-O")) {
+                        inline_leaves = true;
+                } else if (!strncmp(argv[i], "--inline-budget=", 16)) {
+                        char *end;
+                        inline_budget = strtol(argv[i] + 16, &end, 10);
+                        if (end == argv[i] + 16 || *end || inline_budget <= 0 || inline_budget > INT_MAX) {
+                                fprintf(stderr, FMT_ERRMSG("invalid value for `--inline-budget`\n"));
+                                return ERR_INVALID_ARG;
+                        }
+                } else if (!strcmp(argv[i], "--instrument") || !strcmp(argv[i], "--instrument=8")) {
+                        counter_bits = 8;
+                } else if (!strcmp(argv[i], "--instrument=16")) {
+                        counter_bits = 16;
+                } else if (!strcmp(argv[i], "--size")) {
+                        size = true;
+                } else if (!strncmp(argv[i], "--trace=", 8) && argv[i][8]) {
+                        trace_name = argv[i] + 8;
+                } else if (!strncmp(argv[i], "--bundle=", 9) && argv[i][9]) {
+                        bundle_name = argv[i] + 9;
+                } else if (!strncmp(argv[i], "--bundle-list=", 14) && argv[i][14]) {
+                        return list_bundle(argv[i] + 14);
+                } else if (!strcmp(argv[i], "--sandbox")) {
+                        limits = &sandbox_limits;
+                } else if (!strncmp(argv[i], "--sandbox=", 10)) {
+                        if (!parse_limits(argv[i] + 10, &sandbox_limits)) {
+                                fputs(FMT_ERRMSG("expected `--sandbox=NAME=N,...` with names `src`, `tokens`, "
+                                        "`labels`, `errors` and `time`\n"), stderr);
+                                return ERR_INVALID_ARG;
+                        }
+                        limits = &sandbox_limits;
+                } else if (!strncmp(argv[i], "--shm=", 6) && argv[i][6]) {
+                        shm_name = argv[i] + 6;
+                } else if (!strncmp(argv[i], "--token-cache=", 14) && argv[i][14]) {
+                        cache_dir = argv[i] + 14;
+                } else if (!strncmp(argv[i], "--delta=", 8) && argv[i][8]) {
+                        delta_name = argv[i] + 8;
+                } else if (!strcmp(argv[i], "--map")) {
+                        map = true;
+                } else if (!strcmp(argv[i], "--lsp")) {
+                        lsp = true;
+                } else if (!strncmp(argv[i], "--path=", 7)) {
+                        path_from = argv[i] + 7;
+                        if (!(path_to = strchr(path_from, ':'))) {
+                                fputs(FMT_ERRMSG("expected `--path=FROM:TO`\n"), stderr);
+                                return ERR_INVALID_ARG;
+                        }
+                        *path_to++ = '\0';
+                } else if (!strncmp(argv[i], "--threads=", 10)) {
+                        char *end;
+                        threads = strtol(argv[i] + 10, &end, 10);
+                        if (end == argv[i] + 10 || *end || threads < 1 || threads > C8ASM_MAX_THREADS) {
+                                fprintf(stderr, FMT_ERRMSG("invalid value for `--threads`, expected 1-%d\n"),
+                                        C8ASM_MAX_THREADS);
+                                return ERR_INVALID_ARG;
+                        }
+                } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+                        fprintf(stderr, FMT_ERRMSG("unknown option `%s`\n" USAGE), argv[i], argv[0], argv[0]);
+                        return ERR_INVALID_ARG;
+                } else {
+                        srcs[srcs_len++] = argv[i];
+                }
+        }
+
+        if (lsp)
+                return run_lsp(target);
+
+        if (srcs_len == 0) {
+                fprintf(stderr, FMT_ERRMSG("too few arguments\n" USAGE), argv[0], argv[0]);
+                return ERR_TOO_FEW_ARGS;
+        }
+
+        // without a bundle the second name is the output file
+        if (!bundle_name && srcs_len > 2) {
+                fprintf(stderr, FMT_ERRMSG("too many arguments\n" USAGE), argv[0], argv[0]);
+                return ERR_INVALID_ARG;
+        }
+
+        if (bundle_name && map) {
+                fputs(FMT_ERRMSG("`--map` can't be used with `--bundle`\n"), stderr);
+                return ERR_INVALID_ARG;
+        }
+
+        if (bundle_name && shm_name) {
+                fputs(FMT_ERRMSG("`--shm` can't be used with `--bundle`\n"), stderr);
+                return ERR_INVALID_ARG;
+        }
+
+        if (bundle_name && delta_name) {
+                fputs(FMT_ERRMSG("`--delta` can't be used with `--bundle`\n"), stderr);
+                return ERR_INVALID_ARG;
+        }
+
+        // with --shm an output file is only written if one is named
+        if (shm_name && (map || delta_name) && srcs_len < 2) {
+                fprintf(stderr, FMT_ERRMSG("`%s` needs an output file with `--shm`\n"), map ? "--map" : "--delta");
+                return ERR_INVALID_ARG;
+        }
+
+        c8asm_ctx *ctx;
+        if (!(ctx = c8asm_ctx_new()) || (trace_name && !c8asm_set_trace(ctx, TRACE_MAX_EVENTS))) {
+                fputs(FMT_ERRMSG("failed to allocate assembler context\n"), stderr);
+                c8asm_ctx_free(ctx);
+                return ERR_MALLOC_FAIL;
+        }
+        c8asm_set_diagnostics(ctx, diag_format, max_errors);
+        c8asm_set_target(ctx, target);
+        c8asm_set_analysis(ctx, analyze, path_from, path_to);
+        c8asm_set_fold(ctx, fold);
+        c8asm_set_eliminate_loads(ctx, eliminate_loads);
+        c8asm_set_inline(ctx, inline_leaves, inline_budget);
+        c8asm_set_instrument(ctx, counter_bits);
+        c8asm_set_limits(ctx, limits);
+
+        // threads beyond the processors online only take turns, which is slower than parsing on one
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        c8asm_set_threads(ctx, (cpus >= 1 && threads > cpus) ? cpus : threads);
+
+        int err;
+
+        if (bundle_name) {
+                err = write_bundle(ctx, srcs, srcs_len, bundle_name, diag_format, size, limits, cache_dir,
+                        if_changed);
+        } else {
+                const char *outfile_name = (srcs_len > 1) ? srcs[1] : "out.ch8";
+                const uint8_t *rom;
+                size_t rom_len;
+
+                // write the assembled chip8 code to disk, shared memory or both
+                err = assemble_file(ctx, srcs[0], diag_format, size, limits, cache_dir, &rom, &rom_len);
+                if (err == SUCCESS) {
+                        c8asm_trace_begin(ctx, "write output");
+                        if (delta_name)
+                                err = write_delta(delta_name, outfile_name, rom, rom_len, diag_format, if_changed);
+                        if (err == SUCCESS && shm_name)
+                                err = write_shm(shm_name, rom, rom_len);
+                        if (err == SUCCESS && (!shm_name || srcs_len > 1))
+                                err = write_output(outfile_name, rom, rom_len, if_changed);
+                        if (err == SUCCESS && map)
+                                err = write_map(ctx, outfile_name, if_changed);
+                        c8asm_trace_end(ctx, "write output");
+                }
+        }
+
+        // the trace is written even if assembly failed, a failure to write it only matters if nothing else failed
+        if (trace_name) {
+                int trace_err = write_trace(ctx, trace_name);
+                if (err == SUCCESS)
+                        err = trace_err;
+        }
+
+        // cleanup and exit
+        c8asm_ctx_free(ctx);
+
+        return err;
+}
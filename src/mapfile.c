@@ -0,0 +1,84 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapfile.h"
+#include "exitcodes.h"
+#include "ansicodes.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+//
+// map_fd - maps the file at name opened as fd read only and closes it, a negative fd is a failure to open it
+//
+static int map_fd(const char *name, int fd, const uint8_t **data, size_t *len) {
+        struct stat st;
+
+        if (fd < 0) {
+                fprintf(stderr, FMT_ERRMSG("failed to open file `%s`\n"), name);
+                return ERR_FOPEN_FAIL;
+        }
+
+        if (fstat(fd, &st)) {
+                fprintf(stderr, FMT_ERRMSG("failed to load file `%s`\n"), name);
+                close(fd);
+                return ERR_FREAD_FAIL;
+        }
+
+        *data = NULL;
+        *len = st.st_size;
+
+        if (*len > 0) {
+                void *map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                if (map == MAP_FAILED) {
+                        fprintf(stderr, FMT_ERRMSG("failed to map file `%s`\n"), name);
+                        close(fd);
+                        return ERR_FREAD_FAIL;
+                }
+                *data = map;
+        }
+
+        // the mapping stays valid once the descriptor is closed
+        close(fd);
+
+        return SUCCESS;
+}
+
+//
+// map_file - maps the file at name read only, an empty file gives a NULL mapping of length 0, returns an ExitCode
+//
+int map_file(const char *name, const uint8_t **data, size_t *len) {
+        return map_fd(name, open(name, O_RDONLY), data, len);
+}
+
+//
+// map_file_if_exists - maps the file at name like map_file, a missing file isn't an error and also gives a NULL
+// mapping of length 0
+//
+int map_file_if_exists(const char *name, const uint8_t **data, size_t *len) {
+        int fd = open(name, O_RDONLY);
+
+        if (fd < 0 && errno == ENOENT) {
+                *data = NULL;
+                *len = 0;
+                return SUCCESS;
+        }
+
+        return map_fd(name, fd, data, len);
+}
+
+//
+// unmap_file - unmaps a file mapped with map_file
+//
+void unmap_file(const uint8_t *data, size_t len) {
+        if (data)
+                munmap((void*)data, len);
+}
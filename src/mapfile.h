@@ -0,0 +1,10 @@
+#ifndef MAPFILE_H_INCLUDED
+        #define MAPFILE_H_INCLUDED 1
+
+        #include <stddef.h>
+        #include <stdint.h>
+
+        extern int map_file(const char *name, const uint8_t **data, size_t *len);
+        extern int map_file_if_exists(const char *name, const uint8_t **data, size_t *len);
+        extern void unmap_file(const uint8_t *data, size_t len);
+#endif
@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "output.h"
+#include "exitcodes.h"
+#include "ansicodes.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+//
+// is_unchanged - checks whether the file at name already holds exactly len bytes of buf, sizes are compared first
+// so the file is only read when it could match
+//
+static bool is_unchanged(const char *name, const uint8_t *buf, size_t len) {
+        struct stat st;
+        if (stat(name, &st) || !S_ISREG(st.st_mode) || (size_t)st.st_size != len)
+                return false;
+
+        int fd;
+        if ((fd = open(name, O_RDONLY)) < 0)
+                return false;
+
+        uint8_t *old_buf;
+        if (!(old_buf = malloc(len + 1))) {
+                close(fd);
+                return false;
+        }
+
+        size_t read_len = 0;
+        ssize_t n;
+        while (read_len <= len && (n = read(fd, old_buf + read_len, len + 1 - read_len)) > 0)
+                read_len += n;
+        close(fd);
+
+        bool unchanged = read_len == len && !memcmp(old_buf, buf, len);
+        free(old_buf);
+
+        return unchanged;
+}
+
+//
+// write_file - writes the image to a temporary file next to name and renames it into place so the output is never
+// seen half written, if if_changed is set and the file already holds the image then it is left untouched, failures
+// are reported if report is set
+//
+static int write_file(const char *name, const uint8_t *buf, size_t len, bool if_changed, bool report) {
+        if (if_changed && is_unchanged(name, buf, len))
+                return SUCCESS;
+
+        // keep the mode of an existing file, otherwise create it as fopen would
+        mode_t mode;
+        struct stat st;
+        if (!stat(name, &st)) {
+                mode = st.st_mode & 07777;
+        } else {
+                mode_t mask = umask(0);
+                umask(mask);
+                mode = 0666 & ~mask;
+        }
+
+        char *tmp_name;
+        size_t name_len = strlen(name);
+        if (!(tmp_name = malloc(name_len + sizeof(".XXXXXX")))) {
+                if (report)
+                        fputs(FMT_ERRMSG("failed to allocate memory for temporary file name\n"), stderr);
+                return ERR_MALLOC_FAIL;
+        }
+        memcpy(tmp_name, name, name_len);
+        memcpy(tmp_name + name_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+        int fd;
+        if ((fd = mkstemp(tmp_name)) < 0) {
+                if (report)
+                        fprintf(stderr, FMT_ERRMSG("failed to open output file `%s` for writing\n"), name);
+                free(tmp_name);
+                return ERR_FOPEN_FAIL;
+        }
+
+        // the whole image is written with a single call, the loop only continues after a short write
+        size_t written = 0;
+        ssize_t n;
+        while (written < len && ((n = write(fd, buf + written, len - written)) > 0 || (n < 0 && errno == EINTR)))
+                if (n > 0)
+                        written += n;
+
+        bool failed = written < len || fchmod(fd, mode);
+        if (close(fd))
+                failed = true;
+
+        if (failed) {
+                if (report)
+                        fprintf(stderr, FMT_ERRMSG("failed to write output file `%s`\n"), name);
+                unlink(tmp_name);
+                free(tmp_name);
+                return ERR_FWRITE_FAIL;
+        }
+
+        if (rename(tmp_name, name)) {
+                if (report)
+                        fprintf(stderr, FMT_ERRMSG("failed to replace output file `%s`\n"), name);
+                unlink(tmp_name);
+                free(tmp_name);
+                return ERR_FWRITE_FAIL;
+        }
+
+        free(tmp_name);
+
+        return SUCCESS;
+}
+
+//
+// write_output - writes the image to the file at name as write_file does and reports any failure
+//
+int write_output(const char *name, const uint8_t *buf, size_t len, bool if_changed) {
+        return write_file(name, buf, len, if_changed, true);
+}
+
+//
+// write_output_quietly - writes the image to the file at name as write_file does without reporting failures, for
+// files whose loss the caller can recover from
+//
+int write_output_quietly(const char *name, const uint8_t *buf, size_t len) {
+        return write_file(name, buf, len, false, false);
+}
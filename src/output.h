@@ -0,0 +1,10 @@
+#ifndef OUTPUT_H_INCLUDED
+        #define OUTPUT_H_INCLUDED 1
+
+        #include <stddef.h>
+        #include <stdint.h>
+        #include <stdbool.h>
+
+        extern int write_output(const char *name, const uint8_t *buf, size_t len, bool if_changed);
+        extern int write_output_quietly(const char *name, const uint8_t *buf, size_t len);
+#endif
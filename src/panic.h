@@ -1,42 +1,18 @@
 #ifndef PANIC_H_INCLUDED
         #define PANIC_H_INCLUDED 1
         
-        #include <stdlib.h>
-        #include <stddef.h>
-        #include <stdio.h>        
+        #include <setjmp.h>
 
-        #include "parser.h"
-        #include "lexer.h"
+        #include "threadlocal.h"
         #include "exitcodes.h"
 
-        extern FILE *infile;
-        extern ptrdiff_t label_defs_len, label_refs_len;
+        extern THREAD_LOCAL jmp_buf panic_env;
 
         //
-        // frees resources and calls exit with an ExitCode
+        // abandons assembly and returns an ExitCode from c8asm_assemble, buffers are owned by the assembler context
+        // and c8asm_assemble frees any scratch buffers a pass left behind, see alloc.h
         //
         inline void panic(ExitCode err) {
-                if (label_defs_len > 0)
-                        for (int i = 0; i < label_defs_len; ++i)
-                                free(label_defs[i].label_text);
-
-                if (label_refs_len > 0)
-                        for (int i = 0; i < label_refs_len; ++i)
-                                free(label_refs[i].label_text);
-
-                if (infile_buffer)
-                        free(infile_buffer);
-                if (tkn_stream)
-                        free(tkn_stream);
-                if (label_defs)
-                        free(label_defs);
-                if (label_refs)
-                        free(label_refs);
-                if (outfile_buffer)
-                        free(outfile_buffer);
-                if (infile)
-                        fclose(infile);
-
-                exit(err);
+                longjmp(panic_env, err);
         }
 #endif
@@ -0,0 +1,570 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "lexer.h"
+#include "parser.h"
+#include "expr.h"
+#include "print_msg.h"
+#include "sandbox.h"
+#include "trace.h"
+#include "alloc.h"
+#include "panic.h"
+#include "parallel.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+THREAD_LOCAL int parse_threads;
+
+// what count_tokens counts, each in a COUNT_BITS wide field of one word so a token is counted with a single add, a run
+// of at most COUNT_RUN tokens can't carry from one field into the next
+enum {COUNT_PAYLOADS, COUNT_WORDS, COUNT_TABLES, COUNT_DEFS, COUNT_REFS, COUNTS};
+enum {COUNT_BITS = 12, COUNT_RUN = (1 << COUNT_BITS) - 1};
+
+// the state of the assembling thread a worker needs, workers start with none of the thread local state of their own
+typedef struct {
+        uint8_t *tkn_types;
+        uint32_t *tkn_positions, *tkn_payloads;
+        char *name_pool;
+        Target target;
+        uint64_t limit_deadline;
+
+        Instruction *outfile_buffer;
+        uint32_t *instr_positions;
+        LabelDef *label_defs, *label_defs_ptr;
+
+        uint64_t tkn_counts[UINT8_MAX + 1]; // what each token type adds to the counts of count_tokens
+} Shared;
+
+// a run of the token stream parsed on one thread, or of the label references patched on one thread, what a worker
+// builds is held here until the assembling thread merges it
+typedef struct {
+        const Shared *shared;
+
+        // tokens of the slice, it starts at a mnemonic and ends before the next slice's
+        const uint8_t *types, *types_end;
+        uint32_t *payloads;
+        size_t payloads_len;
+
+        // words parsed into a buffer of the slice's own, addresses are from the start of the slice until it is placed
+        Instruction *words;
+        uint32_t *word_positions;
+        uint32_t words_len, max_words, offset;
+        size_t max_defs, max_refs;
+        bool keeps_code; // no earlier slice opened a section, so a `code` section it opens starts the program
+
+        LabelRef *refs;
+        ptrdiff_t refs_len;
+        LabelDef *defs;
+        ptrdiff_t defs_len;
+        Budget *budgets;
+        ptrdiff_t budgets_len;
+        Section *sections;
+        ptrdiff_t sections_len;
+        uint32_t *table_positions;
+        ptrdiff_t table_positions_len;
+        VregUse *vreg_uses;
+        ptrdiff_t vreg_uses_len;
+
+        Msg *msgs;
+        size_t msgs_len;
+        char *msg_text;
+        size_t msg_text_len;
+        int error_count, warning_count;
+
+        bool overran; // a statement ran past the end of the slice or its buffer, which only a sequential parse reports
+        int err;      // ExitCode of a panic on the worker, or SUCCESS
+} Slice;
+
+//
+// run_workers - runs work on a thread for each slice and waits for all of them, returns false if a thread couldn't be
+// started, after waiting for the ones which were
+//
+static bool run_workers(Slice *slices, int slices_len, void *(*work)(void*)) {
+        pthread_t threads[PARALLEL_MAX_THREADS];
+        int started = 0;
+
+        while (started < slices_len && !pthread_create(&threads[started], NULL, work, &slices[started]))
+                ++started;
+
+        for (int i = 0; i < started; ++i)
+                pthread_join(threads[i], NULL);
+
+        return started == slices_len;
+}
+
+//
+// take_msgs - moves the diagnostics collected on a worker and its error and warning counts to its slice
+//
+static void take_msgs(Slice *slice) {
+        slice->msgs = msgs;
+        slice->msgs_len = msgs_len;
+        slice->msg_text = msg_text;
+        slice->msg_text_len = msg_text_len;
+        slice->error_count = error_count;
+        slice->warning_count = warning_count;
+}
+
+//
+// free_slices - frees what the workers built for each slice, then the slices
+//
+static void free_slices(Slice *slices, int slices_len) {
+        for (int i = 0; i < slices_len; ++i) {
+                free(slices[i].refs);
+                free(slices[i].defs);
+                free(slices[i].budgets);
+                free(slices[i].sections);
+                free(slices[i].table_positions);
+                free(slices[i].vreg_uses);
+                free(slices[i].msgs);
+                free(slices[i].msg_text);
+                free_scratch(slices[i].words);
+                free_scratch(slices[i].word_positions);
+        }
+
+        free_scratch(slices);
+}
+
+//
+// free_slice_msgs - frees the diagnostics collected for each slice, then the slices, for slices of label references
+// which belong to the assembling thread
+//
+static void free_slice_msgs(Slice *slices, int slices_len) {
+        for (int i = 0; i < slices_len; ++i) {
+                free(slices[i].msgs);
+                free(slices[i].msg_text);
+        }
+
+        free_scratch(slices);
+}
+
+//
+// count_tokens - counts the tokens of a slice which carry a payload, the words it can take and the labels it can
+// define and refer to, run on a worker
+//
+// every mnemonic takes a word and `long` another, a table can take all of memory, a statement which takes a word
+// without a mnemonic is an error which runs the slice past the end of its buffer and so is left to a sequential parse
+//
+static void *count_tokens(void *arg) {
+        Slice *slice = arg;
+        const uint64_t *tkn_counts = slice->shared->tkn_counts;
+        uint32_t mem_words = program_words(slice->shared->target);
+        size_t counts[COUNTS] = {0};
+
+        for (const uint8_t *type = slice->types; type < slice->types_end; ) {
+                const uint8_t *run_end = (slice->types_end - type > COUNT_RUN) ? type + COUNT_RUN : slice->types_end;
+                uint64_t run_counts = 0;
+
+                while (type < run_end)
+                        run_counts += tkn_counts[*type++];
+
+                for (int i = 0; i < COUNTS; ++i)
+                        counts[i] += (run_counts >> (i * COUNT_BITS)) & COUNT_RUN;
+        }
+
+        slice->payloads_len = counts[COUNT_PAYLOADS];
+        slice->max_words = (counts[COUNT_WORDS] < mem_words && !counts[COUNT_TABLES]) ? counts[COUNT_WORDS] : mem_words;
+        slice->max_defs = counts[COUNT_DEFS];
+        slice->max_refs = counts[COUNT_REFS];
+
+        return NULL;
+}
+
+//
+// parse_slice - parses the statements of a slice into its own buffers, run on a worker
+//
+static void *parse_slice(void *arg) {
+        Slice *slice = arg;
+        const Shared *shared = slice->shared;
+        uint32_t overflow_words = 0, overflow_pos = 0;
+
+        tkn_types = shared->tkn_types;
+        tkn_positions = shared->tkn_positions;
+        tkn_payloads = shared->tkn_payloads;
+        tkn_types_ptr = (uint8_t*)slice->types;
+        tkn_positions_ptr = tkn_positions + (slice->types - tkn_types);
+        tkn_payloads_ptr = slice->payloads;
+
+        name_pool = shared->name_pool;
+        target = shared->target;
+        limit_deadline = shared->limit_deadline;
+
+        // the slice is parsed as if it started the program, placing it moves every address it took
+        outfile_buffer_ptr = outfile_buffer = slice->words;
+        outfile_buffer_end = outfile_buffer + slice->max_words;
+        instr_positions = slice->word_positions;
+
+        if (!(slice->err = setjmp(panic_env))) {
+                // the tables start with room for every label the slice names so they are never grown
+                label_defs_cap = (slice->max_defs > LABEL_BUFFER_INIT_LEN) ? slice->max_defs : LABEL_BUFFER_INIT_LEN;
+                label_refs_cap = (slice->max_refs > LABEL_BUFFER_INIT_LEN) ? slice->max_refs : LABEL_BUFFER_INIT_LEN;
+                if (!((label_defs_ptr = label_defs = malloc(sizeof(LabelDef) * label_defs_cap)) &&
+                                (label_refs_ptr = label_refs = malloc(sizeof(LabelRef) * label_refs_cap)))) {
+                        fputs(FMT_ERRMSG("failed to allocate label tables for parsing in parallel\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+
+                parse_stmts(slice->types_end, &overflow_words, &overflow_pos);
+
+                slice->overran = overflow_words > 0 || tkn_types_ptr != slice->types_end;
+        }
+
+        slice->words_len = outfile_buffer_ptr - outfile_buffer;
+        slice->defs = label_defs;
+        slice->defs_len = label_defs_ptr - label_defs;
+        slice->refs = label_refs;
+        slice->refs_len = label_refs_ptr - label_refs;
+        slice->budgets = budgets;
+        slice->budgets_len = budgets_ptr - budgets;
+        slice->sections = sections;
+        slice->sections_len = sections_ptr - sections;
+        slice->table_positions = table_positions;
+        slice->table_positions_len = table_positions_ptr - table_positions;
+        slice->vreg_uses = vreg_uses;
+        slice->vreg_uses_len = vreg_uses_ptr - vreg_uses;
+        take_msgs(slice);
+
+        free_expr(&table_expr);
+        free_all_scratch();
+        free(scratch);
+
+        return NULL;
+}
+
+//
+// place_slice - copies the words of a slice to its place in the output stream and moves every address the slice took
+// there, run on a worker
+//
+static void *place_slice(void *arg) {
+        Slice *slice = arg;
+        Instruction *dest = slice->shared->outfile_buffer + slice->offset;
+
+        memcpy(dest, slice->words, slice->words_len * sizeof(Instruction));
+        memcpy(slice->shared->instr_positions + slice->offset, slice->word_positions,
+                slice->words_len * sizeof(uint32_t));
+
+        for (ptrdiff_t i = 0; i < slice->defs_len; ++i)
+                slice->defs[i].c8_addr += slice->offset * C8_INSTR_SIZE;
+
+        for (ptrdiff_t i = 0; i < slice->refs_len; ++i)
+                slice->refs[i].output_pos = dest + (slice->refs[i].output_pos - slice->words);
+
+        for (ptrdiff_t i = 0; i < slice->vreg_uses_len; ++i)
+                slice->vreg_uses[i].output_pos = dest + (slice->vreg_uses[i].output_pos - slice->words);
+
+        // the `code` section a slice opens before its first directive holds the start of the program if it is kept
+        for (ptrdiff_t i = 0; i < slice->sections_len; ++i)
+                if (i > 0 || !slice->keeps_code || slice->sections[i].org != C8_CODE_START_ADDR ||
+                                !slice->sections[i].name)
+                        slice->sections[i].start += slice->offset;
+
+        return NULL;
+}
+
+//
+// append_items - appends len items of size bytes to a table of the parser, grows the table if needed, returns 0 on
+// failure
+//
+static int append_items(void **table, void **table_ptr, ptrdiff_t *cap, const void *items, ptrdiff_t len,
+                size_t size) {
+        ptrdiff_t pushed = ((char*)*table_ptr - (char*)*table) / size;
+
+        if (pushed + len > *cap) {
+                ptrdiff_t new_cap = *cap ? *cap : LABEL_BUFFER_INIT_LEN;
+                void *new_table;
+
+                while (new_cap < pushed + len)
+                        new_cap *= 2;
+
+                if (!(new_table = realloc(*table, new_cap * size)))
+                        return 0;
+                *table = new_table;
+                *cap = new_cap;
+        }
+
+        if (len)
+                memcpy((char*)*table + pushed * size, items, len * size);
+        *table_ptr = (char*)*table + (pushed + len) * size;
+
+        return 1;
+}
+
+//
+// merge_slices - appends the tables and diagnostics of placed slices to those of the assembling thread in source
+// order, so they are as a sequential parse leaves them, returns 0 if a table couldn't grow
+//
+static int merge_slices(Slice *slices, int slices_len) {
+        for (int i = 0; i < slices_len; ++i) {
+                Slice *slice = &slices[i];
+
+                // a slice's own `code` section is dropped when an earlier slice already opened one
+                Section *slice_sections = slice->sections;
+                ptrdiff_t slice_sections_len = slice->sections_len;
+                if (slice_sections_len > 0 && !slice->keeps_code && slice_sections[0].name &&
+                                slice_sections[0].org == C8_CODE_START_ADDR) {
+                        ++slice_sections;
+                        --slice_sections_len;
+                }
+
+                if (!(append_items((void**)&label_defs, (void**)&label_defs_ptr, &label_defs_cap, slice->defs,
+                                        slice->defs_len, sizeof(LabelDef)) &&
+                                append_items((void**)&label_refs, (void**)&label_refs_ptr, &label_refs_cap,
+                                        slice->refs, slice->refs_len, sizeof(LabelRef)) &&
+                                append_items((void**)&budgets, (void**)&budgets_ptr, &budgets_cap, slice->budgets,
+                                        slice->budgets_len, sizeof(Budget)) &&
+                                append_items((void**)&sections, (void**)&sections_ptr, &sections_cap,
+                                        slice_sections, slice_sections_len, sizeof(Section)) &&
+                                append_items((void**)&table_positions, (void**)&table_positions_ptr,
+                                        &table_positions_cap, slice->table_positions, slice->table_positions_len,
+                                        sizeof(uint32_t)) &&
+                                append_items((void**)&vreg_uses, (void**)&vreg_uses_ptr, &vreg_uses_cap,
+                                        slice->vreg_uses, slice->vreg_uses_len, sizeof(VregUse)) &&
+                                append_msgs(slice->msgs, slice->msgs_len, slice->msg_text, slice->msg_text_len)))
+                        return 0;
+
+                error_count += slice->error_count;
+                warning_count += slice->warning_count;
+        }
+
+        return 1;
+}
+
+//
+// split_tkn_stream - splits the token stream into at most slices_len slices of about the same number of tokens, each
+// starting at a mnemonic, returns the number of slices
+//
+static int split_tkn_stream(Slice *slices, int slices_len, const uint8_t *stream_end) {
+        const uint8_t *start = tkn_types;
+        int split = 0;
+
+        for (int i = 1; i <= slices_len && start < stream_end; ++i) {
+                const uint8_t *end = tkn_types + (stream_end - tkn_types) * i / slices_len;
+
+                if (end <= start)
+                        continue;
+
+                while (end < stream_end && *end > INSTR_LOAD)
+                        ++end;
+
+                slices[split].types = start;
+                slices[split].types_end = end;
+                ++split;
+                start = end;
+        }
+
+        return split;
+}
+
+//
+// parse_in_parallel - parses the token stream on up to parse_threads threads, returns false if it is left for a
+// sequential parse, which is always the case for a stream of fewer than two slices' worth of tokens and with limits on
+// labels or errors, which are counted in source order
+//
+// every instruction is a word and no statement but a table takes room without a mnemonic, so the stream is split into
+// slices starting at mnemonics which are parsed on their own threads into buffers of their own, and laid out one after
+// another once the words each took are known, a prefix sum over the slices gives the offset each moves its addresses
+// by, those are placed on the threads too and the tables and diagnostics of the slices are then merged in source
+// order, so the program and diagnostics are the ones a sequential parse gives
+//
+// a statement can only run past the start of the next slice if it is malformed, in which case the statements after it
+// aren't where the slices think, and running past the end of memory is reported against the statement where the
+// whole program did, for both the stream is parsed again sequentially
+//
+bool parse_in_parallel(void) {
+        if (limit_labels || limit_errors)
+                return false;
+
+        // the stream holds at most one token for each character of the source and its STREAM_END
+        const uint8_t *stream_end = memchr(tkn_types, STREAM_END, infile_len + 1);
+        int slices_len = parse_threads;
+
+        if (!stream_end)
+                return false;
+        if (slices_len > PARALLEL_MAX_THREADS)
+                slices_len = PARALLEL_MAX_THREADS;
+        if (slices_len > (stream_end - tkn_types) / PARALLEL_MIN_TOKENS)
+                slices_len = (stream_end - tkn_types) / PARALLEL_MIN_TOKENS;
+        if (slices_len < 2)
+                return false;
+
+        trace_begin("parse slices");
+
+        Shared shared = {
+                .tkn_types = tkn_types,
+                .tkn_positions = tkn_positions,
+                .tkn_payloads = tkn_payloads,
+                .name_pool = name_pool,
+                .target = target,
+                .limit_deadline = limit_deadline,
+                .outfile_buffer = outfile_buffer,
+                .instr_positions = instr_positions
+        };
+        Slice *slices = alloc_or_panic(slices_len, sizeof(Slice), "parsing in parallel");
+
+        for (int type = 0; type <= UINT8_MAX; ++type)
+                shared.tkn_counts[type] = (uint64_t)TKN_HAS_PAYLOAD(type) << (COUNT_PAYLOADS * COUNT_BITS) |
+                        (uint64_t)(type <= INSTR_LOAD || type == NAME_LONG) << (COUNT_WORDS * COUNT_BITS) |
+                        (uint64_t)(type == DIR_TABLE) << (COUNT_TABLES * COUNT_BITS) |
+                        (uint64_t)(type == NAME_LBLDEF) << (COUNT_DEFS * COUNT_BITS) |
+                        (uint64_t)(type == NAME_LBLREF) << (COUNT_REFS * COUNT_BITS);
+
+        slices_len = split_tkn_stream(slices, slices_len, stream_end);
+        for (int i = 0; i < slices_len; ++i)
+                slices[i].shared = &shared;
+
+        // each slice starts reading payloads after those of the slices before it, and its buffer has room for a
+        // statement running past the end as the output image does
+        bool ok = run_workers(slices, slices_len, count_tokens);
+        for (int i = 0; ok && i < slices_len; ++i) {
+                slices[i].payloads = (i == 0) ? tkn_payloads : slices[i - 1].payloads + slices[i - 1].payloads_len;
+                slices[i].words = alloc_or_panic(slices[i].max_words + 2, sizeof(Instruction),
+                        "parsing in parallel");
+                slices[i].word_positions = alloc_or_panic(slices[i].max_words + 2, sizeof(uint32_t),
+                        "parsing in parallel");
+        }
+
+        ok = ok && run_workers(slices, slices_len, parse_slice);
+
+        // a panic on a worker is passed on once every worker is done with its slice
+        for (int i = 0; ok && i < slices_len; ++i) {
+                if (slices[i].err) {
+                        int err = slices[i].err;
+
+                        free_slices(slices, slices_len);
+                        panic(err);
+                }
+        }
+
+        // the offset of each slice is the number of words in the slices before it
+        uint32_t words = outfile_buffer_ptr - outfile_buffer;
+        bool has_sections = sections_ptr > sections;
+        for (int i = 0; ok && i < slices_len; ++i) {
+                ok = !slices[i].overran;
+
+                slices[i].offset = words;
+                slices[i].keeps_code = !has_sections;
+                words += slices[i].words_len;
+                has_sections = has_sections || slices[i].sections_len > 0;
+        }
+
+        ok = ok && words <= program_words(target) && run_workers(slices, slices_len, place_slice);
+        if (!ok) {
+                free_slices(slices, slices_len);
+                trace_end("parse slices");
+
+                return false;
+        }
+
+        trace_end("parse slices");
+        trace_begin("merge slices");
+
+        if (!merge_slices(slices, slices_len)) {
+                free_slices(slices, slices_len);
+                fputs(FMT_ERRMSG("failed to resize buffers for merging parsed slices\n"), stderr);
+                panic(ERR_MALLOC_FAIL);
+        }
+
+        // the stream is left at its STREAM_END as a sequential parse leaves it
+        outfile_buffer_ptr = outfile_buffer + words;
+        tkn_types_ptr = (uint8_t*)stream_end;
+        tkn_positions_ptr = tkn_positions + (stream_end - tkn_types);
+        tkn_payloads_ptr = slices[slices_len - 1].payloads + slices[slices_len - 1].payloads_len;
+
+        free_slices(slices, slices_len);
+
+        // a section runs to the start of the next one and the last to the end of the program
+        for (Section *section = sections; section < sections_ptr; ++section)
+                section->end = (section + 1 < sections_ptr) ? section[1].start : words;
+
+        trace_end("merge slices");
+
+        return true;
+}
+
+//
+// patch_slice - patches the label references of a slice, run on a worker
+//
+static void *patch_slice(void *arg) {
+        Slice *slice = arg;
+
+        label_defs = slice->shared->label_defs;
+        label_defs_ptr = slice->shared->label_defs_ptr;
+
+        if (!(slice->err = setjmp(panic_env)))
+                resolve_refs(slice->refs, slice->refs_len);
+
+        take_msgs(slice);
+
+        return NULL;
+}
+
+//
+// resolve_in_parallel - patches label references on up to parse_threads threads, returns false if it is left for the
+// assembling thread, as for a table with fewer than two threads' worth of references or with a limit on errors
+//
+// the definitions are sorted by name before this so the threads only read them, every reference patches a word of
+// its own and the diagnostics of each thread are merged in the order of the references
+//
+bool resolve_in_parallel(void) {
+        ptrdiff_t refs_len = label_refs_ptr - label_refs;
+        int slices_len = parse_threads;
+
+        if (limit_errors)
+                return false;
+        if (slices_len > PARALLEL_MAX_THREADS)
+                slices_len = PARALLEL_MAX_THREADS;
+        if (slices_len > refs_len / PARALLEL_MIN_REFS)
+                slices_len = refs_len / PARALLEL_MIN_REFS;
+        if (slices_len < 2)
+                return false;
+
+        Shared shared = {
+                .label_defs = label_defs,
+                .label_defs_ptr = label_defs_ptr
+        };
+        Slice *slices = alloc_or_panic(slices_len, sizeof(Slice), "resolving labels in parallel");
+
+        for (int i = 0; i < slices_len; ++i) {
+                ptrdiff_t start = refs_len * i / slices_len, end = refs_len * (i + 1) / slices_len;
+
+                slices[i].shared = &shared;
+                slices[i].refs = label_refs + start;
+                slices[i].refs_len = end - start;
+        }
+
+        if (!run_workers(slices, slices_len, patch_slice)) {
+                free_slice_msgs(slices, slices_len);
+                return false;
+        }
+
+        for (int i = 0; i < slices_len; ++i) {
+                if (slices[i].err) {
+                        int err = slices[i].err;
+
+                        free_slice_msgs(slices, slices_len);
+                        panic(err);
+                }
+        }
+
+        for (int i = 0; i < slices_len; ++i) {
+                if (!append_msgs(slices[i].msgs, slices[i].msgs_len, slices[i].msg_text, slices[i].msg_text_len)) {
+                        free_slice_msgs(slices, slices_len);
+                        fputs(FMT_ERRMSG("failed to resize buffers for merging diagnostics\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+
+                error_count += slices[i].error_count;
+                warning_count += slices[i].warning_count;
+        }
+        free_slice_msgs(slices, slices_len);
+
+        return true;
+}
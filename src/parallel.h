@@ -0,0 +1,23 @@
+#ifndef PARALLEL_H_INCLUDED
+        #define PARALLEL_H_INCLUDED 1
+
+        #include <stdbool.h>
+
+        #include "threadlocal.h"
+
+        // threads never get fewer tokens or label references than this each, below it starting them costs more than
+        // the work they take off the assembling thread, as measured with c8bench, a parse in slices costs about 15us
+        // a slice and 0.4ns a token more than the 1.8ns a token of a sequential one, so two slices break even at
+        // about 21000 tokens each, while patching costs about 10us a slice and pays for itself from about 1000 refs
+        enum {PARALLEL_MIN_TOKENS = 32768, PARALLEL_MIN_REFS = 4096};
+
+        // the most threads used to parse one source, this corresponds to C8ASM_MAX_THREADS in c8asm.h
+        enum {PARALLEL_MAX_THREADS = 64};
+
+        // threads parse_tkn_stream and resolve_labels may use, set with c8asm_set_threads, 1 or less parses on the
+        // assembling thread alone
+        extern THREAD_LOCAL int parse_threads;
+
+        extern bool parse_in_parallel(void);
+        extern bool resolve_in_parallel(void);
+#endif
@@ -2,48 +2,61 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "exitcodes.h"
 #include "ansicodes.h"
 #include "lexer.h"
 #include "parser.h"
+#include "expr.h"
 #include "print_msg.h"
+#include "trace.h"
+#include "sandbox.h"
+#include "alloc.h"
 #include "panic.h"
+#include "parallel.h"
 
 #define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
 
 #define INT_TOO_LARGE_255   "integer constant is too large for this instruction (>255)"
 #define INT_TOO_LARGE_15    "integer constant is too large for this instruction (>15)"
+#define ADDR_TOO_LARGE      "address is too large for this instruction (>4095)"
+#define TABLE_MAX_ENTRIES   65535
+
 #define ADDR_LT_512_WARNING "most CHIP8 implementations use addresses below 0x200 for sprite " \
                             "storage, jumping to any of them probably isn't a good idea"
 
-enum {C8_INSTR_SIZE = 2, C8_CODE_START_ADDR = 0x200};
-
 // used throughout to access a byte in the output stream, this makes writes endian-agnostic
-uint8_t *byte_ptr;
+THREAD_LOCAL uint8_t *byte_ptr;
+
+THREAD_LOCAL bool stmt_has_vreg;
 
 // defined in parser.h
+extern inline uint32_t program_words(Target target);
 extern inline Token next_tkn(void);
 
 //
 // push_label_ref - pushes a LabelRef to the label reference table, grows table if needed
 //
-static inline void push_label_ref(Token *label) {
+static inline void push_label_ref(Token *label, RefKind kind) {
         ptrdiff_t label_refs_pushed = label_refs_ptr - label_refs;
 
-        if (label_refs_pushed >= LABEL_BUFFER_INIT_LEN) {
-                if (!(label_refs = realloc(label_refs, label_refs_pushed * sizeof(LabelRef) + sizeof(LabelRef)))) {
+        if (label_refs_pushed >= label_refs_cap) {
+                LabelRef *new_refs;
+                if (!(new_refs = realloc(label_refs, label_refs_cap * 2 * sizeof(LabelRef)))) {
                         fputs(FMT_ERRMSG("failed to resize buffer for label reference table\n"), stderr);
                         panic(ERR_MALLOC_FAIL);
                 }
+                label_refs = new_refs;
+                label_refs_cap *= 2;
                 label_refs_ptr = label_refs + label_refs_pushed;
         }
 
         *label_refs_ptr++ = (LabelRef){
-                .label_text = label->value.text,
+                .label_text = name_pool + label->value.name,
                 .output_pos = outfile_buffer_ptr,
-                .line = label->line,
-                .col = label->col
+                .kind = kind,
+                .pos = label->pos
         };
 }
 
@@ -53,22 +66,336 @@ static inline void push_label_ref(Token *label) {
 static inline void push_label_def(Token *label) {
         ptrdiff_t label_defs_pushed = label_defs_ptr - label_defs;
 
-        if (label_defs_pushed >= LABEL_BUFFER_INIT_LEN) {
-                if (!(label_defs = realloc(label_defs, label_defs_pushed * sizeof(LabelDef) + sizeof(LabelDef)))) {
+        if (limit_labels && label_defs_pushed >= limit_labels)
+                panic(ERR_LIMIT_LABELS);
+
+        if (label_defs_pushed >= label_defs_cap) {
+                LabelDef *new_defs;
+                if (!(new_defs = realloc(label_defs, label_defs_cap * 2 * sizeof(LabelDef)))) {
                         fputs(FMT_ERRMSG("failed to resize buffer for label definition table\n"), stderr);
                         panic(ERR_MALLOC_FAIL);
                 }
+                label_defs = new_defs;
+                label_defs_cap *= 2;
                 label_defs_ptr = label_defs + label_defs_pushed;
         }
 
         *label_defs_ptr++ = (LabelDef){
-                .label_text = label->value.text,
+                .label_text = name_pool + label->value.name,
                 .c8_addr = C8_CODE_START_ADDR + ((outfile_buffer_ptr - outfile_buffer) * C8_INSTR_SIZE),
-                .line = label->line,
-                .col = label->col
+                .pos = label->pos
+        };
+}
+
+//
+// parse_budget - parses a budget directive, which limits the instructions executed in one pass through a label
+//
+static void parse_budget(void) {
+        Token label;
+
+        if (next_tkn().type != NAME_LBLREF) {
+                print_msg(ERROR, current_tkn.pos, "expected a label reference");
+                ++error_count;
+                return;
+        }
+        label = current_tkn;
+
+        if (next_tkn().type != SYM_COMMA) {
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
+                ++error_count;
+                return;
+        }
+
+        if (next_tkn().type != CONST_INT) {
+                print_msg(ERROR, current_tkn.pos, "expected an integer constant");
+                ++error_count;
+                return;
+        }
+
+        ptrdiff_t budgets_pushed = budgets_ptr - budgets;
+
+        if (budgets_pushed >= budgets_cap) {
+                Budget *new_budgets;
+                ptrdiff_t new_cap = budgets_cap ? budgets_cap * 2 : LABEL_BUFFER_INIT_LEN;
+                if (!(new_budgets = realloc(budgets, new_cap * sizeof(Budget)))) {
+                        fputs(FMT_ERRMSG("failed to resize buffer for budget table\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+                budgets = new_budgets;
+                budgets_cap = new_cap;
+                budgets_ptr = budgets + budgets_pushed;
+        }
+
+        *budgets_ptr++ = (Budget){
+                .label_text = name_pool + label.value.name,
+                .limit = current_tkn.value.num,
+                .pos = label.pos
+        };
+}
+
+//
+// push_section - pushes a Section starting at the current word to the section table, grows table if needed
+//
+static void push_section(const char *name, long org, uint32_t align, uint32_t pos) {
+        ptrdiff_t sections_pushed = sections_ptr - sections;
+
+        if (sections_pushed >= sections_cap) {
+                Section *new_sections;
+                ptrdiff_t new_cap = sections_cap ? sections_cap * 2 : LABEL_BUFFER_INIT_LEN;
+                if (!(new_sections = realloc(sections, new_cap * sizeof(Section)))) {
+                        fputs(FMT_ERRMSG("failed to resize buffer for section table\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+                sections = new_sections;
+                sections_cap = new_cap;
+                sections_ptr = sections + sections_pushed;
+        }
+
+        uint32_t start = outfile_buffer_ptr - outfile_buffer;
+
+        *sections_ptr++ = (Section){
+                .name = name,
+                .start = start,
+                .end = start,
+                .org = org,
+                .align = align,
+                .pos = pos
         };
 }
 
+//
+// open_section - ends the section being parsed and starts a new one, the statements before the first directive are
+// put in the `code` section which is fixed at the start of the program
+//
+static void open_section(const char *name, long org, uint32_t align, uint32_t pos) {
+        if (sections_ptr == sections) {
+                push_section("code", C8_CODE_START_ADDR, C8_INSTR_SIZE, 0);
+                sections_ptr[-1].start = 0;
+        }
+
+        sections_ptr[-1].end = outfile_buffer_ptr - outfile_buffer;
+        push_section(name, org, align, pos);
+}
+
+//
+// parse_org - parses an org directive, which places the statements after it at a fixed address
+//
+static void parse_org(void) {
+        uint32_t pos = current_tkn.pos;
+
+        if (next_tkn().type != CONST_INT) {
+                print_msg(ERROR, current_tkn.pos, "expected an integer constant");
+                ++error_count;
+                return;
+        }
+
+        uint32_t mem_end = C8_CODE_START_ADDR + program_words(target) * C8_INSTR_SIZE;
+        if (current_tkn.value.num < C8_CODE_START_ADDR || (uint32_t)current_tkn.value.num >= mem_end) {
+                print_msg(ERROR, current_tkn.pos, "address 0x%X is outside of the program (0x%X-0x%X)",
+                        (unsigned)current_tkn.value.num, (unsigned)C8_CODE_START_ADDR, (unsigned)mem_end - 1);
+                ++error_count;
+                return;
+        }
+
+        if (current_tkn.value.num % C8_INSTR_SIZE) {
+                print_msg(ERROR, current_tkn.pos, "address 0x%X is not aligned to an instruction",
+                        (unsigned)current_tkn.value.num);
+                ++error_count;
+                return;
+        }
+
+        open_section(NULL, current_tkn.value.num, C8_INSTR_SIZE, pos);
+}
+
+//
+// parse_section - parses a section directive, which puts the statements after it in a named section placed in free
+// memory by place_sections, optionally aligned to a power of two
+//
+static void parse_section(void) {
+        uint32_t pos = current_tkn.pos;
+
+        if (next_tkn().type != NAME_LBLREF) {
+                print_msg(ERROR, current_tkn.pos, "expected a section name");
+                ++error_count;
+                return;
+        }
+        const char *name = name_pool + current_tkn.value.name;
+
+        uint32_t align = C8_INSTR_SIZE;
+        if (*tkn_types_ptr == SYM_COMMA) {
+                next_tkn();
+
+                if (next_tkn().type != CONST_INT) {
+                        print_msg(ERROR, current_tkn.pos, "expected an integer constant");
+                        ++error_count;
+                        return;
+                }
+
+                uint32_t mem_len = program_words(target) * C8_INSTR_SIZE;
+                if (current_tkn.value.num <= 0 || current_tkn.value.num & (current_tkn.value.num - 1) ||
+                                (uint32_t)current_tkn.value.num > mem_len) {
+                        print_msg(ERROR, current_tkn.pos, "alignment must be a power of two no larger than memory");
+                        ++error_count;
+                        return;
+                }
+
+                if ((uint32_t)current_tkn.value.num > align)
+                        align = current_tkn.value.num;
+        }
+
+        open_section(name, -1, align, pos);
+}
+
+//
+// push_table_position - pushes the position of a table directive to the table position list, grows list if needed
+//
+static void push_table_position(uint32_t pos) {
+        ptrdiff_t table_positions_pushed = table_positions_ptr - table_positions;
+
+        if (table_positions_pushed >= table_positions_cap) {
+                uint32_t *new_positions;
+                ptrdiff_t new_cap = table_positions_cap ? table_positions_cap * 2 : LABEL_BUFFER_INIT_LEN;
+                if (!(new_positions = realloc(table_positions, new_cap * sizeof(uint32_t)))) {
+                        fputs(FMT_ERRMSG("failed to resize buffer for table positions\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+                table_positions = new_positions;
+                table_positions_cap = new_cap;
+                table_positions_ptr = table_positions + table_positions_pushed;
+        }
+
+        *table_positions_ptr++ = pos;
+}
+
+//
+// skip_operands - skips the operands left of a table directive which failed to parse, so they aren't taken for the
+// next statement
+//
+static void skip_operands(void) {
+        while (*tkn_types_ptr == SYM_OP || *tkn_types_ptr == SYM_COMMA || *tkn_types_ptr == CONST_INT ||
+                        *tkn_types_ptr == NAME_LBLREF)
+                next_tkn();
+}
+
+//
+// parse_table - parses a table directive, which evaluates an expression of the index `i` for each entry of a table
+// and writes the bytes to the output stream under a label, padded with a 0 to a whole word, returns the number of
+// words which ran past the end of memory
+//
+// the expression is folded once so evaluating it for each entry only does the work which depends on the index
+//
+static uint32_t parse_table(uint32_t pos) {
+        if (next_tkn().type != NAME_LBLDEF) {
+                print_msg(ERROR, current_tkn.pos, "expected a table name");
+                ++error_count;
+                skip_operands();
+                return 0;
+        }
+        push_label_def(&current_tkn);
+
+        if (next_tkn().type != SYM_COMMA) {
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
+                ++error_count;
+                skip_operands();
+                return 0;
+        }
+
+        if (next_tkn().type != CONST_INT) {
+                print_msg(ERROR, current_tkn.pos, "expected an integer constant");
+                ++error_count;
+                skip_operands();
+                return 0;
+        }
+
+        long entries = current_tkn.value.num;
+        if (entries < 1 || entries > TABLE_MAX_ENTRIES) {
+                print_msg(ERROR, current_tkn.pos, "a table must have 1-%d entries", TABLE_MAX_ENTRIES);
+                ++error_count;
+                skip_operands();
+                return 0;
+        }
+
+        if (next_tkn().type != SYM_COMMA) {
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
+                ++error_count;
+                skip_operands();
+                return 0;
+        }
+
+        Expr *expr = &table_expr;
+        uint32_t expr_pos = tkn_positions_ptr[0];
+
+        expr->len = 0;
+        if (!parse_expr(expr)) {
+                skip_operands();
+                return 0;
+        }
+
+        if (!fold_expr(expr))
+                return 0;
+
+        // entries past the end of memory are still evaluated so their errors are reported
+        uint32_t words = (entries + 1) / 2;
+        uint32_t room = outfile_buffer_end - outfile_buffer_ptr;
+        uint32_t kept = (words < room) ? words : room;
+        uint8_t *bytes = (uint8_t*)outfile_buffer_ptr;
+
+        for (long i = 0; i < entries; ++i) {
+                int64_t value;
+                uint32_t err_pos;
+                const char *err;
+
+                check_deadline();
+
+                if ((err = eval_expr(expr, i, &value, &err_pos))) {
+                        print_msg(ERROR, err_pos, "%s for entry %ld of table `%s`", err, i,
+                                label_defs_ptr[-1].label_text);
+                        ++error_count;
+                        break;
+                }
+
+                if (value < -128 || value > 255) {
+                        print_msg(ERROR, expr_pos, "entry %ld of table `%s` is %lld, which doesn't fit in a byte",
+                                i, label_defs_ptr[-1].label_text, (long long)value);
+                        ++error_count;
+                        break;
+                }
+
+                if ((uint32_t)i < kept * C8_INSTR_SIZE)
+                        bytes[i] = value & 0xFF;
+        }
+
+        if (entries % 2 && words == kept)
+                bytes[entries] = 0;
+
+        for (uint32_t w = 0; w < kept; ++w)
+                instr_positions[outfile_buffer_ptr - outfile_buffer + w] = pos;
+        outfile_buffer_ptr += kept;
+
+        push_table_position(pos);
+
+        return words - kept;
+}
+
+//
+// is_table_word - checks whether a word of the output stream holds table data rather than an instruction
+//
+bool is_table_word(uint32_t i) {
+        uint32_t pos = instr_positions[i];
+        ptrdiff_t lo = 0, hi = table_positions_ptr - table_positions;
+
+        while (lo < hi) {
+                ptrdiff_t mid = lo + (hi - lo) / 2;
+
+                if (table_positions[mid] < pos)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo < table_positions_ptr - table_positions && table_positions[lo] == pos;
+}
+
 //
 // parse_jmp - parses a jmp instruction, writes output to the output stream
 //
@@ -76,16 +403,19 @@ static inline void parse_jmp(void) {
         next_tkn();
         if (current_tkn.type == NAME_LBLREF) {
                 byte_ptr[0] = 0x10;
-                push_label_ref(&current_tkn);
+                push_label_ref(&current_tkn, REF_ADDR12);
         } else if (current_tkn.type == CONST_INT) {
-                if (current_tkn.value.num < 0x200) {
-                        print_msg(WARNING, current_tkn.line, current_tkn.col, ADDR_LT_512_WARNING);
+                if (current_tkn.value.num > 0xFFF) {
+                        print_msg(ERROR, current_tkn.pos, ADDR_TOO_LARGE);
+                        ++error_count;
+                } else if (current_tkn.value.num < 0x200) {
+                        print_msg(WARNING, current_tkn.pos, ADDR_LT_512_WARNING);
                         ++warning_count;
                 }
                 byte_ptr[0] = 0x10 | ((current_tkn.value.num & 0xF00) >> 8);
                 byte_ptr[1] = current_tkn.value.num & 0xFF;
         } else {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected an integer constant or a label reference");
+                print_msg(ERROR, current_tkn.pos, "expected an integer constant or a label reference");
                 ++error_count;
         }
 }
@@ -96,17 +426,20 @@ static inline void parse_jmp(void) {
 static inline void parse_vjmp(void) {
         next_tkn();
         if (current_tkn.type == NAME_LBLREF) {
-                push_label_ref(&current_tkn);
+                push_label_ref(&current_tkn, REF_ADDR12);
                 byte_ptr[0] = 0xB0;
         } else if (current_tkn.type == CONST_INT) {
-                if (current_tkn.value.num < 0x200) {
-                        print_msg(WARNING, current_tkn.line, current_tkn.col, ADDR_LT_512_WARNING);
+                if (current_tkn.value.num > 0xFFF) {
+                        print_msg(ERROR, current_tkn.pos, ADDR_TOO_LARGE);
+                        ++error_count;
+                } else if (current_tkn.value.num < 0x200) {
+                        print_msg(WARNING, current_tkn.pos, ADDR_LT_512_WARNING);
                         ++warning_count;
                 }
                 byte_ptr[0] = 0xB0 | ((current_tkn.value.num & 0xF00) >> 8);
                 byte_ptr[1] = current_tkn.value.num & 0xFF;
         } else {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected an integer constant or a label reference");
+                print_msg(ERROR, current_tkn.pos, "expected an integer constant or a label reference");
                 ++error_count;
         }
 }
@@ -118,16 +451,19 @@ static inline void parse_call(void) {
         next_tkn();
         if (current_tkn.type == NAME_LBLREF) {
                 byte_ptr[0] = 0x20;
-                push_label_ref(&current_tkn);
+                push_label_ref(&current_tkn, REF_ADDR12);
         } else if (current_tkn.type == CONST_INT) {
-                if (current_tkn.value.num < 0x200) {
-                        print_msg(WARNING, current_tkn.line, current_tkn.col, ADDR_LT_512_WARNING);
+                if (current_tkn.value.num > 0xFFF) {
+                        print_msg(ERROR, current_tkn.pos, ADDR_TOO_LARGE);
+                        ++error_count;
+                } else if (current_tkn.value.num < 0x200) {
+                        print_msg(WARNING, current_tkn.pos, ADDR_LT_512_WARNING);
                         ++warning_count;
                 }
                 byte_ptr[0] = 0x20 | ((current_tkn.value.num & 0xF00) >> 8);
                 byte_ptr[1] = current_tkn.value.num & 0xFF;
         } else {
-                print_msg(ERROR, current_tkn.line, current_tkn.col,
+                print_msg(ERROR, current_tkn.pos,
                         "expected an integer constant or a label reference");
                 ++error_count;
         }
@@ -140,21 +476,21 @@ static inline void parse_sne(void) {
         int xreg;
 
         if (next_tkn().type != NAME_REG) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+                print_msg(ERROR, current_tkn.pos, "expected a register name");
                 ++error_count;
         }
 
         xreg = current_tkn.value.num;
 
         if (next_tkn().type != SYM_COMMA) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
                 ++error_count;
         }
 
         next_tkn();
         if (current_tkn.type == CONST_INT) {
                 if (current_tkn.value.num > 0xFF)
-                        print_msg(ERROR, current_tkn.line, current_tkn.col, INT_TOO_LARGE_255);
+                        print_msg(ERROR, current_tkn.pos, INT_TOO_LARGE_255);
 
                 byte_ptr[0] = 0x40 | xreg;
                 byte_ptr[1] = current_tkn.value.num;
@@ -162,7 +498,7 @@ static inline void parse_sne(void) {
                 byte_ptr[0] = 0x90 | xreg;
                 byte_ptr[1] = current_tkn.value.num << 4;
         } else {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register or an integer constant");
+                print_msg(ERROR, current_tkn.pos, "expected a register or an integer constant");
                 ++error_count;
         }
 }
@@ -174,21 +510,21 @@ static inline void parse_se(void) {
         int xreg;
 
         if (next_tkn().type != NAME_REG) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+                print_msg(ERROR, current_tkn.pos, "expected a register name");
                 ++error_count;
         }
 
         xreg = current_tkn.value.num;
 
         if (next_tkn().type != SYM_COMMA) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
                 ++error_count;
         }
 
         next_tkn();
         if (current_tkn.type == CONST_INT) {
                 if (current_tkn.value.num > 0xFF)
-                        print_msg(ERROR, current_tkn.line, current_tkn.col, INT_TOO_LARGE_255);
+                        print_msg(ERROR, current_tkn.pos, INT_TOO_LARGE_255);
 
                 byte_ptr[0] = 0x30 | xreg;
                 byte_ptr[1] = current_tkn.value.num;
@@ -196,7 +532,41 @@ static inline void parse_se(void) {
                 byte_ptr[0] = 0x50 | xreg;
                 byte_ptr[1] = current_tkn.value.num << 4;
         } else {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register or an integer constant");
+                print_msg(ERROR, current_tkn.pos, "expected a register or an integer constant");
+                ++error_count;
+        }
+}
+
+//
+// require_xochip - reports an error if an instruction which only exists on XO-CHIP is used for another target
+//
+static void require_xochip(uint32_t pos, const char *mnemonic) {
+        if (target != TARGET_XOCHIP) {
+                print_msg(ERROR, pos, "`%s` requires the XO-CHIP target (--target=xochip)", mnemonic);
+                ++error_count;
+        }
+}
+
+//
+// parse_long_i - parses the operand of `mov I, long`, which takes two words in the output stream
+//
+static void parse_long_i(void) {
+        require_xochip(current_tkn.pos, "mov I, long");
+
+        byte_ptr[0] = 0xF0;
+        byte_ptr[1] = 0x00;
+
+        byte_ptr = (uint8_t*)++outfile_buffer_ptr;
+
+        next_tkn();
+        if (current_tkn.type == NAME_LBLREF) {
+                byte_ptr[0] = byte_ptr[1] = 0;
+                push_label_ref(&current_tkn, REF_ADDR16);
+        } else if (current_tkn.type == CONST_INT) {
+                byte_ptr[0] = current_tkn.value.num >> 8;
+                byte_ptr[1] = current_tkn.value.num & 0xFF;
+        } else {
+                print_msg(ERROR, current_tkn.pos, "expected an integer constant or a label reference");
                 ++error_count;
         }
 }
@@ -217,7 +587,7 @@ static void parse_mov(void) {
                         switch (next_tkn().type) {
                                 case CONST_INT:
                                         if (current_tkn.value.num > 0xFF) {
-                                                print_msg(ERROR, current_tkn.line, current_tkn.col, INT_TOO_LARGE_255);
+                                                print_msg(ERROR, current_tkn.pos, INT_TOO_LARGE_255);
                                                 ++error_count;
                                                 return;
                                         }
@@ -238,7 +608,7 @@ static void parse_mov(void) {
                                         break;
 
                                 default:
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected an integer constant or a name");
                                         ++error_count;
                                         return;
@@ -271,19 +641,38 @@ static void parse_mov(void) {
                         if (next_tkn().type != SYM_COMMA)
                                 goto comma_not_found;
 
-                        if (next_tkn().type != CONST_INT) {
-                                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected an integer constant");
-                                ++error_count;
-                                return;
-                        }
+                        switch (next_tkn().type) {
+                                case NAME_LONG:
+                                        parse_long_i();
+                                        break;
+                                case NAME_LBLREF:
+                                        byte_ptr[0] = 0xA0;
+                                        push_label_ref(&current_tkn, REF_ADDR12);
+
+                                        break;
+                                case CONST_INT:
+                                        if (current_tkn.value.num > 0xFFF) {
+                                                print_msg(ERROR, current_tkn.pos, ADDR_TOO_LARGE);
+                                                ++error_count;
+                                                return;
+                                        }
+
+                                        byte_ptr[0] = 0xA0 | ((current_tkn.value.num & 0xF00) >> 8);
+                                        byte_ptr[1] = current_tkn.value.num & 0xFF;
+
+                                        break;
 
-                        byte_ptr[0] = 0xA0 | ((current_tkn.value.num & 0xF00) >> 8);
-                        byte_ptr[1] = current_tkn.value.num & 0xFF;
+                                default:
+                                        print_msg(ERROR, current_tkn.pos,
+                                                "expected an integer constant or a label reference");
+                                        ++error_count;
+                                        return;
+                        }
 
                         break;                        
 
                 default:
-                        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a name");
+                        print_msg(ERROR, current_tkn.pos, "expected a name");
                         ++error_count;
                         return;
         }
@@ -291,11 +680,11 @@ static void parse_mov(void) {
         return;
 
 reg_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register");
+        print_msg(ERROR, current_tkn.pos, "expected a register");
         ++error_count;
         return;
 comma_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+        print_msg(ERROR, current_tkn.pos, "expected a comma");
         ++error_count;
 }
 
@@ -309,7 +698,7 @@ static inline void parse_or(void) {
         byte_ptr[0] = 0x80 | current_tkn.value.num;
 
         if (next_tkn().type != SYM_COMMA) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
                 ++error_count;
         }
 
@@ -321,7 +710,7 @@ static inline void parse_or(void) {
         return;
 
 reg_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+        print_msg(ERROR, current_tkn.pos, "expected a register name");
         ++error_count;
 }
 
@@ -335,7 +724,7 @@ static inline void parse_and(void) {
         byte_ptr[0] = 0x80 | current_tkn.value.num;
 
         if (next_tkn().type != SYM_COMMA) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
                 ++error_count;
         }
 
@@ -347,7 +736,7 @@ static inline void parse_and(void) {
         return;
 
 reg_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+        print_msg(ERROR, current_tkn.pos, "expected a register name");
         ++error_count;
 }
 
@@ -361,7 +750,7 @@ static inline void parse_xor(void) {
         byte_ptr[0] = 0x80 | current_tkn.value.num;
 
         if (next_tkn().type != SYM_COMMA) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
                 ++error_count;
         }
 
@@ -373,7 +762,7 @@ static inline void parse_xor(void) {
         return;
 
 reg_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+        print_msg(ERROR, current_tkn.pos, "expected a register name");
         ++error_count;
 }
 
@@ -387,7 +776,7 @@ static inline void parse_sub(void) {
         byte_ptr[0] = 0x80 | current_tkn.value.num;
 
         if (next_tkn().type != SYM_COMMA) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
                 ++error_count;
         }
 
@@ -399,7 +788,7 @@ static inline void parse_sub(void) {
         return;
 
 reg_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+        print_msg(ERROR, current_tkn.pos, "expected a register name");
         ++error_count;
 }
 
@@ -413,7 +802,7 @@ static inline void parse_subn(void) {
         byte_ptr[0] = 0x80 | current_tkn.value.num;
 
         if (next_tkn().type != SYM_COMMA) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
                 ++error_count;
         }
 
@@ -425,7 +814,7 @@ static inline void parse_subn(void) {
         return;
 
 reg_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+        print_msg(ERROR, current_tkn.pos, "expected a register name");
         ++error_count;
 }
 
@@ -434,24 +823,24 @@ reg_not_found:
 //
 static inline void parse_rnd(void) {
         if (next_tkn().type != NAME_REG) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+                print_msg(ERROR, current_tkn.pos, "expected a register name");
                 ++error_count;
         }
 
         byte_ptr[0] = 0xC0 | current_tkn.value.num;
 
         if (next_tkn().type != SYM_COMMA) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
                 ++error_count;
         }
 
         if (next_tkn().type != CONST_INT) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected an integer constant");
+                print_msg(ERROR, current_tkn.pos, "expected an integer constant");
                 ++error_count;
         }
 
         if (current_tkn.value.num > 0xFF) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, INT_TOO_LARGE_255);
+                print_msg(ERROR, current_tkn.pos, INT_TOO_LARGE_255);
                 ++error_count;
         }
 
@@ -479,12 +868,12 @@ static void parse_drw(void) {
                 goto comma_not_found;
 
         if (next_tkn().type != CONST_INT) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected an integer constant");
+                print_msg(ERROR, current_tkn.pos, "expected an integer constant");
                 ++error_count;
         }
 
         if (current_tkn.value.num > 0xF) {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, INT_TOO_LARGE_15);
+                print_msg(ERROR, current_tkn.pos, INT_TOO_LARGE_15);
                 ++error_count;
         }
 
@@ -493,11 +882,11 @@ static void parse_drw(void) {
         return;
 
 reg_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+        print_msg(ERROR, current_tkn.pos, "expected a register name");
         ++error_count;
         return;
 comma_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+        print_msg(ERROR, current_tkn.pos, "expected a comma");
         ++error_count;
 }
 
@@ -520,14 +909,14 @@ static void parse_add(void) {
                         byte_ptr[1] = 0x04 | (current_tkn.value.num << 4);
                 } else if (current_tkn.type == CONST_INT) {
                         if (current_tkn.value.num > 0xFF) {
-                                print_msg(ERROR, current_tkn.line, current_tkn.col, INT_TOO_LARGE_255);
+                                print_msg(ERROR, current_tkn.pos, INT_TOO_LARGE_255);
                                 ++error_count;
                         }
 
                         byte_ptr[0] = 0x70 | xreg;
                         byte_ptr[1] = current_tkn.value.num;
                 } else {
-                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                        print_msg(ERROR, current_tkn.pos,
                                 "expected a register or an integer constant");
                         ++error_count;
                 }
@@ -536,31 +925,150 @@ static void parse_add(void) {
                         goto comma_not_found;
 
                 if (next_tkn().type != NAME_REG) {
-                        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register name");
+                        print_msg(ERROR, current_tkn.pos, "expected a register name");
                         ++error_count;
                 }
 
                 byte_ptr[0] = 0xF0 | current_tkn.value.num;
                 byte_ptr[1] = 0x1E;
         } else {
-                print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a register or a name");
+                print_msg(ERROR, current_tkn.pos, "expected a register or a name");
                 ++error_count;
         }
 
         return;
 
 comma_not_found:
-        print_msg(ERROR, current_tkn.line, current_tkn.col, "expected a comma");
+        print_msg(ERROR, current_tkn.pos, "expected a comma");
         ++error_count;
 }
 
 //
-// parse_tkn_stream - examines the token stream and performs a procedure accordingly
+// parse_plane - parses a plane instruction, writes output to the output stream
 //
-void parse_tkn_stream(void) {
-        while (next_tkn().type != STREAM_END) {
+static void parse_plane(void) {
+        require_xochip(current_tkn.pos, "plane");
+
+        if (next_tkn().type != CONST_INT) {
+                print_msg(ERROR, current_tkn.pos, "expected an integer constant");
+                ++error_count;
+        } else if (current_tkn.value.num > 0x3) {
+                print_msg(ERROR, current_tkn.pos, "integer constant is too large for this instruction (>3)");
+                ++error_count;
+        }
+
+        byte_ptr[0] = 0xF0 | (current_tkn.value.num & 0x3);
+        byte_ptr[1] = 0x01;
+}
+
+//
+// parse_save_load - parses a save or load instruction, which store or load a range of registers, writes output to the
+// output stream
+//
+static void parse_save_load(int opcode_low) {
+        require_xochip(current_tkn.pos, (opcode_low == 0x2) ? "save" : "load");
+
+        if (next_tkn().type != NAME_REG)
+                goto reg_not_found;
+
+        byte_ptr[0] = 0x50 | current_tkn.value.num;
+
+        if (next_tkn().type != SYM_COMMA) {
+                print_msg(ERROR, current_tkn.pos, "expected a comma");
+                ++error_count;
+        }
+
+        if (next_tkn().type != NAME_REG)
+                goto reg_not_found;
+
+        byte_ptr[1] = opcode_low | (current_tkn.value.num << 4);
+
+        return;
+
+reg_not_found:
+        print_msg(ERROR, current_tkn.pos, "expected a register name");
+        ++error_count;
+}
+
+//
+// push_vreg_uses - records the virtual registers named by the statement whose operands start at the given tokens,
+// the first register operand of an instruction is always x and the second y
+//
+static void push_vreg_uses(const uint8_t *types, const uint32_t *payloads, Instruction *output_pos) {
+        int operand = 0;
+
+        for (; types < tkn_types_ptr; ++types) {
+                if (!TKN_HAS_PAYLOAD(*types))
+                        continue;
+
+                uint32_t payload = *payloads++;
+                if (*types != NAME_REG)
+                        continue;
+
+                if (payload >= VREG_BASE) {
+                        ptrdiff_t vreg_uses_pushed = vreg_uses_ptr - vreg_uses;
+
+                        if (vreg_uses_pushed >= vreg_uses_cap) {
+                                VregUse *new_uses;
+                                ptrdiff_t new_cap = vreg_uses_cap ? vreg_uses_cap * 2 : LABEL_BUFFER_INIT_LEN;
+                                if (!(new_uses = realloc(vreg_uses, new_cap * sizeof(VregUse)))) {
+                                        fputs(FMT_ERRMSG("failed to resize buffer for virtual registers\n"), stderr);
+                                        panic(ERR_MALLOC_FAIL);
+                                }
+                                vreg_uses = new_uses;
+                                vreg_uses_cap = new_cap;
+                                vreg_uses_ptr = vreg_uses + vreg_uses_pushed;
+                        }
+
+                        *vreg_uses_ptr++ = (VregUse){
+                                .name = name_pool + (payload - VREG_BASE),
+                                .output_pos = output_pos,
+                                .shift = (operand == 0) ? 8 : 4,
+                                .pos = tkn_positions[types - tkn_types]
+                        };
+                }
+
+                ++operand;
+        }
+}
+
+// names of the trace spans recorded for each statement, by the token starting the statement
+static const char *const parse_spans[STREAM_END + 1] = {
+        [INSTR_CLS]   = "parse_cls",   [INSTR_JMP]   = "parse_jmp",   [INSTR_VJMP]  = "parse_vjmp",
+        [INSTR_CALL]  = "parse_call",  [INSTR_RET]   = "parse_ret",   [INSTR_SNE]   = "parse_sne",
+        [INSTR_SE]    = "parse_se",    [INSTR_MOV]   = "parse_mov",   [INSTR_OR]    = "parse_or",
+        [INSTR_AND]   = "parse_and",   [INSTR_XOR]   = "parse_xor",   [INSTR_ADD]   = "parse_add",
+        [INSTR_SUB]   = "parse_sub",   [INSTR_SUBN]  = "parse_subn",  [INSTR_SHR]   = "parse_shr",
+        [INSTR_SHL]   = "parse_shl",   [INSTR_RND]   = "parse_rnd",   [INSTR_DRW]   = "parse_drw",
+        [INSTR_WKP]   = "parse_wkp",   [INSTR_SKD]   = "parse_skd",   [INSTR_SKU]   = "parse_sku",
+        [INSTR_LDF]   = "parse_ldf",   [INSTR_BCD]   = "parse_bcd",   [INSTR_LOD]   = "parse_lod",
+        [INSTR_STR]   = "parse_str",   [INSTR_PLANE] = "parse_plane", [INSTR_AUDIO] = "parse_audio",
+        [INSTR_PITCH] = "parse_pitch", [INSTR_SAVE]  = "parse_save",  [INSTR_LOAD]  = "parse_load",
+        [DIR_BUDGET]  = "parse_budget", [DIR_ORG]     = "parse_org",   [DIR_SECTION] = "parse_section",
+        [DIR_TABLE]   = "parse_table", [NAME_LBLDEF] = "push_label_def"
+};
+
+//
+// parse_stmts - parses the statements of the token stream up to end, or to its STREAM_END if end is NULL, a statement
+// starting before end is parsed whole even if it runs past it, the words which didn't fit in memory are added to
+// *overflow_words and *overflow_pos is set to the statement where the program first ran past the end
+//
+void parse_stmts(const uint8_t *end, uint32_t *overflow_words, uint32_t *overflow_pos) {
+        while ((!end || tkn_types_ptr < end) && next_tkn().type != STREAM_END) {
+                check_deadline();
+
                 byte_ptr = (uint8_t*)outfile_buffer_ptr;
 
+                Instruction *stmt_start = outfile_buffer_ptr;
+                uint32_t stmt_pos = current_tkn.pos;
+                const uint8_t *stmt_types = tkn_types_ptr;
+                const uint32_t *stmt_payloads = tkn_payloads_ptr;
+
+                // symbols like `,` and `I` are numbered by their character, past the end of the table
+                const char *span = (current_tkn.type <= STREAM_END && parse_spans[current_tkn.type]) ?
+                        parse_spans[current_tkn.type] : "parse_unexpected";
+                trace_begin(span);
+
                 switch (current_tkn.type) {
                         case INSTR_SE:   parse_se();   break;
                         case INSTR_OR:   parse_or();   break;
@@ -577,9 +1085,13 @@ void parse_tkn_stream(void) {
                         case INSTR_VJMP: parse_vjmp(); break;
                         case INSTR_CALL: parse_call(); break;
 
+                        case INSTR_PLANE: parse_plane();          break;
+                        case INSTR_SAVE:  parse_save_load(0x2);   break;
+                        case INSTR_LOAD:  parse_save_load(0x3);   break;
+
                         case INSTR_SHL: 
                                 if (next_tkn().type != NAME_REG) {
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected a register name");
                                         ++error_count;
                                 }
@@ -590,7 +1102,7 @@ void parse_tkn_stream(void) {
                                 break;
                         case INSTR_SHR:
                                 if (next_tkn().type != NAME_REG) {
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected a register name");
                                         ++error_count;
                                 }
@@ -601,7 +1113,7 @@ void parse_tkn_stream(void) {
                                 break;
                         case INSTR_WKP:
                                 if (next_tkn().type != NAME_REG) {
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected a register name");
                                         ++error_count;
                                 }
@@ -612,7 +1124,7 @@ void parse_tkn_stream(void) {
                                 break;
                         case INSTR_SKD:
                                 if (next_tkn().type != NAME_REG) {
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected a register name");
                                         ++error_count;
                                 }
@@ -623,7 +1135,7 @@ void parse_tkn_stream(void) {
                                 break;
                         case INSTR_SKU:
                                 if (next_tkn().type != NAME_REG) {
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected a register name");
                                         ++error_count;
                                 }
@@ -634,7 +1146,7 @@ void parse_tkn_stream(void) {
                                 break;
                         case INSTR_LDF:
                                 if (next_tkn().type != NAME_REG) {
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected a register name");
                                         ++error_count;
                                 }
@@ -645,7 +1157,7 @@ void parse_tkn_stream(void) {
                                 break;
                         case INSTR_BCD:
                                 if (next_tkn().type != NAME_REG) {
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected a register name");
                                         ++error_count;
                                 }
@@ -656,7 +1168,7 @@ void parse_tkn_stream(void) {
                                 break;
                         case INSTR_LOD:
                                 if (next_tkn().type != NAME_REG) {
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected a register name");
                                         ++error_count;
                                 }
@@ -667,7 +1179,7 @@ void parse_tkn_stream(void) {
                                 break;
                         case INSTR_STR:
                                 if (next_tkn().type != NAME_REG) {
-                                        print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                        print_msg(ERROR, current_tkn.pos,
                                                 "expected a register name");
                                         ++error_count;
                                 }
@@ -675,6 +1187,26 @@ void parse_tkn_stream(void) {
                                 byte_ptr[0] = 0xF0 | current_tkn.value.num;
                                 byte_ptr[1] = 0x55;
 
+                                break;
+                        case INSTR_PITCH:
+                                require_xochip(current_tkn.pos, "pitch");
+
+                                if (next_tkn().type != NAME_REG) {
+                                        print_msg(ERROR, current_tkn.pos,
+                                                "expected a register name");
+                                        ++error_count;
+                                }
+
+                                byte_ptr[0] = 0xF0 | current_tkn.value.num;
+                                byte_ptr[1] = 0x3A;
+
+                                break;
+                        case INSTR_AUDIO:
+                                require_xochip(current_tkn.pos, "audio");
+
+                                byte_ptr[0] = 0xF0;
+                                byte_ptr[1] = 0x02;
+
                                 break;
                         case INSTR_CLS:
                                 byte_ptr[0] = 0x00;
@@ -688,14 +1220,197 @@ void parse_tkn_stream(void) {
                                 break;
                         case NAME_LBLDEF:
                                 push_label_def(&current_tkn);
+                                trace_end(span);
+                                continue;
+                        case DIR_BUDGET:
+                                parse_budget();
+                                trace_end(span);
+                                continue;
+                        case DIR_ORG:
+                                parse_org();
+                                trace_end(span);
+                                continue;
+                        case DIR_SECTION:
+                                parse_section();
+                                trace_end(span);
+                                continue;
+                        case DIR_TABLE: {
+                                uint32_t lost_words = parse_table(stmt_pos);
+
+                                if (lost_words > 0) {
+                                        if (*overflow_words == 0)
+                                                *overflow_pos = stmt_pos;
+                                        *overflow_words += lost_words;
+                                }
+
+                                trace_end(span);
                                 continue;
+                        }
 
                         default:
-                                print_msg(ERROR, current_tkn.line, current_tkn.col,
+                                print_msg(ERROR, current_tkn.pos,
                                         "expected a label definition or a mnemonic");
                                 ++error_count;
                 }
 
+                if (stmt_has_vreg) {
+                        push_vreg_uses(stmt_types, stmt_payloads, stmt_start);
+                        stmt_has_vreg = false;
+                }
+
                 ++outfile_buffer_ptr;
+
+                // every word of an instruction maps back to its mnemonic
+                for (Instruction *word = stmt_start; word < outfile_buffer_ptr; ++word)
+                        instr_positions[word - outfile_buffer] = stmt_pos;
+
+                // words past the end of memory are counted and then written over by the next statement
+                if (outfile_buffer_ptr > outfile_buffer_end) {
+                        if (*overflow_words == 0)
+                                *overflow_pos = stmt_pos;
+
+                        *overflow_words += outfile_buffer_ptr - ((stmt_start > outfile_buffer_end) ? stmt_start :
+                                outfile_buffer_end);
+                        outfile_buffer_ptr = outfile_buffer_end;
+                }
+
+                trace_end(span);
+        }
+}
+
+//
+// parse_tkn_stream - examines the token stream and performs a procedure accordingly, on several threads if
+// parse_threads allows it, see parallel.c
+//
+void parse_tkn_stream(void) {
+        // words which didn't fit in memory and the statement where the program first ran past the end
+        uint32_t overflow_words = 0, overflow_pos = 0;
+
+        if (parse_threads > 1 && parse_in_parallel())
+                return;
+
+        parse_stmts(NULL, &overflow_words, &overflow_pos);
+
+        if (sections_ptr > sections)
+                sections_ptr[-1].end = outfile_buffer_ptr - outfile_buffer;
+
+        if (overflow_words > 0) {
+                print_msg(ERROR, overflow_pos, "program exceeds the address space by %lu bytes from here",
+                        (unsigned long)overflow_words * C8_INSTR_SIZE);
+                ++error_count;
+        }
+}
+
+//
+// cmp_label_defs - orders label definitions by name, then by position in the source
+//
+static int cmp_label_defs(const void *a, const void *b) {
+        const LabelDef *x = a, *y = b;
+        int diff = strcmp(x->label_text, y->label_text);
+
+        if (diff)
+                return diff;
+
+        return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+//
+// cmp_label_def_ptrs - orders pointers to label definitions by position in the source
+//
+static int cmp_label_def_ptrs(const void *a, const void *b) {
+        const LabelDef *x = *(LabelDef *const *)a, *y = *(LabelDef *const *)b;
+
+        return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+//
+// cmp_label_name - compares a label name to the name of a label definition, used with bsearch
+//
+static int cmp_label_name(const void *name, const void *def) {
+        return strcmp(name, ((const LabelDef*)def)->label_text);
+}
+
+//
+// resolve_refs - patches refs_len label references with the addresses of their labels, the definition table must be
+// sorted by name
+//
+void resolve_refs(LabelRef *refs, ptrdiff_t refs_len) {
+        ptrdiff_t label_defs_len = label_defs_ptr - label_defs;
+        LabelDef *def;
+        uint8_t *instr_ptr;
+
+        for (ptrdiff_t i = 0; i < refs_len; ++i) {
+                if (!(def = bsearch(refs[i].label_text, label_defs, label_defs_len, sizeof(LabelDef),
+                                cmp_label_name))) {
+                        print_msg(ERROR, refs[i].pos, "undefined reference to label `%s`", refs[i].label_text);
+                        ++error_count;
+                        continue;
+                }
+
+                instr_ptr = (uint8_t*)refs[i].output_pos;
+
+                if (refs[i].kind == REF_ADDR16) {
+                        instr_ptr[0] = def->c8_addr >> 8;
+                        instr_ptr[1] = def->c8_addr & 0x0FF;
+                        continue;
+                }
+
+                if (def->c8_addr > 0xFFF) {
+                        print_msg(ERROR, refs[i].pos, "label `%s` (0x%X) is out of range for this instruction (>0xFFF)",
+                                refs[i].label_text, (unsigned)def->c8_addr);
+                        ++error_count;
+                        continue;
+                }
+
+                instr_ptr[0] = (instr_ptr[0] & 0xF0) | ((def->c8_addr & 0xF00) >> 8);
+                instr_ptr[1] = def->c8_addr & 0x0FF;
         }
 }
+
+//
+// resolve_labels - checks that label definitions are unique and patches label references with their addresses
+//
+// the definition table is sorted by name so duplicates end up adjacent and each reference is found with a binary
+// search rather than by comparing it against every definition, diagnostics are still reported in source order
+//
+void resolve_labels(void) {
+        ptrdiff_t label_defs_len = label_defs_ptr - label_defs;
+        ptrdiff_t label_refs_len = label_refs_ptr - label_refs;
+
+        trace_begin("check duplicate labels");
+
+        qsort(label_defs, label_defs_len, sizeof(LabelDef), cmp_label_defs);
+
+        // check that label definitions are unique
+        LabelDef **dups = NULL;
+        ptrdiff_t dups_len = 0;
+
+        for (ptrdiff_t i = 1; i < label_defs_len; ++i) {
+                if (strcmp(label_defs[i - 1].label_text, label_defs[i].label_text))
+                        continue;
+
+                if (!dups)
+                        dups = alloc_or_panic(label_defs_len, sizeof(LabelDef*), "checking for duplicate labels");
+                dups[dups_len++] = &label_defs[i];
+        }
+
+        if (dups) {
+                qsort(dups, dups_len, sizeof(LabelDef*), cmp_label_def_ptrs);
+                for (ptrdiff_t i = 0; i < dups_len; ++i) {
+                        print_msg(ERROR, dups[i]->pos, "multiple definition of label `%s`",
+                                dups[i]->label_text);
+                        ++error_count;
+                }
+                free_scratch(dups);
+        }
+
+        trace_end("check duplicate labels");
+
+        // resolve label references
+        trace_begin("resolve references");
+
+        if (!(parse_threads > 1 && resolve_in_parallel()))
+                resolve_refs(label_refs, label_refs_len);
+
+        trace_end("resolve references");
+}
@@ -2,44 +2,153 @@
         #define PARSER_H_INCLUDED 1
 
         #include <stdint.h>
+        #include <stddef.h>
+        #include <stdbool.h>
 
+        #include "threadlocal.h"
         #include "lexer.h"
 
         enum {LABEL_BUFFER_INIT_LEN = 32};
 
+        // programs are loaded at 0x200, the memory below holds the interpreter
+        enum {C8_INSTR_SIZE = 2, C8_CODE_START_ADDR = 0x200};
+
+        // end of the address space of each target
+        enum {C8_MEM_END = 0x1000, XOCHIP_MEM_END = 0x10000};
+
+        // words in the output image, which holds the largest program for any target plus room for a statement
+        // running past the end of memory as it is written before the overflow is caught
+        enum {IMAGE_WORDS = (XOCHIP_MEM_END - C8_CODE_START_ADDR) / C8_INSTR_SIZE + 2};
+
         typedef uint16_t Instruction;
 
+        // these values correspond to the C8ASM_TARGET_* constants in c8asm.h
+        typedef enum {
+                TARGET_CHIP8,
+                TARGET_XOCHIP
+        } Target;
+
+        // the width of the address field patched when a label reference is resolved
+        typedef enum {
+                REF_ADDR12, // the low 12 bits of the instruction
+                REF_ADDR16  // the whole instruction word, used by the second word of `mov I, long`
+        } RefKind;
+
         typedef struct {
                 char *label_text;
-                uint16_t c8_addr;
+                uint32_t c8_addr;
 
-                uint16_t line, col;
+                uint32_t pos;
         } LabelDef;
 
         typedef struct {
                 char *label_text;
                 Instruction *output_pos;
+                RefKind kind;
 
-                uint16_t line, col;
+                uint32_t pos;
         } LabelRef;
 
-        extern Token current_tkn;
-        extern Token *tkn_stream, *tkn_stream_ptr;
+        // an instruction budget set with the budget directive, checked by analyze_program
+        typedef struct {
+                char *label_text;
+                int limit;
+
+                uint32_t pos;
+        } Budget;
+
+        // a run of statements opened by an org or section directive, runs of a section with the same name are placed
+        // one after another by place_sections, the statements before the first directive are in the `code` section
+        typedef struct {
+                const char *name;     // NULL for an org directive
+                uint32_t start, end;  // range of words in the output stream as parsed
+                long org;             // address the section is fixed at or -1 if it is placed by place_sections
+                uint32_t align;       // in bytes
+
+                uint32_t pos;
+        } Section;
+
+        // a virtual register operand, the nibble it goes in is left as 0 until allocate_registers patches in the
+        // register it is given
+        typedef struct {
+                char *name;
+                Instruction *output_pos;
+                int shift; // 8 for the x operand, 4 for the y operand
+
+                uint32_t pos;
+        } VregUse;
 
-        extern Instruction *outfile_buffer, *outfile_buffer_ptr;
+        extern THREAD_LOCAL Token current_tkn;
+        extern THREAD_LOCAL bool stmt_has_vreg; // set by next_tkn when a virtual register is read
 
-        extern LabelDef *label_defs, *label_defs_ptr;
-        extern LabelRef *label_refs, *label_refs_ptr;
+        extern THREAD_LOCAL Instruction *outfile_buffer, *outfile_buffer_ptr;
+        extern THREAD_LOCAL Instruction *outfile_buffer_end; // end of memory for the target
+        extern THREAD_LOCAL uint32_t *instr_positions; // source offset of the statement behind each output word
 
-        extern int error_count, warning_count;
+        // position of the words of the output stream left between sections, which hold no statement
+        #define POS_NONE UINT32_MAX
 
+        extern THREAD_LOCAL LabelDef *label_defs, *label_defs_ptr;
+        extern THREAD_LOCAL LabelRef *label_refs, *label_refs_ptr;
+        extern THREAD_LOCAL ptrdiff_t label_defs_cap, label_refs_cap;
+
+        extern THREAD_LOCAL Budget *budgets, *budgets_ptr;
+        extern THREAD_LOCAL ptrdiff_t budgets_cap;
+
+        extern THREAD_LOCAL Section *sections, *sections_ptr;
+        extern THREAD_LOCAL ptrdiff_t sections_cap;
+
+        // source offsets of the table directives in source order, a word of the output stream holds table data when
+        // its position is one of these
+        extern THREAD_LOCAL uint32_t *table_positions, *table_positions_ptr;
+        extern THREAD_LOCAL ptrdiff_t table_positions_cap;
+
+        extern THREAD_LOCAL VregUse *vreg_uses, *vreg_uses_ptr;
+        extern THREAD_LOCAL ptrdiff_t vreg_uses_cap;
+
+        extern THREAD_LOCAL int error_count, warning_count;
+
+        extern THREAD_LOCAL Target target;
+
+        extern void parse_stmts(const uint8_t *end, uint32_t *overflow_words, uint32_t *overflow_pos);
         extern void parse_tkn_stream(void);
+        extern void resolve_refs(LabelRef *refs, ptrdiff_t refs_len);
+        extern void resolve_labels(void);
         extern void parser_error(char *errmsg);
+        extern bool is_table_word(uint32_t i);
 
         //
-        // next_tkn - get the next token from the token stream
+        // program_words - gets the number of words of memory a program can take on a target
+        //
+        inline uint32_t program_words(Target machine) {
+                return ((machine == TARGET_XOCHIP) ? XOCHIP_MEM_END - C8_CODE_START_ADDR :
+                        C8_MEM_END - C8_CODE_START_ADDR) / C8_INSTR_SIZE;
+        }
+
+        //
+        // next_tkn - get the next token from the token stream, the stream stays at its STREAM_END once it gets there
+        // so a statement cut short by the end of the source never reads past the stream
         //
         inline Token next_tkn(void) {
-                return (current_tkn = *tkn_stream_ptr++);
+                if (*tkn_types_ptr == STREAM_END) {
+                        current_tkn.type = STREAM_END;
+                        current_tkn.pos = *tkn_positions_ptr;
+                        return current_tkn;
+                }
+
+                current_tkn.type = *tkn_types_ptr++;
+                current_tkn.pos = *tkn_positions_ptr++;
+
+                if (TKN_HAS_PAYLOAD(current_tkn.type)) {
+                        current_tkn.value.num = *tkn_payloads_ptr++;
+
+                        // a virtual register reads as v0 until the allocator gives it a register
+                        if (current_tkn.type == NAME_REG && current_tkn.value.num >= VREG_BASE) {
+                                current_tkn.value.num = 0;
+                                stmt_has_vreg = true;
+                        }
+                }
+
+                return current_tkn;
         }
 #endif
@@ -1,37 +1,276 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
 
+#include "exitcodes.h"
 #include "print_msg.h"
+#include "parser.h"
+#include "sandbox.h"
+#include "panic.h"
 #include "ansicodes.h"
 
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+// output built by flush_msgs, written with a single call
+static THREAD_LOCAL char *out_buf;
+static THREAD_LOCAL size_t out_len, out_cap;
+
 //
-// print_msg - prints formatted error/warning messages
+// grow - grows a buffer to hold at least len bytes, panics on failure
 //
-void print_msg(MsgType msgtype, int line, int col, char *fmt, ...) {
-        char errmsg[128];
+static void grow(char **buf, size_t *cap, size_t len) {
+        if (len <= *cap)
+                return;
+
+        size_t new_cap = *cap ? *cap : 256;
+        while (new_cap < len)
+                new_cap *= 2;
 
+        char *new_buf;
+        if (!(new_buf = realloc(*buf, new_cap))) {
+                fputs(FMT_ERRMSG("failed to allocate buffer for diagnostics\n"), stderr);
+                panic(ERR_MALLOC_FAIL);
+        }
+
+        *buf = new_buf;
+        *cap = new_cap;
+}
+
+//
+// print_msg - collects a formatted error/warning message, pos is an offset in the source from which the line and
+// column are derived when the messages are flushed
+//
+void print_msg(MsgType msgtype, uint32_t pos, char *fmt, ...) {
         va_list arglist;
+
         va_start(arglist, fmt);
-        vsnprintf(errmsg, 127, fmt, arglist);
+        int len = vsnprintf(NULL, 0, fmt, arglist);
         va_end(arglist);
 
+        grow(&msg_text, &msg_text_cap, msg_text_len + len + 1);
+
+        va_start(arglist, fmt);
+        vsnprintf(msg_text + msg_text_len, len + 1, fmt, arglist);
+        va_end(arglist);
+
+        if (msgs_len >= msgs_cap) {
+                Msg *new_msgs;
+                size_t new_cap = msgs_cap ? msgs_cap * 2 : 16;
+
+                if (!(new_msgs = realloc(msgs, new_cap * sizeof(Msg)))) {
+                        fputs(FMT_ERRMSG("failed to allocate buffer for diagnostics\n"), stderr);
+                        panic(ERR_MALLOC_FAIL);
+                }
+                msgs = new_msgs;
+                msgs_cap = new_cap;
+        }
+
+        msgs[msgs_len] = (Msg){
+                .type = msgtype,
+                .pos = pos,
+                .seq = msgs_len,
+                .text = msg_text_len
+        };
+
+        ++msgs_len;
+        msg_text_len += len + 1;
+
+        // the caller counts the error, unless assembly is abandoned here as it goes past the limit
+        if (msgtype == ERROR && limit_errors && (uint32_t)error_count >= limit_errors) {
+                ++error_count;
+                panic(ERR_LIMIT_ERRORS);
+        }
+}
+
+//
+// append_msgs - appends messages collected on another thread after the ones collected so far, as if they had been
+// collected here in the order given, returns 0 if the buffers couldn't grow
+//
+int append_msgs(const Msg *from, size_t from_len, const char *from_text, size_t from_text_len) {
+        if (msgs_len + from_len > msgs_cap) {
+                Msg *new_msgs;
+                size_t new_cap = msgs_cap ? msgs_cap : 16;
+
+                while (new_cap < msgs_len + from_len)
+                        new_cap *= 2;
+
+                if (!(new_msgs = realloc(msgs, new_cap * sizeof(Msg))))
+                        return 0;
+                msgs = new_msgs;
+                msgs_cap = new_cap;
+        }
+
+        if (msg_text_len + from_text_len > msg_text_cap) {
+                char *new_text;
+                size_t new_cap = msg_text_cap ? msg_text_cap : 256;
+
+                while (new_cap < msg_text_len + from_text_len)
+                        new_cap *= 2;
+
+                if (!(new_text = realloc(msg_text, new_cap)))
+                        return 0;
+                msg_text = new_text;
+                msg_text_cap = new_cap;
+        }
+
+        for (size_t i = 0; i < from_len; ++i) {
+                msgs[msgs_len] = from[i];
+                msgs[msgs_len].seq = msgs_len;
+                msgs[msgs_len].text += msg_text_len;
+                ++msgs_len;
+        }
+
+        if (from_text_len)
+                memcpy(msg_text + msg_text_len, from_text, from_text_len);
+        msg_text_len += from_text_len;
+
+        return 1;
+}
+
+//
+// cmp_msgs - orders messages by position in the source, then by the order they were collected in
+//
+static int cmp_msgs(const void *a, const void *b) {
+        const Msg *x = a, *y = b;
+
+        if (x->pos != y->pos)
+                return (x->pos > y->pos) - (x->pos < y->pos);
+
+        return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+//
+// append - appends formatted text to the output buffer
+//
+static void append(const char *fmt, ...) {
+        va_list arglist;
+
+        va_start(arglist, fmt);
+        int len = vsnprintf(NULL, 0, fmt, arglist);
+        va_end(arglist);
+
+        grow(&out_buf, &out_cap, out_len + len + 1);
+
+        va_start(arglist, fmt);
+        vsnprintf(out_buf + out_len, len + 1, fmt, arglist);
+        va_end(arglist);
+
+        out_len += len;
+}
+
+//
+// append_json_str - appends a string to the output buffer as a JSON string literal
+//
+static void append_json_str(const char *str) {
+        append("\"");
+        for (; *str; ++str) {
+                if (*str == '"' || *str == '\\')
+                        append("\\%c", *str);
+                else if ((unsigned char)*str < 0x20)
+                        append("\\u%04x", *str);
+                else
+                        append("%c", *str);
+        }
+        append("\"");
+}
+
+//
+// flush_msgs - sorts the collected messages by location, drops duplicates and writes them to stream with a single
+// write, at most diag_max_errors errors are written if it is above zero
+//
+void flush_msgs(FILE *stream) {
+        // the buffer is NULL until a context has collected a message
+        if (msgs_len > 0)
+                qsort(msgs, msgs_len, sizeof(Msg), cmp_msgs);
+
+        // drop messages identical to an earlier one at the same location
+        size_t unique_len = 0;
+        for (size_t i = 0; i < msgs_len; ++i) {
+                bool is_dup = false;
+                for (size_t j = unique_len; j-- > 0 && msgs[j].pos == msgs[i].pos && !is_dup;)
+                        is_dup = msgs[j].type == msgs[i].type &&
+                                !strcmp(msg_text + msgs[j].text, msg_text + msgs[i].text);
+
+                if (!is_dup)
+                        msgs[unique_len++] = msgs[i];
+        }
+        msgs_len = unique_len;
+
+        error_count = warning_count = 0;
+        for (size_t i = 0; i < msgs_len; ++i)
+                if (msgs[i].type == ERROR)
+                        ++error_count;
+                else
+                        ++warning_count;
+
+        out_len = 0;
+        if (diag_format == DIAG_JSON)
+                append("{\"errors\":%d,\"warnings\":%d,\"diagnostics\":[", error_count, warning_count);
+
+        // messages are sorted so lines and columns are found in a single pass over the source
         char *infile_buffer_alias = infile_buffer;
+        char *infile_buffer_end = infile_buffer + infile_len;
+        char *line_start = infile_buffer;
+        long line = 1, col;
+
+        int msgs_shown = 0, errors_shown = 0, errors_hidden = 0;
+        for (size_t i = 0; i < msgs_len; ++i) {
+                if (msgs[i].type == ERROR && diag_max_errors > 0 && errors_shown >= diag_max_errors) {
+                        ++errors_hidden;
+                        continue;
+                }
+                if (msgs[i].type == ERROR)
+                        ++errors_shown;
+                ++msgs_shown;
+
+                while (infile_buffer_alias < infile_buffer + msgs[i].pos)
+                        if (*infile_buffer_alias++ == '\n') {
+                                ++line;
+                                line_start = infile_buffer_alias;
+                        }
+                col = msgs[i].pos - (line_start - infile_buffer) + 1;
+
+                if (diag_format == DIAG_JSON) {
+                        append("%s{\"file\":", (msgs_shown > 1) ? "," : "");
+                        append_json_str(infile_name);
+                        append(",\"line\":%ld,\"column\":%ld,\"offset\":%lu,\"severity\":\"%s\",\"message\":", line, col,
+                                (unsigned long)msgs[i].pos, (msgs[i].type == ERROR) ? "error" : "warning");
+                        append_json_str(msg_text + msgs[i].text);
+                        append("}");
+                        continue;
+                }
+
+                if (msgs[i].type == ERROR)
+                        append(BOLD("%s:%ld:%ld: " RED("error")) BOLD(": %s") "\n", infile_name, line, col,
+                                msg_text + msgs[i].text);
+                else
+                        append(BOLD("%s:%ld:%ld: " MAGENTA("warning")) BOLD(": %s") "\n", infile_name, line, col,
+                                msg_text + msgs[i].text);
+
+                char *line_end = line_start;
+                while (line_end < infile_buffer_end && *line_end != '\n')
+                        ++line_end;
+
+                append("%.*s\n%*s" BOLD(YELLOW("^")) "\n\n", (int)(line_end - line_start), line_start, (int)col - 1, "");
+        }
 
-        int lines_found = 0;
-        while (lines_found < line - 1 && infile_buffer_alias <= infile_buffer_ptr)
-                if (*infile_buffer_alias++ == '\n')
-                        ++lines_found;
+        if (diag_format == DIAG_JSON)
+                append("],\"suppressed\":%d}\n", errors_hidden);
+        else if (errors_hidden > 0)
+                append("%d further error(s) not shown\n", errors_hidden);
 
-        if (msgtype == ERROR)
-                fprintf(stderr, BOLD("%s:%d:%d: " RED("error")) BOLD(": %s") "\n", infile_name, line, col, errmsg);
-        else
-                fprintf(stderr, BOLD("%s:%d:%d: " MAGENTA("warning")) BOLD(": %s") "\n", infile_name, line, col, errmsg);
+        if (out_len > 0) {
+                fwrite(out_buf, 1, out_len, stream);
+                fflush(stream);
+        }
 
-        while (*infile_buffer_alias != '\n')
-                putchar(*infile_buffer_alias++);
+        free(out_buf);
+        out_buf = NULL;
+        out_len = out_cap = 0;
 
-        putchar('\n');
-        while (--col > 0)
-                putchar(' ');
-        fputs(BOLD(YELLOW("^")) "\n\n", stdout);
+        msgs_len = msg_text_len = 0;
 }
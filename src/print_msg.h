@@ -6,7 +6,38 @@
                 WARNING
         } MsgType;
 
-        extern char *infile_name, *infile_buffer, *infile_buffer_ptr;
+        // these values correspond to the C8ASM_DIAG_* constants in c8asm.h
+        typedef enum {
+                DIAG_TEXT,
+                DIAG_JSON
+        } DiagFormat;
+
+        #include <stdio.h>
+        #include <stdint.h>
+        #include <stddef.h>
+
+        #include "threadlocal.h"
+
+        // a collected diagnostic, text is an offset into msg_text
+        typedef struct {
+                MsgType type;
+                uint32_t pos;
+                uint32_t seq;
+                size_t text;
+        } Msg;
+
+        extern THREAD_LOCAL long infile_len;
+        extern THREAD_LOCAL char *infile_name, *infile_buffer, *infile_buffer_ptr;
+
+        extern THREAD_LOCAL Msg *msgs;
+        extern THREAD_LOCAL size_t msgs_len, msgs_cap;
+        extern THREAD_LOCAL char *msg_text;
+        extern THREAD_LOCAL size_t msg_text_len, msg_text_cap;
+
+        extern THREAD_LOCAL DiagFormat diag_format;
+        extern THREAD_LOCAL int diag_max_errors;
 
-        extern void print_msg(MsgType msgtype, int line, int col, char *fmt, ...);
+        extern void print_msg(MsgType msgtype, uint32_t pos, char *fmt, ...);
+        extern int append_msgs(const Msg *from, size_t from_len, const char *from_text, size_t from_text_len);
+        extern void flush_msgs(FILE *stream);
 #endif
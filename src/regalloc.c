@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "parser.h"
+#include "analyze.h"
+#include "regalloc.h"
+#include "compact.h"
+#include "print_msg.h"
+#include "alloc.h"
+
+// vf holds the flag set by arithmetic and `drw` so it is never given to a virtual register
+enum {REGS = 16, REG_FLAGS = 0xF, NO_VREG = -1};
+
+THREAD_LOCAL uint32_t vregs_allocated, vreg_moves_removed;
+
+// sets of virtual registers, one bit each
+typedef uint64_t Set;
+
+static THREAD_LOCAL int sets_words;
+
+//
+// set_has - checks whether a set holds a virtual register
+//
+static bool set_has(const Set *set, int v) {
+        return set[v / 64] >> (v % 64) & 1;
+}
+
+//
+// set_add - adds a virtual register to a set
+//
+static void set_add(Set *set, int v) {
+        set[v / 64] |= (Set)1 << (v % 64);
+}
+
+//
+// set_union - adds every virtual register of one set to another, returns whether that changed it
+//
+static bool set_union(Set *to, const Set *from) {
+        Set changed = 0;
+
+        for (int i = 0; i < sets_words; ++i) {
+                changed |= from[i] & ~to[i];
+                to[i] |= from[i];
+        }
+
+        return changed != 0;
+}
+
+//
+// cmp_use_names - orders pointers to virtual register uses by name, then by position in the source
+//
+static int cmp_use_names(const void *a, const void *b) {
+        const VregUse *x = *(VregUse *const *)a, *y = *(VregUse *const *)b;
+        int diff = strcmp(x->name, y->name);
+
+        if (diff)
+                return diff;
+
+        return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+//
+// reg_operands - finds which of the x and y fields of an instruction name a register, along with the registers it
+// reads or writes as a range, first to last
+//
+static void reg_operands(uint16_t word, bool *x, bool *y, int *first, int *last) {
+        int nn = word & 0xFF, reg_x = (word >> 8) & 0xF, reg_y = (word >> 4) & 0xF;
+
+        *x = *y = false;
+        *first = 0;
+        *last = -1;
+
+        switch (word >> 12) {
+                case 0x3: // FALLTHROUGH
+                case 0x4:
+                case 0x6:
+                case 0x7:
+                case 0xC:
+                case 0xE:
+                        *x = true;
+                        break;
+                case 0x5:
+                        if ((word & 0xF) == 0x2 || (word & 0xF) == 0x3) {
+                                *first = (reg_x < reg_y) ? reg_x : reg_y;
+                                *last = (reg_x < reg_y) ? reg_y : reg_x;
+                                break;
+                        }
+                        // FALLTHROUGH
+                case 0x8:
+                case 0x9:
+                case 0xD:
+                        *x = *y = true;
+                        break;
+                case 0xB:
+                        *last = 0;
+                        break;
+                case 0xF:
+                        if (nn == 0x55 || nn == 0x65)
+                                *last = reg_x;
+                        else if (nn != 0x00 && nn != 0x01 && nn != 0x02)
+                                *x = true;
+                        break;
+        }
+}
+
+//
+// vreg_effects - finds the virtual register an instruction writes and the ones it reads, NO_VREG where there are none
+//
+static void vreg_effects(uint16_t word, int vx, int vy, int *def, int *use_x, int *use_y) {
+        *def = *use_x = *use_y = NO_VREG;
+
+        switch (word >> 12) {
+                case 0x6: // FALLTHROUGH
+                case 0xC:
+                        *def = vx;
+                        break;
+                case 0x7:
+                        *def = *use_x = vx;
+                        break;
+                case 0x8:
+                        *def = vx;
+                        *use_y = vy;
+                        if ((word & 0xF) != 0x0)
+                                *use_x = vx;
+                        break;
+                case 0xF:
+                        if ((word & 0xFF) == 0x07 || (word & 0xFF) == 0x0A)
+                                *def = vx;
+                        else
+                                *use_x = vx;
+                        break;
+                default:
+                        *use_x = vx;
+                        *use_y = vy;
+        }
+}
+
+//
+// find_liveness - finds the virtual registers live on exit from every block by iterating to a fixed point, a block
+// ending in a call also flows into the subroutine, and `ret` flows to the return point of every call as which call
+// it returns to isn't known
+//
+static void find_liveness(Set *live_out, const Set *gen, const Set *kill, const bool *ends_in_ret) {
+        Set *live_in = alloc_or_panic((size_t)blocks_len * sets_words, sizeof(Set), "register allocation");
+        Set *ret_live = alloc_or_panic(sets_words, sizeof(Set), "register allocation");
+
+        bool changed = true;
+        while (changed) {
+                changed = false;
+
+                for (int b = 0; b < blocks_len; ++b)
+                        if (blocks[b].call_target >= 0 && b + 1 < blocks_len)
+                                set_union(ret_live, &live_in[(b + 1) * sets_words]);
+
+                for (int b = blocks_len - 1; b >= 0; --b) {
+                        Set *out = &live_out[b * sets_words], *in = &live_in[b * sets_words];
+
+                        for (int s = 0; s < blocks[b].succ_len; ++s)
+                                changed |= set_union(out, &live_in[blocks[b].succ[s] * sets_words]);
+                        if (blocks[b].call_target >= 0)
+                                changed |= set_union(out, &live_in[blocks[b].call_target * sets_words]);
+                        if (ends_in_ret[b])
+                                changed |= set_union(out, ret_live);
+
+                        // where a vjmp goes is unknown so everything is live after it
+                        if (blocks[b].indirect) {
+                                for (int i = 0; i < sets_words; ++i) {
+                                        changed |= out[i] != ~(Set)0;
+                                        out[i] = ~(Set)0;
+                                }
+                        }
+
+                        for (int i = 0; i < sets_words; ++i) {
+                                Set new_in = gen[b * sets_words + i] | (out[i] & ~kill[b * sets_words + i]);
+
+                                changed |= new_in != in[i];
+                                in[i] = new_in;
+                        }
+                }
+        }
+
+        free_scratch(live_in);
+        free_scratch(ret_live);
+}
+
+//
+// allocate_registers - gives every virtual register a register no other virtual register live at the same time
+// has, and which the program never names directly, then patches the registers into the program
+//
+// live ranges are found over the control flow graph and the registers are found by coloring the graph of virtual
+// registers live at the same time, copies between virtual registers are given the same register where possible and
+// the copies which then do nothing are taken out, nothing is spilled so a program needing more registers than are
+// free is an error
+//
+void allocate_registers(void) {
+        ptrdiff_t uses_len = vreg_uses_ptr - vreg_uses;
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+
+        if (uses_len == 0 || !build_cfg())
+                return;
+
+        // number the virtual registers by name
+        VregUse **by_name = alloc_or_panic(uses_len, sizeof(VregUse*), "register allocation");
+        for (ptrdiff_t i = 0; i < uses_len; ++i)
+                by_name[i] = &vreg_uses[i];
+        qsort(by_name, uses_len, sizeof(VregUse*), cmp_use_names);
+
+        int *vreg_x = alloc_or_panic(words_len, sizeof(int), "register allocation");
+        int *vreg_y = alloc_or_panic(words_len, sizeof(int), "register allocation");
+        VregUse **first_use = alloc_or_panic(uses_len, sizeof(VregUse*), "register allocation");
+        int vregs_len = 0;
+
+        for (uint32_t i = 0; i < words_len; ++i)
+                vreg_x[i] = vreg_y[i] = NO_VREG;
+
+        for (ptrdiff_t i = 0; i < uses_len; ++i) {
+                if (i == 0 || strcmp(by_name[i - 1]->name, by_name[i]->name))
+                        first_use[vregs_len++] = by_name[i];
+
+                uint32_t word = by_name[i]->output_pos - outfile_buffer;
+                *((by_name[i]->shift == 8) ? &vreg_x[word] : &vreg_y[word]) = vregs_len - 1;
+        }
+
+        // registers named anywhere in the program, or read and written as a range, are left alone
+        bool named[REGS] = {[REG_FLAGS] = true};
+        for (uint32_t i = 0; i < words_len; i += instr_len(instr_word(outfile_buffer, i))) {
+                uint16_t word = instr_word(outfile_buffer, i);
+                bool x, y;
+                int first, last;
+
+                reg_operands(word, &x, &y, &first, &last);
+
+                if (first <= last && (vreg_x[i] != NO_VREG || vreg_y[i] != NO_VREG)) {
+                        for (VregUse *use = vreg_uses; use < vreg_uses_ptr; ++use) {
+                                if (use->output_pos != outfile_buffer + i)
+                                        continue;
+
+                                print_msg(ERROR, use->pos, "virtual register `%%%s` can't be used by an instruction "
+                                        "working on a range of registers", use->name);
+                                ++error_count;
+                        }
+                }
+
+                for (int r = first; r <= last; ++r)
+                        named[r] = true;
+                if (x && vreg_x[i] == NO_VREG)
+                        named[(word >> 8) & 0xF] = true;
+                if (y && vreg_y[i] == NO_VREG)
+                        named[(word >> 4) & 0xF] = true;
+        }
+
+        sets_words = (vregs_len + 63) / 64;
+
+        Set *gen = alloc_or_panic((size_t)blocks_len * sets_words, sizeof(Set), "register allocation");
+        Set *kill = alloc_or_panic((size_t)blocks_len * sets_words, sizeof(Set), "register allocation");
+        Set *live_out = alloc_or_panic((size_t)blocks_len * sets_words, sizeof(Set), "register allocation");
+        Set *interferes = alloc_or_panic((size_t)vregs_len * sets_words, sizeof(Set), "register allocation");
+        Set *live = alloc_or_panic(sets_words, sizeof(Set), "register allocation");
+        bool *ends_in_ret = alloc_or_panic(blocks_len, sizeof(bool), "register allocation");
+        uint32_t *instrs = alloc_or_panic(words_len, sizeof(uint32_t), "register allocation");
+        int *partner = alloc_or_panic(vregs_len, sizeof(int), "register allocation");
+
+        for (int v = 0; v < vregs_len; ++v)
+                partner[v] = NO_VREG;
+
+        for (int b = 0; b < blocks_len; ++b) {
+                Set *block_gen = &gen[b * sets_words], *block_kill = &kill[b * sets_words];
+
+                for (uint32_t i = blocks[b].start; i < blocks[b].end; i += instr_len(instr_word(outfile_buffer, i))) {
+                        int def, use_x, use_y;
+                        vreg_effects(instr_word(outfile_buffer, i), vreg_x[i], vreg_y[i], &def, &use_x, &use_y);
+
+                        if (use_x != NO_VREG && !set_has(block_kill, use_x))
+                                set_add(block_gen, use_x);
+                        if (use_y != NO_VREG && !set_has(block_kill, use_y))
+                                set_add(block_gen, use_y);
+                        if (def != NO_VREG)
+                                set_add(block_kill, def);
+
+                        ends_in_ret[b] = instr_word(outfile_buffer, i) == 0x00EE;
+                }
+        }
+
+        find_liveness(live_out, gen, kill, ends_in_ret);
+
+        // a register written while another is live can't share its register, a copy doesn't make its source
+        // interfere so both can end up in the same register
+        for (int b = 0; b < blocks_len; ++b) {
+                uint32_t instrs_len = 0;
+                for (uint32_t i = blocks[b].start; i < blocks[b].end; i += instr_len(instr_word(outfile_buffer, i)))
+                        instrs[instrs_len++] = i;
+
+                memcpy(live, &live_out[b * sets_words], sets_words * sizeof(Set));
+
+                while (instrs_len > 0) {
+                        uint32_t i = instrs[--instrs_len];
+                        uint16_t word = instr_word(outfile_buffer, i);
+                        bool is_copy = (word & 0xF00F) == 0x8000;
+                        int def, use_x, use_y;
+
+                        vreg_effects(word, vreg_x[i], vreg_y[i], &def, &use_x, &use_y);
+
+                        if (def != NO_VREG) {
+                                for (int v = 0; v < vregs_len; ++v) {
+                                        if (v == def || !set_has(live, v) || (is_copy && v == use_y))
+                                                continue;
+
+                                        set_add(&interferes[def * sets_words], v);
+                                        set_add(&interferes[v * sets_words], def);
+                                }
+
+                                live[def / 64] &= ~((Set)1 << (def % 64));
+                        }
+
+                        if (is_copy && def != NO_VREG && use_y != NO_VREG && def != use_y) {
+                                partner[def] = use_y;
+                                partner[use_y] = def;
+                        }
+
+                        if (use_x != NO_VREG)
+                                set_add(live, use_x);
+                        if (use_y != NO_VREG)
+                                set_add(live, use_y);
+                }
+        }
+
+        // simplify the graph by taking out registers with fewer neighbours than free registers, which can always be
+        // colored, and when none are left the one with the most neighbours, which may still be colorable
+        int free_regs = 0;
+        for (int r = 0; r < REGS; ++r)
+                free_regs += !named[r];
+
+        int *degree = alloc_or_panic(vregs_len, sizeof(int), "register allocation");
+        int *order = alloc_or_panic(vregs_len, sizeof(int), "register allocation");
+        int *reg_of = alloc_or_panic(vregs_len, sizeof(int), "register allocation");
+        bool *removed = alloc_or_panic(vregs_len, sizeof(bool), "register allocation");
+
+        for (int v = 0; v < vregs_len; ++v)
+                for (int w = 0; w < vregs_len; ++w)
+                        degree[v] += set_has(&interferes[v * sets_words], w);
+
+        for (int n = 0; n < vregs_len; ++n) {
+                int pick = NO_VREG;
+
+                for (int v = 0; v < vregs_len; ++v) {
+                        if (removed[v])
+                                continue;
+                        if (degree[v] < free_regs) {
+                                pick = v;
+                                break;
+                        }
+                        if (pick == NO_VREG || degree[v] > degree[pick])
+                                pick = v;
+                }
+
+                removed[pick] = true;
+                order[n] = pick;
+                for (int w = 0; w < vregs_len; ++w)
+                        if (!removed[w] && set_has(&interferes[pick * sets_words], w))
+                                --degree[w];
+        }
+
+        for (int v = 0; v < vregs_len; ++v)
+                reg_of[v] = NO_VREG;
+
+        for (int n = vregs_len - 1; n >= 0; --n) {
+                int v = order[n];
+                bool taken[REGS];
+
+                memcpy(taken, named, sizeof(taken));
+                for (int w = 0; w < vregs_len; ++w)
+                        if (reg_of[w] != NO_VREG && set_has(&interferes[v * sets_words], w))
+                                taken[reg_of[w]] = true;
+
+                if (partner[v] != NO_VREG && reg_of[partner[v]] != NO_VREG && !taken[reg_of[partner[v]]]) {
+                        reg_of[v] = reg_of[partner[v]];
+                        continue;
+                }
+
+                for (int r = 0; r < REGS && reg_of[v] == NO_VREG; ++r)
+                        if (!taken[r])
+                                reg_of[v] = r;
+
+                if (reg_of[v] == NO_VREG) {
+                        print_msg(ERROR, first_use[v]->pos, "no register is left for virtual register `%%%s`, too many "
+                                "are live at the same time (%d registers are free)", first_use[v]->name, free_regs);
+                        ++error_count;
+                }
+        }
+
+        if (error_count == 0) {
+                for (VregUse *use = vreg_uses; use < vreg_uses_ptr; ++use) {
+                        uint32_t word = use->output_pos - outfile_buffer;
+                        uint8_t *instr_ptr = (uint8_t*)use->output_pos;
+                        int reg = reg_of[(use->shift == 8) ? vreg_x[word] : vreg_y[word]];
+
+                        if (use->shift == 8)
+                                instr_ptr[0] |= reg;
+                        else
+                                instr_ptr[1] |= reg << 4;
+                }
+
+                vregs_allocated = vregs_len;
+        }
+
+        // copies between virtual registers given the same register do nothing, unless they can be skipped
+        bool *dead = alloc_or_panic(words_len + 1, sizeof(bool), "register allocation");
+        bool after_skip = false;
+
+        for (uint32_t i = 0; i < words_len && error_count == 0; i += instr_len(instr_word(outfile_buffer, i))) {
+                uint16_t word = instr_word(outfile_buffer, i);
+
+                if (!after_skip && vreg_x[i] != NO_VREG && vreg_y[i] != NO_VREG && (word & 0xF00F) == 0x8000 &&
+                                ((word >> 8) & 0xF) == ((word >> 4) & 0xF)) {
+                        dead[i] = true;
+                        ++vreg_moves_removed;
+                }
+                after_skip = is_skip(word);
+        }
+
+        free_cfg();
+
+        if (vreg_moves_removed > 0 && find_literal_addr() < 0 && find_section_directive() < 0)
+                compact_program(dead, NULL);
+        else
+                vreg_moves_removed = 0;
+
+        free_scratch(by_name);
+        free_scratch(vreg_x);
+        free_scratch(vreg_y);
+        free_scratch(first_use);
+        free_scratch(gen);
+        free_scratch(kill);
+        free_scratch(live_out);
+        free_scratch(interferes);
+        free_scratch(live);
+        free_scratch(ends_in_ret);
+        free_scratch(instrs);
+        free_scratch(partner);
+        free_scratch(degree);
+        free_scratch(order);
+        free_scratch(reg_of);
+        free_scratch(removed);
+        free_scratch(dead);
+}
@@ -0,0 +1,11 @@
+#ifndef REGALLOC_H_INCLUDED
+        #define REGALLOC_H_INCLUDED 1
+
+        #include <stdint.h>
+
+        #include "threadlocal.h"
+
+        extern THREAD_LOCAL uint32_t vregs_allocated, vreg_moves_removed;
+
+        extern void allocate_registers(void);
+#endif
@@ -0,0 +1,42 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <time.h>
+
+#include "sandbox.h"
+#include "exitcodes.h"
+#include "panic.h"
+
+THREAD_LOCAL uint32_t limit_tokens, limit_labels, limit_errors;
+THREAD_LOCAL uint64_t limit_deadline;
+THREAD_LOCAL uint32_t deadline_polls;
+
+// defined in sandbox.h
+extern inline void check_deadline(void);
+
+//
+// now_ns - reads the monotonic clock in nanoseconds
+//
+static uint64_t now_ns(void) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+//
+// start_deadline - sets the deadline time_ms milliseconds from now, a time_ms of 0 is no deadline
+//
+void start_deadline(uint32_t time_ms) {
+        limit_deadline = time_ms ? now_ns() + (uint64_t)time_ms * 1000000u : 0;
+        deadline_polls = 0;
+}
+
+//
+// poll_deadline - reads the clock and abandons assembly if the deadline has passed
+//
+void poll_deadline(void) {
+        if (limit_deadline && now_ns() > limit_deadline)
+                panic(ERR_LIMIT_TIME);
+}
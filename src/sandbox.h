@@ -0,0 +1,27 @@
+#ifndef SANDBOX_H_INCLUDED
+        #define SANDBOX_H_INCLUDED 1
+
+        #include <stdint.h>
+
+        #include "threadlocal.h"
+
+        // the clock is read once every this many calls to check_deadline, a power of two
+        enum {DEADLINE_POLL_INTERVAL = 1024};
+
+        // limits on the work done assembling one source, set with c8asm_set_limits, 0 is no limit
+        extern THREAD_LOCAL uint32_t limit_tokens, limit_labels, limit_errors;
+        extern THREAD_LOCAL uint64_t limit_deadline; // monotonic time in nanoseconds assembly must end by
+        extern THREAD_LOCAL uint32_t deadline_polls;
+
+        extern void start_deadline(uint32_t time_ms);
+        extern void poll_deadline(void);
+
+        //
+        // check_deadline - abandons assembly once the deadline has passed, the clock is only read every so often so
+        // this is cheap enough to call for every token
+        //
+        inline void check_deadline(void) {
+                if (limit_deadline && (++deadline_polls & (DEADLINE_POLL_INTERVAL - 1)) == 0)
+                        poll_deadline();
+        }
+#endif
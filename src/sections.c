@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "exitcodes.h"
+#include "ansicodes.h"
+#include "parser.h"
+#include "sections.h"
+#include "print_msg.h"
+#include "alloc.h"
+
+// the runs of every section with the same name, placed as one block of memory
+typedef struct {
+        const char *name;     // NULL for an org directive
+        long org;             // fixed address or -1
+        uint32_t align, len;  // in bytes
+        uint32_t addr;        // address it is placed at
+
+        uint32_t pos;         // of its first run
+} Group;
+
+// a range of free memory between fixed sections
+typedef struct {
+        uint32_t start, end;
+} Hole;
+
+//
+// describe - writes how a group is named in diagnostics to buf
+//
+static const char *describe(const Group *group, char *buf, size_t len) {
+        if (group->name)
+                snprintf(buf, len, "section `%s`", group->name);
+        else
+                snprintf(buf, len, "`org 0x%X`", (unsigned)group->org);
+
+        return buf;
+}
+
+//
+// align_up - rounds an address up to a power of two
+//
+static uint32_t align_up(uint32_t addr, uint32_t align) {
+        return (addr + align - 1) & ~(align - 1);
+}
+
+//
+// group_sections - gathers the runs of each section into groups, sets group_of for each run and returns the number of
+// groups, a section's address comes from its first run and its alignment is the largest asked for
+//
+static long group_sections(Group *groups, long *group_of) {
+        ptrdiff_t sections_len = sections_ptr - sections;
+        long groups_len = 0;
+
+        for (ptrdiff_t i = 0; i < sections_len; ++i) {
+                const Section *section = &sections[i];
+                long g = 0;
+
+                if (section->name)
+                        while (g < groups_len && !(groups[g].name && !strcmp(groups[g].name, section->name)))
+                                ++g;
+                else
+                        g = groups_len;
+
+                if (g == groups_len)
+                        groups[groups_len++] = (Group){
+                                .name = section->name,
+                                .org = section->org,
+                                .align = section->align,
+                                .pos = section->pos
+                        };
+
+                if (section->align > groups[g].align)
+                        groups[g].align = section->align;
+                groups[g].len += (section->end - section->start) * C8_INSTR_SIZE;
+                group_of[i] = g;
+        }
+
+        return groups_len;
+}
+
+//
+// cmp_fixed - orders fixed groups by address
+//
+static int cmp_fixed(const void *a, const void *b) {
+        const Group *x = *(const Group *const *)a, *y = *(const Group *const *)b;
+
+        return (x->org > y->org) - (x->org < y->org);
+}
+
+//
+// cmp_relocatable - orders groups to be placed largest first, then by position in the source
+//
+static int cmp_relocatable(const void *a, const void *b) {
+        const Group *x = *(const Group *const *)a, *y = *(const Group *const *)b;
+
+        if (x->len != y->len)
+                return (x->len < y->len) - (x->len > y->len);
+
+        return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+//
+// place_fixed - checks that fixed groups fit in memory without overlapping and finds the holes left between them,
+// returns the number of holes or -1 if any group doesn't fit
+//
+static long place_fixed(Group **fixed, long fixed_len, Hole *holes, uint32_t mem_end) {
+        char a[64], b[64];
+        uint32_t free_start = C8_CODE_START_ADDR;
+        const Group *prev = NULL;
+        long holes_len = 0;
+        bool failed = false;
+
+        qsort(fixed, fixed_len, sizeof(Group*), cmp_fixed);
+
+        for (long i = 0; i < fixed_len; ++i) {
+                Group *group = fixed[i];
+
+                group->addr = group->org;
+                if (group->len == 0)
+                        continue;
+
+                if (group->org % group->align) {
+                        print_msg(ERROR, group->pos, "%s is fixed at 0x%X, which is not aligned to %lu bytes",
+                                describe(group, a, sizeof(a)), (unsigned)group->org, (unsigned long)group->align);
+                        ++error_count;
+                        failed = true;
+                }
+
+                if (group->addr + group->len > mem_end) {
+                        print_msg(ERROR, group->pos, "%s runs past the end of memory by %lu bytes",
+                                describe(group, a, sizeof(a)), (unsigned long)(group->addr + group->len - mem_end));
+                        ++error_count;
+                        failed = true;
+                }
+
+                if (prev && group->addr < free_start) {
+                        print_msg(ERROR, group->pos, "%s (0x%X-0x%X) overlaps %s (0x%X-0x%X)",
+                                describe(group, a, sizeof(a)), (unsigned)group->addr,
+                                (unsigned)(group->addr + group->len - 1), describe(prev, b, sizeof(b)),
+                                (unsigned)prev->addr, (unsigned)(prev->addr + prev->len - 1));
+                        ++error_count;
+                        failed = true;
+                }
+
+                if (group->addr > free_start)
+                        holes[holes_len++] = (Hole){free_start, group->addr};
+                if (group->addr + group->len > free_start) {
+                        free_start = group->addr + group->len;
+                        prev = group;
+                }
+        }
+
+        if (free_start < mem_end)
+                holes[holes_len++] = (Hole){free_start, mem_end};
+
+        return failed ? -1 : holes_len;
+}
+
+//
+// place_relocatable - places each group without a fixed address in the hole which leaves the least room around it,
+// largest group first, returns false if any group doesn't fit
+//
+static bool place_relocatable(Group **relocatable, long relocatable_len, Hole *holes, long holes_len) {
+        char a[64];
+        bool failed = false;
+
+        qsort(relocatable, relocatable_len, sizeof(Group*), cmp_relocatable);
+
+        for (long i = 0; i < relocatable_len; ++i) {
+                Group *group = relocatable[i];
+                long best = -1;
+                uint32_t best_left = 0;
+
+                // holes are kept in address order so the lowest of the best fits is taken
+                for (long h = 0; h < holes_len; ++h) {
+                        uint32_t start = align_up(holes[h].start, group->align);
+
+                        if (start > holes[h].end || holes[h].end - start < group->len)
+                                continue;
+
+                        uint32_t left = holes[h].end - holes[h].start - group->len;
+                        if (best < 0 || left < best_left) {
+                                best = h;
+                                best_left = left;
+                        }
+                }
+
+                if (best < 0) {
+                        print_msg(ERROR, group->pos, "no room is left for %s (%lu bytes)",
+                                describe(group, a, sizeof(a)), (unsigned long)group->len);
+                        ++error_count;
+                        failed = true;
+                        continue;
+                }
+
+                // the padding before an aligned group stays free as its own hole
+                Hole hole = holes[best];
+                group->addr = align_up(hole.start, group->align);
+
+                memmove(&holes[best + 1], &holes[best], (holes_len - best) * sizeof(Hole));
+                holes[best] = (Hole){hole.start, group->addr};
+                holes[best + 1] = (Hole){group->addr + group->len, hole.end};
+                ++holes_len;
+        }
+
+        return !failed;
+}
+
+//
+// relocate - moves every run of statements from where it was parsed to where its section was placed, along with the
+// label definitions, label references and virtual register uses in it, words between sections are left as 0
+//
+static void relocate(const Group *groups, const long *group_of) {
+        ptrdiff_t sections_len = sections_ptr - sections;
+        uint32_t words_len = outfile_buffer_ptr - outfile_buffer;
+
+        Instruction *words = alloc_or_panic(words_len, sizeof(Instruction), "placing sections");
+        uint32_t *positions = alloc_or_panic(words_len, sizeof(uint32_t), "placing sections");
+        long *moved_to = alloc_or_panic(words_len + 1, sizeof(long), "placing sections");
+        uint32_t *group_next = alloc_or_panic(sections_len, sizeof(uint32_t), "placing sections");
+
+        memcpy(words, outfile_buffer, words_len * sizeof(Instruction));
+        memcpy(positions, instr_positions, words_len * sizeof(uint32_t));
+
+        // runs of a section follow each other in source order
+        uint32_t new_len = 0;
+        for (ptrdiff_t i = 0; i < sections_len; ++i) {
+                const Group *group = &groups[group_of[i]];
+                uint32_t start = (group->addr - C8_CODE_START_ADDR) / C8_INSTR_SIZE + group_next[group_of[i]];
+
+                for (uint32_t w = sections[i].start; w <= sections[i].end; ++w)
+                        moved_to[w] = start + (w - sections[i].start);
+
+                group_next[group_of[i]] += sections[i].end - sections[i].start;
+                if (sections[i].end > sections[i].start && start + sections[i].end - sections[i].start > new_len)
+                        new_len = start + sections[i].end - sections[i].start;
+        }
+
+        for (uint32_t i = 0; i < new_len; ++i) {
+                outfile_buffer[i] = 0;
+                instr_positions[i] = POS_NONE;
+        }
+        for (ptrdiff_t i = 0; i < sections_len; ++i) {
+                for (uint32_t w = sections[i].start; w < sections[i].end; ++w) {
+                        outfile_buffer[moved_to[w]] = words[w];
+                        instr_positions[moved_to[w]] = positions[w];
+                }
+        }
+
+        // a label belongs to the run it was defined in, which can end at the word the next run starts at
+        ptrdiff_t run = 0;
+        for (LabelDef *def = label_defs; def < label_defs_ptr; ++def) {
+                while (run + 1 < sections_len && sections[run + 1].pos <= def->pos)
+                        ++run;
+
+                uint32_t w = (def->c8_addr - C8_CODE_START_ADDR) / C8_INSTR_SIZE;
+                def->c8_addr = C8_CODE_START_ADDR + (moved_to[sections[run].start] + (w - sections[run].start)) *
+                        C8_INSTR_SIZE;
+        }
+
+        for (LabelRef *ref = label_refs; ref < label_refs_ptr; ++ref)
+                ref->output_pos = outfile_buffer + moved_to[ref->output_pos - outfile_buffer];
+        for (VregUse *use = vreg_uses; use < vreg_uses_ptr; ++use)
+                use->output_pos = outfile_buffer + moved_to[use->output_pos - outfile_buffer];
+
+        outfile_buffer_ptr = outfile_buffer + new_len;
+
+        free_scratch(words);
+        free_scratch(positions);
+        free_scratch(moved_to);
+        free_scratch(group_next);
+}
+
+//
+// place_sections - places the sections of a program, sections fixed with org and the `code` section at the start of
+// the program keep their addresses and the rest are packed into the memory left between them best fit, largest first,
+// the program then ends with the last section in memory
+//
+// this runs before labels are resolved, so it only has to move label definitions and the words references patch
+//
+void place_sections(void) {
+        ptrdiff_t sections_len = sections_ptr - sections;
+
+        if (sections_len == 0)
+                return;
+
+        Group *groups = alloc_or_panic(sections_len, sizeof(Group), "placing sections");
+        long *group_of = alloc_or_panic(sections_len, sizeof(long), "placing sections");
+        Group **fixed = alloc_or_panic(sections_len, sizeof(Group*), "placing sections");
+        Group **relocatable = alloc_or_panic(sections_len, sizeof(Group*), "placing sections");
+        Hole *holes = alloc_or_panic(sections_len * 2 + 1, sizeof(Hole), "placing sections");
+
+        long groups_len = group_sections(groups, group_of);
+        long fixed_len = 0, relocatable_len = 0;
+
+        for (long g = 0; g < groups_len; ++g) {
+                if (groups[g].org >= 0)
+                        fixed[fixed_len++] = &groups[g];
+                else
+                        relocatable[relocatable_len++] = &groups[g];
+        }
+
+        uint32_t mem_end = C8_CODE_START_ADDR + program_words(target) * C8_INSTR_SIZE;
+        long holes_len = place_fixed(fixed, fixed_len, holes, mem_end);
+
+        if (holes_len >= 0 && place_relocatable(relocatable, relocatable_len, holes, holes_len))
+                relocate(groups, group_of);
+
+        free_scratch(groups);
+        free_scratch(group_of);
+        free_scratch(fixed);
+        free_scratch(relocatable);
+        free_scratch(holes);
+}
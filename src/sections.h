@@ -0,0 +1,5 @@
+#ifndef SECTIONS_H_INCLUDED
+        #define SECTIONS_H_INCLUDED 1
+
+        extern void place_sections(void);
+#endif
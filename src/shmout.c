@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmout.h"
+#include "c8shm.h"
+#include "exitcodes.h"
+#include "ansicodes.h"
+
+#define FMT_ERRMSG(msg) (BOLD(RED("error")) ": " msg)
+
+enum {REGION_SIZE = C8ASM_SHM_HEADER_SIZE + C8ASM_SHM_CAPACITY};
+
+//
+// open_region - opens the shared memory object at name, creating it if needed, and makes sure it is large enough to
+// hold any program, names which don't start with a '/' are given one as shm_open expects
+//
+// a new object is only readable and writable by its owner, so no other user can read or replace the program
+//
+static int open_region(const char *name) {
+        char *shm_name;
+        size_t name_len = strlen(name);
+
+        if (!(shm_name = malloc(name_len + 2))) {
+                fputs(FMT_ERRMSG("failed to allocate memory for shared memory name\n"), stderr);
+                return -1;
+        }
+        shm_name[0] = '/';
+        memcpy(shm_name + (name[0] != '/'), name, name_len + 1);
+
+        int fd;
+        struct stat st;
+        if ((fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600)) < 0 || fstat(fd, &st) ||
+                        (st.st_size < REGION_SIZE && ftruncate(fd, REGION_SIZE))) {
+                fprintf(stderr, FMT_ERRMSG("failed to open shared memory `%s`\n"), shm_name);
+                if (fd >= 0)
+                        close(fd);
+                fd = -1;
+        }
+
+        free(shm_name);
+
+        return fd;
+}
+
+//
+// write_shm - publishes the image to the shared memory object at name, a reader which has it mapped sees the new
+// image once the sequence in the header is even again (see c8shm.h)
+//
+// only one assembler should publish to an object at a time
+//
+int write_shm(const char *name, const uint8_t *buf, size_t len) {
+        if (len > C8ASM_SHM_CAPACITY) {
+                fputs(FMT_ERRMSG("program is too large for shared memory\n"), stderr);
+                return ERR_FILE_TOO_LARGE;
+        }
+
+        int fd;
+        if ((fd = open_region(name)) < 0)
+                return ERR_FOPEN_FAIL;
+
+        uint8_t *region = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (region == MAP_FAILED) {
+                fprintf(stderr, FMT_ERRMSG("failed to map shared memory `%s`\n"), name);
+                return ERR_FOPEN_FAIL;
+        }
+
+        uint32_t *fields = (uint32_t*)(region + 8);
+
+        // a new object is zero filled, it and one left by something else are set up with nothing published
+        if (!c8asm_shm_check(region, REGION_SIZE) || fields[1] != C8ASM_SHM_CAPACITY) {
+                memcpy(region, "C8ASMSHM", 8);
+                fields[0] = C8ASM_SHM_VERSION;
+                fields[1] = C8ASM_SHM_CAPACITY;
+                fields[3] = 0;
+                __atomic_store_n(&fields[2], 0, __ATOMIC_RELEASE);
+        }
+
+        // the sequence is odd over the copy, if an assembler died while publishing it is still odd and the next
+        // even number is used, 0 is skipped as it means nothing was published
+        uint32_t seq = __atomic_load_n(&fields[2], __ATOMIC_RELAXED);
+        seq += (seq & 1) ? 1 : 2;
+        if (seq == 0)
+                seq = 2;
+
+        __atomic_store_n(&fields[2], seq - 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        memcpy(region + C8ASM_SHM_HEADER_SIZE, buf, len);
+        __atomic_store_n(&fields[3], (uint32_t)len, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&fields[2], seq, __ATOMIC_RELEASE);
+
+        munmap(region, REGION_SIZE);
+
+        return SUCCESS;
+}
@@ -0,0 +1,8 @@
+#ifndef SHMOUT_H_INCLUDED
+        #define SHMOUT_H_INCLUDED 1
+
+        #include <stddef.h>
+        #include <stdint.h>
+
+        extern int write_shm(const char *name, const uint8_t *buf, size_t len);
+#endif
@@ -0,0 +1,10 @@
+#ifndef THREAD_LOCAL_H_INCLUDED
+        #define THREAD_LOCAL_H_INCLUDED 1
+
+        // assembler state is kept per thread so that contexts on different threads never share it
+        #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+                #define THREAD_LOCAL _Thread_local
+        #else
+                #define THREAD_LOCAL __thread
+        #endif
+#endif
@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "trace.h"
+
+THREAD_LOCAL TraceRing *trace_ring;
+
+// defined in trace.h
+extern inline void trace_begin(const char *name);
+extern inline void trace_end(const char *name);
+extern inline void trace_counter(const char *name, uint32_t value);
+
+//
+// trace_push - timestamps an event and appends it to a ring
+//
+void trace_push(TraceRing *ring, char phase, const char *name, uint32_t value) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        ring->events[ring->len++ & (ring->cap - 1)] = (TraceEvent){
+                .name = name,
+                .ts = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec,
+                .value = value,
+                .phase = phase
+        };
+}
+
+//
+// trace_write - writes the events of each ring to stream in the Chrome trace event format, each ring gets its own
+// track, returns 0 on failure
+//
+int trace_write(const TraceRing *const *rings, size_t rings_len, FILE *stream) {
+        // timestamps are written relative to the oldest event kept
+        uint64_t origin = UINT64_MAX;
+
+        for (size_t i = 0; i < rings_len; ++i) {
+                const TraceRing *ring = rings[i];
+                size_t first = (ring->len > ring->cap) ? ring->len - ring->cap : 0;
+
+                if (first < ring->len && ring->events[first & (ring->cap - 1)].ts < origin)
+                        origin = ring->events[first & (ring->cap - 1)].ts;
+        }
+
+        fputs("{\"traceEvents\":[", stream);
+
+        for (size_t i = 0; i < rings_len; ++i) {
+                const TraceRing *ring = rings[i];
+                size_t first = (ring->len > ring->cap) ? ring->len - ring->cap : 0;
+                int depth = 0;
+
+                fprintf(stream, "%s\n{\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"name\":\"thread_name\","
+                        "\"args\":{\"name\":\"worker %lu\"}}", i ? "," : "", (unsigned long)i + 1, (unsigned long)i + 1);
+
+                for (size_t j = first; j < ring->len; ++j) {
+                        const TraceEvent *event = &ring->events[j & (ring->cap - 1)];
+                        uint64_t ts = event->ts - origin;
+
+                        // the beginning of a span may have been overwritten
+                        if (event->phase == 'E' && depth == 0)
+                                continue;
+                        depth += (event->phase == 'B') - (event->phase == 'E');
+
+                        fprintf(stream, ",\n{\"ph\":\"%c\",\"pid\":1,\"tid\":%lu,\"ts\":%lu.%03u,\"name\":\"%s\"",
+                                event->phase, (unsigned long)i + 1, (unsigned long)(ts / 1000), (unsigned)(ts % 1000),
+                                event->name);
+
+                        if (event->phase == 'C')
+                                fprintf(stream, ",\"args\":{\"%s\":%lu}", event->name, (unsigned long)event->value);
+
+                        fputs("}", stream);
+                }
+        }
+
+        fputs("\n],\"displayTimeUnit\":\"ns\"}\n", stream);
+
+        return !ferror(stream);
+}
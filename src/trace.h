@@ -0,0 +1,54 @@
+#ifndef TRACE_H_INCLUDED
+        #define TRACE_H_INCLUDED 1
+
+        #include <stdio.h>
+        #include <stdint.h>
+        #include <stddef.h>
+
+        #include "threadlocal.h"
+
+        // a span boundary or counter sample, names must be string literals as only the pointer is kept
+        typedef struct {
+                const char *name;
+                uint64_t ts;    // nanoseconds on the monotonic clock
+                uint32_t value; // sampled value of a counter
+                char phase;     // 'B' begins a span, 'E' ends one and 'C' samples a counter
+        } TraceEvent;
+
+        // a preallocated ring of events, once it is full the oldest events are overwritten
+        typedef struct {
+                TraceEvent *events;
+                size_t cap;  // a power of two
+                size_t len;  // events pushed, which may be more than cap
+        } TraceRing;
+
+        // ring of the context being assembled on this thread, NULL when tracing is disabled
+        extern THREAD_LOCAL TraceRing *trace_ring;
+
+        extern void trace_push(TraceRing *ring, char phase, const char *name, uint32_t value);
+        extern int trace_write(const TraceRing *const *rings, size_t rings_len, FILE *stream);
+
+        //
+        // trace_begin - begins a span on the current ring
+        //
+        inline void trace_begin(const char *name) {
+                if (trace_ring)
+                        trace_push(trace_ring, 'B', name, 0);
+        }
+
+        //
+        // trace_end - ends the innermost span on the current ring
+        //
+        inline void trace_end(const char *name) {
+                if (trace_ring)
+                        trace_push(trace_ring, 'E', name, 0);
+        }
+
+        //
+        // trace_counter - samples a counter on the current ring
+        //
+        inline void trace_counter(const char *name, uint32_t value) {
+                if (trace_ring)
+                        trace_push(trace_ring, 'C', name, value);
+        }
+#endif
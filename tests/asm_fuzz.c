@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "c8asm.h"
+#include "exitcodes.h"
+
+#include "test_util.h"
+
+//
+// asm_fuzz - assembles truncated and random sources through libc8asm and checks that every call returns an ExitCode,
+// as an embedder passing a source cut short or made of garbage must get an error back rather than lose its process
+//
+// diagnostics go to stderr, which is discarded, so failures are reported on stdout
+//
+
+// random sources assembled, and the most words in one
+enum {RANDOM_INPUTS = 5000, RANDOM_MAX_WORDS = 24};
+
+// sources using every kind of statement, each is assembled cut short at every length
+static const char *const corpus[] = {
+        "; every CHIP-8 instruction, and labels named like the keywords which came later\n"
+        "start:\n"
+        "        cls\n"
+        "        mov v0, 0x10\n"
+        "        mov v1, v0\n"
+        "        mov v2, dtimer\n"
+        "        mov dtimer, v2\n"
+        "        mov stimer, v2\n"
+        "        mov I, sprite\n"
+        "        mov I, 0x300\n"
+        "        add v0, 1\n"
+        "        add v0, v1\n"
+        "        add I, v0\n"
+        "        sub v0, v1\n"
+        "        subn v0, v1\n"
+        "        or v0, v1\n"
+        "        and v0, v1\n"
+        "        xor v0, v1\n"
+        "        shr v0\n"
+        "        shl v0\n"
+        "        rnd v3, 0xFF\n"
+        "        se v0, 1\n"
+        "        sne v0, v1\n"
+        "        skd v0\n"
+        "        sku v0\n"
+        "        wkp v0\n"
+        "        ldf v0\n"
+        "        bcd v0\n"
+        "        str v3\n"
+        "        lod v3\n"
+        "        drw v0, v1, 5\n"
+        "        call subroutine\n"
+        "        vjmp start\n"
+        "        jmp start\n"
+        "subroutine:\n"
+        "        ret\n"
+        "load: budget:\n"
+        "        jmp load\n"
+        "        jmp budget\n"
+        "org: section: table:\n"
+        "        jmp org\n"
+        "        call section\n"
+        "        mov I, table\n"
+        "plane: audio:\n"
+        "        call plane\n"
+        "        mov I, audio\n"
+        "        mov I, long\n"
+        "long:\n"
+        "sprite:\n",
+
+        "; directives, virtual registers and XO-CHIP\n"
+        "budget main, 100\n"
+        "main:\n"
+        "        mov %x, 0\n"
+        "        mov %tmp, %x\n"
+        "        add %tmp, 5\n"
+        "        drw %x, %tmp, 5\n"
+        "        plane 3\n"
+        "        audio\n"
+        "        pitch v0\n"
+        "        save v0, v3\n"
+        "        load v0, v3\n"
+        "        mov I, long data\n"
+        "        call leaf\n"
+        "        jmp main\n"
+        "leaf:\n"
+        "        mov v5, 1\n"
+        "        ret\n"
+        "        table squares, 16, i * i\n"
+        "        table bits, 7, ((i & 1) << 3) | (i >> 1) ^ ~i % 3\n"
+        "        table mods, 8, i%3 + (i)%2 + 7%(i+1)\n"
+        "section data, 16\n"
+        "data:\n"
+        "        table zeros, 3, 0\n"
+        "org 0x800\n"
+        "handler:\n"
+        "        ret\n"
+};
+
+// words random sources are made of, separated by spaces, newlines and commas
+static const char *const vocabulary[] = {
+        "cls", "ret", "jmp", "vjmp", "call", "mov", "add", "sub", "subn", "or", "and", "xor", "shr", "shl", "se",
+        "sne", "rnd", "drw", "wkp", "skd", "sku", "ldf", "bcd", "lod", "str", "plane", "audio", "pitch", "save",
+        "load", "budget", "org", "section", "table", "long", "dtimer", "stimer", "I", "i", "v0", "vf", "%x", "%y", "0",
+        "0x200", "0xFFFF", "65536", "0b12", "a", "a:", "b:", "load:", "(", ")", "+", "-", "<<", "*", "%", ";"
+};
+
+static const char *const separators[] = {" ", "\n", ", ", ",", ""};
+
+static size_t calls;
+
+//
+// assemble - assembles a source and checks that an ExitCode came back, returns it
+//
+static int assemble(c8asm_ctx *ctx, const char *src, size_t len) {
+        const uint8_t *rom;
+        size_t rom_len;
+        int err = c8asm_assemble(ctx, src, len, &rom, &rom_len);
+
+        if (err < SUCCESS || err > ERR_LIMIT_TIME)
+                fail_input("c8asm_assemble returned something other than an ExitCode", src, len);
+        if (err == SUCCESS && rom_len > c8asm_capacity(ctx))
+                fail_input("the program outgrew memory", src, len);
+
+        ++calls;
+
+        return err;
+}
+
+//
+// assemble_prefixes - assembles a source cut short at every length, for each target
+//
+static void assemble_prefixes(c8asm_ctx *ctx, const char *src) {
+        size_t len = strlen(src);
+
+        for (int target = C8ASM_TARGET_CHIP8; target <= C8ASM_TARGET_XOCHIP; ++target) {
+                c8asm_set_target(ctx, target);
+
+                for (size_t i = 0; i <= len; ++i)
+                        assemble(ctx, src, i);
+        }
+}
+
+//
+// check_cache - assembles a source from its token cache and from the cache cut short at every length, a cache cut
+// short must be refused and lexed over, and the cache must give the program lexing does
+//
+static void check_cache(c8asm_ctx *ctx, const char *src) {
+        size_t len = strlen(src), rom_len, cached_len, cache_len;
+        const uint8_t *rom, *cached_rom, *out;
+
+        c8asm_set_target(ctx, C8ASM_TARGET_XOCHIP);
+        if (c8asm_assemble(ctx, src, len, &rom, &rom_len) != SUCCESS)
+                fail_input("a corpus source failed to assemble", src, len);
+
+        uint8_t *expected = xmalloc(rom_len), *cache;
+        if (c8asm_build_token_cache(ctx, &out, &cache_len) != SUCCESS)
+                fail_input("couldn't build a token cache", src, len);
+        cache = xmalloc(cache_len);
+        memcpy(expected, rom, rom_len);
+        memcpy(cache, out, cache_len);
+
+        for (size_t i = 0; i <= cache_len; ++i) {
+                c8asm_set_token_cache(ctx, cache, i);
+                int err = assemble(ctx, src, len);
+
+                if (c8asm_token_cache_used(ctx) != (i == cache_len))
+                        fail_input("a token cache cut short was used", src, len);
+                if (err != SUCCESS)
+                        fail_input("the source failed to assemble with a token cache", src, len);
+        }
+
+        c8asm_set_token_cache(ctx, cache, cache_len);
+        if (c8asm_assemble(ctx, src, len, &cached_rom, &cached_len) != SUCCESS || cached_len != rom_len ||
+                        memcmp(cached_rom, expected, rom_len))
+                fail_input("the token cache gave another program", src, len);
+
+        free(expected);
+        free(cache);
+}
+
+//
+// check_sandbox - assembles the truncations of a source under limits low enough that most of them stop assembly
+// partway, as with --sandbox, then checks that the context still gives the same program for the whole source
+//
+static void check_sandbox(c8asm_ctx *ctx, const char *src) {
+        static const c8asm_limits limits[] = {
+                {.src_len = 256, .tokens = 64, .labels = 4, .errors = 100, .time_ms = 1000},
+                {.tokens = 16},
+                {.labels = 1},
+                {.errors = 1},
+                {.errors = 2}
+        };
+        size_t len = strlen(src), rom_len, after_len;
+        const uint8_t *rom, *after;
+
+        c8asm_set_target(ctx, C8ASM_TARGET_XOCHIP);
+        if (c8asm_assemble(ctx, src, len, &rom, &rom_len) != SUCCESS)
+                fail_input("a corpus source failed to assemble", src, len);
+
+        uint8_t *expected = xmalloc(rom_len);
+        memcpy(expected, rom, rom_len);
+
+        for (size_t l = 0; l < sizeof(limits) / sizeof(limits[0]); ++l) {
+                c8asm_set_limits(ctx, &limits[l]);
+                assemble_prefixes(ctx, src);
+        }
+        c8asm_set_limits(ctx, NULL);
+
+        c8asm_set_target(ctx, C8ASM_TARGET_XOCHIP);
+        if (c8asm_assemble(ctx, src, len, &after, &after_len) != SUCCESS || after_len != rom_len ||
+                        memcmp(after, expected, rom_len))
+                fail_input("the context gave another program after assemblies stopped by limits", src, len);
+
+        free(expected);
+}
+
+//
+// check_error_limit - checks that a source with as many errors as the error limit fails as it would without one and
+// that the error after them stops assembly
+//
+static void check_error_limit(c8asm_ctx *ctx) {
+        static const char src[] = "a:\na:\nb:\nb:\nc:\nc:\n        jmp a\n";
+        c8asm_limits limits = {.errors = 3};
+        const uint8_t *rom;
+        size_t rom_len;
+
+        c8asm_set_limits(ctx, &limits);
+        if (c8asm_assemble(ctx, src, strlen(src), &rom, &rom_len) != FAILURE)
+                fail_input("a source with as many errors as the limit was stopped by it", src, strlen(src));
+
+        limits.errors = 2;
+        c8asm_set_limits(ctx, &limits);
+        if (c8asm_assemble(ctx, src, strlen(src), &rom, &rom_len) != ERR_LIMIT_ERRORS)
+                fail_input("a source with more errors than the limit wasn't stopped by it", src, strlen(src));
+
+        c8asm_set_limits(ctx, NULL);
+}
+
+//
+// random_src - fills a buffer with random words of the language, returns its length
+//
+static size_t random_src(char *buf) {
+        size_t len = 0, words = rng() % (RANDOM_MAX_WORDS + 1);
+
+        for (size_t i = 0; i < words; ++i) {
+                const char *word = vocabulary[rng() % (sizeof(vocabulary) / sizeof(vocabulary[0]))];
+                const char *sep = separators[rng() % (sizeof(separators) / sizeof(separators[0]))];
+
+                memcpy(buf + len, word, strlen(word));
+                len += strlen(word);
+                memcpy(buf + len, sep, strlen(sep));
+                len += strlen(sep);
+        }
+
+        return len;
+}
+
+int main(int argc, char **argv) {
+        (void)argv;
+
+        if (argc > 1) {
+                fputs("usage: asm_fuzz\n", stderr);
+                return ERR_INVALID_ARG;
+        }
+
+        start_test("asm_fuzz", stdout);
+
+        if (!freopen("/dev/null", "w", stderr))
+                fail("failed to discard diagnostics");
+
+        c8asm_ctx *ctx;
+        if (!(ctx = c8asm_ctx_new()))
+                fail("failed to create a context");
+
+        for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); ++i) {
+                assemble_prefixes(ctx, corpus[i]);
+                check_cache(ctx, corpus[i]);
+                check_sandbox(ctx, corpus[i]);
+        }
+        check_error_limit(ctx);
+
+        // the optional passes only run on sources without errors, which random ones rarely are
+        char buf[RANDOM_MAX_WORDS * 16];
+        for (int i = 0; i < RANDOM_INPUTS; ++i) {
+                c8asm_set_target(ctx, i % 2);
+                c8asm_set_fold(ctx, i % 3 == 0);
+                c8asm_set_eliminate_loads(ctx, i % 5 == 0);
+                c8asm_set_inline(ctx, i % 7 == 0, 0);
+                c8asm_set_instrument(ctx, (i % 11 == 0) ? 8 : 0);
+
+                assemble(ctx, buf, random_src(buf));
+        }
+
+        c8asm_ctx_free(ctx);
+
+        printf("asm_fuzz: %lu sources assembled\n", (unsigned long)calls);
+
+        return SUCCESS;
+}
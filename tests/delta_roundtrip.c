@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "c8asm.h"
+#include "c8delta.h"
+#include "exitcodes.h"
+
+#include "test_util.h"
+
+//
+// delta_roundtrip - stands in for a device receiving ROM deltas, it assembles two builds of a program, makes a delta
+// between them with c8asm_delta_build, applies it to the old build with c8asm_delta_apply as c8patch does and checks
+// that the result is the new build, for hand written edits and random ones
+//
+// it also checks that a delta is refused by any other ROM than the one it was made from, and that a delta cut short
+// is never applied to give a wrong ROM
+//
+
+// random programs are made of this many statements and edited this many times before being assembled again
+enum {RANDOM_PROGRAMS = 300, RANDOM_STMTS = 160, RANDOM_EDITS = 6};
+
+// a label is defined before every this many statements of a random program
+enum {LABEL_EVERY = 8};
+
+enum {STMT_MAX_LEN = 32};
+
+// statements random programs are made of, %d is the number of a label
+static const char *const stmts[] = {
+        "cls", "ret", "jmp L%d", "call L%d", "mov I, L%d", "mov I, long L%d", "mov v0, 0x12", "mov v1, v0",
+        "add v2, 7", "se v1, 3", "sne v0, v1", "drw v0, v1, 5", "rnd v3, 0xFF", "ldf v0", "bcd v2", "lod v3"
+};
+
+// hand written edits, an insertion at the start shifts every address after it, each pair is an old and new source
+static const char *const edits[][2] = {
+        {
+                "start:\n"
+                "        call draw\n"
+                "        jmp start\n"
+                "draw:\n"
+                "        mov I, sprite\n"
+                "        drw v0, v1, 5\n"
+                "        ret\n"
+                "sprite:\n"
+                "        table glyph, 5, i * 3\n",
+
+                "start:\n"
+                "        cls\n"
+                "        mov v0, 8\n"
+                "        call draw\n"
+                "        jmp start\n"
+                "draw:\n"
+                "        mov I, sprite\n"
+                "        drw v0, v1, 5\n"
+                "        ret\n"
+                "sprite:\n"
+                "        table glyph, 5, i * 3\n"
+        },
+        {
+                "start:\n"
+                "        mov v0, 1\n"
+                "        mov v1, 2\n"
+                "        call sub1\n"
+                "        jmp start\n"
+                "sub1:\n"
+                "        add v0, v1\n"
+                "        ret\n",
+
+                "start:\n"
+                "        mov v1, 2\n"
+                "        call sub1\n"
+                "        jmp start\n"
+                "sub1:\n"
+                "        add v0, v1\n"
+                "        ret\n"
+        },
+        {
+                "start:\n"
+                "        jmp start\n",
+
+                "start:\n"
+                "        jmp start\n"
+        },
+        {
+                "start:\n"
+                "        mov I, long data\n"
+                "        jmp start\n"
+                "data:\n"
+                "        table bytes, 4, i\n",
+
+                "start:\n"
+                "        mov I, long data\n"
+                "        jmp start\n"
+                "data:\n"
+                "        table bytes, 9, 255 - i\n"
+        }
+};
+
+// labels defined by a random program
+enum {LABELS = (RANDOM_STMTS + LABEL_EVERY - 1) / LABEL_EVERY};
+
+// statements of the random program being edited, label definitions are kept in place so every reference resolves
+static char prog[RANDOM_STMTS * 2][STMT_MAX_LEN];
+static int prog_len;
+
+static size_t roundtrips;
+
+//
+// fail_edit - reports the builds a delta got wrong and exits
+//
+static void fail_edit(const char *what, const char *old_src, const char *new_src) {
+        fprintf(stderr, "delta_roundtrip: %s\n--- old\n%s--- new\n%s", what, old_src, new_src);
+
+        exit(FAILURE);
+}
+
+//
+// assemble - assembles a source, returns a copy of the ROM
+//
+static uint8_t *assemble(c8asm_ctx *ctx, const char *src, size_t *len) {
+        const uint8_t *rom;
+
+        if (c8asm_assemble(ctx, src, strlen(src), &rom, len) != SUCCESS)
+                fail_edit("a build failed to assemble", src, "");
+
+        uint8_t *copy = xmalloc(*len);
+        memcpy(copy, rom, *len);
+
+        return copy;
+}
+
+//
+// roundtrip - makes a delta between two builds and checks that applying it to the old one gives the new one, returns
+// the length of the delta
+//
+static size_t roundtrip(c8asm_ctx *ctx, const char *old_src, const char *new_src) {
+        size_t old_len, new_len, delta_len, out_len;
+        uint8_t *old = assemble(ctx, old_src, &old_len), *rom = assemble(ctx, new_src, &new_len), *delta, *out;
+
+        if (c8asm_delta_build(old, old_len, rom, new_len, &delta, &delta_len) != SUCCESS)
+                fail_edit("couldn't build a delta", old_src, new_src);
+
+        if (c8asm_delta_apply(old, old_len, delta, delta_len, &out, &out_len) != SUCCESS)
+                fail_edit("couldn't apply a delta to the ROM it was made from", old_src, new_src);
+        if (out_len != new_len || memcmp(out, rom, new_len))
+                fail_edit("applying a delta gave another ROM than the new build", old_src, new_src);
+        free(out);
+
+        // the new build differs from the old one unless the edit changed nothing, and it is not the base
+        if ((old_len != new_len || memcmp(old, rom, new_len)) &&
+                        c8asm_delta_apply(rom, new_len, delta, delta_len, &out, &out_len) != FAILURE)
+                fail_edit("a delta was applied to another ROM than the one it was made from", old_src, new_src);
+
+        free(old);
+        free(rom);
+        free(delta);
+        ++roundtrips;
+
+        return delta_len;
+}
+
+//
+// check_truncated - checks that a delta cut short at every length is refused or still gives the new build
+//
+static void check_truncated(c8asm_ctx *ctx, const char *old_src, const char *new_src) {
+        size_t old_len, new_len, delta_len, out_len;
+        uint8_t *old = assemble(ctx, old_src, &old_len), *rom = assemble(ctx, new_src, &new_len), *delta, *out;
+
+        if (c8asm_delta_build(old, old_len, rom, new_len, &delta, &delta_len) != SUCCESS)
+                fail_edit("couldn't build a delta", old_src, new_src);
+
+        for (size_t i = 0; i < delta_len; ++i) {
+                int err = c8asm_delta_apply(old, old_len, delta, i, &out, &out_len);
+
+                if (err < SUCCESS || err > ERR_LIMIT_TIME)
+                        fail_edit("c8asm_delta_apply returned something other than an ExitCode", old_src, new_src);
+                if (err != SUCCESS)
+                        continue;
+
+                if (out_len != new_len || memcmp(out, rom, new_len))
+                        fail_edit("a delta cut short was applied to give another ROM", old_src, new_src);
+                free(out);
+        }
+
+        free(old);
+        free(rom);
+        free(delta);
+}
+
+//
+// random_stmt - writes a random statement, any label it refers to is picked at random
+//
+static void random_stmt(char *stmt) {
+        snprintf(stmt, STMT_MAX_LEN, "        ");
+        snprintf(stmt + 8, STMT_MAX_LEN - 8, stmts[rng() % (sizeof(stmts) / sizeof(stmts[0]))], (int)(rng() % LABELS));
+}
+
+//
+// random_prog - fills prog with random statements and a label before every LABEL_EVERY of them
+//
+static void random_prog(void) {
+        prog_len = 0;
+
+        for (int i = 0; i < RANDOM_STMTS; ++i) {
+                if (i % LABEL_EVERY == 0)
+                        snprintf(prog[prog_len++], STMT_MAX_LEN, "L%d:", i / LABEL_EVERY);
+                random_stmt(prog[prog_len++]);
+        }
+}
+
+//
+// print_prog - writes the random program to a buffer as source
+//
+static void print_prog(char *buf) {
+        for (int i = 0; i < prog_len; ++i)
+                buf += sprintf(buf, "%s\n", prog[i]);
+}
+
+//
+// edit_prog - inserts, deletes or replaces a random statement which isn't a label definition
+//
+static void edit_prog(void) {
+        int at = rng() % prog_len;
+
+        switch (rng() % 3) {
+                case 0:
+                        if (prog_len == (int)(sizeof(prog) / sizeof(prog[0])))
+                                break;
+                        memmove(prog[at + 1], prog[at], (prog_len - at) * STMT_MAX_LEN);
+                        ++prog_len;
+                        random_stmt(prog[at]);
+                        break;
+                case 1:
+                        if (prog[at][0] == 'L')
+                                break;
+                        memmove(prog[at], prog[at + 1], (prog_len - at - 1) * STMT_MAX_LEN);
+                        --prog_len;
+                        break;
+                case 2:
+                        if (prog[at][0] != 'L')
+                                random_stmt(prog[at]);
+                        break;
+        }
+}
+
+//
+// check_shift - inserts a statement at the start of a random program, which moves every address after it, and checks
+// that the delta carries the shifted code and its references in segments rather than sending them again
+//
+static void check_shift(c8asm_ctx *ctx, char *old_src, char *new_src) {
+        size_t rom_len;
+
+        random_prog();
+        print_prog(old_src);
+
+        memmove(prog[1], prog[0], prog_len * STMT_MAX_LEN);
+        ++prog_len;
+        snprintf(prog[0], STMT_MAX_LEN, "        mov v0, 1");
+        print_prog(new_src);
+
+        size_t delta_len = roundtrip(ctx, old_src, new_src);
+
+        free(assemble(ctx, new_src, &rom_len));
+        if (delta_len > C8ASM_DELTA_HEADER_SIZE + rom_len / 4)
+                fail_edit("a delta for an insertion resent the code it shifted", old_src, new_src);
+}
+
+int main(int argc, char **argv) {
+        (void)argv;
+
+        if (argc > 1) {
+                fputs("usage: delta_roundtrip\n", stderr);
+                return ERR_INVALID_ARG;
+        }
+
+        start_test("delta_roundtrip", stderr);
+
+        c8asm_ctx *ctx;
+        if (!(ctx = c8asm_ctx_new()))
+                fail("failed to create a context");
+        c8asm_set_target(ctx, C8ASM_TARGET_XOCHIP);
+
+        for (size_t i = 0; i < sizeof(edits) / sizeof(edits[0]); ++i) {
+                roundtrip(ctx, edits[i][0], edits[i][1]);
+                roundtrip(ctx, edits[i][1], edits[i][0]);
+                check_truncated(ctx, edits[i][0], edits[i][1]);
+        }
+
+        char *old_src = xmalloc(sizeof(prog) + sizeof(prog) / STMT_MAX_LEN);
+        char *new_src = xmalloc(sizeof(prog) + sizeof(prog) / STMT_MAX_LEN);
+
+        for (int i = 0; i < RANDOM_PROGRAMS; ++i) {
+                random_prog();
+                print_prog(old_src);
+
+                for (int e = 0; e < RANDOM_EDITS; ++e)
+                        edit_prog();
+                print_prog(new_src);
+
+                roundtrip(ctx, old_src, new_src);
+        }
+
+        check_shift(ctx, old_src, new_src);
+
+        free(old_src);
+        free(new_src);
+        c8asm_ctx_free(ctx);
+
+        printf("delta_roundtrip: %lu deltas applied\n", (unsigned long)roundtrips);
+
+        return SUCCESS;
+}
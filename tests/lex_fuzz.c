@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exitcodes.h"
+#include "lexer.h"
+#include "parser.h"
+#include "print_msg.h"
+#include "panic.h"
+
+#include "test_util.h"
+
+//
+// lex_fuzz - lexes random, malformed and truncated sources and checks that the lexer always ends, stays within the
+// token buffers c8asm_assemble sizes from the source length and takes time linear in the length of its input
+//
+// the lexer has no timeout of its own, so a watchdog alarm kills the test if it ever stops making progress
+//
+
+// random inputs lexed, and the longest of them
+enum {RANDOM_INPUTS = 20000, RANDOM_MAX_LEN = 96};
+
+// input that used to stop the lexer or is easy to get wrong, each is also lexed cut short at every length
+static const char *const edge_cases[] = {
+        "0x1G",
+        "0b102",
+        "0o9",
+        "0z",
+        "0x",
+        "0b",
+        "0",
+        "0x_",
+        "123abc",
+        "0xFFFFFFFFFFFFFFFFFFFF",
+        "99999999999999999999999",
+        "mov v0, 0x1G\nmov v1, 0b2\n",
+        "v",
+        "vF",
+        "%",
+        "%1",
+        "%reg",
+        "table t, 5, i%i+1\n",
+        "3%x (i)%y\n",
+        "<",
+        "<<",
+        ">",
+        "; a comment with no newline",
+        "label_with_a_name_longer_than_thirty_two_characters:",
+        "table t, 4, (i << 1) + 0x1G\n",
+        "start:\n        mov v0, 0\n        mov I, long data\n        jmp start\ndata:\n"
+};
+
+// characters random inputs are mostly made of, the ones which start or continue each kind of token
+static const char alphabet[] = "0123456789xXbBoOaAfFgGzZ_vVIi%:;,()+-*/<>&|^~ \n\t";
+
+// token buffers, grown to fit the longest input
+static uint8_t *types;
+static uint32_t *positions, *payloads;
+static size_t tkns_cap;
+
+static size_t inputs_lexed;
+
+//
+// lex - lexes len bytes of src and checks the token stream, returns the number of tokens
+//
+// c8asm_assemble reserves one token for each byte of the source and one for the end of the stream, so the stream
+// must never be longer than that
+//
+static size_t lex(const char *text, size_t len) {
+        if (len + 1 > tkns_cap) {
+                free(types);
+                free(positions);
+                free(payloads);
+
+                tkns_cap = len + 1;
+                types = xmalloc(tkns_cap);
+                positions = xmalloc(tkns_cap * sizeof(uint32_t));
+                payloads = xmalloc(tkns_cap * sizeof(uint32_t));
+        }
+
+        // the lexer may look one character past the end of the source
+        char *src = xmalloc(len + 1);
+        memcpy(src, text, len);
+        src[len] = '\0';
+
+        tkn_types = types;
+        tkn_positions = positions;
+        tkn_payloads = payloads;
+        rewind_tkn_stream();
+        lex_set_input(src, len);
+
+        name_pool_len = 0;
+        error_count = 0;
+        msgs_len = msg_text_len = 0;
+
+        if (setjmp(panic_env))
+                fail_input("the lexer panicked", text, len);
+
+        lex_src();
+
+        size_t count = tkn_types_ptr - tkn_types;
+        if (count > len + 1)
+                fail_input("the token stream outgrew its buffer", text, len);
+        if (count == 0 || tkn_types[count - 1] != STREAM_END)
+                fail_input("the token stream doesn't end in STREAM_END", text, len);
+        for (size_t i = 0; i < count; ++i)
+                if (tkn_positions[i] > len)
+                        fail_input("a token is positioned past the end of the source", text, len);
+
+        free(src);
+        ++inputs_lexed;
+
+        return count;
+}
+
+//
+// lex_prefixes - lexes a source cut short at every length, including the whole of it
+//
+static void lex_prefixes(const char *src) {
+        size_t len = strlen(src);
+
+        for (size_t i = 0; i <= len; ++i)
+                lex(src, i);
+}
+
+//
+// random_src - fills a buffer with a random source, mostly from the alphabet with the odd arbitrary byte
+//
+static size_t random_src(char *buf) {
+        size_t len = rng() % (RANDOM_MAX_LEN + 1);
+
+        for (size_t i = 0; i < len; ++i) {
+                uint64_t r = rng();
+
+                buf[i] = (r % 16 == 0) ? (char)(r >> 8) : alphabet[(r >> 8) % (sizeof(alphabet) - 1)];
+        }
+
+        return len;
+}
+
+//
+// now_ns - reads the monotonic clock in nanoseconds
+//
+static uint64_t now_ns(void) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+//
+// time_lex - the fastest of a few runs of lexing a fragment repeated times times, in nanoseconds
+//
+static uint64_t time_lex(const char *fragment, size_t times) {
+        size_t fragment_len = strlen(fragment), len = fragment_len * times;
+        char *src = xmalloc(len);
+        uint64_t best = UINT64_MAX;
+
+        for (size_t i = 0; i < times; ++i)
+                memcpy(src + i * fragment_len, fragment, fragment_len);
+
+        for (int run = 0; run < 5; ++run) {
+                uint64_t start = now_ns();
+                lex(src, len);
+                uint64_t ns = now_ns() - start;
+
+                if (ns < best)
+                        best = ns;
+        }
+
+        free(src);
+
+        return best;
+}
+
+//
+// check_linear - checks that lexing a fragment repeated 16 times as often takes well under the 256 times as long a
+// quadratic lexer would, with slack for the clock on a small input
+//
+static void check_linear(const char *fragment) {
+        uint64_t small = time_lex(fragment, 4096), large = time_lex(fragment, 16 * 4096);
+
+        if (large > 64 * small + 2000000) {
+                fprintf(stderr, "lex_fuzz: lexing \"%s\" isn't linear, 16 times the input took %.1f times as long\n",
+                        fragment, (double)large / (small ? small : 1));
+                exit(FAILURE);
+        }
+}
+
+int main(int argc, char **argv) {
+        (void)argv;
+
+        if (argc > 1) {
+                fputs("usage: lex_fuzz\n", stderr);
+                return ERR_INVALID_ARG;
+        }
+
+        start_test("lex_fuzz", stderr);
+        infile_name = "fuzz";
+
+        for (size_t i = 0; i < sizeof(edge_cases) / sizeof(edge_cases[0]); ++i)
+                lex_prefixes(edge_cases[i]);
+
+        char buf[RANDOM_MAX_LEN];
+        for (int i = 0; i < RANDOM_INPUTS; ++i)
+                lex(buf, random_src(buf));
+
+        // runs of one token which grows with the input, and runs of many short ones
+        check_linear("1");
+        check_linear("a");
+        check_linear("0x1G ");
+        check_linear("0b12,");
+        check_linear("mov v0, 0x1F\n");
+        check_linear("; comment\n");
+
+        printf("lex_fuzz: %lu inputs lexed\n", (unsigned long)inputs_lexed);
+
+        free(types);
+        free(positions);
+        free(payloads);
+        free(name_pool);
+        free(msgs);
+        free(msg_text);
+
+        return SUCCESS;
+}
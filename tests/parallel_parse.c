@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "c8asm.h"
+#include "exitcodes.h"
+
+#include "test_util.h"
+
+//
+// parallel_parse - assembles large random programs on one thread and then with c8asm_set_threads, and checks that
+// every thread count gives the same exit status, program, map, error and warning counts and diagnostics, for programs
+// using every kind of statement, programs with errors, programs which run past the end of memory and programs with
+// enough label references to be patched in parallel
+//
+// diagnostics are written to stderr, which is sent to a temporary file while a program is assembled
+//
+
+// statements in the random programs, enough for at least two slices of PARALLEL_MIN_TOKENS tokens while still fitting
+// in memory, and the programs of each kind
+enum {RANDOM_STMTS = 23000, RANDOM_PROGRAMS = 3};
+
+// a label is defined before every this many statements, references only go to the first REF_LABELS labels so their
+// addresses fit in 12 bits wherever the sections are placed
+enum {LABEL_EVERY = 8, REF_LABELS = 30};
+
+enum {STMT_MAX_LEN = 48};
+
+// kinds of random program
+enum {PLAIN, TABLES, SECTIONS, VREGS, BUDGETS, ERRORS, REFS, DENSE, OVERFLOW, KINDS};
+
+static const char *const kind_names[KINDS] = {
+        "plain", "tables", "sections", "virtual registers", "budgets", "errors", "references", "dense", "overflow"
+};
+
+// statements random programs are made of, %d is the number of a label
+static const char *const stmts[] = {
+        "cls", "ret", "jmp L%d", "call L%d", "mov I, L%d", "mov I, long L%d", "mov v0, 0x12", "mov v1, v0",
+        "add v2, 7", "se v1, 3", "sne v0, v1", "drw v0, v1, 5", "rnd v3, 0xFF", "ldf v0", "bcd v2", "lod v3",
+        "plane 2", "save v0, v3", "jmp 0x100"
+};
+
+static const char *const vreg_stmts[] = {"mov %%a, 1", "add %%a, %%b", "mov %%b, v3", "drw %%a, %%b, 3"};
+
+static const char *const error_stmts[] = {"jmp", "mov v0,", "add v0, 999", "jmp nowhere", "se v0", "table t, 0, i"};
+
+static const char *const ref_stmts[] = {"jmp L%d", "call L%d", "mov I, L%d", "mov I, long L%d"};
+
+// statements of many tokens for each word they take, so a program which fits in memory is split in more slices
+static const char *const dense_stmts[] = {"drw v0, v1, 5", "drw v2, v3, 15", "sne v0, v1", "mov I, L%d"};
+
+static const int thread_counts[] = {2, 3, 4, 8};
+
+static size_t compared;
+
+//
+// pick - picks a random statement of a list
+//
+#define pick(list) (list[rng() % (sizeof(list) / sizeof(list[0]))])
+
+//
+// random_prog - writes a random program of a kind to buf, returns its length
+//
+static size_t random_prog(char *buf, int kind) {
+        int stmts_len = (kind == OVERFLOW) ? 2 * RANDOM_STMTS : RANDOM_STMTS;
+        char *p = buf;
+
+        for (int i = 0; i < stmts_len; ++i) {
+                const char *stmt = pick(stmts);
+
+                if (i % LABEL_EVERY == 0)
+                        p += sprintf(p, "L%d:\n", i / LABEL_EVERY);
+
+                if (kind == TABLES && i % 97 == 0)
+                        p += sprintf(p, "        table t%d, %d, i * 3 %% 256\n", i, (int)(rng() % 40) + 1);
+                // the first directive comes after the first slice, whose words go in the `code` section of a later one
+                if (kind == SECTIONS && i > stmts_len / 3 && i % 500 == 250)
+                        p += sprintf(p, "section s%d, 16\n", (int)(rng() % 3));
+                if (kind == SECTIONS && i == stmts_len * 3 / 4)
+                        p += sprintf(p, "org 0xA000\n");
+                if (kind == BUDGETS && i % 300 == 0)
+                        p += sprintf(p, "budget L%d, 60000\n", i / LABEL_EVERY);
+
+                if (kind == VREGS && rng() % 4 == 0)
+                        stmt = pick(vreg_stmts);
+                else if (kind == ERRORS && rng() % 8 == 0)
+                        stmt = pick(error_stmts);
+                else if (kind == REFS)
+                        stmt = pick(ref_stmts);
+                else if (kind == DENSE || kind == SECTIONS)
+                        stmt = pick(dense_stmts);
+
+                p += sprintf(p, "        ");
+                p += sprintf(p, stmt, (int)(rng() % REF_LABELS));
+                p += sprintf(p, "\n");
+        }
+
+        return p - buf;
+}
+
+// the results of assembling a program
+typedef struct {
+        int err, errors, warnings;
+        uint8_t *rom, *map;
+        size_t rom_len, map_len;
+        char *diags;
+        size_t diags_len;
+} Result;
+
+//
+// copy - copies a buffer assembly left in the context
+//
+static uint8_t *copy(const uint8_t *buf, size_t len) {
+        uint8_t *out = xmalloc(len);
+
+        memcpy(out, buf, len);
+
+        return out;
+}
+
+//
+// assemble - assembles a program on up to threads threads with stderr sent to diag_file, and keeps the results
+//
+static Result assemble(c8asm_ctx *ctx, const char *src, size_t len, int threads, FILE *diag_file) {
+        Result result = {0};
+        const uint8_t *out;
+        int saved_stderr;
+
+        rewind(diag_file);
+        if (ftruncate(fileno(diag_file), 0) || (saved_stderr = dup(STDERR_FILENO)) < 0 ||
+                        dup2(fileno(diag_file), STDERR_FILENO) < 0)
+                fail("couldn't send diagnostics to a temporary file");
+
+        c8asm_set_threads(ctx, threads);
+        result.err = c8asm_assemble(ctx, src, len, &out, &result.rom_len);
+        result.errors = c8asm_error_count(ctx);
+        result.warnings = c8asm_warning_count(ctx);
+
+        fflush(stderr);
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+
+        if (result.err == SUCCESS) {
+                result.rom = copy(out, result.rom_len);
+                if (c8asm_build_map(ctx, &out, &result.map_len) != SUCCESS)
+                        fail("couldn't build a map");
+                result.map = copy(out, result.map_len);
+        }
+
+        result.diags_len = ftell(diag_file);
+        result.diags = xmalloc(result.diags_len);
+        rewind(diag_file);
+        if (fread(result.diags, 1, result.diags_len, diag_file) != result.diags_len)
+                fail("couldn't read the diagnostics back");
+
+        return result;
+}
+
+//
+// free_result - frees the buffers of a result
+//
+static void free_result(Result *result) {
+        free(result->rom);
+        free(result->map);
+        free(result->diags);
+}
+
+//
+// same - checks whether two buffers hold the same bytes
+//
+static int same(const void *a, size_t a_len, const void *b, size_t b_len) {
+        return a_len == b_len && (a_len == 0 || !memcmp(a, b, a_len));
+}
+
+//
+// check_prog - assembles a program on one thread with one context and on each thread count with another and compares
+// the results, returns the exit status on one thread
+//
+// a context keeps its buffers from one assembly to the next, so were both runs made with the same one, words or
+// positions the threads failed to write would still hold what the run on one thread left there
+//
+static int check_prog(c8asm_ctx *one, c8asm_ctx *ctx, const char *src, size_t len, int kind, FILE *diag_file) {
+        Result expected = assemble(one, src, len, 1, diag_file);
+
+        for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++i) {
+                Result got = assemble(ctx, src, len, thread_counts[i], diag_file);
+                const char *what = NULL;
+
+                if (got.err != expected.err)
+                        what = "exit status";
+                else if (got.errors != expected.errors || got.warnings != expected.warnings)
+                        what = "error or warning count";
+                else if (!same(got.rom, got.rom_len, expected.rom, expected.rom_len))
+                        what = "program";
+                else if (!same(got.map, got.map_len, expected.map, expected.map_len))
+                        what = "map";
+                else if (!same(got.diags, got.diags_len, expected.diags, expected.diags_len))
+                        what = "diagnostics";
+
+                if (what) {
+                        printf("parallel_parse: a %s program gave another %s on %d threads\n", kind_names[kind],
+                                what, thread_counts[i]);
+                        exit(FAILURE);
+                }
+
+                free_result(&got);
+                ++compared;
+        }
+
+        int err = expected.err;
+        free_result(&expected);
+
+        return err;
+}
+
+int main(int argc, char **argv) {
+        (void)argv;
+
+        if (argc > 1) {
+                fputs("usage: parallel_parse\n", stderr);
+                return ERR_INVALID_ARG;
+        }
+
+        start_test("parallel_parse", stdout);
+
+        FILE *diag_file;
+        if (!(diag_file = tmpfile()))
+                fail("couldn't create a temporary file");
+
+        c8asm_ctx *one, *ctx;
+        if (!(one = c8asm_ctx_new()) || !(ctx = c8asm_ctx_new()))
+                fail("failed to create a context");
+        c8asm_set_target(one, C8ASM_TARGET_XOCHIP);
+        c8asm_set_target(ctx, C8ASM_TARGET_XOCHIP);
+
+        char *src = xmalloc(2 * RANDOM_STMTS * STMT_MAX_LEN);
+
+        // every kind but the ones made to fail must assemble, so their programs are compared and not only the errors
+        for (int kind = 0; kind < KINDS; ++kind) {
+                for (int i = 0; i < RANDOM_PROGRAMS; ++i) {
+                        int err = check_prog(one, ctx, src, random_prog(src, kind), kind, diag_file);
+
+                        if ((err == SUCCESS) != (kind != ERRORS && kind != OVERFLOW)) {
+                                printf("parallel_parse: a %s program %s\n", kind_names[kind],
+                                        (err == SUCCESS) ? "assembled" : "failed to assemble");
+                                return FAILURE;
+                        }
+                }
+        }
+
+        free(src);
+        c8asm_ctx_free(one);
+        c8asm_ctx_free(ctx);
+        fclose(diag_file);
+
+        printf("parallel_parse: %lu assemblies on several threads matched one thread\n", (unsigned long)compared);
+
+        return SUCCESS;
+}
@@ -0,0 +1,221 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "c8asm.h"
+#include "c8shm.h"
+#include "exitcodes.h"
+
+#include "test_util.h"
+
+//
+// shm_consumer - stands in for an emulator reading programs published with `c8asm --shm`, it keeps the region mapped
+// and polls it with c8asm_shm_read while ./c8asm publishes two programs in turn, and checks that every image it reads
+// is one of them whole and that it ends up with the last one
+//
+// run from the root of the repository after building c8asm
+//
+
+// programs published after the first, alternating between the two sources
+enum {PUBLISHES = 40};
+
+static const char *const srcs[] = {
+        "start:\n"
+        "        cls\n"
+        "        jmp start\n",
+
+        "start:\n"
+        "        mov v0, 1\n"
+        "        mov v1, 2\n"
+        "        add v0, v1\n"
+        "        drw v0, v1, 5\n"
+        "        call subroutine\n"
+        "        jmp start\n"
+        "subroutine:\n"
+        "        ret\n"
+};
+
+enum {SRCS = sizeof(srcs) / sizeof(srcs[0])};
+
+static char src_names[SRCS][64], shm_name[64];
+
+// the programs assembled with libc8asm, the images read must match one of them
+static uint8_t roms[SRCS][C8ASM_SHM_CAPACITY];
+static size_t rom_lens[SRCS];
+
+static uint8_t image[C8ASM_SHM_CAPACITY];
+
+//
+// clean_up - removes the sources and the shared memory object, run on exit
+//
+static void clean_up(void) {
+        for (int i = 0; i < SRCS; ++i)
+                if (src_names[i][0])
+                        unlink(src_names[i]);
+
+        shm_unlink(shm_name);
+}
+
+//
+// publish - runs ./c8asm to publish a source to the shared memory object, returns its exit status
+//
+static int publish(const char *src_name) {
+        char shm_arg[80];
+        pid_t pid;
+        int status;
+
+        snprintf(shm_arg, sizeof(shm_arg), "--shm=%s", shm_name);
+
+        if ((pid = fork()) < 0)
+                fail("couldn't fork");
+
+        if (pid == 0) {
+                execl("./c8asm", "./c8asm", shm_arg, src_name, (char*)NULL);
+                _exit(ERR_FOPEN_FAIL);
+        }
+
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+                return FAILURE;
+
+        return WEXITSTATUS(status);
+}
+
+//
+// write_srcs - writes the sources to temporary files and assembles each of them with libc8asm
+//
+static void write_srcs(void) {
+        c8asm_ctx *ctx;
+
+        if (!(ctx = c8asm_ctx_new()))
+                fail("failed to create a context");
+
+        for (int i = 0; i < SRCS; ++i) {
+                const uint8_t *rom;
+                size_t len = strlen(srcs[i]);
+                int fd;
+
+                snprintf(src_names[i], sizeof(src_names[i]), "/tmp/c8asm_shm_consumer_XXXXXX");
+                if ((fd = mkstemp(src_names[i])) < 0) {
+                        src_names[i][0] = '\0';
+                        fail("couldn't create a source file");
+                }
+
+                if (write(fd, srcs[i], len) != (ssize_t)len) {
+                        close(fd);
+                        fail("couldn't write a source file");
+                }
+                close(fd);
+
+                if (c8asm_assemble(ctx, srcs[i], len, &rom, &rom_lens[i]) != SUCCESS)
+                        fail("a source failed to assemble");
+                memcpy(roms[i], rom, rom_lens[i]);
+        }
+
+        c8asm_ctx_free(ctx);
+}
+
+//
+// matches - checks whether an image read is one of the programs whole, returns its index or -1
+//
+static int matches(const uint8_t *buf, size_t len) {
+        for (int i = 0; i < SRCS; ++i)
+                if (len == rom_lens[i] && !memcmp(buf, roms[i], len))
+                        return i;
+
+        return -1;
+}
+
+int main(int argc, char **argv) {
+        (void)argv;
+
+        if (argc > 1) {
+                fputs("usage: shm_consumer\n", stderr);
+                return ERR_INVALID_ARG;
+        }
+
+        start_test("shm_consumer", stderr);
+
+        snprintf(shm_name, sizeof(shm_name), "/c8asm_shm_consumer_%ld", (long)getpid());
+        atexit(clean_up);
+        write_srcs();
+
+        // the first program creates the object, after which it stays mapped while the rest are published
+        if (publish(src_names[0]) != SUCCESS)
+                fail("./c8asm failed to publish, is it built?");
+
+        int fd;
+        struct stat st;
+        if ((fd = shm_open(shm_name, O_RDONLY, 0)) < 0 || fstat(fd, &st))
+                fail("couldn't open the shared memory object");
+
+        if (st.st_mode & 0077)
+                fail("the shared memory object can be opened by other users");
+
+        void *region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (region == MAP_FAILED)
+                fail("couldn't map the shared memory object");
+        if (!c8asm_shm_check(region, st.st_size))
+                fail("the shared memory object has no header");
+
+        pid_t publisher;
+        if ((publisher = fork()) < 0)
+                fail("couldn't fork");
+
+        if (publisher == 0) {
+                for (int i = 1; i <= PUBLISHES; ++i)
+                        if (publish(src_names[i % SRCS]) != SUCCESS)
+                                _exit(FAILURE);
+                _exit(SUCCESS);
+        }
+
+        // poll until the publisher is done, then once more for the last program
+        uint32_t last_seq = 0, seq;
+        size_t len, reads = 0;
+        int status, done = 0;
+
+        while (!done) {
+                done = waitpid(publisher, &status, WNOHANG) == publisher;
+
+                if (c8asm_shm_seq(region) == last_seq)
+                        continue;
+
+                int got = c8asm_shm_read(region, image, sizeof(image), &len, &seq);
+                if (got < 0)
+                        fail("an image didn't fit in the buffer");
+                if (got == 0)
+                        continue;
+
+                if (seq <= last_seq || seq & 1)
+                        fail("the sequence didn't go up by an even number");
+                if (matches(image, len) < 0)
+                        fail("read an image which isn't one of the programs published");
+
+                last_seq = seq;
+                ++reads;
+        }
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != SUCCESS)
+                fail("./c8asm failed to publish a program");
+
+        if (c8asm_shm_read(region, image, sizeof(image), &len, &seq) != 1)
+                fail("couldn't read the last program");
+        if (seq != 2 * (PUBLISHES + 1) || matches(image, len) != PUBLISHES % SRCS)
+                fail("the last program read isn't the last one published");
+
+        munmap(region, st.st_size);
+
+        printf("shm_consumer: %lu images read of %d published\n", (unsigned long)reads, PUBLISHES + 1);
+
+        return SUCCESS;
+}
@@ -0,0 +1,78 @@
+#ifndef TEST_UTIL_H_INCLUDED
+        #define TEST_UTIL_H_INCLUDED 1
+
+        #include <stdio.h>
+        #include <stdlib.h>
+        #include <stdint.h>
+        #include <stddef.h>
+        #include <unistd.h>
+
+        #include "exitcodes.h"
+
+        // seconds a test may run for before it is taken to be stuck and killed by its watchdog alarm
+        enum {WATCHDOG_SECS = 120};
+
+        // the name a test reports under and where it reports failures, set by start_test
+        static const char *test_name = "test";
+        static FILE *test_out;
+
+        //
+        // start_test - names the test in what it reports, sends its failures to out and starts the watchdog
+        //
+        static inline void start_test(const char *name, FILE *out) {
+                test_name = name;
+                test_out = out;
+
+                alarm(WATCHDOG_SECS);
+        }
+
+        //
+        // rng - xorshift64*, a test is the same on every run so a failure can be reproduced
+        //
+        static inline uint64_t rng(void) {
+                static uint64_t state = 0x9E3779B97F4A7C15u;
+
+                state ^= state >> 12;
+                state ^= state << 25;
+                state ^= state >> 27;
+
+                return state * 0x2545F4914F6CDD1Du;
+        }
+
+        //
+        // fail - reports what went wrong and exits
+        //
+        static inline void fail(const char *what) {
+                fprintf(test_out ? test_out : stderr, "%s: %s\n", test_name, what);
+
+                exit(FAILURE);
+        }
+
+        //
+        // fail_input - reports an input a test got wrong, with the characters which aren't printable escaped, and exits
+        //
+        static inline void fail_input(const char *what, const char *src, size_t len) {
+                FILE *out = test_out ? test_out : stderr;
+
+                fprintf(out, "%s: %s on a %lu byte input: \"", test_name, what, (unsigned long)len);
+                for (size_t i = 0; i < len; ++i)
+                        fprintf(out, (src[i] >= ' ' && src[i] <= '~') ? "%c" : "\\x%02X", (unsigned char)src[i]);
+                fputs("\"\n", out);
+
+                exit(FAILURE);
+        }
+
+        //
+        // xmalloc - allocates memory, exits on failure
+        //
+        static inline void *xmalloc(size_t len) {
+                void *buf;
+
+                if (!(buf = malloc(len ? len : 1))) {
+                        fprintf(test_out ? test_out : stderr, "%s: out of memory\n", test_name);
+                        exit(ERR_MALLOC_FAIL);
+                }
+
+                return buf;
+        }
+#endif